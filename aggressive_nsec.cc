@@ -283,11 +283,12 @@ void AggressiveNSECCache::insertNSEC(const DNSName& zone, const DNSName& owner,
     auto zoneEntry = entry->lock();
     if (nsec3 && !zoneEntry->d_nsec3) {
       d_entriesCount -= zoneEntry->d_entries.size();
-      zoneEntry->d_entries.clear();
+      zoneEntry->clearEntries();
       zoneEntry->d_nsec3 = true;
     }
 
     DNSName next;
+    std::string ownerHash;
     if (!nsec3) {
       auto content = getRR<NSECRecordContent>(record);
       if (!content) {
@@ -330,6 +331,7 @@ void AggressiveNSECCache::insertNSEC(const DNSName& zone, const DNSName& owner,
       // XXX: Ponder storing everything in raw form, without the zone instead. It still needs to be a DNSName for NSEC, though,
       // but doing the conversion on cache hits only might be faster
       next = DNSName(toBase32Hex(content->d_nexthash)) + zone;
+      ownerHash = fromBase32Hex(owner.getRawLabel(0));
 
       if (zoneEntry->d_iterations != content->d_iterations || zoneEntry->d_salt != content->d_salt) {
         zoneEntry->d_iterations = content->d_iterations;
@@ -338,28 +340,28 @@ void AggressiveNSECCache::insertNSEC(const DNSName& zone, const DNSName& owner,
         // Clearing the existing entries since we can't use them, and it's likely a rollover
         // If it instead is different servers using different parameters, well, too bad.
         d_entriesCount -= zoneEntry->d_entries.size();
-        zoneEntry->d_entries.clear();
+        zoneEntry->clearEntries();
       }
     }
 
     /* the TTL is already a TTD by now */
     if (!nsec3 && isWildcardExpanded(owner.countLabels(), *signatures.at(0))) {
       DNSName realOwner = getNSECOwnerName(owner, signatures);
-      auto pair = zoneEntry->d_entries.insert({record.getContent(), signatures, realOwner, next, qname, record.d_ttl, qtype});
+      auto pair = zoneEntry->d_entries.insert({record.getContent(), signatures, realOwner, next, qname, record.d_ttl, qtype, std::string()});
       if (pair.second) {
         ++d_entriesCount;
       }
       else {
-        zoneEntry->d_entries.replace(pair.first, {record.getContent(), signatures, std::move(realOwner), std::move(next), qname, record.d_ttl, qtype});
+        zoneEntry->d_entries.replace(pair.first, {record.getContent(), signatures, std::move(realOwner), std::move(next), qname, record.d_ttl, qtype, std::string()});
       }
     }
     else {
-      auto pair = zoneEntry->d_entries.insert({record.getContent(), signatures, owner, next, qname, record.d_ttl, qtype});
+      auto pair = zoneEntry->d_entries.insert({record.getContent(), signatures, owner, next, qname, record.d_ttl, qtype, ownerHash});
       if (pair.second) {
         ++d_entriesCount;
       }
       else {
-        zoneEntry->d_entries.replace(pair.first, {record.getContent(), signatures, owner, std::move(next), qname, record.d_ttl, qtype});
+        zoneEntry->d_entries.replace(pair.first, {record.getContent(), signatures, owner, std::move(next), qname, record.d_ttl, qtype, std::move(ownerHash)});
       }
     }
   }
@@ -411,34 +413,89 @@ bool AggressiveNSECCache::getNSECBefore(time_t now, std::shared_ptr<LockGuarded<
   return true;
 }
 
-bool AggressiveNSECCache::getNSEC3(time_t now, std::shared_ptr<LockGuarded<AggressiveNSECCache::ZoneEntry>>& zone, const DNSName& name, ZoneEntry::CacheEntry& entry)
+bool AggressiveNSECCache::getNSEC3(time_t now, std::shared_ptr<LockGuarded<AggressiveNSECCache::ZoneEntry>>& zone, const std::string& hash, ZoneEntry::CacheEntry& entry)
 {
   auto zoneEntry = zone->try_lock();
-  if (!zoneEntry.owns_lock() || zoneEntry->d_entries.empty()) {
+  if (!zoneEntry.owns_lock() || zoneEntry->d_entries.empty() || hash.empty()) {
     return false;
   }
 
-  auto& idx = zoneEntry->d_entries.get<ZoneEntry::HashedTag>();
-  auto entries = idx.equal_range(name);
+  auto& idx = zoneEntry->d_entries.get<ZoneEntry::HashTag>();
+  auto it = idx.find(hash);
+  if (it == idx.end()) {
+    return false;
+  }
 
-  for (auto it = entries.first; it != entries.second; ++it) {
+  auto firstIndexIterator = zoneEntry->d_entries.project<ZoneEntry::OrderedTag>(it);
+  if (it->d_ttd <= now) {
+    moveCacheItemToFront<ZoneEntry::SequencedTag>(zoneEntry->d_entries, firstIndexIterator);
+    return false;
+  }
 
-    if (it->d_owner != name) {
-      continue;
-    }
+  entry = *it;
+  moveCacheItemToBack<ZoneEntry::SequencedTag>(zoneEntry->d_entries, firstIndexIterator);
+  return true;
+}
 
-    auto firstIndexIterator = zoneEntry->d_entries.project<ZoneEntry::OrderedTag>(it);
-    if (it->d_ttd <= now) {
-      moveCacheItemToFront<ZoneEntry::SequencedTag>(zoneEntry->d_entries, firstIndexIterator);
-      return false;
+// The NSEC3 counterpart of getNSECBefore(): find the entry with the largest owner hash that is not
+// larger than hash, wrapping around to the last one if there is none.
+bool AggressiveNSECCache::getNSEC3Before(time_t now, std::shared_ptr<LockGuarded<AggressiveNSECCache::ZoneEntry>>& zone, const std::string& hash, ZoneEntry::CacheEntry& entry)
+{
+  auto zoneEntry = zone->try_lock();
+  if (!zoneEntry.owns_lock() || zoneEntry->d_entries.empty() || hash.empty()) {
+    return false;
+  }
+
+  auto& idx = zoneEntry->d_entries.get<ZoneEntry::HashTag>();
+  auto it = idx.upper_bound(hash);
+  if (it == idx.begin()) {
+    // every owner hash is larger than ours, so we are covered by the last one, if by any
+    it = idx.end();
+  }
+  // we know the map is not empty
+  --it;
+
+  auto firstIndexIterator = zoneEntry->d_entries.project<ZoneEntry::OrderedTag>(it);
+  if (it->d_ttd <= now) {
+    moveCacheItemToFront<ZoneEntry::SequencedTag>(zoneEntry->d_entries, firstIndexIterator);
+    return false;
+  }
+
+  entry = *it;
+  moveCacheItemToBack<ZoneEntry::SequencedTag>(zoneEntry->d_entries, firstIndexIterator);
+  return true;
+}
+
+std::string AggressiveNSECCache::getNSEC3Hash(std::shared_ptr<LockGuarded<AggressiveNSECCache::ZoneEntry>>& zone, const DNSName& name, uint16_t iterations, const std::string& salt, pdns::validation::ValidationContext& validationContext)
+{
+  const auto slot = name.hash() % s_nsec3HashCacheSize;
+  {
+    auto zoneEntry = zone->try_lock();
+    if (zoneEntry.owns_lock() && zoneEntry->d_iterations == iterations && zoneEntry->d_salt == salt && !zoneEntry->d_hashCache.empty()) {
+      const auto& cached = zoneEntry->d_hashCache.at(slot);
+      if (cached.d_name == name) {
+        return cached.d_hash;
+      }
     }
+  }
 
-    entry = *it;
-    moveCacheItemToBack<ZoneEntry::SequencedTag>(zoneEntry->d_entries, firstIndexIterator);
-    return true;
+  // do the (potentially expensive) hashing without holding the lock
+  auto hash = getHashFromNSEC3(name, iterations, salt, validationContext);
+  if (hash.empty()) {
+    return hash;
   }
 
-  return false;
+  auto zoneEntry = zone->try_lock();
+  /* the parameters might have changed while we were not holding the lock */
+  if (zoneEntry.owns_lock() && zoneEntry->d_iterations == iterations && zoneEntry->d_salt == salt) {
+    if (zoneEntry->d_hashCache.empty()) {
+      zoneEntry->d_hashCache.resize(s_nsec3HashCacheSize);
+    }
+    auto& cached = zoneEntry->d_hashCache.at(slot);
+    cached.d_name = name;
+    cached.d_hash = hash;
+  }
+  return hash;
 }
 
 static void addToRRSet(const time_t now, std::vector<DNSRecord>& recordSet, const MemRecursorCache::SigRecs& signatures, const DNSName& owner, bool doDNSSEC, std::vector<DNSRecord>& ret, DNSResourceRecord::Place place = DNSResourceRecord::AUTHORITY)
@@ -568,11 +625,11 @@ bool AggressiveNSECCache::getNSEC3Denial(time_t now, std::shared_ptr<LockGuarded
     }
   }
 
-  auto nameHash = DNSName(toBase32Hex(getHashFromNSEC3(name, iterations, salt, validationContext))) + zone;
+  auto nameHash = getNSEC3Hash(zoneEntry, name, iterations, salt, validationContext);
 
   ZoneEntry::CacheEntry exactNSEC3;
   if (getNSEC3(now, zoneEntry, nameHash, exactNSEC3)) {
-    VLOG(log, name << ": Found a direct NSEC3 match for " << nameHash << " inserted by " << exactNSEC3.d_qname << '/' << exactNSEC3.d_qtype);
+    VLOG(log, name << ": Found a direct NSEC3 match for " << toBase32Hex(nameHash) << " inserted by " << exactNSEC3.d_qname << '/' << exactNSEC3.d_qtype);
     auto nsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(exactNSEC3.d_record);
     if (!nsec3 || nsec3->d_iterations != iterations || nsec3->d_salt != salt) {
       VLOG_NO_PREFIX(log, " but the content is not valid, or has a different salt or iterations count" << endl);
@@ -611,17 +668,17 @@ bool AggressiveNSECCache::getNSEC3Denial(time_t now, std::shared_ptr<LockGuarded
     return true;
   }
 
-  VLOG(log, name << ": No direct NSEC3 match found for " << nameHash << ", looking for closest encloser" << endl);
+  VLOG(log, name << ": No direct NSEC3 match found for " << toBase32Hex(nameHash) << ", looking for closest encloser" << endl);
   DNSName closestEncloser(name);
   bool found = false;
   ZoneEntry::CacheEntry closestNSEC3;
   auto remainingLabels = closestEncloser.countLabels() - 1;
   while (!found && closestEncloser.chopOff() && remainingLabels >= zoneLabelsCount) {
-    auto closestHash = DNSName(toBase32Hex(getHashFromNSEC3(closestEncloser, iterations, salt, validationContext))) + zone;
+    auto closestHash = getNSEC3Hash(zoneEntry, closestEncloser, iterations, salt, validationContext);
     remainingLabels--;
 
     if (getNSEC3(now, zoneEntry, closestHash, closestNSEC3)) {
-      VLOG(log, name << ": Found closest encloser at " << closestEncloser << " (" << closestHash << ") inserted by " << closestNSEC3.d_qname << '/' << closestNSEC3.d_qtype << endl);
+      VLOG(log, name << ": Found closest encloser at " << closestEncloser << " (" << toBase32Hex(closestHash) << ") inserted by " << closestNSEC3.d_qname << '/' << closestNSEC3.d_qtype << endl);
 
       auto nsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(closestNSEC3.d_record);
       if (!nsec3 || nsec3->d_iterations != iterations || nsec3->d_salt != salt) {
@@ -666,22 +723,22 @@ bool AggressiveNSECCache::getNSEC3Denial(time_t now, std::shared_ptr<LockGuarded
   DNSName nsecFound;
   DNSName nextCloser(closestEncloser);
   nextCloser.prependRawLabel(name.getRawLabel(labelIdx - 1));
-  auto nextCloserHash = toBase32Hex(getHashFromNSEC3(nextCloser, iterations, salt, validationContext));
-  VLOG(log, name << ": Looking for a NSEC3 covering the next closer " << nextCloser << " (" << nextCloserHash << ")" << endl);
+  auto nextCloserHash = getHashFromNSEC3(nextCloser, iterations, salt, validationContext);
+  VLOG(log, name << ": Looking for a NSEC3 covering the next closer " << nextCloser << " (" << toBase32Hex(nextCloserHash) << ")" << endl);
 
   ZoneEntry::CacheEntry nextCloserEntry;
-  if (!getNSECBefore(now, zoneEntry, DNSName(nextCloserHash) + zone, nextCloserEntry)) {
+  if (!getNSEC3Before(now, zoneEntry, nextCloserHash, nextCloserEntry)) {
     VLOG(log, name << ": Nothing found for the next closer in NSEC3 aggressive cache" << endl);
     return false;
   }
 
-  if (!isCoveredByNSEC3Hash(DNSName(nextCloserHash) + zone, nextCloserEntry.d_owner, nextCloserEntry.d_next)) {
+  auto nextCloserNsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(nextCloserEntry.d_record);
+  if (!nextCloserNsec3 || !isCoveredByNSEC3Hash(nextCloserHash, nextCloserEntry.d_hash, nextCloserNsec3->d_nexthash)) {
     VLOG(log, name << ": No covering record found for the next closer in NSEC3 aggressive cache" << endl);
     return false;
   }
 
-  auto nextCloserNsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(nextCloserEntry.d_record);
-  if (!nextCloserNsec3 || nextCloserNsec3->d_iterations != iterations || nextCloserNsec3->d_salt != salt) {
+  if (nextCloserNsec3->d_iterations != iterations || nextCloserNsec3->d_salt != salt) {
     VLOG(log, name << ": The NSEC3 covering the next closer is not valid, or has a different salt or iterations count, bailing out" << endl);
     return false;
   }
@@ -695,16 +752,16 @@ bool AggressiveNSECCache::getNSEC3Denial(time_t now, std::shared_ptr<LockGuarded
   /* An ancestor NSEC3 would be fine here, since it does prove that there is no delegation at the next closer
      name (we don't insert opt-out NSEC3s into the cache). */
   DNSName wildcard(g_wildcarddnsname + closestEncloser);
-  auto wcHash = toBase32Hex(getHashFromNSEC3(wildcard, iterations, salt, validationContext));
-  VLOG(log, name << ": Looking for a NSEC3 covering the wildcard " << wildcard << " (" << wcHash << ")" << endl);
+  auto wcHash = getNSEC3Hash(zoneEntry, wildcard, iterations, salt, validationContext);
+  VLOG(log, name << ": Looking for a NSEC3 covering the wildcard " << wildcard << " (" << toBase32Hex(wcHash) << ")" << endl);
 
   ZoneEntry::CacheEntry wcEntry;
-  if (!getNSECBefore(now, zoneEntry, DNSName(wcHash) + zone, wcEntry)) {
+  if (!getNSEC3Before(now, zoneEntry, wcHash, wcEntry)) {
     VLOG(log, name << ": Nothing found for the wildcard in NSEC3 aggressive cache" << endl);
     return false;
   }
 
-  if ((DNSName(wcHash) + zone) == wcEntry.d_owner) {
+  if (wcHash == wcEntry.d_hash) {
     VLOG(log, name << ": Found an exact match for the wildcard");
 
     auto nsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(wcEntry.d_record);
@@ -741,13 +798,13 @@ bool AggressiveNSECCache::getNSEC3Denial(time_t now, std::shared_ptr<LockGuarded
     VLOG(log, endl);
   }
   else {
-    if (!isCoveredByNSEC3Hash(DNSName(wcHash) + zone, wcEntry.d_owner, wcEntry.d_next)) {
+    auto nsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(wcEntry.d_record);
+    if (!nsec3 || !isCoveredByNSEC3Hash(wcHash, wcEntry.d_hash, nsec3->d_nexthash)) {
       VLOG(log, name << ": No covering record found for the wildcard in aggressive cache" << endl);
       return false;
     }
 
-    auto nsec3 = std::dynamic_pointer_cast<const NSEC3RecordContent>(wcEntry.d_record);
-    if (!nsec3 || nsec3->d_iterations != iterations || nsec3->d_salt != salt) {
+    if (nsec3->d_iterations != iterations || nsec3->d_salt != salt) {
       VLOG(log, name << ": The content of the NSEC3 covering the wildcard is not valid, or has a different salt or iterations count" << endl);
       return false;
     }
@@ -947,3 +1004,136 @@ size_t AggressiveNSECCache::dumpToFile(pdns::UniqueFilePtr& filePtr, const struc
 
   return ret;
 }
+
+#if TEST_AGGRESSIVE_NSEC_TIMING
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+static double elapsedSince(const timeval& start)
+{
+  timeval stop{};
+  gettimeofday(&stop, nullptr);
+  timeval diff{};
+  timersub(&stop, &start, &diff);
+  return static_cast<double>(diff.tv_sec) + static_cast<double>(diff.tv_usec) / 1e6;
+}
+
+static DNSName hostName(size_t idx, const DNSName& zone)
+{
+  // zero-padded so that the canonical order of the names is their numerical order
+  std::ostringstream str;
+  str << "host" << std::setw(8) << std::setfill('0') << idx;
+  return DNSName(str.str()) + zone;
+}
+
+static DNSRecord makeNSEC(const DNSName& owner, const DNSName& next, const std::set<uint16_t>& types, time_t ttd)
+{
+  auto content = std::make_shared<NSECRecordContent>();
+  content->d_next = next;
+  for (auto type : types) {
+    content->set(type);
+  }
+  DNSRecord record;
+  record.d_name = owner;
+  record.d_type = QType::NSEC;
+  record.d_class = QClass::IN;
+  record.d_ttl = ttd;
+  record.setContent(std::move(content));
+  return record;
+}
+
+static std::vector<std::shared_ptr<const RRSIGRecordContent>> makeSignature(const DNSName& owner, const DNSName& zone, uint16_t type, time_t ttd)
+{
+  auto sig = std::make_shared<RRSIGRecordContent>();
+  sig->d_type = type;
+  sig->d_algorithm = 13;
+  sig->d_labels = owner.countLabels();
+  sig->d_originalttl = 3600;
+  sig->d_sigexpire = ttd;
+  sig->d_siginception = ttd - 7200;
+  sig->d_tag = 42;
+  sig->d_signer = zone;
+  sig->d_signature = std::string(64, 'x');
+  return {sig};
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " entries lookups" << std::endl;
+    return 1;
+  }
+  const size_t entries = std::max(std::atoi(argv[1]), 1);
+  const size_t lookups = std::atoi(argv[2]);
+  reportAllTypes();
+
+  const time_t now = time(nullptr);
+  const time_t ttd = now + 3600;
+  const DNSName zone("example");
+  const ComboAddress who("192.0.2.1");
+
+  // getDenial() only answers for zones whose SOA has been validated
+  g_recCache = std::make_unique<MemRecursorCache>();
+  DNSRecord soa;
+  soa.d_name = zone;
+  soa.d_type = QType::SOA;
+  soa.d_class = QClass::IN;
+  soa.d_ttl = ttd;
+  soa.d_place = DNSResourceRecord::AUTHORITY;
+  soa.setContent(DNSRecordContent::make(QType::SOA, QClass::IN, "ns.example. hostmaster.example. 1 3600 600 86400 300"));
+  g_recCache->replace(now, zone, QType(QType::SOA), {soa}, makeSignature(zone, zone, QType::SOA, ttd), {}, true, zone, boost::none, boost::none, vState::Secure);
+
+  AggressiveNSECCache cache(entries + 1);
+  timeval start{};
+  gettimeofday(&start, nullptr);
+  // the apex NSEC also covers the wildcard *.example
+  cache.insertNSEC(zone, zone, makeNSEC(zone, hostName(0, zone), {QType::SOA, QType::NS, QType::RRSIG, QType::NSEC}, ttd), makeSignature(zone, zone, QType::NSEC, ttd), false);
+  for (size_t idx = 0; idx < entries; idx++) {
+    auto owner = hostName(idx, zone);
+    auto next = idx + 1 < entries ? hostName(idx + 1, zone) : zone;
+    cache.insertNSEC(zone, owner, makeNSEC(owner, next, {QType::A, QType::RRSIG, QType::NSEC}, ttd), makeSignature(owner, zone, QType::NSEC, ttd), false);
+  }
+  auto elapsed = elapsedSince(start);
+  std::cout << "Per NSEC insert " << elapsed * 1e9 / static_cast<double>(entries + 1) << "ns, " << cache.getEntriesCount() << " entries" << std::endl;
+
+  // Names that fall between two existing ones, so every lookup synthesizes a NXDOMAIN
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<size_t> dist(0, entries - 1);
+  std::vector<DNSName> names;
+  names.reserve(std::min(lookups, size_t(100000)));
+  for (size_t idx = 0; idx < names.capacity(); idx++) {
+    names.emplace_back(DNSName("x") + hostName(dist(gen), zone));
+  }
+
+  pdns::validation::ValidationContext context;
+  std::vector<DNSRecord> ret;
+  size_t denied = 0;
+  gettimeofday(&start, nullptr);
+  for (size_t idx = 0; idx < lookups; idx++) {
+    ret.clear();
+    int res = 0;
+    if (cache.getDenial(now, names.at(idx % names.size()), QType::A, ret, res, who, boost::none, true, context) && res == RCode::NXDomain) {
+      ++denied;
+    }
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per synthesized NXDOMAIN " << elapsed * 1e9 / static_cast<double>(lookups) << "ns, " << denied << " of " << lookups << " denied" << std::endl;
+
+  // What every cache miss pays when the name is outside any zone we hold NSECs for
+  const DNSName other("www.example.net");
+  gettimeofday(&start, nullptr);
+  for (size_t idx = 0; idx < lookups; idx++) {
+    ret.clear();
+    int res = 0;
+    if (cache.getDenial(now, other, QType::A, ret, res, who, boost::none, true, context)) {
+      ++denied;
+    }
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per lookup outside the cached zones " << elapsed * 1e9 / static_cast<double>(lookups) << "ns" << std::endl;
+}
+
+#endif
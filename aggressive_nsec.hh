@@ -44,6 +44,7 @@ class AggressiveNSECCache
 {
 public:
   static constexpr uint8_t s_default_maxNSEC3CommonPrefix = 10;
+  static constexpr size_t s_nsec3HashCacheSize = 32;
   static uint64_t s_nsec3DenialProofMaxCost;
   static uint8_t s_maxNSEC3CommonPrefix;
 
@@ -111,7 +112,7 @@ private:
     {
     }
 
-    struct HashedTag
+    struct HashTag
     {
     };
     struct SequencedTag
@@ -131,6 +132,13 @@ private:
       DNSName d_qname; // of the query data that lead to this entry being created/updated
       time_t d_ttd;
       QType d_qtype; // of the query data that lead to this entry being created/updated
+      std::string d_hash; // NSEC3 only: the owner hash in binary form, empty for NSEC
+    };
+
+    struct HashCacheSlot
+    {
+      DNSName d_name;
+      std::string d_hash;
     };
 
     typedef multi_index_container<
@@ -140,11 +148,24 @@ private:
                        member<CacheEntry, const DNSName, &CacheEntry::d_owner>,
                        CanonDNSNameCompare>,
         sequenced<tag<SequencedTag>>,
-        hashed_non_unique<tag<HashedTag>,
-                          member<CacheEntry, const DNSName, &CacheEntry::d_owner>>>>
+        /* for NSEC3 zones, lets us look up an exact or covering hash with plain binary compares
+           instead of building and canonically comparing DNSNames */
+        ordered_non_unique<tag<HashTag>,
+                           member<CacheEntry, std::string, &CacheEntry::d_hash>>>>
       cache_t;
 
+    void clearEntries()
+    {
+      d_entries.clear();
+      d_hashCache.clear();
+    }
+
     cache_t d_entries;
+    /* small direct-mapped cache of the NSEC3 hashes of recently looked up names, indexed by the
+       DNSName hash. Every denial for a name below the same closest encloser needs the hashes of
+       the closest encloser and of its wildcard, so this avoids redoing those iterations for
+       each query. Only valid for the current salt and iterations, allocated on first use */
+    std::vector<HashCacheSlot> d_hashCache;
     const DNSName d_zone;
     std::string d_salt;
     uint16_t d_iterations{0};
@@ -154,7 +175,9 @@ private:
   std::shared_ptr<LockGuarded<ZoneEntry>> getZone(const DNSName& zone);
   std::shared_ptr<LockGuarded<ZoneEntry>> getBestZone(const DNSName& zone);
   bool getNSECBefore(time_t now, std::shared_ptr<LockGuarded<ZoneEntry>>& zoneEntry, const DNSName& name, ZoneEntry::CacheEntry& entry);
-  bool getNSEC3(time_t now, std::shared_ptr<LockGuarded<ZoneEntry>>& zoneEntry, const DNSName& name, ZoneEntry::CacheEntry& entry);
+  bool getNSEC3(time_t now, std::shared_ptr<LockGuarded<ZoneEntry>>& zoneEntry, const std::string& hash, ZoneEntry::CacheEntry& entry);
+  bool getNSEC3Before(time_t now, std::shared_ptr<LockGuarded<ZoneEntry>>& zoneEntry, const std::string& hash, ZoneEntry::CacheEntry& entry);
+  static std::string getNSEC3Hash(std::shared_ptr<LockGuarded<ZoneEntry>>& zoneEntry, const DNSName& name, uint16_t iterations, const std::string& salt, pdns::validation::ValidationContext& validationContext);
   bool getNSEC3Denial(time_t now, std::shared_ptr<LockGuarded<ZoneEntry>>& zoneEntry, std::vector<DNSRecord>& soaSet, const MemRecursorCache::SigRecs& soaSignatures, const DNSName& name, const QType& type, std::vector<DNSRecord>& ret, int& res, bool doDNSSEC, const OptLog&, pdns::validation::ValidationContext& validationContext);
   bool synthesizeFromNSEC3Wildcard(time_t now, const DNSName& name, const QType& type, std::vector<DNSRecord>& ret, int& res, bool doDNSSEC, ZoneEntry::CacheEntry& nextCloser, const DNSName& wildcardName, const OptLog&);
   bool synthesizeFromNSECWildcard(time_t now, const DNSName& name, const QType& type, std::vector<DNSRecord>& ret, int& res, bool doDNSSEC, ZoneEntry::CacheEntry& nsec, const DNSName& wildcardName, const OptLog&);
@@ -0,0 +1,757 @@
+/*
+ * PowerDNS Recursor Windows - Query replay benchmark
+ *
+ * Drives the full resolver (handleNewUDPQuestion -> startDoResolve -> SyncRes -> asendto/arecvfrom)
+ * with a recorded query stream, against an in-process fake authoritative that answers everything
+ * with a configurable RTT and loss rate. "." is forwarded to the fake authoritative, so every cache
+ * miss costs exactly one upstream round trip and runs are reproducible without network access.
+ *
+ * Usage: bench_replay --replay-file=queries.txt|capture.pcap [--replay-qps=2000] [--replay-count=100000]
+ *                     [--fake-auth-rtt-msec=5] [--fake-auth-loss=0.01] ...  (--help lists all settings)
+ *
+ * The text query log has one "qname qtype" per line ('#' starts a comment). Names whose first
+ * label starts with "nx" are answered with NXDOMAIN. A pcap (Ethernet, Linux cooked or raw IP
+ * link types) contributes every UDP DNS query to port 53 it contains.
+ *
+ * Reported: achieved qps, client-side latency percentiles, answer rcodes, record cache hit rate,
+ * upstream queries per client query, and heap allocations and CPU time per query on the resolver
+ * thread.
+ *
+ * bench_replay_queries.txt is the query log of the baseline recorded in BENCH_REPLAY.md.
+ */
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/any.hpp>
+
+#include "mplexer.hh"
+#include "dnsname.hh"
+#include "qtype.hh"
+#include "dnsparser.hh"
+#include "dnswriter.hh"
+#include "dnsrecords.hh"
+#include "recursor_cache.hh"
+#include "negcache.hh"
+#include "misc.hh"
+#include "syncres.hh"
+#include "mtasker.hh"
+#include "utility.hh"
+#include "arguments.hh"
+#include "dns.hh"
+#include "histogram.hh"
+#include "iputils.hh"
+#include "pdnsexception.hh"
+#include "rec-main.hh"
+#include "logging.hh"
+#include "logr.hh"
+
+extern std::unique_ptr<MemRecursorCache> g_recCache;
+extern std::unique_ptr<NegCache> g_negCache;
+
+typedef MTasker<std::shared_ptr<PacketID>, PacketBuffer, PacketIDCompare> MT_t;
+extern thread_local std::unique_ptr<MT_t> g_multiTasker;
+extern thread_local std::unique_ptr<FDMultiplexer> t_fdm;
+
+typedef std::vector<std::pair<int, std::function<void(int, boost::any&)>>> deferredAdd_t;
+
+extern void initializeMTaskerInfrastructure();
+extern void initializeOptionalVariablesForUpstream();
+unsigned int makeUDPServerSockets(deferredAdd_t& deferredAdds, Logr::log_t log, bool doLog, unsigned int instances);
+
+// Allocation counting: only the resolver thread sets t_countAllocations, so the client and fake
+// authoritative threads do not pollute the per-query figure and no atomics are needed
+static thread_local bool t_countAllocations{false};
+static thread_local uint64_t t_allocations{0};
+
+void* operator new(size_t size)
+{
+  if (t_countAllocations) {
+    ++t_allocations;
+  }
+  void* ptr = std::malloc(size > 0 ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */) noexcept
+{
+  std::free(ptr);
+}
+
+static double threadCPUSeconds()
+{
+#ifdef _WIN32
+  FILETIME creation{};
+  FILETIME exited{};
+  FILETIME kernel{};
+  FILETIME user{};
+  if (GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user) == 0) {
+    return 0.0;
+  }
+  auto ticks = [](const FILETIME& filetime) {
+    return (static_cast<uint64_t>(filetime.dwHighDateTime) << 32) | filetime.dwLowDateTime;
+  };
+  // FILETIME counts 100ns intervals
+  return static_cast<double>(ticks(kernel) + ticks(user)) / 1e7;
+#else
+  timespec now{};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+#endif
+}
+
+struct ReplayQuery
+{
+  DNSName d_qname;
+  uint16_t d_qtype;
+};
+
+static std::vector<ReplayQuery> loadTextLog(const std::string& fname)
+{
+  std::ifstream input(fname);
+  if (!input) {
+    throw std::runtime_error("Unable to open query log '" + fname + "'");
+  }
+  std::vector<ReplayQuery> ret;
+  std::string line;
+  size_t lineno = 0;
+  while (std::getline(input, line)) {
+    ++lineno;
+    auto hash = line.find('#');
+    if (hash != std::string::npos) {
+      line.resize(hash);
+    }
+    std::istringstream fields(line);
+    std::string qname;
+    std::string qtype;
+    if (!(fields >> qname)) {
+      continue;
+    }
+    if (!(fields >> qtype)) {
+      qtype = "A";
+    }
+    uint16_t code = QType::chartocode(qtype.c_str());
+    if (code == 0) {
+      throw std::runtime_error("Unknown qtype '" + qtype + "' on line " + std::to_string(lineno) + " of '" + fname + "'");
+    }
+    ret.push_back({DNSName(qname), code});
+  }
+  return ret;
+}
+
+static uint32_t readPcapUInt32(const uint8_t* data, bool swapped)
+{
+  uint32_t value = 0;
+  memcpy(&value, data, sizeof(value));
+  if (swapped) {
+    value = ((value & 0xff) << 24) | ((value & 0xff00) << 8) | ((value & 0xff0000) >> 8) | (value >> 24);
+  }
+  return value;
+}
+
+static uint16_t readBE16(const uint8_t* data)
+{
+  return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+// Extracts the UDP payload of a datagram to port 53, or returns false
+static bool pcapUDPQueryPayload(uint32_t linkType, const uint8_t* frame, size_t len, const uint8_t*& payload, size_t& payloadLen)
+{
+  size_t offset = 0;
+  uint16_t etherType = 0;
+  switch (linkType) {
+  case 1: // Ethernet
+    if (len < 14) {
+      return false;
+    }
+    etherType = readBE16(frame + 12);
+    offset = 14;
+    if (etherType == 0x8100 && len >= 18) { // 802.1Q
+      etherType = readBE16(frame + 16);
+      offset = 18;
+    }
+    break;
+  case 113: // Linux cooked capture
+    if (len < 16) {
+      return false;
+    }
+    etherType = readBE16(frame + 14);
+    offset = 16;
+    break;
+  case 101: // Raw IP
+  case 12:
+    if (len < 1) {
+      return false;
+    }
+    etherType = (frame[0] >> 4) == 6 ? 0x86dd : 0x0800;
+    break;
+  default:
+    return false;
+  }
+
+  uint8_t protocol = 0;
+  if (etherType == 0x0800) {
+    if (len < offset + 20) {
+      return false;
+    }
+    const size_t ihl = static_cast<size_t>(frame[offset] & 0x0f) * 4;
+    const bool fragment = (readBE16(frame + offset + 6) & 0x3fff) != 0;
+    protocol = frame[offset + 9];
+    if (fragment || ihl < 20) {
+      return false;
+    }
+    offset += ihl;
+  }
+  else if (etherType == 0x86dd) {
+    if (len < offset + 40) {
+      return false;
+    }
+    // Extension headers are not walked, DNS over UDP rarely carries them
+    protocol = frame[offset + 6];
+    offset += 40;
+  }
+  else {
+    return false;
+  }
+
+  if (protocol != IPPROTO_UDP || len < offset + 8 || readBE16(frame + offset + 2) != 53) {
+    return false;
+  }
+  payload = frame + offset + 8;
+  payloadLen = len - offset - 8;
+  return true;
+}
+
+static std::vector<ReplayQuery> loadPcap(const std::string& fname)
+{
+  std::ifstream input(fname, std::ios::binary);
+  if (!input) {
+    throw std::runtime_error("Unable to open capture '" + fname + "'");
+  }
+  uint8_t header[24];
+  if (!input.read(reinterpret_cast<char*>(header), sizeof(header))) {
+    throw std::runtime_error("Capture '" + fname + "' is too short");
+  }
+  const uint32_t magic = readPcapUInt32(header, false);
+  bool swapped = false;
+  if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+    swapped = true;
+  }
+  else if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+    throw std::runtime_error("'" + fname + "' is not a pcap capture (pcapng is not supported)");
+  }
+  const uint32_t linkType = readPcapUInt32(header + 20, swapped) & 0xffff;
+
+  std::vector<ReplayQuery> ret;
+  std::vector<uint8_t> frame;
+  uint8_t recordHeader[16];
+  while (input.read(reinterpret_cast<char*>(recordHeader), sizeof(recordHeader))) {
+    const uint32_t capLen = readPcapUInt32(recordHeader + 8, swapped);
+    if (capLen > 262144) {
+      throw std::runtime_error("Corrupt record in capture '" + fname + "'");
+    }
+    frame.resize(capLen);
+    if (!input.read(reinterpret_cast<char*>(frame.data()), capLen)) {
+      break;
+    }
+    const uint8_t* payload = nullptr;
+    size_t payloadLen = 0;
+    if (!pcapUDPQueryPayload(linkType, frame.data(), frame.size(), payload, payloadLen) || payloadLen < sizeof(dnsheader)) {
+      continue;
+    }
+    try {
+      MOADNSParser mdp(true, reinterpret_cast<const char*>(payload), payloadLen);
+      if (mdp.d_header.opcode == Opcode::Query && mdp.d_header.qdcount == 1) {
+        ret.push_back({mdp.d_qname, mdp.d_qtype});
+      }
+    }
+    catch (const std::exception& e) {
+      // Not a (well formed) query, skip it
+    }
+  }
+  return ret;
+}
+
+static std::vector<ReplayQuery> loadQueries(const std::string& fname)
+{
+  std::ifstream input(fname, std::ios::binary);
+  uint8_t magic[4]{};
+  if (input.read(reinterpret_cast<char*>(magic), sizeof(magic))) {
+    const uint32_t value = readPcapUInt32(magic, false);
+    if (value == 0xa1b2c3d4 || value == 0xd4c3b2a1 || value == 0xa1b23c4d || value == 0x4d3cb2a1) {
+      return loadPcap(fname);
+    }
+  }
+  return loadTextLog(fname);
+}
+
+static bool waitReadable(int sock, int timeoutMsec)
+{
+  return waitForData(sock, 0, timeoutMsec * 1000) > 0;
+}
+
+// Answers every question authoritatively after d_rtt, dropping a d_loss fraction of them.
+// A: a 192.0.2.0/24 address derived from the name, AAAA: the same in 2001:db8::/64,
+// names whose first label starts with "nx": NXDOMAIN, anything else: NODATA.
+class FakeAuthoritative
+{
+public:
+  FakeAuthoritative(const ComboAddress& local, std::chrono::microseconds rtt, double loss, uint32_t ttl) :
+    d_local(local), d_rtt(rtt), d_loss(loss), d_ttl(ttl)
+  {
+    d_socket = SSocket(d_local.sin4.sin_family, SOCK_DGRAM, 0);
+    SBind(d_socket, d_local);
+  }
+
+  FakeAuthoritative(const FakeAuthoritative&) = delete;
+  FakeAuthoritative& operator=(const FakeAuthoritative&) = delete;
+
+  ~FakeAuthoritative()
+  {
+    stop();
+    closesocket(d_socket);
+  }
+
+  void start()
+  {
+    d_receiver = std::thread([this]() { receiveLoop(); });
+    d_sender = std::thread([this]() { sendLoop(); });
+  }
+
+  void stop()
+  {
+    d_stop = true;
+    d_cond.notify_all();
+    if (d_receiver.joinable()) {
+      d_receiver.join();
+    }
+    if (d_sender.joinable()) {
+      d_sender.join();
+    }
+  }
+
+  [[nodiscard]] uint64_t getQueries() const
+  {
+    return d_queries;
+  }
+
+  [[nodiscard]] uint64_t getDropped() const
+  {
+    return d_dropped;
+  }
+
+private:
+  struct Pending
+  {
+    ComboAddress d_remote;
+    std::string d_packet;
+  };
+
+  std::string answer(const MOADNSParser& mdp) const
+  {
+    std::vector<uint8_t> packet;
+    DNSPacketWriter writer(packet, mdp.d_qname, mdp.d_qtype, mdp.d_qclass);
+    writer.getHeader()->id = mdp.d_header.id;
+    writer.getHeader()->qr = 1;
+    writer.getHeader()->aa = 1;
+    writer.getHeader()->rd = mdp.d_header.rd;
+
+    const std::string first = mdp.d_qname.countLabels() > 0 ? mdp.d_qname.getRawLabel(0) : std::string();
+    const uint32_t hash = mdp.d_qname.hash();
+    if (first.size() >= 2 && (first[0] == 'n' || first[0] == 'N') && (first[1] == 'x' || first[1] == 'X')) {
+      writer.getHeader()->rcode = RCode::NXDomain;
+    }
+    else if (mdp.d_qtype == QType::A) {
+      writer.startRecord(mdp.d_qname, QType::A, d_ttl);
+      ARecordContent(ComboAddress("192.0.2." + std::to_string(hash % 254 + 1))).toPacket(writer);
+    }
+    else if (mdp.d_qtype == QType::AAAA) {
+      writer.startRecord(mdp.d_qname, QType::AAAA, d_ttl);
+      AAAARecordContent(ComboAddress("2001:db8::" + std::to_string(hash % 9999 + 1))).toPacket(writer);
+    }
+    if ((mdp.d_qtype != QType::A && mdp.d_qtype != QType::AAAA) || writer.getHeader()->rcode == RCode::NXDomain) {
+      // Negative answers carry the SOA of the (single, root) zone for the negative TTL
+      writer.startRecord(g_rootdnsname, QType::SOA, d_ttl, QClass::IN, DNSResourceRecord::AUTHORITY);
+      SOARecordContent(DNSName("ns.fake."), DNSName("hostmaster.fake."), soatimes{1, 3600, 600, 86400, d_ttl}).toPacket(writer);
+    }
+    EDNSOpts edns;
+    if (getEDNSOpts(mdp, &edns)) {
+      writer.addOpt(1232, 0, edns.d_extFlags & EDNSOpts::DNSSECOK);
+    }
+    writer.commit();
+    return {packet.begin(), packet.end()};
+  }
+
+  void receiveLoop()
+  {
+    std::mt19937 rng(4711);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    std::string buffer(1500, '\0');
+    while (!d_stop) {
+      if (!waitReadable(d_socket, 100)) {
+        continue;
+      }
+      ComboAddress remote(d_local);
+      socklen_t remotelen = remote.getSocklen();
+      auto len = recvfrom(d_socket, &buffer.at(0), buffer.size(), 0, reinterpret_cast<sockaddr*>(&remote), &remotelen);
+      if (len < static_cast<ssize_t>(sizeof(dnsheader))) {
+        continue;
+      }
+      ++d_queries;
+      if (d_loss > 0.0 && dist(rng) < d_loss) {
+        ++d_dropped;
+        continue;
+      }
+      std::string response;
+      try {
+        MOADNSParser mdp(true, buffer.data(), static_cast<size_t>(len));
+        response = answer(mdp);
+      }
+      catch (const std::exception& e) {
+        continue;
+      }
+      auto due = std::chrono::steady_clock::now() + d_rtt;
+      {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_pending.emplace(due, Pending{remote, std::move(response)});
+      }
+      d_cond.notify_one();
+    }
+  }
+
+  void sendLoop()
+  {
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (!d_stop) {
+      if (d_pending.empty()) {
+        d_cond.wait_for(lock, std::chrono::milliseconds(100));
+        continue;
+      }
+      auto first = d_pending.begin();
+      if (first->first > std::chrono::steady_clock::now()) {
+        d_cond.wait_until(lock, first->first);
+        continue;
+      }
+      Pending pending = std::move(first->second);
+      d_pending.erase(first);
+      lock.unlock();
+      sendto(d_socket, pending.d_packet.data(), pending.d_packet.size(), 0, reinterpret_cast<const sockaddr*>(&pending.d_remote), pending.d_remote.getSocklen());
+      lock.lock();
+    }
+  }
+
+  ComboAddress d_local;
+  std::chrono::microseconds d_rtt;
+  double d_loss;
+  uint32_t d_ttl;
+  int d_socket{-1};
+  std::thread d_receiver;
+  std::thread d_sender;
+  std::mutex d_mutex;
+  std::condition_variable d_cond;
+  std::multimap<std::chrono::steady_clock::time_point, Pending> d_pending;
+  std::atomic<bool> d_stop{false};
+  std::atomic<uint64_t> d_queries{0};
+  std::atomic<uint64_t> d_dropped{0};
+};
+
+// Sends the query stream to the resolver at a fixed rate and measures the latency of the answers.
+// Outstanding queries are tracked by DNS id, so at most 65536 can be in flight at once.
+class ReplayClient
+{
+public:
+  ReplayClient(const ComboAddress& resolver, const std::vector<ReplayQuery>& queries, size_t count, double qps, std::chrono::milliseconds timeout) :
+    d_resolver(resolver), d_queries(queries), d_count(count), d_qps(qps), d_timeout(timeout), d_sent(65536)
+  {
+    d_socket = SSocket(d_resolver.sin4.sin_family, SOCK_DGRAM, 0);
+    SConnect(d_socket, d_resolver);
+  }
+
+  ReplayClient(const ReplayClient&) = delete;
+  ReplayClient& operator=(const ReplayClient&) = delete;
+
+  ~ReplayClient()
+  {
+    if (d_thread.joinable()) {
+      d_thread.join();
+    }
+    closesocket(d_socket);
+  }
+
+  void start()
+  {
+    d_thread = std::thread([this]() { run(); });
+  }
+
+  [[nodiscard]] bool done() const
+  {
+    return d_done;
+  }
+
+  void join()
+  {
+    d_thread.join();
+  }
+
+  void report(std::ostream& out) const
+  {
+    const double seconds = std::chrono::duration<double>(d_lastAnswer - d_start).count();
+    out << "queries sent:        " << d_count << std::endl;
+    out << "answers received:    " << d_answered << " (" << d_count - d_answered << " timed out)" << std::endl;
+    out << "achieved qps:        " << (seconds > 0 ? static_cast<double>(d_answered) / seconds : 0.0) << " (target " << d_qps << ")" << std::endl;
+    out << "rcodes:              noerror " << d_rcodes[RCode::NoError] << ", nxdomain " << d_rcodes[RCode::NXDomain] << ", servfail " << d_rcodes[RCode::ServFail] << std::endl;
+    out << "latency usec:        p50 " << d_latency.getPercentile(50) << ", p90 " << d_latency.getPercentile(90)
+        << ", p99 " << d_latency.getPercentile(99) << ", p99.9 " << d_latency.getPercentile(99.9) << ", max " << d_latency.getMax() << std::endl;
+  }
+
+  [[nodiscard]] uint64_t getAnswered() const
+  {
+    return d_answered;
+  }
+
+private:
+  void run()
+  {
+    std::thread receiver([this]() { receiveLoop(); });
+    d_start = std::chrono::steady_clock::now();
+    const auto interval = std::chrono::duration<double>(1.0 / d_qps);
+    std::vector<uint8_t> packet;
+    for (size_t index = 0; index < d_count; ++index) {
+      std::this_thread::sleep_until(d_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * static_cast<double>(index)));
+      const auto& query = d_queries.at(index % d_queries.size());
+      const auto queryId = static_cast<uint16_t>(index);
+      packet.clear();
+      DNSPacketWriter writer(packet, query.d_qname, query.d_qtype);
+      writer.getHeader()->id = htons(queryId);
+      writer.getHeader()->rd = 1;
+      writer.commit();
+      d_sent.at(queryId) = std::chrono::steady_clock::now().time_since_epoch().count();
+      send(d_socket, reinterpret_cast<const char*>(packet.data()), packet.size(), 0);
+    }
+    d_sendingDone = std::chrono::steady_clock::now();
+    d_sendDone = true;
+    receiver.join();
+    d_done = true;
+  }
+
+  void receiveLoop()
+  {
+    std::string buffer(65535, '\0');
+    while (d_answered < d_count) {
+      if (!waitReadable(d_socket, 100)) {
+        if (d_sendDone && std::chrono::steady_clock::now() - d_sendingDone > d_timeout) {
+          break;
+        }
+        continue;
+      }
+      auto len = recv(d_socket, &buffer.at(0), buffer.size(), 0);
+      if (len < static_cast<ssize_t>(sizeof(dnsheader))) {
+        continue;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      dnsheader header{};
+      memcpy(&header, buffer.data(), sizeof(header));
+      auto& sent = d_sent.at(ntohs(header.id));
+      const int64_t sentAt = sent.exchange(0);
+      if (sentAt == 0) {
+        // Duplicate, or an answer for a slot that has been reused already
+        continue;
+      }
+      const auto elapsed = now.time_since_epoch().count() - sentAt;
+      d_latency(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::duration(elapsed)).count()));
+      ++d_rcodes.at(header.rcode);
+      ++d_answered;
+      d_lastAnswer = now;
+    }
+  }
+
+  ComboAddress d_resolver;
+  const std::vector<ReplayQuery>& d_queries;
+  size_t d_count;
+  double d_qps;
+  std::chrono::milliseconds d_timeout;
+  int d_socket{-1};
+  std::thread d_thread;
+  std::vector<std::atomic<int64_t>> d_sent;
+  pdns::LogLinearHistogram d_latency{"replay-latency-usec", 3};
+  std::array<uint64_t, 16> d_rcodes{};
+  std::chrono::steady_clock::time_point d_start;
+  std::chrono::steady_clock::time_point d_sendingDone;
+  std::chrono::steady_clock::time_point d_lastAnswer;
+  std::atomic<uint64_t> d_answered{0};
+  std::atomic<bool> d_sendDone{false};
+  std::atomic<bool> d_done{false};
+};
+
+static void declareArguments()
+{
+  ::arg().set("replay-file", "Query log to replay: a pcap capture, or text with one 'qname qtype' per line") = "";
+  ::arg().set("replay-qps", "Rate at which queries are sent to the resolver") = "1000";
+  ::arg().set("replay-count", "Number of queries to send, the query log is repeated as needed (0: once through the log)") = "0";
+  ::arg().set("replay-timeout-msec", "How long to wait for outstanding answers after the last query was sent") = "2000";
+  ::arg().set("fake-auth-address", "Address the fake authoritative listens on") = "127.0.0.1:5399";
+  ::arg().set("fake-auth-rtt-msec", "Delay before the fake authoritative answers") = "5";
+  ::arg().set("fake-auth-loss", "Fraction of upstream queries the fake authoritative drops") = "0";
+  ::arg().set("fake-auth-ttl", "TTL of the records served by the fake authoritative") = "3600";
+  ::arg().set("record-cache-shards", "Number of shards in the record cache") = "1024";
+  ::arg().set("local-address", "Address the resolver listens on") = "127.0.0.1";
+  ::arg().set("local-port", "Port the resolver listens on") = "5533";
+  ::arg().set("non-local-bind", "Allow binding to non-local addresses") = "no";
+  ::arg().set("spoof-nearmiss-max", "If non-zero, assume spoofing after this many near misses") = "1";
+  ::arg().set("log-common-errors", "Log answers from the fake authoritative that cannot be parsed") = "yes";
+  ::arg().set("hint-file", "Root hints, empty for the built-in ones (SyncRes primes them even when '.' is forwarded)") = "";
+  ::arg().setSwitch("help", "Show the settings") = "no";
+}
+
+int main(int argc, char** argv)
+{
+  declareArguments();
+  try {
+    ::arg().parse(argc, argv);
+    if (::arg().mustDo("help") || ::arg()["replay-file"].empty()) {
+      std::cout << ::arg().helpstring() << std::endl;
+      return ::arg().mustDo("help") ? 0 : 1;
+    }
+
+    reportAllTypes();
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+      std::cerr << "Failed to initialize Winsock" << std::endl;
+      return 1;
+    }
+#endif
+
+    extern std::shared_ptr<Logging::Logger> g_slog;
+    g_slog = Logging::Logger::create([](const Logging::Entry& entry) {
+      if (entry.error) {
+        std::cerr << entry.message << ": " << entry.error.get() << std::endl;
+      }
+    });
+    g_slogout = g_slog->withName("out");
+
+    const auto queries = loadQueries(::arg()["replay-file"]);
+    if (queries.empty()) {
+      std::cerr << "No queries found in '" << ::arg()["replay-file"] << "'" << std::endl;
+      return 1;
+    }
+    const size_t count = ::arg().asNum("replay-count") > 0 ? static_cast<size_t>(::arg().asNum("replay-count")) : queries.size();
+    const double qps = std::stod(::arg()["replay-qps"]);
+    if (qps <= 0) {
+      throw std::runtime_error("replay-qps must be positive");
+    }
+
+    deferredAdd_t deferredAdds;
+    makeUDPServerSockets(deferredAdds, g_slog->withName("socket"), false, 1);
+
+    g_recCache = std::make_unique<MemRecursorCache>(::arg().asNum("record-cache-shards"));
+    g_negCache = std::make_unique<NegCache>(::arg().asNum("record-cache-shards") / 8);
+    primeHints(time(nullptr));
+
+    initializeMTaskerInfrastructure();
+    initializeOptionalVariablesForUpstream();
+    SyncRes::s_maxqperq = 50;
+    SyncRes::s_maxcachettl = 86400;
+    SyncRes::s_max_CNAMES_followed = 10;
+    SyncRes::setDefaultLogMode(SyncRes::LogNone);
+    SyncRes::s_doIPv4 = true;
+    SyncRes::s_doIPv6 = false;
+    SyncRes::s_noEDNS = false;
+    SyncRes::s_qnameminimization = false;
+
+    const ComboAddress fakeAuthAddress(::arg()["fake-auth-address"], 53);
+    FakeAuthoritative fakeAuth(fakeAuthAddress, std::chrono::microseconds(::arg().asNum("fake-auth-rtt-msec") * 1000), std::stod(::arg()["fake-auth-loss"]), ::arg().asNum("fake-auth-ttl"));
+    fakeAuth.start();
+
+    // Forward everything to the fake authoritative, non-recursively, so it is treated as the auth for all names
+    auto domainMap = std::make_shared<SyncRes::domainmap_t>();
+    SyncRes::AuthDomain authDomain;
+    authDomain.d_name = g_rootdnsname;
+    authDomain.d_servers = {fakeAuthAddress};
+    authDomain.d_rdForward = false;
+    (*domainMap)[g_rootdnsname] = authDomain;
+    SyncRes::t_sstorage.domainmap = domainMap;
+
+    for (const auto& deferred : deferredAdds) {
+      boost::any param;
+      t_fdm->addReadFD(deferred.first, deferred.second, param);
+    }
+
+    const ComboAddress resolverAddress(::arg()["local-address"], ::arg().asNum("local-port"));
+    ReplayClient client(resolverAddress, queries, count, qps, std::chrono::milliseconds(::arg().asNum("replay-timeout-msec")));
+    std::cout << "Replaying " << count << " queries (" << queries.size() << " distinct log entries) at " << qps << " qps" << std::endl;
+
+    const uint64_t hitsBefore = g_recCache->getCacheHits();
+    const uint64_t missesBefore = g_recCache->getCacheMisses();
+    const double cpuBefore = threadCPUSeconds();
+    t_countAllocations = true;
+    client.start();
+
+    timeval now{};
+    while (!client.done()) {
+      Utility::gettimeofday(&now, nullptr);
+      while (g_multiTasker->schedule(now)) {
+        Utility::gettimeofday(&now, nullptr);
+      }
+      auto timeoutMsec = static_cast<int>(g_multiTasker->nextWaiterDelayUsec(100000) / 1000);
+      if (t_fdm->run(&now, timeoutMsec) < 0) {
+        std::cerr << "Multiplexer error" << std::endl;
+        break;
+      }
+    }
+
+    t_countAllocations = false;
+    const double cpu = threadCPUSeconds() - cpuBefore;
+    const uint64_t hits = g_recCache->getCacheHits() - hitsBefore;
+    const uint64_t misses = g_recCache->getCacheMisses() - missesBefore;
+    client.join();
+    fakeAuth.stop();
+
+    const double answered = std::max(static_cast<double>(client.getAnswered()), 1.0);
+    client.report(std::cout);
+    std::cout << "record cache:        " << hits << " hits, " << misses << " misses ("
+              << (hits + misses > 0 ? 100.0 * static_cast<double>(hits) / static_cast<double>(hits + misses) : 0.0) << "% hit rate)" << std::endl;
+    std::cout << "negative cache:      " << g_negCache->size() << " entries" << std::endl;
+    std::cout << "upstream queries:    " << fakeAuth.getQueries() << " (" << fakeAuth.getDropped() << " dropped), "
+              << static_cast<double>(fakeAuth.getQueries()) / answered << " per answered query" << std::endl;
+    std::cout << "resolver thread:     " << static_cast<double>(t_allocations) / answered << " allocations/query, "
+              << cpu * 1e6 / answered << " CPU usec/query" << std::endl;
+
+    for (const auto& deferred : deferredAdds) {
+      t_fdm->removeReadFD(deferred.first);
+      closesocket(deferred.first);
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+  }
+  catch (const PDNSException& e) {
+    std::cerr << "Error: " << e.reason << std::endl;
+  }
+  catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+  }
+  return 1;
+}
@@ -22,16 +22,55 @@
 #pragma once
 
 #include <cmath>
+#include <iterator>
 #include <boost/multi_index_container.hpp>
 
 #include "dnsname.hh"
 #include "lock.hh"
 
+// The eviction policy of the caches using the functions below. With LRU, a hit relocates the entry
+// to the back of the sequence index, which writes to the index nodes of its neighbours. With Clock,
+// a hit only sets the d_referenced flag of the entry and the sequence index acts as the clock: the
+// hand sweeps from the front, referenced entries get a second chance (flag cleared, moved to the
+// back) and unreferenced entries are evicted. Entries must have a mutable bool d_referenced member
+// to be used with Clock.
+enum class CacheEvictionPolicy : uint8_t
+{
+  LRU,
+  Clock,
+};
+
+// Remove up to toTrim entries from the front of the sequence index S, calling preRemoval() for each
+// entry about to be removed. Returns the number of entries removed. With Clock, every entry gets at
+// most one second chance per sweep since no flag is set during the sweep, so this terminates.
+template <typename S, typename T, typename F>
+size_t sweepCacheItems(T& collection, size_t toTrim, CacheEvictionPolicy policy, F&& preRemoval)
+{
+  auto& sidx = collection.template get<S>();
+  size_t removed = 0;
+  auto iter = sidx.begin();
+  while (removed < toTrim && iter != sidx.end()) {
+    if (policy == CacheEvictionPolicy::Clock && iter->d_referenced) {
+      iter->d_referenced = false;
+      auto next = std::next(iter);
+      if (next != sidx.end()) {
+        sidx.relocate(sidx.end(), iter);
+        iter = next;
+      }
+      continue;
+    }
+    preRemoval(*iter);
+    iter = sidx.erase(iter);
+    ++removed;
+  }
+  return removed;
+}
+
 // this function can clean any cache that has an isStale() method on its entries, a preRemoval() method and a 'sequence' index as its second index
 // the ritual is that the oldest entries are in *front* of the sequence collection, so on a hit, move an item to the end
 // and optionally, on a miss, move it to the beginning
 template <typename S, typename T>
-void pruneCollection(T& collection, size_t maxCached, size_t scanFraction = 1000)
+void pruneCollection(T& collection, size_t maxCached, size_t scanFraction = 1000, CacheEvictionPolicy policy = CacheEvictionPolicy::LRU)
 {
   const time_t now = time(nullptr);
   size_t toTrim = 0;
@@ -71,10 +110,7 @@ void pruneCollection(T& collection, size_t maxCached, size_t scanFraction = 1000
   toTrim -= erased;
 
   // just lob it off from the beginning
-  auto iter = sidx.begin();
-  for (size_t i = 0; i < toTrim && iter != sidx.end(); i++) {
-    iter = sidx.erase(iter);
-  }
+  sweepCacheItems<S>(collection, toTrim, policy, [](const auto& /* entry */) {});
 }
 
 // note: this expects iterator from first index
@@ -103,6 +139,20 @@ void moveCacheItemToBack(T& collection, typename T::iterator& iter)
   moveCacheItemToFrontOrBack<S>(collection, iter, false);
 }
 
+// note: this expects iterator from first index
+template <typename S, typename T>
+void touchCacheItem(T& collection, typename T::iterator& iter, CacheEvictionPolicy policy)
+{
+  if (policy == CacheEvictionPolicy::Clock) {
+    // only write if needed, so a hit on a hot entry does not dirty its cache line
+    if (!iter->d_referenced) {
+      iter->d_referenced = true;
+    }
+    return;
+  }
+  moveCacheItemToBack<S>(collection, iter);
+}
+
 template <typename S, typename T>
 uint64_t pruneLockedCollectionsVector(std::vector<T>& maps)
 {
@@ -132,7 +182,7 @@ uint64_t pruneLockedCollectionsVector(std::vector<T>& maps)
 }
 
 template <typename S, typename T>
-uint64_t pruneMutexCollectionsVector(time_t now, std::vector<T>& maps, uint64_t maxCached, uint64_t cacheSize)
+uint64_t pruneMutexCollectionsVector(time_t now, std::vector<T>& maps, uint64_t maxCached, uint64_t cacheSize, CacheEvictionPolicy policy = CacheEvictionPolicy::LRU)
 {
   uint64_t totErased = 0;
   uint64_t toTrim = 0;
@@ -187,7 +237,7 @@ uint64_t pruneMutexCollectionsVector(time_t now, std::vector<T>& maps, uint64_t
   toTrim -= totErased;
 
   // It was not enough, so we need to remove entries that are not
-  // expired, still using the LRU index.
+  // expired, still using the LRU index (or the clock, see sweepCacheItems()).
 
   // From here on cacheSize is the total number of entries in the
   // shards that still need to be cleaned. When a shard is processed,
@@ -221,16 +271,14 @@ uint64_t pruneMutexCollectionsVector(time_t now, std::vector<T>& maps, uint64_t
       continue;
     }
     shard->invalidate();
-    auto& sidx = boost::multi_index::get<S>(shard->d_map);
-    size_t removed = 0;
-    for (auto i = sidx.begin(); i != sidx.end() && removed < toTrimForThisShard; removed++) {
-      shard->preRemoval(*i);
-      i = sidx.erase(i);
+    const auto removed = sweepCacheItems<S>(shard->d_map, std::min(toTrimForThisShard, toTrim), policy, [&](const auto& entry) {
+      shard->preRemoval(entry);
       content.decEntriesCount();
-      ++totErased;
-      if (--toTrim == 0) {
-        return totErased;
-      }
+    });
+    totErased += removed;
+    toTrim -= removed;
+    if (toTrim == 0) {
+      return totErased;
     }
   }
   return totErased;
@@ -291,12 +339,13 @@ uint64_t purgeExactLockedCollection(T& shard, const DNSName& qname)
 }
 
 template <typename S, typename Index>
-bool lruReplacingInsert(Index& index, const typename Index::value_type& value)
+bool lruReplacingInsert(Index& index, const typename Index::value_type& value, CacheEvictionPolicy policy = CacheEvictionPolicy::LRU)
 {
   auto inserted = index.insert(value);
   if (!inserted.second) {
-    moveCacheItemToBack<S>(index, inserted.first);
+    // replace first, as it would overwrite the reference flag set by touchCacheItem()
     index.replace(inserted.first, value);
+    touchCacheItem<S>(index, inserted.first, policy);
     return false;
   }
   return true;
@@ -33,8 +33,6 @@
 // Provide no-op report() overrides for DNSSEC-related record contents to satisfy linking
 struct ReportIsOnlyCallableByReportAllTypes;
 void LOCRecordContent::report(const ReportIsOnlyCallableByReportAllTypes&) {}
-void NSECRecordContent::report(const ReportIsOnlyCallableByReportAllTypes&) {}
-void NSEC3RecordContent::report(const ReportIsOnlyCallableByReportAllTypes&) {}
 void NSEC3PARAMRecordContent::report(const ReportIsOnlyCallableByReportAllTypes&) {}
 void CSYNCRecordContent::report(const ReportIsOnlyCallableByReportAllTypes&) {}
 #endif
@@ -3,7 +3,11 @@
 #include "validate.hh"
 #include "dnsrecords.hh"
 #include "syncres.hh"
+#include <limits>
 #include <ostream>
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/sha.h>
+#endif
 
 #if defined(HAVE_DNSSEC) && !HAVE_DNSSEC
 const std::string& vStateToString(vState)
@@ -24,9 +28,15 @@ std::ostream& operator<<(std::ostream& os, dState)
   return os;
 }
 
-DNSName getSigner(const std::vector<std::shared_ptr<const RRSIGRecordContent>>&)
+DNSName getSigner(const std::vector<std::shared_ptr<const RRSIGRecordContent>>& signatures)
 {
-  return DNSName();
+  for (const auto& sig : signatures) {
+    if (sig) {
+      return sig->d_signer;
+    }
+  }
+
+  return {};
 }
 
 bool isRRSIGNotExpired(time_t, const RRSIGRecordContent&)
@@ -72,15 +82,247 @@ vState validateWithKeySet(time_t /* now */, const DNSName& /* name */,
   return vState::Indeterminate;
 }
 
-bool isWildcardExpanded(unsigned int /* labelCount */, const RRSIGRecordContent& /* rrsig */)
+/* The NSEC and NSEC3 helpers below are the ones from validate.cc. They only look at records that
+   are already in hand, so they work without validation and let aggressive_nsec.cc do real lookups.
+   RFC 4035 section-5.3.4:
+   "If the number of labels in an RRset's owner name is greater than the
+   Labels field of the covering RRSIG RR, then the RRset and its
+   covering RRSIG RR were created as a result of wildcard expansion."
+*/
+bool isWildcardExpanded(unsigned int labelCount, const RRSIGRecordContent& sign)
+{
+  return sign.d_labels < labelCount;
+}
+
+bool isWildcardExpandedOntoItself(const DNSName& owner, unsigned int labelCount, const RRSIGRecordContent& sign)
+{
+  /* this is a wildcard alright, but it has not been expanded */
+  return owner.isWildcard() && (labelCount - 1) == sign.d_labels;
+}
+
+uint16_t g_maxNSEC3Iterations{0};
+
+#ifdef HAVE_LIBCRYPTO
+// rfc5155 section 5, see dnssecinfra.cc
+string hashQNameWithSalt(const std::string& salt, unsigned int iterations, const DNSName& qname)
+{
+  unsigned int times = iterations;
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  string toHash(qname.toDNSStringLC() + salt);
+
+  for (;;) {
+    /* so the first time we hash the (lowercased) qname plus the salt,
+       then the result of the last iteration plus the salt */
+    SHA1(reinterpret_cast<const unsigned char*>(toHash.c_str()), toHash.length(), hash);
+    if (!times--) {
+      /* we are done, just copy the result and return it */
+      toHash.assign(reinterpret_cast<char*>(hash), sizeof(hash));
+      break;
+    }
+    if (times == (iterations - 1)) {
+      /* first time, we need to replace the qname + salt with
+         the hash plus salt, since the qname will not likely
+         match the size of the hash */
+      if (toHash.capacity() < (sizeof(hash) + salt.size())) {
+        toHash.reserve(sizeof(hash) + salt.size());
+      }
+      toHash.assign(reinterpret_cast<char*>(hash), sizeof(hash));
+      toHash.append(salt);
+    }
+    else {
+      /* starting with the second iteration, the hash size does not change, so we don't need to copy the salt again */
+      std::copy(reinterpret_cast<char*>(hash), reinterpret_cast<char*>(hash) + sizeof(hash), toHash.begin());
+    }
+  }
+
+  return toHash;
+}
+#endif
+
+[[nodiscard]] std::string getHashFromNSEC3(const DNSName& qname, uint16_t iterations, const std::string& salt, pdns::validation::ValidationContext& context)
+{
+  std::string result;
+#ifdef HAVE_LIBCRYPTO
+  if (g_maxNSEC3Iterations != 0 && iterations > g_maxNSEC3Iterations) {
+    return result;
+  }
+
+  auto key = std::tuple(qname, salt, iterations);
+  auto iter = context.d_nsec3Cache.find(key);
+  if (iter != context.d_nsec3Cache.end()) {
+    return iter->second;
+  }
+
+  if (context.d_nsec3IterationsRemainingQuota < iterations) {
+    // we throw here because we cannot take the risk that the result
+    // be cached, since a different query can try to validate the
+    // same result with a bigger NSEC3 iterations quota
+    throw pdns::validation::TooManySEC3IterationsException();
+  }
+
+  result = hashQNameWithSalt(salt, iterations, qname);
+  context.d_nsec3IterationsRemainingQuota -= iterations;
+  context.d_nsec3Cache[key] = result;
+#endif
+  return result;
+}
+
+bool isCoveredByNSEC3Hash(const std::string& hash, const std::string& beginHash, const std::string& nextHash)
 {
+  int order_bh = beginHash.compare(hash);
+  int order_hn = hash.compare(nextHash);
+  if (order_bh < 0 && order_hn < 0) { // beginHash < hash && hash < nextHash
+    return true; // no wrap          BEGINNING --- HASH -- END
+  }
+  int order_bn = beginHash.compare(nextHash);
+  if (order_hn < 0 && order_bn > 0) { // nextHash > hash && beginHash > nextHash
+    return true; // wrap             HASH --- END --- BEGINNING
+  }
+  if (order_bn > 0 && order_bh < 0) { // nextHash < beginHash && beginHash < hash
+    return true; // wrap other case  END --- BEGINNING --- HASH
+  }
+  if (order_bn == 0 && order_bh != 0) { // beginHash == nextHash && hash != beginHash
+    return true; // "we have only 1 NSEC3 record, LOL!"
+  }
   return false;
 }
 
-bool isWildcardExpandedOntoItself(const DNSName& /* name */, unsigned int /* labelCount */, const RRSIGRecordContent& /* rrsig */)
+// Exact same logic as above, except that the arguments are not hashes.
+bool isCoveredByNSEC(const DNSName& name, const DNSName& begin, const DNSName& next)
 {
+  int order_bh = begin.canonCompare_three_way(name);
+  int order_hn = name.canonCompare_three_way(next);
+  if (order_bh < 0 && order_hn < 0) {
+    return true; // no wrap          BEGINNING --- NAME -- NEXT
+  }
+  int order_bn = begin.canonCompare_three_way(next);
+  if (order_hn < 0 && order_bn > 0) {
+    return true; // wrap             NEXT --- END --- BEGINNING
+  }
+  if (order_bn > 0 && order_bh < 0) {
+    return true; // wrap other case  END --- BEGINNING --- NEXT
+  }
+  if (order_bn == 0 && order_bh != 0) {
+    return true; // "we have only 1 NSEC record, LOL!"
+  }
   return false;
 }
+
+static bool nsecProvesENT(const DNSName& name, const DNSName& begin, const DNSName& next)
+{
+  /* if name is an ENT:
+     - begin < name
+     - next is a child of name
+  */
+  return begin.canonCompare(name) && next != name && next.isPartOf(name);
+}
+
+static bool isNSECAncestorDelegation(const DNSName& signer, const DNSName& owner, const NSECRecordContent& nsec)
+{
+  return nsec.isSet(QType::NS) && !nsec.isSet(QType::SOA) && signer.countLabels() < owner.countLabels();
+}
+
+bool isNSEC3AncestorDelegation(const DNSName& signer, const DNSName& owner, const NSEC3RecordContent& nsec3)
+{
+  return nsec3.isSet(QType::NS) && !nsec3.isSet(QType::SOA) && signer.countLabels() < owner.countLabels();
+}
+
+/* if this is a wildcard NSEC, the owner name has been modified
+   to match the name. Make sure we use the original '*' form. */
+DNSName getNSECOwnerName(const DNSName& initialOwner, const std::vector<std::shared_ptr<const RRSIGRecordContent>>& signatures)
+{
+  DNSName result = initialOwner;
+
+  if (signatures.empty()) {
+    return result;
+  }
+
+  const auto& sign = signatures.at(0);
+  unsigned int labelsCount = initialOwner.countLabels();
+  if (sign && sign->d_labels < labelsCount) {
+    do {
+      result.chopOff();
+      labelsCount--;
+    } while (sign->d_labels < labelsCount);
+
+    result = g_wildcarddnsname + result;
+  }
+
+  return result;
+}
+
+DNSName getClosestEncloserFromNSEC(const DNSName& name, const DNSName& owner, const DNSName& next)
+{
+  DNSName commonWithOwner(name.getCommonLabels(owner));
+  DNSName commonWithNext(name.getCommonLabels(next));
+  if (commonWithOwner.countLabels() >= commonWithNext.countLabels()) {
+    return commonWithOwner;
+  }
+  return commonWithNext;
+}
+
+dState matchesNSEC(const DNSName& name, uint16_t qtype, const DNSName& nsecOwner, const NSECRecordContent& nsec, const std::vector<std::shared_ptr<const RRSIGRecordContent>>& signatures, const OptLog& log)
+{
+  const DNSName signer = getSigner(signatures);
+  if (!name.isPartOf(signer) || !nsecOwner.isPartOf(signer)) {
+    return dState::INCONCLUSIVE;
+  }
+
+  const DNSName owner = getNSECOwnerName(nsecOwner, signatures);
+  /* RFC 6840 section 4.1 "Clarifications on Nonexistence Proofs":
+     Ancestor delegation NSEC or NSEC3 RRs MUST NOT be used to assume
+     nonexistence of any RRs below that zone cut, which include all RRs at
+     that (original) owner name other than DS RRs, and all RRs below that
+     owner name regardless of type.
+  */
+  if (name.isPartOf(owner) && isNSECAncestorDelegation(signer, owner, nsec)) {
+    /* this is an "ancestor delegation" NSEC RR */
+    if (qtype != QType::DS || name != owner) {
+      VLOG_NO_PREFIX(log, "An ancestor delegation NSEC RR can only deny the existence of a DS" << endl);
+      return dState::NODENIAL;
+    }
+  }
+
+  /* check if the type is denied */
+  if (name == owner) {
+    if (!isTypeDenied(nsec, QType(qtype))) {
+      VLOG_NO_PREFIX(log, "does _not_ deny existence of type " << QType(qtype) << endl);
+      return dState::NODENIAL;
+    }
+
+    if (qtype == QType::DS && signer == name) {
+      VLOG_NO_PREFIX(log, "the NSEC comes from the child zone and cannot be used to deny a DS" << endl);
+      return dState::NODENIAL;
+    }
+
+    VLOG_NO_PREFIX(log, "Denies existence of type " << QType(qtype) << endl);
+    return dState::NXQTYPE;
+  }
+
+  if (name.isPartOf(owner) && nsec.isSet(QType::DNAME)) {
+    /* rfc6672 section 5.3.2: DNAME Bit in NSEC Type Map */
+    VLOG(log, "the DNAME bit is set and the query name is a subdomain of that NSEC");
+    return dState::NODENIAL;
+  }
+
+  if (isCoveredByNSEC(name, owner, nsec.d_next)) {
+    VLOG_NO_PREFIX(log, name << ": is covered by (" << owner << " to " << nsec.d_next << ")");
+
+    if (nsecProvesENT(name, owner, nsec.d_next)) {
+      VLOG_NO_PREFIX(log, " denies existence of type " << name << "/" << QType(qtype) << " by proving that " << name << " is an ENT" << endl);
+      return dState::NXQTYPE;
+    }
+
+    return dState::NXDOMAIN;
+  }
+
+  return dState::INCONCLUSIVE;
+}
+
+[[nodiscard]] uint64_t getNSEC3DenialProofWorstCaseIterationsCount(uint8_t maxLabels, uint16_t iterations, size_t saltLength)
+{
+  return static_cast<uint64_t>((iterations + 1U + (saltLength > 0 ? 1U : 0U))) * maxLabels;
+}
 #endif
 
 // Define g_dnssecLogBogus (needed by startDoResolve in pdns_recursor.cc)
@@ -0,0 +1,153 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+#include "dnstap.hh"
+#include "dns.hh"
+
+#include <protozero/pbf_writer.hpp>
+
+namespace DnstapBaseFields
+{
+enum : protozero::pbf_tag_type
+{
+  identity = 1,
+  version = 2,
+  extra = 3,
+  message = 14,
+  type = 15
+};
+}
+
+namespace DnstapMessageTypes
+{
+enum : protozero::pbf_tag_type
+{
+  message = 1
+};
+}
+
+namespace DnstapSocketFamilyTypes
+{
+enum : protozero::pbf_tag_type
+{
+  inet = 1,
+  inet6 = 2
+};
+}
+
+namespace DnstapMessageFields
+{
+enum : protozero::pbf_tag_type
+{
+  type = 1,
+  socket_family = 2,
+  socket_protocol = 3,
+  query_address = 4,
+  response_address = 5,
+  query_port = 6,
+  response_port = 7,
+  query_time_sec = 8,
+  query_time_nsec = 9,
+  query_message = 10,
+  query_zone = 11,
+  response_time_sec = 12,
+  response_time_nsec = 13,
+  response_message = 14
+};
+}
+
+static void addAddress(protozero::pbf_writer& pbf, protozero::pbf_tag_type addressField, protozero::pbf_tag_type portField, const ComboAddress& address)
+{
+  if (address.sin4.sin_family == AF_INET) {
+    pbf.add_bytes(addressField, reinterpret_cast<const char*>(&address.sin4.sin_addr.s_addr), sizeof(address.sin4.sin_addr.s_addr)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  }
+  else if (address.sin4.sin_family == AF_INET6) {
+    pbf.add_bytes(addressField, reinterpret_cast<const char*>(&address.sin6.sin6_addr.s6_addr), sizeof(address.sin6.sin6_addr.s6_addr)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  }
+  pbf.add_uint32(portField, ntohs(address.sin4.sin_port));
+}
+
+DnstapMessage::DnstapMessage(std::string&& buffer, DnstapMessage::MessageType type, const std::string& identity, const ComboAddress* requestor, const ComboAddress* responder, DnstapMessage::ProtocolType protocol, const char* packet, const size_t len, const struct timespec* queryTime, const struct timespec* responseTime, const boost::optional<const DNSName&>& auth) :
+  d_buffer(std::move(buffer))
+{
+  d_buffer.clear();
+  protozero::pbf_writer pbf{d_buffer};
+
+  pbf.add_bytes(DnstapBaseFields::identity, identity);
+  pbf.add_bytes(DnstapBaseFields::version, PACKAGE_STRING);
+  pbf.add_enum(DnstapBaseFields::type, DnstapMessageTypes::message);
+
+  protozero::pbf_writer pbf_message{pbf, DnstapBaseFields::message};
+
+  pbf_message.add_enum(DnstapMessageFields::type, static_cast<int32_t>(type));
+  pbf_message.add_enum(DnstapMessageFields::socket_protocol, static_cast<int32_t>(protocol));
+
+  const ComboAddress* familySource = requestor != nullptr ? requestor : responder;
+  if (familySource != nullptr) {
+    pbf_message.add_enum(DnstapMessageFields::socket_family, familySource->sin4.sin_family == AF_INET ? DnstapSocketFamilyTypes::inet : DnstapSocketFamilyTypes::inet6);
+  }
+
+  if (requestor != nullptr) {
+    addAddress(pbf_message, DnstapMessageFields::query_address, DnstapMessageFields::query_port, *requestor);
+  }
+  if (responder != nullptr) {
+    addAddress(pbf_message, DnstapMessageFields::response_address, DnstapMessageFields::response_port, *responder);
+  }
+
+  if (queryTime != nullptr) {
+    pbf_message.add_uint64(DnstapMessageFields::query_time_sec, queryTime->tv_sec);
+    pbf_message.add_fixed32(DnstapMessageFields::query_time_nsec, queryTime->tv_nsec);
+  }
+
+  if (responseTime != nullptr) {
+    pbf_message.add_uint64(DnstapMessageFields::response_time_sec, responseTime->tv_sec);
+    pbf_message.add_fixed32(DnstapMessageFields::response_time_nsec, responseTime->tv_nsec);
+  }
+
+  if (packet != nullptr && len >= sizeof(dnsheader)) {
+    const dnsheader_aligned header(packet);
+    if (!header->qr) {
+      pbf_message.add_bytes(DnstapMessageFields::query_message, packet, len);
+    }
+    else {
+      pbf_message.add_bytes(DnstapMessageFields::response_message, packet, len);
+    }
+  }
+
+  if (auth) {
+    pbf_message.add_bytes(DnstapMessageFields::query_zone, auth->toDNSString());
+  }
+
+  pbf_message.commit();
+}
+
+void DnstapMessage::setExtra(const std::string& extra)
+{
+  protozero::pbf_writer pbf{d_buffer};
+  pbf.add_bytes(DnstapBaseFields::extra, extra);
+}
+
+std::string&& DnstapMessage::getBuffer()
+{
+  return std::move(d_buffer);
+}
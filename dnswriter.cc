@@ -547,8 +547,9 @@ template <typename Container> void GenericDNSPacketWriter<Container>::commit()
     uint8_t* packetPtr = &*d_content.begin();
     switch(d_recordplace) {
     case DNSResourceRecord::QUESTION: {
+      // The bytes are big-endian, so assembling them by hand already yields the host order value
       uint16_t qdcount = (static_cast<uint16_t>(packetPtr[4]) << 8) | static_cast<uint16_t>(packetPtr[5]);
-      qdcount = htons(ntohs(qdcount) + 1);
+      qdcount = qdcount + 1;
       packetPtr[4] = (qdcount >> 8) & 0xFF;
       packetPtr[5] = qdcount & 0xFF;
       break;
@@ -575,17 +576,15 @@ template <typename Container> void GenericDNSPacketWriter<Container>::commit()
     }
     case DNSResourceRecord::AUTHORITY: {
       uint16_t nscount = (static_cast<uint16_t>(packetPtr[8]) << 8) | static_cast<uint16_t>(packetPtr[9]);
-      nscount = htons(ntohs(nscount) + 1);
+      nscount = nscount + 1;
       packetPtr[8] = (nscount >> 8) & 0xFF;
       packetPtr[9] = nscount & 0xFF;
       break;
     }
     case DNSResourceRecord::ADDITIONAL: {
       // Read ARCOUNT from wire format (network byte order, big-endian)
-      // Bytes 10-11 are already in network byte order: high byte at 10, low byte at 11
-      uint16_t arcount_network = (static_cast<uint16_t>(packetPtr[10]) << 8) | static_cast<uint16_t>(packetPtr[11]);
-      // Convert to host byte order for arithmetic
-      uint16_t arcount_host = ntohs(arcount_network);
+      // Assembling bytes 10-11 high byte first already yields the host order value, no ntohs() needed
+      uint16_t arcount_host = (static_cast<uint16_t>(packetPtr[10]) << 8) | static_cast<uint16_t>(packetPtr[11]);
       // Increment
       uint16_t arcount_new_host = arcount_host + 1;
       // CRITICAL FIX: Write bytes directly in network byte order (big-endian)
@@ -20,13 +20,19 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <array>
 #include <cinttypes>
+#include <deque>
 #include <iostream>
 #include <boost/format.hpp>
 
 #include "filterpo.hh"
 #include "namespaces.hh"
 #include "dnsrecords.hh"
+#include "rec-tcounters.hh"
+
+extern thread_local rec::TCounters t_Counters;
 
 // Names below are RPZ Actions and end with a dot (except "Local Data")
 static const std::string rpzDropName("rpz-drop."),
@@ -40,6 +46,8 @@ static const std::string rpzClientIPName("rpz-client-ip"),
   rpzNSDnameName("rpz-nsdname"),
   rpzNSIPName("rpz-nsip");
 
+std::atomic<uint64_t> DNSFilterEngine::Zone::s_nameTriggersGeneration{0};
+
 DNSFilterEngine::DNSFilterEngine() = default;
 
 bool DNSFilterEngine::Zone::findExactQNamePolicy(const DNSName& qname, DNSFilterEngine::Policy& pol) const
@@ -59,8 +67,8 @@ bool DNSFilterEngine::Zone::findExactNSPolicy(const DNSName& qname, DNSFilterEng
 
 bool DNSFilterEngine::Zone::findNSIPPolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const
 {
-  if (const auto* fnd = d_propolNSAddr.lookup(addr)) {
-    pol = fnd->second;
+  if (const auto* fnd = d_propolNSAddrCompiled ? d_propolNSAddrCompiled->lookup(addr) : d_propolNSAddr.lookup(addr)) {
+    pol = d_actions.at(fnd->second);
     pol.setHitData(Zone::maskToRPZ(fnd->first), addr.toString());
     pol.d_hitdata->d_trigger.appendRawLabel(rpzNSIPName);
     return true;
@@ -70,8 +78,8 @@ bool DNSFilterEngine::Zone::findNSIPPolicy(const ComboAddress& addr, DNSFilterEn
 
 bool DNSFilterEngine::Zone::findResponsePolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const
 {
-  if (const auto* fnd = d_postpolAddr.lookup(addr)) {
-    pol = fnd->second;
+  if (const auto* fnd = d_postpolAddrCompiled ? d_postpolAddrCompiled->lookup(addr) : d_postpolAddr.lookup(addr)) {
+    pol = d_actions.at(fnd->second);
     pol.setHitData(Zone::maskToRPZ(fnd->first), addr.toString());
     pol.d_hitdata->d_trigger.appendRawLabel(rpzIPName);
     return true;
@@ -81,8 +89,8 @@ bool DNSFilterEngine::Zone::findResponsePolicy(const ComboAddress& addr, DNSFilt
 
 bool DNSFilterEngine::Zone::findClientPolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const
 {
-  if (const auto* fnd = d_qpolAddr.lookup(addr)) {
-    pol = fnd->second;
+  if (const auto* fnd = d_qpolAddrCompiled ? d_qpolAddrCompiled->lookup(addr) : d_qpolAddr.lookup(addr)) {
+    pol = d_actions.at(fnd->second);
     pol.setHitData(Zone::maskToRPZ(fnd->first), addr.toString());
     pol.d_hitdata->d_trigger.appendRawLabel(rpzClientIPName);
     return true;
@@ -90,7 +98,7 @@ bool DNSFilterEngine::Zone::findClientPolicy(const ComboAddress& addr, DNSFilter
   return false;
 }
 
-bool DNSFilterEngine::Zone::findNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol)
+bool DNSFilterEngine::Zone::findNamedPolicy(const PackedNameMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const
 {
   if (polmap.empty()) {
     return false;
@@ -103,35 +111,31 @@ bool DNSFilterEngine::Zone::findNamedPolicy(const std::unordered_map<DNSName, DN
                     *.
    */
 
-  std::unordered_map<DNSName, DNSFilterEngine::Policy>::const_iterator iter;
-  iter = polmap.find(qname);
-
-  if (iter != polmap.end()) {
-    pol = iter->second;
+  if (const auto* index = polmap.find(qname)) {
+    pol = d_actions.at(*index);
     return true;
   }
 
   DNSName sub(qname);
   while (sub.chopOff()) {
-    iter = polmap.find(g_wildcarddnsname + sub);
-    if (iter != polmap.end()) {
-      pol = iter->second;
-      pol.setHitData(iter->first, qname.toStringNoDot());
+    DNSName wildcard = g_wildcarddnsname + sub;
+    if (const auto* index = polmap.find(wildcard)) {
+      pol = d_actions.at(*index);
+      pol.setHitData(wildcard, qname.toStringNoDot());
       return true;
     }
   }
   return false;
 }
 
-bool DNSFilterEngine::Zone::findExactNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol)
+bool DNSFilterEngine::Zone::findExactNamedPolicy(const PackedNameMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const
 {
   if (polmap.empty()) {
     return false;
   }
 
-  const auto iter = polmap.find(qname);
-  if (iter != polmap.end()) {
-    pol = iter->second;
+  if (const auto* index = polmap.find(qname)) {
+    pol = d_actions.at(*index);
     pol.setHitData(qname, qname.toStringNoDot());
     return true;
   }
@@ -139,12 +143,42 @@ bool DNSFilterEngine::Zone::findExactNamedPolicy(const std::unordered_map<DNSNam
   return false;
 }
 
+namespace
+{
+/* keeps track of what the prefilters said during an address lookup that found nothing */
+class PrefilterOutcome
+{
+public:
+  bool mayMatch(bool hasPolicies, bool mayHavePolicy)
+  {
+    d_consulted = d_consulted || hasPolicies;
+    d_passed = d_passed || (hasPolicies && mayHavePolicy);
+    return hasPolicies && mayHavePolicy;
+  }
+  void count() const
+  {
+    if (d_passed) {
+      t_Counters.at(rec::Counter::rpzPrefilterFalsePositives)++;
+    }
+    else if (d_consulted) {
+      t_Counters.at(rec::Counter::rpzPrefilterSkips)++;
+    }
+  }
+
+private:
+  bool d_consulted{false};
+  bool d_passed{false};
+};
+}
+
 bool DNSFilterEngine::getProcessingPolicy(const DNSName& qname, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& pol) const
 {
   // cout<<"Got question for nameserver name "<<qname<<endl;
   std::vector<bool> zoneEnabled(d_zones.size());
   size_t count = 0;
   bool allEmpty = true;
+  bool mayMatch = false;
+  TriggersPrefilter::NameKeys keys;
   for (const auto& zone : d_zones) {
     bool enabled = true;
     const auto& zoneName = zone->getName();
@@ -153,7 +187,12 @@ bool DNSFilterEngine::getProcessingPolicy(const DNSName& qname, const std::unord
     }
     else {
       if (zone->hasNSPolicies()) {
+        if (allEmpty) {
+          TriggersPrefilter::getNameKeys(qname, keys);
+        }
         allEmpty = false;
+        enabled = zone->mayHaveNSPolicy(keys);
+        mayMatch = mayMatch || enabled;
       }
       else {
         enabled = false;
@@ -167,6 +206,18 @@ bool DNSFilterEngine::getProcessingPolicy(const DNSName& qname, const std::unord
   if (allEmpty) {
     return false;
   }
+  if (!mayMatch) {
+    t_Counters.at(rec::Counter::rpzPrefilterSkips)++;
+    return false;
+  }
+
+  if (d_nsTrie) {
+    if (findNamedPolicyUsingTrie(*d_nsTrie, &Zone::findExactNSPolicy, qname, zoneEnabled, pol)) {
+      return true;
+    }
+    t_Counters.at(rec::Counter::rpzPrefilterFalsePositives)++;
+    return false;
+  }
 
   /* prepare the wildcard-based names */
   std::vector<DNSName> wcNames;
@@ -198,12 +249,14 @@ bool DNSFilterEngine::getProcessingPolicy(const DNSName& qname, const std::unord
     ++count;
   }
 
+  t_Counters.at(rec::Counter::rpzPrefilterFalsePositives)++;
   return false;
 }
 
 bool DNSFilterEngine::getProcessingPolicy(const ComboAddress& address, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& pol) const
 {
   //  cout<<"Got question for nameserver IP "<<address.toString()<<endl;
+  PrefilterOutcome outcome;
   for (const auto& zone : d_zones) {
     if (zone->getPriority() >= pol.getPriority()) {
       break;
@@ -212,18 +265,23 @@ bool DNSFilterEngine::getProcessingPolicy(const ComboAddress& address, const std
     if (discardedPolicies.find(zoneName) != discardedPolicies.end()) {
       continue;
     }
+    if (!outcome.mayMatch(zone->hasNSIPPolicies(), zone->mayHaveNSIPPolicy(address))) {
+      continue;
+    }
 
     if (zone->findNSIPPolicy(address, pol)) {
       //      cerr<<"Had a hit on the nameserver ("<<address.toString()<<") used to process the query"<<endl;
       return true;
     }
   }
+  outcome.count();
   return false;
 }
 
 bool DNSFilterEngine::getClientPolicy(const ComboAddress& address, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& pol) const
 {
   // cout<<"Got question from "<<ca.toString()<<endl;
+  PrefilterOutcome outcome;
   for (const auto& zone : d_zones) {
     if (zone->getPriority() >= pol.getPriority()) {
       break;
@@ -232,12 +290,16 @@ bool DNSFilterEngine::getClientPolicy(const ComboAddress& address, const std::un
     if (discardedPolicies.find(zoneName) != discardedPolicies.end()) {
       continue;
     }
+    if (!outcome.mayMatch(zone->hasClientPolicies(), zone->mayHaveClientPolicy(address))) {
+      continue;
+    }
 
     if (zone->findClientPolicy(address, pol)) {
       // cerr<<"Had a hit on the IP address ("<<ca.toString()<<") of the client"<<endl;
       return true;
     }
   }
+  outcome.count();
   return false;
 }
 
@@ -247,6 +309,8 @@ bool DNSFilterEngine::getQueryPolicy(const DNSName& qname, const std::unordered_
   std::vector<bool> zoneEnabled(d_zones.size());
   size_t count = 0;
   bool allEmpty = true;
+  bool mayMatch = false;
+  TriggersPrefilter::NameKeys keys;
   for (const auto& zone : d_zones) {
     bool enabled = true;
     if (zone->getPriority() >= pol.getPriority()) {
@@ -259,7 +323,12 @@ bool DNSFilterEngine::getQueryPolicy(const DNSName& qname, const std::unordered_
       }
       else {
         if (zone->hasQNamePolicies()) {
+          if (allEmpty) {
+            TriggersPrefilter::getNameKeys(qname, keys);
+          }
           allEmpty = false;
+          enabled = zone->mayHaveQNamePolicy(keys);
+          mayMatch = mayMatch || enabled;
         }
         else {
           enabled = false;
@@ -274,6 +343,18 @@ bool DNSFilterEngine::getQueryPolicy(const DNSName& qname, const std::unordered_
   if (allEmpty) {
     return false;
   }
+  if (!mayMatch) {
+    t_Counters.at(rec::Counter::rpzPrefilterSkips)++;
+    return false;
+  }
+
+  if (d_qnameTrie) {
+    if (findNamedPolicyUsingTrie(*d_qnameTrie, &Zone::findExactQNamePolicy, qname, zoneEnabled, pol)) {
+      return true;
+    }
+    t_Counters.at(rec::Counter::rpzPrefilterFalsePositives)++;
+    return false;
+  }
 
   /* prepare the wildcard-based names */
   std::vector<DNSName> wcNames;
@@ -307,6 +388,7 @@ bool DNSFilterEngine::getQueryPolicy(const DNSName& qname, const std::unordered_
     ++count;
   }
 
+  t_Counters.at(rec::Counter::rpzPrefilterFalsePositives)++;
   return false;
 }
 
@@ -342,20 +424,26 @@ bool DNSFilterEngine::getPostPolicy(const DNSRecord& record, const std::unordere
     return false;
   }
 
+  PrefilterOutcome outcome;
   for (const auto& zone : d_zones) {
     if (zone->getPriority() >= pol.getPriority()) {
       break;
     }
     const auto& zoneName = zone->getName();
     if (discardedPolicies.find(zoneName) != discardedPolicies.end()) {
+      outcome.count();
       return false;
     }
+    if (!outcome.mayMatch(zone->hasResponsePolicies(), zone->mayHaveResponsePolicy(address))) {
+      continue;
+    }
 
     if (zone->findResponsePolicy(address, pol)) {
       return true;
     }
   }
 
+  outcome.count();
   return false;
 }
 
@@ -366,6 +454,331 @@ void DNSFilterEngine::assureZones(size_t zone)
   }
 }
 
+namespace
+{
+std::string_view toLowerLabel(std::string_view label, std::array<char, 256>& buffer)
+{
+  std::transform(label.begin(), label.end(), buffer.begin(), [](char chr) { return static_cast<char>(dns_tolower(chr)); });
+  return {buffer.data(), label.size()};
+}
+}
+
+struct DNSFilterEngine::NameTriggersTrie::BuilderNode
+{
+  void add(const DNSName& trigger, uint16_t zoneIdx, std::array<char, 256>& buffer)
+  {
+    auto* node = this;
+    auto visitor = trigger.getRawLabelsVisitor();
+    while (!visitor.empty()) {
+      auto& child = node->d_children[std::string(toLowerLabel(visitor.back(), buffer))];
+      if (!child) {
+        child = std::make_unique<BuilderNode>();
+      }
+      node = child.get();
+      visitor.pop_back();
+    }
+    /* zones are added in order so this stays sorted */
+    if (node->d_zones.empty() || node->d_zones.back() != zoneIdx) {
+      node->d_zones.push_back(zoneIdx);
+    }
+  }
+
+  std::map<std::string, std::unique_ptr<BuilderNode>> d_children;
+  std::vector<uint16_t> d_zones;
+};
+
+DNSFilterEngine::NameTriggersTrie::NameTriggersTrie(const std::vector<std::shared_ptr<Zone>>& zones, bool nsTriggers)
+{
+  BuilderNode root;
+  std::array<char, 256> buffer{};
+
+  d_zoneGenerations.reserve(zones.size());
+  for (size_t zoneIdx = 0; zoneIdx < zones.size(); ++zoneIdx) {
+    const auto& zone = zones.at(zoneIdx);
+    if (!zone) {
+      d_zoneGenerations.emplace_back(nullptr, 0);
+      continue;
+    }
+    d_zoneGenerations.emplace_back(zone.get(), zone->getNameTriggersGeneration());
+
+    const auto& triggers = nsTriggers ? zone->getNSTriggers() : zone->getQNameTriggers();
+    triggers.visit([&root, &buffer, zoneIdx](const DNSName& trigger, uint32_t /* action */) {
+      root.add(trigger, static_cast<uint16_t>(zoneIdx), buffer);
+    });
+  }
+
+  /* flatten breadth-first so that the children of a node are contiguous */
+  std::deque<std::pair<const BuilderNode*, size_t>> queue;
+  d_nodes.emplace_back();
+  queue.emplace_back(&root, 0);
+  while (!queue.empty()) {
+    auto [builder, index] = queue.front();
+    queue.pop_front();
+
+    d_nodes.at(index).d_firstZone = d_zones.size();
+    d_nodes.at(index).d_zonesCount = builder->d_zones.size();
+    d_zones.insert(d_zones.end(), builder->d_zones.begin(), builder->d_zones.end());
+    d_nodes.at(index).d_firstChild = d_nodes.size();
+    d_nodes.at(index).d_childrenCount = builder->d_children.size();
+
+    for (const auto& [label, child] : builder->d_children) {
+      Node node;
+      node.d_labelOffset = d_labels.size();
+      node.d_labelLength = label.size();
+      d_labels.append(label);
+      d_nodes.push_back(node);
+      queue.emplace_back(child.get(), d_nodes.size() - 1);
+    }
+  }
+}
+
+const DNSFilterEngine::NameTriggersTrie::Node* DNSFilterEngine::NameTriggersTrie::findChild(const Node& parent, std::string_view label) const
+{
+  auto begin = d_nodes.begin() + parent.d_firstChild;
+  auto end = begin + parent.d_childrenCount;
+  auto iter = std::lower_bound(begin, end, label, [this](const Node& node, std::string_view value) {
+    return getLabel(node) < value;
+  });
+  if (iter != end && getLabel(*iter) == label) {
+    return &*iter;
+  }
+  return nullptr;
+}
+
+void DNSFilterEngine::NameTriggersTrie::addZonesOf(const Node& node, uint8_t labels, bool wildcard, std::vector<Candidate>& candidates) const
+{
+  for (size_t idx = node.d_firstZone; idx < node.d_firstZone + node.d_zonesCount; ++idx) {
+    candidates.push_back({d_zones[idx], labels, wildcard});
+  }
+}
+
+void DNSFilterEngine::NameTriggersTrie::getCandidates(const DNSName& qname, std::vector<Candidate>& candidates) const
+{
+  candidates.clear();
+  std::array<char, 256> buffer{};
+  const Node* node = &d_nodes.at(0);
+  uint8_t labels = 0;
+  auto visitor = qname.getRawLabelsVisitor();
+
+  while (true) {
+    if (visitor.empty()) {
+      addZonesOf(*node, labels, false, candidates);
+      break;
+    }
+    /* '*' directly below a proper ancestor of the qname */
+    if (const auto* wildcard = findChild(*node, "*"); wildcard != nullptr) {
+      addZonesOf(*wildcard, labels, true, candidates);
+    }
+    node = findChild(*node, toLowerLabel(visitor.back(), buffer));
+    if (node == nullptr) {
+      break;
+    }
+    visitor.pop_back();
+    ++labels;
+  }
+
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs) {
+    if (lhs.d_zone != rhs.d_zone) {
+      return lhs.d_zone < rhs.d_zone;
+    }
+    if (lhs.d_wildcard != rhs.d_wildcard) {
+      return !lhs.d_wildcard;
+    }
+    return lhs.d_labels > rhs.d_labels;
+  });
+}
+
+bool DNSFilterEngine::NameTriggersTrie::isCurrent(size_t zoneIdx, const Zone& zone) const
+{
+  if (zoneIdx >= d_zoneGenerations.size()) {
+    return false;
+  }
+  const auto& [compiled, generation] = d_zoneGenerations.at(zoneIdx);
+  return compiled == &zone && generation == zone.getNameTriggersGeneration();
+}
+
+void DNSFilterEngine::NameTriggersTrie::addZone(size_t nodeIdx, uint16_t zoneIdx)
+{
+  auto& node = d_nodes[nodeIdx];
+  auto begin = d_zones.cbegin() + node.d_firstZone;
+  auto end = begin + node.d_zonesCount;
+  auto iter = std::lower_bound(begin, end, zoneIdx);
+  if (iter != end && *iter == zoneIdx) {
+    return;
+  }
+  /* the zones of a node are contiguous and sorted, so copy them to the end with the new one in its place */
+  std::vector<uint16_t> zones(begin, iter);
+  zones.push_back(zoneIdx);
+  zones.insert(zones.end(), iter, end);
+  node.d_firstZone = d_zones.size();
+  node.d_zonesCount = zones.size();
+  d_zones.insert(d_zones.end(), zones.begin(), zones.end());
+}
+
+void DNSFilterEngine::NameTriggersTrie::merge(size_t nodeIdx, const BuilderNode& builder, uint16_t zoneIdx)
+{
+  if (!builder.d_zones.empty()) {
+    addZone(nodeIdx, zoneIdx);
+  }
+
+  std::vector<std::string_view> missing;
+  for (const auto& [label, child] : builder.d_children) {
+    if (findChild(d_nodes[nodeIdx], label) == nullptr) {
+      missing.emplace_back(label);
+    }
+  }
+
+  if (!missing.empty()) {
+    /* the children of a node have to stay contiguous and sorted: copy them to the end,
+       the new ones merged in at their place (both lists are already sorted) */
+    const size_t first = d_nodes[nodeIdx].d_firstChild;
+    const size_t count = d_nodes[nodeIdx].d_childrenCount;
+    const size_t newFirst = d_nodes.size();
+    d_nodes.reserve(d_nodes.size() + count + missing.size());
+    size_t existing = first;
+    for (const auto& label : missing) {
+      while (existing < first + count && getLabel(d_nodes[existing]) < label) {
+        d_nodes.push_back(d_nodes[existing++]);
+      }
+      Node node;
+      node.d_labelOffset = d_labels.size();
+      node.d_labelLength = label.size();
+      d_labels.append(label);
+      d_nodes.push_back(node);
+    }
+    while (existing < first + count) {
+      d_nodes.push_back(d_nodes[existing++]);
+    }
+    d_nodes[nodeIdx].d_firstChild = newFirst;
+    d_nodes[nodeIdx].d_childrenCount = count + missing.size();
+    d_unusedNodes += count;
+  }
+
+  for (const auto& [label, child] : builder.d_children) {
+    const auto* node = findChild(d_nodes[nodeIdx], label);
+    merge(node - d_nodes.data(), *child, zoneIdx);
+  }
+}
+
+std::shared_ptr<const DNSFilterEngine::NameTriggersTrie> DNSFilterEngine::NameTriggersTrie::patch(size_t zoneIdx, const Zone& zone, bool nsTriggers) const
+{
+  if (zoneIdx >= d_zoneGenerations.size() || !zone.tracksAddedNameTriggers() || d_zoneGenerations.at(zoneIdx).second != zone.getCompiledNameTriggersGeneration()) {
+    return nullptr;
+  }
+
+  /* gather the new names first so that the children of a node are moved at most once,
+     however many names are added below it */
+  BuilderNode added;
+  std::array<char, 256> buffer{};
+  for (const auto& name : nsTriggers ? zone.getAddedNSTriggers() : zone.getAddedQNameTriggers()) {
+    added.add(name, static_cast<uint16_t>(zoneIdx), buffer);
+  }
+
+  auto patched = std::make_shared<NameTriggersTrie>(*this);
+  patched->merge(0, added, static_cast<uint16_t>(zoneIdx));
+  if (patched->d_unusedNodes > patched->d_nodes.size() / 2) {
+    return nullptr;
+  }
+  patched->d_zoneGenerations.at(zoneIdx) = {&zone, zone.getNameTriggersGeneration()};
+  return patched;
+}
+
+void DNSFilterEngine::compile()
+{
+  for (const auto& zone : d_zones) {
+    if (zone) {
+      zone->compileNetmaskTriggers();
+    }
+  }
+  d_qnameTrie = std::make_shared<const NameTriggersTrie>(d_zones, false);
+  d_nsTrie = std::make_shared<const NameTriggersTrie>(d_zones, true);
+  for (const auto& zone : d_zones) {
+    if (zone) {
+      zone->markNameTriggersCompiled();
+    }
+  }
+}
+
+void DNSFilterEngine::patchZone(size_t zoneIdx)
+{
+  auto& zone = *d_zones.at(zoneIdx);
+  auto qnameTrie = d_qnameTrie->patch(zoneIdx, zone, false);
+  auto nsTrie = d_nsTrie->patch(zoneIdx, zone, true);
+  if (!qnameTrie || !nsTrie) {
+    compile();
+    return;
+  }
+  /* the netmask triggers are compiled per zone, only this one needs it */
+  zone.compileNetmaskTriggers();
+  zone.markNameTriggersCompiled();
+  d_qnameTrie = std::move(qnameTrie);
+  d_nsTrie = std::move(nsTrie);
+}
+
+bool DNSFilterEngine::findNamedPolicyUsingTrie(const NameTriggersTrie& trie, ExactNamedPolicyFinder finder, const DNSName& qname, const std::vector<bool>& zoneEnabled, Policy& pol) const
+{
+  std::vector<NameTriggersTrie::Candidate> candidates;
+  trie.getCandidates(qname, candidates);
+
+  /* only needed for zones that changed since the trie was compiled */
+  std::vector<DNSName> wcNames;
+  bool wcNamesPrepared = false;
+
+  auto candidate = candidates.cbegin();
+  for (size_t count = 0; count < d_zones.size(); ++count) {
+    while (candidate != candidates.cend() && candidate->d_zone < count) {
+      ++candidate;
+    }
+    if (!zoneEnabled[count]) {
+      continue;
+    }
+    const auto& zone = *d_zones[count];
+
+    if (!trie.isCurrent(count, zone)) {
+      if ((zone.*finder)(qname, pol)) {
+        return true;
+      }
+      if (!wcNamesPrepared) {
+        wcNames.reserve(qname.countLabels());
+        DNSName sub(qname);
+        while (sub.chopOff()) {
+          wcNames.emplace_back(g_wildcarddnsname + sub);
+        }
+        wcNamesPrepared = true;
+      }
+      for (const auto& wildcard : wcNames) {
+        if ((zone.*finder)(wildcard, pol)) {
+          // Hit is not the wildcard passed to the finder but the actual qname!
+          pol.d_hitdata->d_hit = qname.toStringNoDot();
+          return true;
+        }
+      }
+      continue;
+    }
+
+    /* the trie might still list triggers that have been removed since, so check the zone */
+    for (; candidate != candidates.cend() && candidate->d_zone == count; ++candidate) {
+      if (!candidate->d_wildcard) {
+        if ((zone.*finder)(qname, pol)) {
+          return true;
+        }
+        continue;
+      }
+      DNSName sub(qname);
+      while (sub.countLabels() > candidate->d_labels) {
+        sub.chopOff();
+      }
+      if ((zone.*finder)(g_wildcarddnsname + sub, pol)) {
+        // Hit is not the wildcard passed to the finder but the actual qname!
+        pol.d_hitdata->d_hit = qname.toStringNoDot();
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
 static void addCustom(DNSFilterEngine::Policy& existingPol, const DNSFilterEngine::Policy& pol)
 {
   if (!existingPol.d_custom) {
@@ -377,12 +790,353 @@ static void addCustom(DNSFilterEngine::Policy& existingPol, const DNSFilterEngin
   }
 }
 
-void DNSFilterEngine::Zone::addNameTrigger(std::unordered_map<DNSName, Policy>& map, const DNSName& n, Policy&& pol, bool ignoreDuplicate, PolicyType ptype)
+size_t DNSFilterEngine::PackedNameMap::findSlot(std::string_view wire, uint32_t hash) const
+{
+  if (d_slots.empty()) {
+    return std::string::npos;
+  }
+  const size_t mask = d_slots.size() - 1;
+  /* we always keep some empty slots around, so this ends */
+  for (size_t idx = hash & mask;; idx = (idx + 1) & mask) {
+    const auto& slot = d_slots[idx];
+    if (slot.d_offset == s_empty) {
+      return std::string::npos;
+    }
+    if (slot.d_offset != s_deleted && slot.d_hash == hash) {
+      auto existing = getWireName(slot.d_offset);
+      if (existing.size() == wire.size() && std::equal(existing.begin(), existing.end(), wire.begin(), [](char lhs, char rhs) { return dns_tolower(lhs) == dns_tolower(rhs); })) {
+        return idx;
+      }
+    }
+  }
+}
+
+const uint32_t* DNSFilterEngine::PackedNameMap::find(const DNSName& name) const
+{
+  const auto& storage = name.getStorage();
+  auto idx = findSlot({storage.data(), storage.size()}, static_cast<uint32_t>(name.hash()));
+  if (idx == std::string::npos) {
+    return nullptr;
+  }
+  return &d_slots[idx].d_value;
+}
+
+bool DNSFilterEngine::PackedNameMap::insert(const DNSName& name, uint32_t value)
+{
+  const auto& storage = name.getStorage();
+  std::string_view wire(storage.data(), storage.size());
+  auto hash = static_cast<uint32_t>(name.hash());
+  if (findSlot(wire, hash) != std::string::npos) {
+    return false;
+  }
+  if (d_arena.size() + wire.size() + 1 >= s_deleted) {
+    throw std::runtime_error("Too many names to store in a single RPZ zone");
+  }
+
+  /* keep the load factor, including the deleted slots, under 70% */
+  if ((d_size + d_deletedSlots + 1) * 10 > d_slots.size() * 7) {
+    rebuild((d_size + 1) * 2);
+  }
+
+  const size_t mask = d_slots.size() - 1;
+  size_t idx = hash & mask;
+  while (d_slots[idx].d_offset < s_deleted) {
+    idx = (idx + 1) & mask;
+  }
+  if (d_slots[idx].d_offset == s_deleted) {
+    --d_deletedSlots;
+  }
+  d_slots[idx] = {static_cast<uint32_t>(d_arena.size()), hash, value};
+  d_arena.push_back(static_cast<char>(wire.size()));
+  d_arena.append(wire);
+  ++d_size;
+  return true;
+}
+
+bool DNSFilterEngine::PackedNameMap::erase(const DNSName& name)
 {
-  auto iter = map.find(n);
+  const auto& storage = name.getStorage();
+  auto idx = findSlot({storage.data(), storage.size()}, static_cast<uint32_t>(name.hash()));
+  if (idx == std::string::npos) {
+    return false;
+  }
 
-  if (iter != map.end()) {
-    auto& existingPol = iter->second;
+  d_deadBytes += storage.size() + 1;
+  d_slots[idx].d_offset = s_deleted;
+  ++d_deletedSlots;
+  --d_size;
+
+  /* the arena is only compacted once most of it is garbage */
+  if (d_deadBytes > d_arena.size() / 2) {
+    rebuild(d_size * 2);
+  }
+  return true;
+}
+
+void DNSFilterEngine::PackedNameMap::clear()
+{
+  d_slots.clear();
+  d_arena.clear();
+  d_size = 0;
+  d_deletedSlots = 0;
+  d_deadBytes = 0;
+}
+
+void DNSFilterEngine::PackedNameMap::reserve(size_t entries)
+{
+  if (entries * 10 > d_slots.size() * 7) {
+    rebuild(entries * 10 / 7 + 1);
+  }
+}
+
+void DNSFilterEngine::PackedNameMap::rebuild(size_t slotsCount)
+{
+  size_t count = 16;
+  while (count < slotsCount) {
+    count *= 2;
+  }
+
+  std::vector<Slot> slots(count);
+  std::string arena;
+  arena.reserve(d_arena.size() - d_deadBytes);
+  for (const auto& slot : d_slots) {
+    if (slot.d_offset >= s_deleted) {
+      continue;
+    }
+    auto wire = getWireName(slot.d_offset);
+    size_t idx = slot.d_hash & (count - 1);
+    while (slots[idx].d_offset != s_empty) {
+      idx = (idx + 1) & (count - 1);
+    }
+    slots[idx] = {static_cast<uint32_t>(arena.size()), slot.d_hash, slot.d_value};
+    arena.push_back(static_cast<char>(wire.size()));
+    arena.append(wire);
+  }
+
+  d_slots = std::move(slots);
+  d_arena = std::move(arena);
+  d_deletedSlots = 0;
+  d_deadBytes = 0;
+}
+
+/* two policies with the same key are interchangeable, the zone data being the same for all of them */
+std::string DNSFilterEngine::Zone::getActionKey(const Policy& pol)
+{
+  std::string key = std::to_string(static_cast<int>(pol.d_kind)) + " " + std::to_string(static_cast<int>(pol.d_type)) + " " + std::to_string(pol.d_ttl);
+  if (pol.d_custom) {
+    for (const auto& custom : *pol.d_custom) {
+      key += " " + std::to_string(custom->getType()) + " " + custom->getZoneRepresentation();
+    }
+  }
+  return key;
+}
+
+uint32_t DNSFilterEngine::Zone::acquireAction(Policy&& pol)
+{
+  auto key = getActionKey(pol);
+  if (auto iter = d_actionIndex.find(key); iter != d_actionIndex.end()) {
+    ++d_actionRefs.at(iter->second);
+    return iter->second;
+  }
+
+  uint32_t index = 0;
+  if (!d_freeActions.empty()) {
+    index = d_freeActions.back();
+    d_freeActions.pop_back();
+    d_actions.at(index) = std::move(pol);
+    d_actionRefs.at(index) = 1;
+  }
+  else {
+    index = d_actions.size();
+    d_actions.push_back(std::move(pol));
+    d_actionRefs.push_back(1);
+  }
+  d_actionIndex.emplace(std::move(key), index);
+  return index;
+}
+
+void DNSFilterEngine::Zone::releaseAction(uint32_t index)
+{
+  if (--d_actionRefs.at(index) > 0) {
+    return;
+  }
+  d_actionIndex.erase(getActionKey(d_actions.at(index)));
+  d_actions.at(index) = Policy();
+  d_freeActions.push_back(index);
+}
+
+void DNSFilterEngine::Zone::markNameTriggersCompiled()
+{
+  d_trackAddedNameTriggers = true;
+  d_compiledNameTriggersGeneration = d_nameTriggersGeneration;
+  d_addedQNameTriggers.clear();
+  d_addedNSTriggers.clear();
+}
+
+void DNSFilterEngine::Zone::compileNetmaskTriggers()
+{
+  d_qpolAddrCompiled = d_qpolAddr.empty() ? nullptr : std::make_shared<const CompiledNetmaskTree<uint32_t>>(d_qpolAddr);
+  d_propolNSAddrCompiled = d_propolNSAddr.empty() ? nullptr : std::make_shared<const CompiledNetmaskTree<uint32_t>>(d_propolNSAddr);
+  d_postpolAddrCompiled = d_postpolAddr.empty() ? nullptr : std::make_shared<const CompiledNetmaskTree<uint32_t>>(d_postpolAddr);
+}
+
+size_t DNSFilterEngine::Zone::getMemoryUsage() const
+{
+  /* we can't see the nodes of the netmask trees, this is a close enough estimate */
+  static const size_t netmaskNodeSize = sizeof(Netmask) + sizeof(uint32_t) + 4 * sizeof(void*);
+
+  size_t usage = sizeof(*this);
+  usage += d_qpolName.getMemoryUsage() + d_propolName.getMemoryUsage();
+  usage += (d_qpolAddr.size() + d_propolNSAddr.size() + d_postpolAddr.size()) * netmaskNodeSize;
+  for (const auto& compiled : {d_qpolAddrCompiled, d_propolNSAddrCompiled, d_postpolAddrCompiled}) {
+    if (compiled) {
+      usage += compiled->getMemoryUsage();
+    }
+  }
+  usage += d_qpolNameFilter.getMemoryUsage() + d_qpolAddrFilter.getMemoryUsage() + d_propolNameFilter.getMemoryUsage() + d_propolNSAddrFilter.getMemoryUsage() + d_postpolAddrFilter.getMemoryUsage();
+  usage += d_actions.capacity() * sizeof(Policy) + (d_actionRefs.capacity() + d_freeActions.capacity()) * sizeof(uint32_t);
+  for (const auto& action : d_actions) {
+    if (action.d_custom) {
+      usage += sizeof(Policy::CustomData) + action.d_custom->capacity() * sizeof(Policy::CustomData::value_type);
+    }
+  }
+  for (const auto& entry : d_actionIndex) {
+    usage += sizeof(entry) + entry.first.capacity() + 2 * sizeof(void*);
+  }
+  return usage;
+}
+
+static uint64_t getPrefilterKey(const char* data, size_t length, uint32_t salt)
+{
+  const auto* bytes = reinterpret_cast<const unsigned char*>(data); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  return (static_cast<uint64_t>(burtleCI(bytes, length, salt)) << 32) | burtleCI(bytes, length, ~salt);
+}
+
+/* exact names and the names below a wildcard live in the same filter, with a different salt */
+static const uint32_t s_prefilterExactSalt = 0;
+static const uint32_t s_prefilterWildcardSalt = 0x9e3779b9;
+
+void DNSFilterEngine::TriggersPrefilter::getNameKeys(const DNSName& qname, NameKeys& keys)
+{
+  const auto& storage = qname.getStorage();
+  keys.d_count = 0;
+  keys.d_keys.at(keys.d_count++) = getPrefilterKey(storage.data(), storage.size(), s_prefilterExactSalt);
+
+  size_t position = 0;
+  while (position < storage.size() && storage.at(position) != 0 && keys.d_count < keys.d_keys.size()) {
+    position += static_cast<uint8_t>(storage.at(position)) + 1;
+    keys.d_keys.at(keys.d_count++) = getPrefilterKey(&storage.at(position), storage.size() - position, s_prefilterWildcardSalt);
+  }
+}
+
+void DNSFilterEngine::TriggersPrefilter::addName(const DNSName& name)
+{
+  const auto& storage = name.getStorage();
+  if (storage.size() > 2 && storage.at(0) == 1 && storage.at(1) == '*') {
+    add(getPrefilterKey(&storage.at(2), storage.size() - 2, s_prefilterWildcardSalt));
+  }
+  else {
+    add(getPrefilterKey(storage.data(), storage.size(), s_prefilterExactSalt));
+  }
+}
+
+static uint64_t getPrefilterKey(const Netmask& netmask)
+{
+  const auto& network = netmask.getMaskedNetwork();
+  if (network.isIPv4()) {
+    return getPrefilterKey(reinterpret_cast<const char*>(&network.sin4.sin_addr.s_addr), sizeof(network.sin4.sin_addr.s_addr), netmask.getBits()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  }
+  return getPrefilterKey(reinterpret_cast<const char*>(&network.sin6.sin6_addr.s6_addr), sizeof(network.sin6.sin6_addr.s6_addr), netmask.getBits()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+}
+
+void DNSFilterEngine::TriggersPrefilter::addNetmask(const Netmask& netmask)
+{
+  if (netmask.isIPv4()) {
+    d_v4Bits.set(netmask.getBits());
+  }
+  else {
+    d_v6Bits.set(netmask.getBits());
+  }
+  add(getPrefilterKey(netmask));
+}
+
+bool DNSFilterEngine::TriggersPrefilter::mayMatchName(const NameKeys& keys) const
+{
+  if (d_count == 0) {
+    return false;
+  }
+  for (size_t idx = 0; idx < keys.d_count; ++idx) {
+    if (mayContain(keys.d_keys.at(idx))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DNSFilterEngine::TriggersPrefilter::mayMatchAddress(const ComboAddress& address) const
+{
+  if (d_count == 0) {
+    return false;
+  }
+  if (address.isIPv4()) {
+    for (size_t bits = 0; bits < d_v4Bits.size(); ++bits) {
+      if (d_v4Bits.test(bits) && mayContain(getPrefilterKey(Netmask(address, bits)))) {
+        return true;
+      }
+    }
+    return false;
+  }
+  for (size_t bits = 0; bits < d_v6Bits.size(); ++bits) {
+    if (d_v6Bits.test(bits) && mayContain(getPrefilterKey(Netmask(address, bits)))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void DNSFilterEngine::TriggersPrefilter::reset(size_t capacity)
+{
+  capacity = std::max(capacity, static_cast<size_t>(64));
+  auto blocks = (capacity * s_bitsPerEntry + sizeof(Block) * 8 - 1) / (sizeof(Block) * 8);
+  d_blocks.assign(blocks, Block{});
+  d_v4Bits.reset();
+  d_v6Bits.reset();
+  d_count = 0;
+  d_capacity = capacity;
+}
+
+/* the high half of the key picks a cache-line sized block, the low half the bits inside it */
+void DNSFilterEngine::TriggersPrefilter::add(uint64_t key)
+{
+  if (d_blocks.empty()) {
+    reset(0);
+  }
+  auto& block = d_blocks[(key >> 32) % d_blocks.size()];
+  auto bits = static_cast<uint64_t>(static_cast<uint32_t>(key)) * 0x9e3779b97f4a7c15ULL;
+  for (size_t idx = 0; idx < s_bitsPerKey; ++idx) {
+    auto bit = (bits >> (64 - 9 * (idx + 1))) & 511;
+    block.at(bit / 64) |= (1ULL << (bit % 64));
+  }
+  ++d_count;
+}
+
+bool DNSFilterEngine::TriggersPrefilter::mayContain(uint64_t key) const
+{
+  const auto& block = d_blocks[(key >> 32) % d_blocks.size()];
+  auto bits = static_cast<uint64_t>(static_cast<uint32_t>(key)) * 0x9e3779b97f4a7c15ULL;
+  for (size_t idx = 0; idx < s_bitsPerKey; ++idx) {
+    auto bit = (bits >> (64 - 9 * (idx + 1))) & 511;
+    if ((block.at(bit / 64) & (1ULL << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void DNSFilterEngine::Zone::addNameTrigger(PackedNameMap& map, TriggersPrefilter& filter, const DNSName& n, Policy&& pol, bool ignoreDuplicate, PolicyType ptype)
+{
+  if (auto* index = map.find(n)) {
+    const auto& existingPol = d_actions.at(*index);
 
     if (pol.d_kind != PolicyKind::Custom && !ignoreDuplicate) {
       if (d_zoneData->d_ignoreDuplicates) {
@@ -398,21 +1152,46 @@ void DNSFilterEngine::Zone::addNameTrigger(std::unordered_map<DNSName, Policy>&
       throw std::runtime_error("Adding a " + getTypeToString(ptype) + "-based filter policy of kind " + getKindToString(pol.d_kind) + " but a policy of kind " + getKindToString(existingPol.d_kind) + " already exists for for the following name: " + n.toLogString());
     }
 
-    addCustom(existingPol, pol);
+    Policy merged(existingPol);
+    addCustom(merged, pol);
+    auto mergedIndex = acquireAction(std::move(merged));
+    releaseAction(*index);
+    *index = mergedIndex;
   }
   else {
-    auto& qpol = map.insert({n, std::move(pol)}).first->second;
-    qpol.d_zoneData = d_zoneData;
-    qpol.d_type = ptype;
+    pol.d_zoneData = d_zoneData;
+    pol.d_type = ptype;
+    map.insert(n, acquireAction(std::move(pol)));
+    d_nameTriggersGeneration = ++s_nameTriggersGeneration;
+    if (d_trackAddedNameTriggers) {
+      (&map == &d_qpolName ? d_addedQNameTriggers : d_addedNSTriggers).push_back(n);
+      if (d_addedQNameTriggers.size() + d_addedNSTriggers.size() > s_maxAddedNameTriggers) {
+        d_trackAddedNameTriggers = false;
+        d_addedQNameTriggers.clear();
+        d_addedNSTriggers.clear();
+      }
+    }
+
+    if (filter.isFull()) {
+      filter.reset(map.size() * 2);
+      map.visit([&filter](const DNSName& name, uint32_t /* action */) {
+        filter.addName(name);
+      });
+    }
+    else {
+      filter.addName(n);
+    }
   }
 }
 
-void DNSFilterEngine::Zone::addNetmaskTrigger(NetmaskTree<Policy>& nmt, const Netmask& netmask, Policy&& pol, bool ignoreDuplicate, PolicyType ptype)
+void DNSFilterEngine::Zone::addNetmaskTrigger(NetmaskTree<uint32_t>& nmt, TriggersPrefilter& filter, const Netmask& netmask, Policy&& pol, bool ignoreDuplicate, PolicyType ptype)
 {
   bool exists = nmt.has_key(netmask);
+  resetCompiledNetmaskTriggers();
 
   if (exists) {
-    auto& existingPol = nmt.lookup(netmask)->second;
+    auto& index = nmt.lookup(netmask)->second;
+    const auto& existingPol = d_actions.at(index);
 
     if (pol.d_kind != PolicyKind::Custom && !ignoreDuplicate) {
       if (d_zoneData->d_ignoreDuplicates) {
@@ -428,30 +1207,46 @@ void DNSFilterEngine::Zone::addNetmaskTrigger(NetmaskTree<Policy>& nmt, const Ne
       throw std::runtime_error("Adding a " + getTypeToString(ptype) + "-based filter policy of kind " + getKindToString(pol.d_kind) + " but a policy of kind " + getKindToString(existingPol.d_kind) + " already exists for the following netmask: " + netmask.toString());
     }
 
-    addCustom(existingPol, pol);
+    Policy merged(existingPol);
+    addCustom(merged, pol);
+    auto mergedIndex = acquireAction(std::move(merged));
+    releaseAction(index);
+    index = mergedIndex;
   }
   else {
     pol.d_zoneData = d_zoneData;
     pol.d_type = ptype;
-    nmt.insert(netmask).second = std::move(pol);
+    nmt.insert(netmask).second = acquireAction(std::move(pol));
+
+    if (filter.isFull()) {
+      filter.reset(nmt.size() * 2);
+      for (const auto& entry : nmt) {
+        filter.addNetmask(entry.first);
+      }
+    }
+    else {
+      filter.addNetmask(netmask);
+    }
   }
 }
 
-bool DNSFilterEngine::Zone::rmNameTrigger(std::unordered_map<DNSName, Policy>& map, const DNSName& name, const Policy& pol)
+bool DNSFilterEngine::Zone::rmNameTrigger(PackedNameMap& map, const DNSName& name, const Policy& pol)
 {
-  auto found = map.find(name);
-  if (found == map.end()) {
+  auto* index = map.find(name);
+  if (index == nullptr) {
     return false;
   }
 
-  auto& existing = found->second;
-  if (existing.d_kind != DNSFilterEngine::PolicyKind::Custom) {
-    map.erase(found);
+  if (d_actions.at(*index).d_kind != DNSFilterEngine::PolicyKind::Custom) {
+    releaseAction(*index);
+    map.erase(name);
     return true;
   }
 
   /* for custom types, we might have more than one type,
-     and then we need to remove only the right ones. */
+     and then we need to remove only the right ones.
+     The action might be shared with other triggers, so work on a copy. */
+  Policy existing(d_actions.at(*index));
   bool result = false;
   if (pol.d_custom && existing.d_custom) {
     for (const auto& toRemove : *pol.d_custom) {
@@ -467,29 +1262,38 @@ bool DNSFilterEngine::Zone::rmNameTrigger(std::unordered_map<DNSName, Policy>& m
 
   // No records left for this trigger?
   if (existing.customRecordsSize() == 0) {
-    map.erase(found);
+    releaseAction(*index);
+    map.erase(name);
     return true;
   }
 
+  if (result) {
+    auto remainingIndex = acquireAction(std::move(existing));
+    releaseAction(*index);
+    *index = remainingIndex;
+  }
   return result;
 }
 
-bool DNSFilterEngine::Zone::rmNetmaskTrigger(NetmaskTree<Policy>& nmt, const Netmask& netmask, const Policy& pol)
+bool DNSFilterEngine::Zone::rmNetmaskTrigger(NetmaskTree<uint32_t>& nmt, const Netmask& netmask, const Policy& pol)
 {
   bool found = nmt.has_key(netmask);
   if (!found) {
     return false;
   }
+  resetCompiledNetmaskTriggers();
 
-  auto& existing = nmt.lookup(netmask)->second;
-  if (existing.d_kind != DNSFilterEngine::PolicyKind::Custom) {
+  auto& index = nmt.lookup(netmask)->second;
+  if (d_actions.at(index).d_kind != DNSFilterEngine::PolicyKind::Custom) {
+    releaseAction(index);
     nmt.erase(netmask);
     return true;
   }
 
   /* for custom types, we might have more than one type,
-     and then we need to remove only the right ones. */
-
+     and then we need to remove only the right ones.
+     The action might be shared with other triggers, so work on a copy. */
+  Policy existing(d_actions.at(index));
   bool result = false;
   if (pol.d_custom && existing.d_custom) {
     for (const auto& toRemove : *pol.d_custom) {
@@ -505,36 +1309,42 @@ bool DNSFilterEngine::Zone::rmNetmaskTrigger(NetmaskTree<Policy>& nmt, const Net
 
   // No records left for this trigger?
   if (existing.customRecordsSize() == 0) {
+    releaseAction(index);
     nmt.erase(netmask);
     return true;
   }
 
+  if (result) {
+    auto remainingIndex = acquireAction(std::move(existing));
+    releaseAction(index);
+    index = remainingIndex;
+  }
   return result;
 }
 
 void DNSFilterEngine::Zone::addClientTrigger(const Netmask& netmask, Policy&& pol, bool ignoreDuplicate)
 {
-  addNetmaskTrigger(d_qpolAddr, netmask, std::move(pol), ignoreDuplicate, PolicyType::ClientIP);
+  addNetmaskTrigger(d_qpolAddr, d_qpolAddrFilter, netmask, std::move(pol), ignoreDuplicate, PolicyType::ClientIP);
 }
 
 void DNSFilterEngine::Zone::addResponseTrigger(const Netmask& netmask, Policy&& pol, bool ignoreDuplicate)
 {
-  addNetmaskTrigger(d_postpolAddr, netmask, std::move(pol), ignoreDuplicate, PolicyType::ResponseIP);
+  addNetmaskTrigger(d_postpolAddr, d_postpolAddrFilter, netmask, std::move(pol), ignoreDuplicate, PolicyType::ResponseIP);
 }
 
 void DNSFilterEngine::Zone::addQNameTrigger(const DNSName& dnsname, Policy&& pol, bool ignoreDuplicate)
 {
-  addNameTrigger(d_qpolName, dnsname, std::move(pol), ignoreDuplicate, PolicyType::QName);
+  addNameTrigger(d_qpolName, d_qpolNameFilter, dnsname, std::move(pol), ignoreDuplicate, PolicyType::QName);
 }
 
 void DNSFilterEngine::Zone::addNSTrigger(const DNSName& dnsname, Policy&& pol, bool ignoreDuplicate)
 {
-  addNameTrigger(d_propolName, dnsname, std::move(pol), ignoreDuplicate, PolicyType::NSDName);
+  addNameTrigger(d_propolName, d_propolNameFilter, dnsname, std::move(pol), ignoreDuplicate, PolicyType::NSDName);
 }
 
 void DNSFilterEngine::Zone::addNSIPTrigger(const Netmask& netmask, Policy&& pol, bool ignoreDuplicate)
 {
-  addNetmaskTrigger(d_propolNSAddr, netmask, std::move(pol), ignoreDuplicate, PolicyType::NSIP);
+  addNetmaskTrigger(d_propolNSAddr, d_propolNSAddrFilter, netmask, std::move(pol), ignoreDuplicate, PolicyType::NSIP);
 }
 
 bool DNSFilterEngine::Zone::rmClientTrigger(const Netmask& netmask, const Policy& pol)
@@ -808,24 +1618,24 @@ void DNSFilterEngine::Zone::dump(FILE* filePtr) const
     fprintf(filePtr, "%s IN SOA %s\n", d_domain.toString().c_str(), soarr->getZoneRepresentation().c_str());
   }
 
-  for (const auto& pair : d_qpolName) {
-    dumpNamedPolicy(filePtr, pair.first + d_domain, pair.second);
-  }
+  d_qpolName.visit([this, filePtr](const DNSName& name, uint32_t index) {
+    dumpNamedPolicy(filePtr, name + d_domain, d_actions.at(index));
+  });
 
-  for (const auto& pair : d_propolName) {
-    dumpNamedPolicy(filePtr, pair.first + DNSName(rpzNSDnameName) + d_domain, pair.second);
-  }
+  d_propolName.visit([this, filePtr](const DNSName& name, uint32_t index) {
+    dumpNamedPolicy(filePtr, name + DNSName(rpzNSDnameName) + d_domain, d_actions.at(index));
+  });
 
   for (const auto& pair : d_qpolAddr) {
-    dumpAddrPolicy(filePtr, pair.first, DNSName(rpzClientIPName) + d_domain, pair.second);
+    dumpAddrPolicy(filePtr, pair.first, DNSName(rpzClientIPName) + d_domain, d_actions.at(pair.second));
   }
 
   for (const auto& pair : d_propolNSAddr) {
-    dumpAddrPolicy(filePtr, pair.first, DNSName(rpzNSIPName) + d_domain, pair.second);
+    dumpAddrPolicy(filePtr, pair.first, DNSName(rpzNSIPName) + d_domain, d_actions.at(pair.second));
   }
 
   for (const auto& pair : d_postpolAddr) {
-    dumpAddrPolicy(filePtr, pair.first, DNSName(rpzIPName) + d_domain, pair.second);
+    dumpAddrPolicy(filePtr, pair.first, DNSName(rpzIPName) + d_domain, d_actions.at(pair.second));
   }
 }
 
@@ -835,3 +1645,176 @@ void mergePolicyTags(std::unordered_set<std::string>& tags, const std::unordered
     tags.insert(tag);
   }
 }
+
+#if TEST_FILTERPO_TIMING
+
+#include <random>
+
+static double elapsedSince(const timeval& start)
+{
+  timeval stop{};
+  gettimeofday(&stop, nullptr);
+  timeval diff{};
+  timersub(&stop, &start, &diff);
+  return static_cast<double>(diff.tv_sec) + static_cast<double>(diff.tv_usec) / 1e6;
+}
+
+static DNSName triggerName(size_t zoneIdx, size_t idx)
+{
+  // one trigger out of ten is a wildcard
+  return DNSName((idx % 10 == 0 ? "*.wc" : "host") + std::to_string(idx) + ".zone" + std::to_string(zoneIdx) + ".example");
+}
+
+static DNSName matchingName(const DNSName& trigger)
+{
+  if (!trigger.isWildcard()) {
+    return trigger;
+  }
+  DNSName parent(trigger);
+  parent.chopOff();
+  return DNSName("www") + parent;
+}
+
+static void printPrefilterCounters(const char* what, uint64_t skipsBefore, uint64_t falsePositivesBefore, size_t misses)
+{
+  const auto skips = t_Counters.at(rec::Counter::rpzPrefilterSkips) - skipsBefore;
+  const auto falsePositives = t_Counters.at(rec::Counter::rpzPrefilterFalsePositives) - falsePositivesBefore;
+  std::cout << "  " << what << ": " << skips << " of " << misses << " misses skipped by the prefilters, " << falsePositives << " false positives" << std::endl;
+}
+
+static size_t countHits(const DNSFilterEngine& dfe, const std::vector<DNSName>& names, size_t lookups)
+{
+  const std::unordered_map<std::string, bool> discarded;
+  size_t hits = 0;
+  for (size_t idx = 0; idx < lookups; idx++) {
+    // a fresh policy for every query, as SyncRes does
+    DNSFilterEngine::Policy policy;
+    if (dfe.getQueryPolicy(names[idx % names.size()], discarded, policy)) {
+      ++hits;
+    }
+  }
+  return hits;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " zones triggers-per-zone lookups" << std::endl;
+    return 1;
+  }
+  const size_t zonesCount = std::atoi(argv[1]);
+  const size_t triggers = std::atoi(argv[2]);
+  const size_t lookups = std::atoi(argv[3]);
+  // one address trigger for ten name triggers, half of them /32 and half /24
+  const size_t addressTriggers = std::max(triggers / 10, size_t(1));
+
+  DNSFilterEngine dfe;
+  for (size_t zoneIdx = 0; zoneIdx < zonesCount; zoneIdx++) {
+    auto zone = std::make_shared<DNSFilterEngine::Zone>();
+    zone->setName("zone" + std::to_string(zoneIdx));
+    zone->reserve(triggers);
+    for (size_t idx = 0; idx < triggers; idx++) {
+      zone->addQNameTrigger(triggerName(zoneIdx, idx), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::NXDOMAIN, DNSFilterEngine::PolicyType::QName));
+    }
+    for (size_t idx = 0; idx < addressTriggers; idx++) {
+      zone->addClientTrigger(Netmask(ComboAddress(std::to_string(10 + zoneIdx) + "." + std::to_string(idx / 256 % 256) + "." + std::to_string(idx % 256) + ".1"), idx % 2 == 0 ? 32 : 24), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::Drop, DNSFilterEngine::PolicyType::ClientIP));
+    }
+    dfe.addZone(zone);
+  }
+
+  // One name in ten matches a trigger, exactly or through a wildcard, the others match nothing
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<size_t> zoneDist(0, zonesCount - 1);
+  std::uniform_int_distribution<size_t> triggerDist(0, triggers - 1);
+  std::vector<DNSName> names;
+  for (size_t idx = 0; idx < 100000; idx++) {
+    if (idx % 10 != 0) {
+      names.emplace_back("miss" + std::to_string(idx) + ".example.net");
+    }
+    else {
+      names.push_back(matchingName(triggerName(zoneDist(gen), triggerDist(gen))));
+    }
+  }
+
+  // warm up the caches and the allocator before timing anything
+  countHits(dfe, names, names.size());
+
+  auto skips = t_Counters.at(rec::Counter::rpzPrefilterSkips);
+  auto falsePositives = t_Counters.at(rec::Counter::rpzPrefilterFalsePositives);
+  timeval start{};
+  gettimeofday(&start, nullptr);
+  auto hits = countHits(dfe, names, lookups);
+  auto elapsed = elapsedSince(start);
+  std::cout << "Per lookup without compilation " << elapsed * 1e9 / static_cast<double>(lookups) << "ns, " << hits << " hits" << std::endl;
+  printPrefilterCounters("names", skips, falsePositives, lookups - hits);
+
+  // Same mix for the client addresses: one in ten is covered by a trigger
+  std::vector<ComboAddress> addresses;
+  for (size_t idx = 0; idx < 100000; idx++) {
+    if (idx % 10 != 0) {
+      addresses.emplace_back("192.168." + std::to_string(idx / 256 % 256) + "." + std::to_string(idx % 256));
+    }
+    else {
+      const auto trigger = triggerDist(gen) % addressTriggers;
+      addresses.emplace_back(std::to_string(10 + zoneDist(gen)) + "." + std::to_string(trigger / 256 % 256) + "." + std::to_string(trigger % 256) + ".1");
+    }
+  }
+  const std::unordered_map<std::string, bool> discarded;
+  skips = t_Counters.at(rec::Counter::rpzPrefilterSkips);
+  falsePositives = t_Counters.at(rec::Counter::rpzPrefilterFalsePositives);
+  hits = 0;
+  gettimeofday(&start, nullptr);
+  for (size_t idx = 0; idx < lookups; idx++) {
+    DNSFilterEngine::Policy policy;
+    if (dfe.getClientPolicy(addresses[idx % addresses.size()], discarded, policy)) {
+      ++hits;
+    }
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per client address lookup " << elapsed * 1e9 / static_cast<double>(lookups) << "ns, " << hits << " hits" << std::endl;
+  printPrefilterCounters("addresses", skips, falsePositives, lookups - hits);
+
+  gettimeofday(&start, nullptr);
+  dfe.compile();
+  elapsed = elapsedSince(start);
+  std::cout << "Compilation of " << zonesCount * triggers << " triggers " << elapsed * 1e3 << "ms" << std::endl;
+
+  gettimeofday(&start, nullptr);
+  hits = countHits(dfe, names, lookups);
+  elapsed = elapsedSince(start);
+  std::cout << "Per lookup with the trie " << elapsed * 1e9 / static_cast<double>(lookups) << "ns, " << hits << " hits" << std::endl;
+
+  // An IXFR to the first zone, applied the way the RPZ loader does it: on a copy, then setZone()
+  const size_t updates = std::max(triggers / 100, size_t(1));
+  auto updated = std::make_shared<DNSFilterEngine::Zone>(*dfe.getZone(0));
+  for (size_t idx = 0; idx < updates; idx++) {
+    updated->rmQNameTrigger(triggerName(0, idx), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::NXDOMAIN, DNSFilterEngine::PolicyType::QName));
+    updated->addQNameTrigger(triggerName(0, triggers + idx), DNSFilterEngine::Policy(DNSFilterEngine::PolicyKind::NXDOMAIN, DNSFilterEngine::PolicyType::QName));
+  }
+  std::vector<DNSName> added;
+  for (size_t idx = 0; idx < updates; idx++) {
+    added.push_back(matchingName(triggerName(0, triggers + idx)));
+  }
+  auto patched = dfe;
+  gettimeofday(&start, nullptr);
+  patched.setZone(0, updated);
+  elapsed = elapsedSince(start);
+  std::cout << "Patching after " << updates << " removals and additions " << elapsed * 1e3 << "ms" << std::endl;
+
+  auto recompiled = dfe;
+  recompiled.clearZones();
+  for (size_t zoneIdx = 0; zoneIdx < zonesCount; zoneIdx++) {
+    recompiled.addZone(zoneIdx == 0 ? updated : dfe.getZone(zoneIdx));
+  }
+  gettimeofday(&start, nullptr);
+  recompiled.compile();
+  elapsed = elapsedSince(start);
+  std::cout << "Recompiling instead " << elapsed * 1e3 << "ms" << std::endl;
+
+  gettimeofday(&start, nullptr);
+  hits = countHits(patched, names, lookups);
+  elapsed = elapsedSince(start);
+  std::cout << "Per lookup with the patched trie " << elapsed * 1e9 / static_cast<double>(lookups) << "ns, " << hits << " hits (" << countHits(recompiled, names, lookups) << " when recompiled), " << countHits(patched, added, added.size()) << " of " << added.size() << " added names hit" << std::endl;
+}
+
+#endif
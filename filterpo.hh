@@ -26,6 +26,10 @@
 #include "dnsparser.hh"
 #include "logging.hh"
 #include "logr.hh"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <map>
 #include <unordered_map>
 #include <limits>
@@ -296,6 +300,120 @@ public:
     [[nodiscard]] DNSRecord getRecordFromCustom(const DNSName& qname, const std::shared_ptr<const DNSRecordContent>& custom) const;
   };
 
+  /* An open-addressing hash table from names to 32-bit values. The names are stored back to back
+     in wire format in a single arena, instead of one DNSName (and for most of them one heap
+     allocation) per entry. Lookups are case-insensitive, like DNSName comparisons. */
+  class PackedNameMap
+  {
+  public:
+    [[nodiscard]] const uint32_t* find(const DNSName& name) const;
+    uint32_t* find(const DNSName& name)
+    {
+      return const_cast<uint32_t*>(std::as_const(*this).find(name)); // NOLINT(cppcoreguidelines-pro-type-const-cast)
+    }
+    /* returns false, leaving the existing value untouched, if the name was already present */
+    bool insert(const DNSName& name, uint32_t value);
+    bool erase(const DNSName& name);
+    void clear();
+    void reserve(size_t entries);
+    [[nodiscard]] size_t size() const
+    {
+      return d_size;
+    }
+    [[nodiscard]] bool empty() const
+    {
+      return d_size == 0;
+    }
+    [[nodiscard]] size_t getMemoryUsage() const
+    {
+      return d_slots.capacity() * sizeof(Slot) + d_arena.capacity();
+    }
+    /* visitor(const DNSName&, uint32_t value), in no particular order */
+    template <typename F>
+    void visit(F&& visitor) const
+    {
+      for (const auto& slot : d_slots) {
+        if (slot.d_offset < s_deleted) {
+          auto wire = getWireName(slot.d_offset);
+          visitor(DNSName(wire.data(), wire.size(), 0, false), slot.d_value);
+        }
+      }
+    }
+
+  private:
+    struct Slot
+    {
+      uint32_t d_offset{s_empty};
+      uint32_t d_hash{0};
+      uint32_t d_value{0};
+    };
+    static constexpr uint32_t s_empty = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t s_deleted = std::numeric_limits<uint32_t>::max() - 1;
+
+    /* each entry in the arena is the length of the wire name on one byte, then the wire name */
+    [[nodiscard]] std::string_view getWireName(uint32_t offset) const
+    {
+      return {d_arena.data() + offset + 1, static_cast<uint8_t>(d_arena.at(offset))};
+    }
+    [[nodiscard]] size_t findSlot(std::string_view wire, uint32_t hash) const;
+    void rebuild(size_t slotsCount);
+
+    std::vector<Slot> d_slots;
+    std::string d_arena;
+    size_t d_size{0};
+    size_t d_deletedSlots{0};
+    size_t d_deadBytes{0};
+  };
+
+  /* A blocked Bloom filter over the triggers of one kind in a zone, consulted before the real
+     lookup so that names and addresses that cannot match are rejected without probing the hash
+     tables and netmask trees. There are no false negatives. Removed triggers are not taken out,
+     they only cost a false positive until the filter is rebuilt, which happens when it grows. */
+  class TriggersPrefilter
+  {
+  public:
+    /* the hashes of a qname, computed once per lookup and shared by all zones:
+       the name itself first, then the names a wildcard could cover it from */
+    struct NameKeys
+    {
+      /* only the first d_count keys are set, not zeroing the others saves a 1 kB memset per lookup */
+      std::array<uint64_t, 128> d_keys; // NOLINT(cppcoreguidelines-pro-type-member-init)
+      uint8_t d_count{0};
+    };
+
+    static void getNameKeys(const DNSName& qname, NameKeys& keys);
+
+    void addName(const DNSName& name);
+    void addNetmask(const Netmask& netmask);
+    [[nodiscard]] bool mayMatchName(const NameKeys& keys) const;
+    [[nodiscard]] bool mayMatchAddress(const ComboAddress& address) const;
+    [[nodiscard]] bool isFull() const
+    {
+      return d_count >= d_capacity;
+    }
+    /* empties the filter and sizes it for capacity entries */
+    void reset(size_t capacity);
+    [[nodiscard]] size_t getMemoryUsage() const
+    {
+      return d_blocks.capacity() * sizeof(Block);
+    }
+
+  private:
+    static constexpr size_t s_bitsPerEntry = 16;
+    static constexpr size_t s_bitsPerKey = 6;
+    using Block = std::array<uint64_t, 8>;
+
+    void add(uint64_t key);
+    [[nodiscard]] bool mayContain(uint64_t key) const;
+
+    std::vector<Block> d_blocks;
+    /* prefix lengths used by the netmask triggers, so we know which ones to try */
+    std::bitset<33> d_v4Bits;
+    std::bitset<129> d_v6Bits;
+    size_t d_count{0};
+    size_t d_capacity{0};
+  };
+
   class Zone
   {
   public:
@@ -311,10 +429,23 @@ public:
       d_propolName.clear();
       d_propolNSAddr.clear();
       d_qpolName.clear();
+      resetCompiledNetmaskTriggers();
+      d_actions.clear();
+      d_actionRefs.clear();
+      d_freeActions.clear();
+      d_actionIndex.clear();
+      d_qpolAddrFilter.reset(0);
+      d_postpolAddrFilter.reset(0);
+      d_propolNameFilter.reset(0);
+      d_propolNSAddrFilter.reset(0);
+      d_qpolNameFilter.reset(0);
     }
     void reserve(size_t entriesCount)
     {
       d_qpolName.reserve(entriesCount);
+      if (d_qpolName.empty()) {
+        d_qpolNameFilter.reset(entriesCount);
+      }
     }
     void setName(const std::string& name)
     {
@@ -409,6 +540,28 @@ public:
     bool rmNSIPTrigger(const Netmask& netmask, const Policy& pol);
     bool rmResponseTrigger(const Netmask& netmask, const Policy& pol);
 
+    /* false means that there is definitely no matching trigger in this zone */
+    [[nodiscard]] bool mayHaveQNamePolicy(const TriggersPrefilter::NameKeys& keys) const
+    {
+      return d_qpolNameFilter.mayMatchName(keys);
+    }
+    [[nodiscard]] bool mayHaveNSPolicy(const TriggersPrefilter::NameKeys& keys) const
+    {
+      return d_propolNameFilter.mayMatchName(keys);
+    }
+    [[nodiscard]] bool mayHaveClientPolicy(const ComboAddress& addr) const
+    {
+      return d_qpolAddrFilter.mayMatchAddress(addr);
+    }
+    [[nodiscard]] bool mayHaveNSIPPolicy(const ComboAddress& addr) const
+    {
+      return d_propolNSAddrFilter.mayMatchAddress(addr);
+    }
+    [[nodiscard]] bool mayHaveResponsePolicy(const ComboAddress& addr) const
+    {
+      return d_postpolAddrFilter.mayMatchAddress(addr);
+    }
+
     bool findExactQNamePolicy(const DNSName& qname, DNSFilterEngine::Policy& pol) const;
     bool findExactNSPolicy(const DNSName& qname, DNSFilterEngine::Policy& pol) const;
     bool findNSIPPolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const;
@@ -444,28 +597,165 @@ public:
       d_zoneData->d_priority = priority;
     }
 
+    [[nodiscard]] const PackedNameMap& getQNameTriggers() const
+    {
+      return d_qpolName;
+    }
+    [[nodiscard]] const PackedNameMap& getNSTriggers() const
+    {
+      return d_propolName;
+    }
+    [[nodiscard]] size_t getActionsCount() const
+    {
+      return d_actionIndex.size();
+    }
+    /* approximate number of bytes used by the triggers, actions and filters of this zone */
+    [[nodiscard]] size_t getMemoryUsage() const;
+    /* build the compiled form of the netmask triggers, used for lookups until they are modified */
+    void compileNetmaskTriggers();
+    /* changes every time a new name is added to the QNAME or NSDNAME triggers,
+       removals do not change it */
+    [[nodiscard]] uint64_t getNameTriggersGeneration() const
+    {
+      return d_nameTriggersGeneration;
+    }
+    /* the names added to the QNAME and NSDNAME triggers since the zone (or the one it was copied
+       from) was last compiled, so that the tries can be patched after an IXFR instead of being
+       rebuilt. Not tracked before the first compilation, nor once there are too many of them */
+    [[nodiscard]] bool tracksAddedNameTriggers() const
+    {
+      return d_trackAddedNameTriggers;
+    }
+    [[nodiscard]] uint64_t getCompiledNameTriggersGeneration() const
+    {
+      return d_compiledNameTriggersGeneration;
+    }
+    [[nodiscard]] const std::vector<DNSName>& getAddedQNameTriggers() const
+    {
+      return d_addedQNameTriggers;
+    }
+    [[nodiscard]] const std::vector<DNSName>& getAddedNSTriggers() const
+    {
+      return d_addedNSTriggers;
+    }
+    void markNameTriggersCompiled();
+
     static DNSName maskToRPZ(const Netmask& netmask);
 
   private:
-    void addNameTrigger(std::unordered_map<DNSName, Policy>& map, const DNSName& n, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
-    void addNetmaskTrigger(NetmaskTree<Policy>& nmt, const Netmask& netmask, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
-    static bool rmNameTrigger(std::unordered_map<DNSName, Policy>& map, const DNSName& n, const Policy& pol);
-    static bool rmNetmaskTrigger(NetmaskTree<Policy>& nmt, const Netmask& netmask, const Policy& pol);
+    void addNameTrigger(PackedNameMap& map, TriggersPrefilter& filter, const DNSName& n, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
+    void addNetmaskTrigger(NetmaskTree<uint32_t>& nmt, TriggersPrefilter& filter, const Netmask& netmask, Policy&& pol, bool ignoreDuplicate, PolicyType ptype);
+    bool rmNameTrigger(PackedNameMap& map, const DNSName& n, const Policy& pol);
+    bool rmNetmaskTrigger(NetmaskTree<uint32_t>& nmt, const Netmask& netmask, const Policy& pol);
+
+    void resetCompiledNetmaskTriggers()
+    {
+      d_qpolAddrCompiled.reset();
+      d_propolNSAddrCompiled.reset();
+      d_postpolAddrCompiled.reset();
+    }
 
-    static bool findExactNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol);
-    static bool findNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol);
+    uint32_t acquireAction(Policy&& pol);
+    void releaseAction(uint32_t index);
+    static std::string getActionKey(const Policy& pol);
+
+    bool findExactNamedPolicy(const PackedNameMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const;
+    bool findNamedPolicy(const PackedNameMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const;
     static void dumpNamedPolicy(FILE* filePtr, const DNSName& name, const Policy& pol);
     static void dumpAddrPolicy(FILE* filePtr, const Netmask& netmask, const DNSName& name, const Policy& pol);
 
-    std::unordered_map<DNSName, Policy> d_qpolName; // QNAME trigger (RPZ)
-    NetmaskTree<Policy> d_qpolAddr; // Source address
-    std::unordered_map<DNSName, Policy> d_propolName; // NSDNAME (RPZ)
-    NetmaskTree<Policy> d_propolNSAddr; // NSIP (RPZ)
-    NetmaskTree<Policy> d_postpolAddr; // IP trigger (RPZ)
+    /* the triggers only hold an index into d_actions, where identical policies are shared */
+    PackedNameMap d_qpolName; // QNAME trigger (RPZ)
+    NetmaskTree<uint32_t> d_qpolAddr; // Source address
+    PackedNameMap d_propolName; // NSDNAME (RPZ)
+    NetmaskTree<uint32_t> d_propolNSAddr; // NSIP (RPZ)
+    NetmaskTree<uint32_t> d_postpolAddr; // IP trigger (RPZ)
+    std::shared_ptr<const CompiledNetmaskTree<uint32_t>> d_qpolAddrCompiled{nullptr};
+    std::shared_ptr<const CompiledNetmaskTree<uint32_t>> d_propolNSAddrCompiled{nullptr};
+    std::shared_ptr<const CompiledNetmaskTree<uint32_t>> d_postpolAddrCompiled{nullptr};
+    std::vector<Policy> d_actions;
+    std::vector<uint32_t> d_actionRefs;
+    std::vector<uint32_t> d_freeActions;
+    std::unordered_map<std::string, uint32_t> d_actionIndex;
+    TriggersPrefilter d_qpolNameFilter;
+    TriggersPrefilter d_qpolAddrFilter;
+    TriggersPrefilter d_propolNameFilter;
+    TriggersPrefilter d_propolNSAddrFilter;
+    TriggersPrefilter d_postpolAddrFilter;
     DNSName d_domain;
     std::shared_ptr<PolicyZoneData> d_zoneData{nullptr};
+    std::vector<DNSName> d_addedQNameTriggers;
+    std::vector<DNSName> d_addedNSTriggers;
+    uint64_t d_nameTriggersGeneration{0};
+    uint64_t d_compiledNameTriggersGeneration{0};
     uint32_t d_serial{0};
     uint32_t d_refresh{0};
+    bool d_trackAddedNameTriggers{false};
+    static std::atomic<uint64_t> s_nameTriggersGeneration;
+    /* past that many added names, recompiling everything is cheaper than patching */
+    static constexpr size_t s_maxAddedNameTriggers{65536};
+  };
+
+  /* A compiled, read-only reverse-label trie over the name-based triggers (QNAME or NSDNAME)
+     of all the zones of an engine. A single walk from the root towards the qname tells us which
+     zones have an exact or wildcard trigger for that name, instead of probing the hash table of
+     every zone for the qname and each of its wildcards.
+     The trie only says where to look: every candidate is confirmed against the zone itself, so
+     triggers removed since the trie was compiled are skipped, while zones that gained names or
+     were replaced since then are detected via isCurrent() and looked up directly until the trie
+     is patched or compiled again. */
+  class NameTriggersTrie
+  {
+  public:
+    struct Candidate
+    {
+      uint16_t d_zone;
+      // labels count of the qname for an exact match, of the name below the '*' for a wildcard one
+      uint8_t d_labels;
+      bool d_wildcard;
+    };
+
+    NameTriggersTrie(const std::vector<std::shared_ptr<Zone>>& zones, bool nsTriggers);
+    /* candidates are sorted by zone, then exact match first, then most specific wildcard first */
+    void getCandidates(const DNSName& qname, std::vector<Candidate>& candidates) const;
+    [[nodiscard]] bool isCurrent(size_t zoneIdx, const Zone& zone) const;
+    /* a copy of this trie that also holds the names added to the zone since it was compiled,
+       or nullptr if the zone does not derive from the compiled one or the copy got too sparse */
+    [[nodiscard]] std::shared_ptr<const NameTriggersTrie> patch(size_t zoneIdx, const Zone& zone, bool nsTriggers) const;
+    [[nodiscard]] size_t getNodesCount() const
+    {
+      return d_nodes.size();
+    }
+
+  private:
+    struct Node
+    {
+      uint32_t d_labelOffset{0};
+      uint32_t d_firstChild{0};
+      uint32_t d_childrenCount{0};
+      uint32_t d_firstZone{0};
+      uint16_t d_zonesCount{0};
+      uint8_t d_labelLength{0};
+    };
+
+    [[nodiscard]] std::string_view getLabel(const Node& node) const
+    {
+      return {d_labels.data() + node.d_labelOffset, node.d_labelLength};
+    }
+    struct BuilderNode;
+
+    [[nodiscard]] const Node* findChild(const Node& parent, std::string_view label) const;
+    void addZone(size_t nodeIdx, uint16_t zoneIdx);
+    void merge(size_t nodeIdx, const BuilderNode& builder, uint16_t zoneIdx);
+    void addZonesOf(const Node& node, uint8_t labels, bool wildcard, std::vector<Candidate>& candidates) const;
+
+    /* children of a node are contiguous and sorted by (lowercase) label */
+    std::vector<Node> d_nodes;
+    std::string d_labels;
+    std::vector<uint16_t> d_zones;
+    std::vector<std::pair<const Zone*, uint64_t>> d_zoneGenerations;
+    /* nodes left unreachable by merge(), which moves the siblings of new nodes to the end */
+    size_t d_unusedNodes{0};
   };
 
   DNSFilterEngine();
@@ -478,6 +768,8 @@ public:
   void clearZones()
   {
     d_zones.clear();
+    d_qnameTrie.reset();
+    d_nsTrie.reset();
   }
   [[nodiscard]] std::shared_ptr<Zone> getZone(size_t zoneIdx) const
   {
@@ -509,8 +801,15 @@ public:
       assureZones(zoneIdx);
       newZone->setPriority(zoneIdx);
       d_zones[zoneIdx] = newZone;
+      if (d_qnameTrie) {
+        patchZone(zoneIdx);
+      }
     }
   }
+  /* (re)build the QNAME and NSDNAME tries from the current zones, and the compiled netmask triggers
+     of each zone. This is expensive for large zones and should be done off the hot path, once a
+     batch of zone changes has been applied */
+  void compile();
 
   bool getQueryPolicy(const DNSName& qname, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& policy) const;
   bool getClientPolicy(const ComboAddress& address, const std::unordered_map<std::string, bool>& discardedPolicies, Policy& policy) const;
@@ -570,9 +869,23 @@ public:
     return d_zones.size();
   }
 
+  // Whether any zone has rpz-client-ip triggers, making answers depend on who asked
+  [[nodiscard]] bool hasClientPolicies() const
+  {
+    return std::any_of(d_zones.begin(), d_zones.end(), [](const auto& zone) { return zone->hasClientPolicies(); });
+  }
+
 private:
+  using ExactNamedPolicyFinder = bool (Zone::*)(const DNSName&, Policy&) const;
+
   void assureZones(size_t zone);
+  /* bring the compiled forms up to date after the zone at zoneIdx has been replaced, typically by a copy
+     with an IXFR applied, falling back to compile() when patching is not possible */
+  void patchZone(size_t zoneIdx);
+  bool findNamedPolicyUsingTrie(const NameTriggersTrie& trie, ExactNamedPolicyFinder finder, const DNSName& qname, const std::vector<bool>& zoneEnabled, Policy& pol) const;
   vector<std::shared_ptr<Zone>> d_zones;
+  std::shared_ptr<const NameTriggersTrie> d_qnameTrie{nullptr};
+  std::shared_ptr<const NameTriggersTrie> d_nsTrie{nullptr};
 };
 
 void mergePolicyTags(std::unordered_set<std::string>& tags, const std::unordered_set<std::string>& newTags);
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "fstrm_logger.hh"
+#include "threadname.hh"
 
 #ifdef RECURSOR
 #include "logger.hh"
@@ -15,181 +16,250 @@
 
 static const std::string DNSTAP_CONTENT_TYPE = "protobuf:dnstap.Dnstap";
 
-FrameStreamLogger::FrameStreamLogger(const int family, std::string address, bool connect, const std::unordered_map<string, unsigned>& options) :
-  d_family(family), d_address(std::move(address))
+// Frame Streams control frames, sent after a zero "escape" length instead of a data frame
+enum class ControlFrameType : uint32_t
 {
-  try {
-    d_fwopt = fstrm_writer_options_init();
-    if (d_fwopt == nullptr) {
-      throw std::runtime_error("FrameStreamLogger: fstrm_writer_options_init failed.");
-    }
-
-    auto res = fstrm_writer_options_add_content_type(d_fwopt, DNSTAP_CONTENT_TYPE.c_str(), DNSTAP_CONTENT_TYPE.size());
-    if (res != fstrm_res_success) {
-      throw std::runtime_error("FrameStreamLogger: fstrm_writer_options_add_content_type failed: " + std::to_string(res));
-    }
-
-    if (d_family == AF_UNIX) {
-      struct sockaddr_un local{};
-      if (makeUNsockaddr(d_address, &local) != 0) {
-        throw std::runtime_error("FrameStreamLogger: Unable to use '" + d_address + "', it is not a valid UNIX socket path.");
-      }
+  Accept = 0x01,
+  Start = 0x02,
+  Stop = 0x03,
+  Ready = 0x04,
+  Finish = 0x05
+};
+static const uint32_t s_controlFieldContentType = 0x01;
+static const uint32_t s_maxControlFrameLength = 512;
+static const int s_handshakeTimeout = 2;
+// Assumed average frame size when turning inputQueueSize (in frames, like libfstrm) into bytes
+static const size_t s_averageFrameSize = 512;
 
-      d_uwopt = fstrm_unix_writer_options_init();
-      if (d_uwopt == nullptr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_unix_writer_options_init failed.");
-      }
+static void appendUInt32(std::string& buffer, uint32_t value)
+{
+  const uint32_t net = htonl(value);
+  buffer.append(reinterpret_cast<const char*>(&net), sizeof(net)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+}
 
-      // void return, no error checking.
-      fstrm_unix_writer_options_set_socket_path(d_uwopt, d_address.c_str());
+static std::string makeControlFrame(ControlFrameType type, bool withContentType)
+{
+  std::string payload;
+  appendUInt32(payload, static_cast<uint32_t>(type));
+  if (withContentType) {
+    appendUInt32(payload, s_controlFieldContentType);
+    appendUInt32(payload, DNSTAP_CONTENT_TYPE.size());
+    payload.append(DNSTAP_CONTENT_TYPE);
+  }
+  std::string frame;
+  appendUInt32(frame, 0);
+  appendUInt32(frame, payload.size());
+  return frame + payload;
+}
 
-      d_writer = fstrm_unix_writer_init(d_uwopt, d_fwopt);
-      if (d_writer == nullptr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_unix_writer_init() failed.");
-      }
-#ifdef HAVE_FSTRM_TCP_WRITER_INIT
+static void readExactly(const Socket& sock, char* buffer, size_t len)
+{
+  while (len > 0) {
+    auto got = sock.readWithTimeout(buffer, len, s_handshakeTimeout);
+    if (got == 0) {
+      throw NetworkError("EOF during the Frame Streams handshake");
     }
-    else if (family == AF_INET || family == AF_INET6) {
-      d_twopt = fstrm_tcp_writer_options_init();
-      if (d_twopt == nullptr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_tcp_writer_options_init failed.");
-      }
+    buffer += got; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    len -= got;
+  }
+}
 
-      try {
-        ComboAddress inetAddress(d_address);
+static uint32_t readUInt32(const Socket& sock)
+{
+  uint32_t net{0};
+  readExactly(sock, reinterpret_cast<char*>(&net), sizeof(net)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  return ntohl(net);
+}
 
-        // void return, no error checking.
-        fstrm_tcp_writer_options_set_socket_address(d_twopt, inetAddress.toString().c_str());
-        fstrm_tcp_writer_options_set_socket_port(d_twopt, std::to_string(inetAddress.getPort()).c_str());
-      }
-      catch (PDNSException& e) {
-        throw std::runtime_error("FrameStreamLogger: Unable to use '" + d_address + "': " + e.reason);
-      }
+static void expectControlFrame(const Socket& sock, ControlFrameType expected)
+{
+  if (readUInt32(sock) != 0) {
+    throw NetworkError("Expected a Frame Streams control frame, got a data frame");
+  }
+  const uint32_t len = readUInt32(sock);
+  if (len < sizeof(uint32_t) || len > s_maxControlFrameLength) {
+    throw NetworkError("Invalid Frame Streams control frame length " + std::to_string(len));
+  }
+  std::string payload(len, '\0');
+  readExactly(sock, payload.data(), len);
+  uint32_t type{0};
+  memcpy(&type, payload.data(), sizeof(type));
+  if (ntohl(type) != static_cast<uint32_t>(expected)) {
+    throw NetworkError("Unexpected Frame Streams control frame type " + std::to_string(ntohl(type)));
+  }
+  // An ACCEPT may list content types, ours has to be one of them
+  if (expected == ControlFrameType::Accept && len > sizeof(uint32_t) && payload.find(DNSTAP_CONTENT_TYPE) == std::string::npos) {
+    throw NetworkError("The Frame Streams receiver does not accept " + DNSTAP_CONTENT_TYPE);
+  }
+}
 
-      d_writer = fstrm_tcp_writer_init(d_twopt, d_fwopt);
-      if (d_writer == nullptr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_tcp_writer_init() failed.");
-      }
-#endif
-    }
-    else {
-      throw std::runtime_error("FrameStreamLogger: family " + std::to_string(family) + " not supported");
-    }
+static size_t getOption(const std::unordered_map<string, unsigned>& options, const std::string& name, size_t def)
+{
+  if (auto option = options.find(name); option != options.end() && option->second != 0) {
+    return option->second;
+  }
+  return def;
+}
 
-    d_iothropt = fstrm_iothr_options_init();
-    if (d_iothropt == nullptr) {
-      throw std::runtime_error("FrameStreamLogger: fstrm_iothr_options_init() failed.");
-    }
+static size_t getRingSize(const std::unordered_map<string, unsigned>& options)
+{
+  // Each ring must be able to hold the largest frame: a 64k packet plus the dnstap fields around it
+  const size_t minimum = 2 * std::numeric_limits<uint16_t>::max();
+  return std::max(getOption(options, "inputQueueSize", 512) * s_averageFrameSize, minimum);
+}
 
-    res = fstrm_iothr_options_set_queue_model(d_iothropt, FSTRM_IOTHR_QUEUE_MODEL_MPSC);
-    if (res != fstrm_res_success) {
-      throw std::runtime_error("FrameStreamLogger: fstrm_iothr_options_set_queue_model failed: " + std::to_string(res));
+FrameStreamLogger::FrameStreamLogger(const int family, std::string address, bool connect, const std::unordered_map<string, unsigned>& options) :
+  d_family(family), d_address(std::move(address)), d_rings(getRingSize(options), sizeof(uint32_t))
+{
+  if (d_family == AF_UNIX) {
+    struct sockaddr_un local{};
+    if (makeUNsockaddr(d_address, &local) != 0) {
+      throw std::runtime_error("FrameStreamLogger: Unable to use '" + d_address + "', it is not a valid UNIX socket path.");
     }
-
-    struct setters
-    {
-      const std::string name;
-      fstrm_res (*function)(struct fstrm_iothr_options*, const unsigned int);
-    };
-    const std::array<struct setters, 6> list = {{{"bufferHint", fstrm_iothr_options_set_buffer_hint},
-                                                 {"flushTimeout", fstrm_iothr_options_set_flush_timeout},
-                                                 {"inputQueueSize", fstrm_iothr_options_set_input_queue_size},
-                                                 {"outputQueueSize", fstrm_iothr_options_set_output_queue_size},
-                                                 {"queueNotifyThreshold", fstrm_iothr_options_set_queue_notify_threshold},
-                                                 {"setReopenInterval", fstrm_iothr_options_set_reopen_interval}}};
-
-    for (const auto& entry : list) {
-      if (auto option = options.find(entry.name); option != options.end() && option->second != 0) {
-        auto result = entry.function(d_iothropt, option->second);
-        if (result != fstrm_res_success) {
-          throw std::runtime_error("FrameStreamLogger: setting " + string(entry.name) + " failed: " + std::to_string(result));
-        }
-      }
+  }
+  else if (d_family == AF_INET || d_family == AF_INET6) {
+    try {
+      d_remote = ComboAddress(d_address);
     }
-
-    if (connect) {
-      d_iothr = fstrm_iothr_init(d_iothropt, &d_writer);
-      if (d_iothr == nullptr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_iothr_init() failed.");
-      }
-
-      d_ioqueue = fstrm_iothr_get_input_queue(d_iothr);
-      if (d_ioqueue == nullptr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_iothr_get_input_queue() failed.");
-      }
+    catch (const PDNSException& e) {
+      throw std::runtime_error("FrameStreamLogger: Unable to use '" + d_address + "': " + e.reason);
     }
   }
-  catch (std::runtime_error& e) {
-    this->cleanup();
-    throw;
+  else {
+    throw std::runtime_error("FrameStreamLogger: family " + std::to_string(family) + " not supported");
+  }
+
+  // outputQueueSize and queueNotifyThreshold tune libfstrm's own queues and have no equivalent here
+  d_bufferHint = getOption(options, "bufferHint", d_bufferHint);
+  d_flushTimeout = std::chrono::seconds(getOption(options, "flushTimeout", d_flushTimeout.count()));
+  d_reopenInterval = static_cast<time_t>(getOption(options, "reopenInterval", d_reopenInterval));
+
+  if (connect) {
+    d_thread = std::thread(&FrameStreamLogger::writerThread, this);
   }
 }
 
-void FrameStreamLogger::cleanup()
+FrameStreamLogger::~FrameStreamLogger()
 {
-  if (d_iothr != nullptr) {
-    fstrm_iothr_destroy(&d_iothr);
-    d_iothr = nullptr;
-  }
-  if (d_iothropt != nullptr) {
-    fstrm_iothr_options_destroy(&d_iothropt);
-    d_iothropt = nullptr;
+  d_exiting = true;
+  if (d_thread.joinable()) {
+    d_thread.join();
   }
-  if (d_writer != nullptr) {
-    fstrm_writer_destroy(&d_writer);
-    d_writer = nullptr;
-  }
-  if (d_uwopt != nullptr) {
-    fstrm_unix_writer_options_destroy(&d_uwopt);
-    d_uwopt = nullptr;
-  }
-#ifdef HAVE_FSTRM_TCP_WRITER_INIT
-  if (d_twopt != nullptr) {
-    fstrm_tcp_writer_options_destroy(&d_twopt);
-    d_twopt = nullptr;
+}
+
+bool FrameStreamLogger::reconnect()
+{
+  try {
+    std::unique_ptr<Socket> sock;
+    if (d_family == AF_UNIX) {
+      struct sockaddr_un local{};
+      makeUNsockaddr(d_address, &local);
+      sock = make_unique<Socket>(AF_UNIX, SOCK_STREAM, 0);
+      if (::connect(sock->getHandle(), reinterpret_cast<const struct sockaddr*>(&local), sizeof(local)) < 0) { // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        throw NetworkError("connecting to " + d_address + ": " + stringerror());
+      }
+    }
+    else {
+      sock = make_unique<Socket>(d_family, SOCK_STREAM, 0);
+      sock->setNonBlocking();
+      sock->connect(d_remote, s_handshakeTimeout);
+    }
+
+    // Bidirectional handshake: READY, the receiver answers ACCEPT, then START
+    const auto ready = makeControlFrame(ControlFrameType::Ready, true);
+    sock->writenWithTimeout(ready.data(), ready.size(), s_handshakeTimeout);
+    expectControlFrame(*sock, ControlFrameType::Accept);
+    const auto start = makeControlFrame(ControlFrameType::Start, true);
+    sock->writenWithTimeout(start.data(), start.size(), s_handshakeTimeout);
+
+    sock->setNonBlocking();
+    d_socket = std::move(sock);
   }
+  catch (const std::exception& e) {
+    ++d_permanentFailures;
+#ifdef RECURSOR
+    SLOG(g_log << Logger::Warning << "Error connecting to dnstap receiver " << d_address << ": " << e.what() << std::endl,
+         g_slog->withName("dnstap")->error(Logr::Error, e.what(), "Exception while connecting to dnstap receiver", "address", Logging::Loggable(d_address)));
+#else
+    warnlog("Error connecting to dnstap receiver %s: %s", d_address, e.what());
 #endif
-  if (d_fwopt != nullptr) {
-    fstrm_writer_options_destroy(&d_fwopt);
-    d_fwopt = nullptr;
+    return false;
   }
+  return true;
 }
 
-FrameStreamLogger::~FrameStreamLogger()
+void FrameStreamLogger::stopSession()
 {
-  this->cleanup();
+  try {
+    // Best effort: send what is left, then STOP, and wait for the FINISH
+    for (int tries = 0; tries < 10 && d_rings.pending() > 0; ++tries) {
+      if (!d_rings.flush(d_socket->getHandle())) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    const auto stop = makeControlFrame(ControlFrameType::Stop, false);
+    d_socket->writenWithTimeout(stop.data(), stop.size(), s_handshakeTimeout);
+    expectControlFrame(*d_socket, ControlFrameType::Finish);
+  }
+  catch (const std::exception& e) {
+    // we are going away anyway
+  }
+  d_socket.reset();
 }
 
 RemoteLoggerInterface::Result FrameStreamLogger::queueData(const std::string& data)
 {
-  if ((d_ioqueue == nullptr) || d_iothr == nullptr) {
+  if (!d_thread.joinable()) {
     ++d_permanentFailures;
     return Result::OtherError;
   }
-  uint8_t* frame = (uint8_t*)malloc(data.length()); // NOLINT: it's the API
-  if (frame == nullptr) {
-    ++d_tooLargeCount;
-    return Result::TooLarge;
-  }
-  memcpy(frame, data.c_str(), data.length());
+  return d_rings.queue(data);
+}
 
-  auto res = fstrm_iothr_submit(d_iothr, d_ioqueue, frame, data.length(), fstrm_free_wrapper, nullptr);
+void FrameStreamLogger::writerThread()
+{
+  setThreadName("rec/dnstap");
+
+  time_t lastConnectAttempt = 0;
+  auto lastFlush = std::chrono::steady_clock::now();
+  while (!d_exiting) {
+    if (d_socket == nullptr) {
+      time_t now = time(nullptr);
+      if (now - lastConnectAttempt < d_reopenInterval) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      lastConnectAttempt = now;
+      if (!reconnect()) {
+        continue;
+      }
+    }
 
-  if (res == fstrm_res_success) {
-    // Frame successfully queued.
-    ++d_framesSent;
-    // do not call free here
-    return Result::Queued;
+    // Batch: wait for bufferHint bytes, but do not sit on data longer than flushTimeout
+    const auto pending = d_rings.pending();
+    const auto now = std::chrono::steady_clock::now();
+    if (pending == 0 || (pending < d_bufferHint && now - lastFlush < d_flushTimeout)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+
+    try {
+      if (!d_rings.flush(d_socket->getHandle())) {
+        /* the outgoing TCP buffer is full, that's fine by us */
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      lastFlush = now;
+    }
+    catch (const std::exception& e) {
+      d_socket.reset();
+      ++d_permanentFailures;
+      lastConnectAttempt = 0;
+    }
   }
-  if (res == fstrm_res_again) {
-    free(frame); // NOLINT: it's the API
-    ++d_queueFullDrops;
-    return Result::PipeFull;
+
+  if (d_socket != nullptr) {
+    stopSession();
   }
-  // Permanent failure.
-  free(frame); // NOLINT: it's the API
-  ++d_permanentFailures;
-  return Result::OtherError;
 }
 
 #endif /* HAVE_FSTRM */
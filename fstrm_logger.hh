@@ -25,14 +25,15 @@
 
 #ifdef HAVE_FSTRM
 
+#include <chrono>
 #include <unordered_map>
-#include <fstrm.h>
-#include <fstrm/iothr.h>
-#include <fstrm/unix_writer.h>
-#ifdef HAVE_FSTRM_TCP_WRITER_INIT
-#include <fstrm/tcp_writer.h>
-#endif
 
+/* Sends dnstap frames over the bidirectional Frame Streams protocol
+   (https://farsightsec.github.io/fstrm/) to a Unix or TCP socket, without libfstrm.
+   Frames are queued to per-thread rings (see ThreadRings) and a writer thread per destination
+   does the READY/ACCEPT/START handshake, then sends them in batches: once bufferHint bytes are
+   pending, or flushTimeout seconds after the previous flush. Frames queued while a ring is full
+   are dropped and counted. */
 class FrameStreamLogger : public RemoteLoggerInterface
 {
 public:
@@ -56,35 +57,34 @@ public:
 
   [[nodiscard]] std::string toString() override
   {
-    return "FrameStreamLogger to " + d_address + " (" + std::to_string(d_framesSent) + " frames sent, " + std::to_string(d_queueFullDrops) + " dropped, " + std::to_string(d_permanentFailures) + " permanent failures)";
+    auto stats = getStats();
+    return "FrameStreamLogger to " + d_address + " (" + std::to_string(stats.d_queued) + " frames sent, " + std::to_string(stats.d_pipeFull) + " dropped, " + std::to_string(stats.d_otherError) + " permanent failures)";
   }
 
   [[nodiscard]] RemoteLoggerInterface::Stats getStats() override
   {
-    return Stats{.d_queued = d_framesSent,
-                 .d_pipeFull = d_queueFullDrops,
-                 .d_tooLarge = d_tooLargeCount,
-                 .d_otherError = d_permanentFailures};
+    auto stats = d_rings.getStats();
+    stats.d_otherError = d_permanentFailures.load(std::memory_order_relaxed);
+    return stats;
   }
 
 private:
+  bool reconnect();
+  void stopSession();
+  void writerThread();
+
   const int d_family;
   const std::string d_address;
-  struct fstrm_iothr_queue* d_ioqueue{nullptr};
-  struct fstrm_writer_options* d_fwopt{nullptr};
-  struct fstrm_unix_writer_options* d_uwopt{nullptr};
-#ifdef HAVE_FSTRM_TCP_WRITER_INIT
-  struct fstrm_tcp_writer_options* d_twopt{nullptr};
-#endif
-  struct fstrm_writer* d_writer{nullptr};
-  struct fstrm_iothr_options* d_iothropt{nullptr};
-  struct fstrm_iothr* d_iothr{nullptr};
-  std::atomic<uint64_t> d_framesSent{0};
-  std::atomic<uint64_t> d_queueFullDrops{0};
-  std::atomic<uint64_t> d_tooLargeCount{0};
+  ComboAddress d_remote;
+  size_t d_bufferHint{8192};
+  std::chrono::seconds d_flushTimeout{1};
+  time_t d_reopenInterval{5};
+  ThreadRings d_rings;
+  // Only used by the writer thread
+  std::unique_ptr<Socket> d_socket{nullptr};
   std::atomic<uint64_t> d_permanentFailures{0};
-
-  void cleanup();
+  std::atomic<bool> d_exiting{false};
+  std::thread d_thread;
 };
 
 #else
@@ -23,6 +23,7 @@
 
 #include <cassert>
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include <stdexcept>
 #include <string>
@@ -204,6 +205,154 @@ private:
 
 using Histogram = BaseHistogram<Bucket, uint64_t>;
 
+// A log-linear (HDR style) histogram: values are recorded with a fixed number of significant
+// decimal digits over the range [0, highestTrackableValue], larger values are clamped to the top.
+// Buckets double in width every power of two, each one split into 2^n linear sub-buckets, so the
+// index of a value is computed with a count-leading-zeros instead of a search through the boundaries.
+// Instances with the same parameters can be merged with +=, percentiles are reported from the counts.
+class LogLinearHistogram
+{
+public:
+  LogLinearHistogram(std::string name, unsigned int significantDigits = 2, uint64_t highestTrackableValue = 60000000) :
+    d_name(std::move(name)), d_highestTrackableValue(highestTrackableValue)
+  {
+    if (significantDigits < 1 || significantDigits > 5) {
+      throw std::invalid_argument("significant digits must be between 1 and 5");
+    }
+    uint64_t largestValueWithSingleUnitResolution = 2;
+    for (unsigned int digit = 0; digit < significantDigits; ++digit) {
+      largestValueWithSingleUnitResolution *= 10;
+    }
+    unsigned int subBucketCountMagnitude = 0;
+    while ((static_cast<uint64_t>(1) << subBucketCountMagnitude) < largestValueWithSingleUnitResolution) {
+      ++subBucketCountMagnitude;
+    }
+    d_subBucketHalfCountMagnitude = subBucketCountMagnitude - 1;
+    d_subBucketHalfCount = static_cast<uint64_t>(1) << d_subBucketHalfCountMagnitude;
+    d_subBucketMask = (static_cast<uint64_t>(1) << subBucketCountMagnitude) - 1;
+    if (d_highestTrackableValue < 2 * d_subBucketHalfCount) {
+      throw std::invalid_argument("highest trackable value is too small for the requested precision");
+    }
+
+    uint64_t smallestUntrackableValue = static_cast<uint64_t>(1) << subBucketCountMagnitude;
+    size_t bucketCount = 1;
+    while (smallestUntrackableValue <= d_highestTrackableValue) {
+      if (smallestUntrackableValue > std::numeric_limits<uint64_t>::max() / 2) {
+        ++bucketCount;
+        break;
+      }
+      smallestUntrackableValue <<= 1;
+      ++bucketCount;
+    }
+    d_counts.resize((bucketCount + 1) * d_subBucketHalfCount, 0);
+  }
+
+  [[nodiscard]] std::string getName() const
+  {
+    return d_name;
+  }
+
+  [[nodiscard]] uint64_t getSum() const
+  {
+    return d_sum;
+  }
+
+  [[nodiscard]] uint64_t getCount() const
+  {
+    return d_count;
+  }
+
+  [[nodiscard]] uint64_t getMax() const
+  {
+    return d_max;
+  }
+
+  void operator()(uint64_t value)
+  {
+    ++d_counts[countsIndex(value)];
+    ++d_count;
+    d_sum += value;
+    d_max = std::max(d_max, value);
+  }
+
+  LogLinearHistogram& operator+=(const LogLinearHistogram& rhs)
+  {
+    assert(d_name == rhs.d_name);
+    assert(d_counts.size() == rhs.d_counts.size());
+    assert(d_subBucketMask == rhs.d_subBucketMask);
+    for (size_t index = 0; index < d_counts.size(); ++index) {
+      d_counts[index] += rhs.d_counts[index];
+    }
+    d_count += rhs.d_count;
+    d_sum += rhs.d_sum;
+    d_max = std::max(d_max, rhs.d_max);
+    return *this;
+  }
+
+  // The smallest recorded value (at the histogram's precision) that percentile percent of the values are at or below
+  [[nodiscard]] uint64_t getPercentile(double percentile) const
+  {
+    if (d_count == 0) {
+      return 0;
+    }
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    auto target = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(d_count)));
+    target = std::max(target, static_cast<uint64_t>(1));
+    uint64_t cumulative = 0;
+    for (size_t index = 0; index < d_counts.size(); ++index) {
+      cumulative += d_counts[index];
+      if (cumulative >= target) {
+        return std::min(highestEquivalentValue(index), d_max);
+      }
+    }
+    return d_max;
+  }
+
+  // Number of recorded values at or below value, at the histogram's precision
+  [[nodiscard]] uint64_t getCountAtOrBelow(uint64_t value) const
+  {
+    const size_t last = countsIndex(value);
+    uint64_t cumulative = 0;
+    for (size_t index = 0; index <= last; ++index) {
+      cumulative += d_counts[index];
+    }
+    return cumulative;
+  }
+
+private:
+  [[nodiscard]] size_t countsIndex(uint64_t value) const
+  {
+    value = std::min(value, d_highestTrackableValue);
+    // value | mask is never zero, and makes all values below the first bucket's top land in bucket 0
+    const unsigned int pow2Ceiling = 64 - __builtin_clzll(value | d_subBucketMask);
+    const unsigned int bucketIndex = pow2Ceiling - (d_subBucketHalfCountMagnitude + 1);
+    const uint64_t subBucketIndex = value >> bucketIndex;
+    return ((static_cast<size_t>(bucketIndex) + 1) << d_subBucketHalfCountMagnitude) + (subBucketIndex - d_subBucketHalfCount);
+  }
+
+  [[nodiscard]] uint64_t highestEquivalentValue(size_t index) const
+  {
+    int bucketIndex = static_cast<int>(index >> d_subBucketHalfCountMagnitude) - 1;
+    uint64_t subBucketIndex = (index & (d_subBucketHalfCount - 1)) + d_subBucketHalfCount;
+    if (bucketIndex < 0) {
+      subBucketIndex -= d_subBucketHalfCount;
+      bucketIndex = 0;
+    }
+    const uint64_t lowest = subBucketIndex << bucketIndex;
+    return lowest + (static_cast<uint64_t>(1) << bucketIndex) - 1;
+  }
+
+  std::vector<uint64_t> d_counts;
+  std::string d_name;
+  uint64_t d_highestTrackableValue;
+  uint64_t d_subBucketHalfCount{0};
+  uint64_t d_subBucketMask{0};
+  uint64_t d_count{0};
+  uint64_t d_sum{0};
+  uint64_t d_max{0};
+  unsigned int d_subBucketHalfCountMagnitude{0};
+};
+
 using AtomicHistogram = BaseHistogram<AtomicBucket, pdns::stat_t>;
 
 } // namespace pdns
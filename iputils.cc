@@ -822,3 +822,121 @@ std::vector<Netmask> getListOfRangesOfNetworkInterface(const std::string& /* itf
   return result;
 }
 #endif // HAVE_GETIFADDRS
+
+#if TEST_NETMASK_TREE_TIMING
+
+#include <iostream>
+#include <random>
+
+static double elapsedSince(const timeval& start)
+{
+  timeval stop{};
+  gettimeofday(&stop, nullptr);
+  timeval diff{};
+  timersub(&stop, &start, &diff);
+  return static_cast<double>(diff.tv_sec) + static_cast<double>(diff.tv_usec) / 1e6;
+}
+
+static ComboAddress randomAddress(std::mt19937_64& gen, bool ipv6)
+{
+  ComboAddress address(ipv6 ? "::" : "0.0.0.0");
+  if (ipv6) {
+    for (auto& byte : address.sin6.sin6_addr.s6_addr) {
+      byte = static_cast<uint8_t>(gen());
+    }
+  }
+  else {
+    address.sin4.sin_addr.s_addr = static_cast<uint32_t>(gen());
+  }
+  return address;
+}
+
+/* the address with the bits past the first ones of the prefix randomized, so that it falls inside */
+static ComboAddress addressIn(std::mt19937_64& gen, const Netmask& netmask)
+{
+  auto address = randomAddress(gen, netmask.isIPv6());
+  const auto& network = netmask.getNetwork();
+  const auto bits = netmask.getBits();
+  auto* dst = address.isIPv6() ? address.sin6.sin6_addr.s6_addr : reinterpret_cast<uint8_t*>(&address.sin4.sin_addr.s_addr); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  const auto* src = network.isIPv6() ? network.sin6.sin6_addr.s6_addr : reinterpret_cast<const uint8_t*>(&network.sin4.sin_addr.s_addr); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  for (uint8_t bit = 0; bit < bits; bit++) {
+    const uint8_t mask = 0x80 >> (bit % 8);
+    dst[bit / 8] = (dst[bit / 8] & ~mask) | (src[bit / 8] & mask); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  }
+  return address;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " prefixes lookups" << std::endl;
+    return 1;
+  }
+  const size_t prefixes = std::atoi(argv[1]);
+  const size_t lookups = std::atoi(argv[2]);
+
+  // Three IPv4 prefixes for one IPv6 prefix, mostly /24 and /48 like a routing table
+  std::mt19937_64 gen(42);
+  std::discrete_distribution<int> v4Lengths({1, 2, 4, 8, 60, 10, 15});
+  const std::array<uint8_t, 7> v4Bits{8, 12, 16, 20, 24, 28, 32};
+  std::discrete_distribution<int> v6Lengths({2, 10, 20, 50, 10, 8});
+  const std::array<uint8_t, 6> v6Bits{16, 29, 32, 48, 64, 128};
+  NetmaskTree<size_t> tree;
+  std::vector<Netmask> netmasks;
+  netmasks.reserve(prefixes);
+  for (size_t idx = 0; idx < prefixes; idx++) {
+    const bool ipv6 = idx % 4 == 3;
+    netmasks.emplace_back(randomAddress(gen, ipv6), ipv6 ? v6Bits.at(v6Lengths(gen)) : v4Bits.at(v4Lengths(gen)));
+    tree.insert_or_assign(netmasks.back(), idx);
+  }
+
+  timeval start{};
+  gettimeofday(&start, nullptr);
+  const CompiledNetmaskTree<size_t> compiled(tree);
+  auto elapsed = elapsedSince(start);
+  std::cout << tree.size() << " prefixes compiled in " << elapsed * 1e3 << "ms, " << compiled.getMemoryUsage() / 1024 << " kB" << std::endl;
+
+  // Half of the addresses fall inside one of the prefixes, the others are random
+  std::vector<ComboAddress> addresses;
+  addresses.reserve(std::min(lookups, size_t(1000000)));
+  std::uniform_int_distribution<size_t> dist(0, netmasks.size() - 1);
+  for (size_t idx = 0; idx < addresses.capacity(); idx++) {
+    addresses.push_back(idx % 2 == 0 ? addressIn(gen, netmasks.at(dist(gen))) : randomAddress(gen, idx % 8 == 7));
+  }
+
+  size_t mismatches = 0;
+  size_t matches = 0;
+  for (const auto& address : addresses) {
+    const auto* expected = tree.lookup(address);
+    const auto* got = compiled.lookup(address);
+    if ((expected == nullptr) != (got == nullptr) || (expected != nullptr && expected->first != got->first)) {
+      ++mismatches;
+    }
+    if (expected != nullptr) {
+      ++matches;
+    }
+  }
+  std::cout << matches << " of " << addresses.size() << " addresses matched, " << mismatches << " mismatches" << std::endl;
+
+  size_t found = 0;
+  gettimeofday(&start, nullptr);
+  for (size_t idx = 0; idx < lookups; idx++) {
+    if (tree.lookup(addresses[idx % addresses.size()]) != nullptr) {
+      ++found;
+    }
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per NetmaskTree lookup " << elapsed * 1e9 / static_cast<double>(lookups) << "ns" << std::endl;
+
+  gettimeofday(&start, nullptr);
+  for (size_t idx = 0; idx < lookups; idx++) {
+    if (compiled.lookup(addresses[idx % addresses.size()]) != nullptr) {
+      --found;
+    }
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per CompiledNetmaskTree lookup " << elapsed * 1e9 / static_cast<double>(lookups) << "ns" << (found == 0 ? "" : ", results differ") << std::endl;
+  return mismatches == 0 && found == 0 ? 0 : 1;
+}
+
+#endif
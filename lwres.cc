@@ -113,7 +113,8 @@ static void logFstreamQuery(const std::shared_ptr<std::vector<std::unique_ptr<Fr
 
   struct timespec ts;
   TIMEVAL_TO_TIMESPEC(&queryTime, &ts);
-  std::string str;
+  // Moved into the message and back, so its capacity is reused from one query to the next
+  static thread_local std::string str;
   // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
   DnstapMessage message(std::move(str), DnstapMessage::MessageType::resolver_query, SyncRes::s_serverID, &localip, &address, protocol, reinterpret_cast<const char*>(packet.data()), packet.size(), &ts, nullptr, auth);
   str = message.getBuffer();
@@ -144,7 +145,7 @@ static void logFstreamResponse(const std::shared_ptr<std::vector<std::unique_ptr
   struct timespec ts1, ts2;
   TIMEVAL_TO_TIMESPEC(&queryTime, &ts1);
   TIMEVAL_TO_TIMESPEC(&replyTime, &ts2);
-  std::string str;
+  static thread_local std::string str;
   // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
   DnstapMessage message(std::move(str), DnstapMessage::MessageType::resolver_response, SyncRes::s_serverID, &localip, &address, protocol, reinterpret_cast<const char*>(packet.data()), packet.size(), &ts1, &ts2, auth);
   str = message.getBuffer();
@@ -512,6 +513,7 @@ static LWResult::Result asyncresolve(const ComboAddress& address, const DNSName&
   
   lwr->d_rcode = 0;
   lwr->d_haveEDNS = false;
+  lwr->d_staggeredAnswer = false;
   LWResult::Result ret;
 
   DTime dt;
@@ -598,7 +600,12 @@ static LWResult::Result asyncresolve(const ComboAddress& address, const DNSName&
 #endif /* HAVE_FSTRM */
 
     // sleep until we see an answer to this, interface to mtasker
-    ret = arecvfrom(buf, 0, address, len, qid, domain, type, queryfd, subnetOpts, *now);
+    if (context.d_staggeredAddress) {
+      ret = arecvfromStaggered(buf, address, len, qid, domain, type, queryfd, subnetOpts, *now, context.d_timeoutMsec, vpacket, *context.d_staggeredAddress, context.d_staggeredDelayMsec, lwr->d_staggeredAnswer);
+    }
+    else {
+      ret = arecvfrom(buf, 0, address, len, qid, domain, type, queryfd, subnetOpts, *now, context.d_timeoutMsec);
+    }
   }
   else {
     bool isNew;
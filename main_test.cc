@@ -28,9 +28,16 @@
 #include "dns.hh"  // For RCode
 #include "root-addresses.hh"  // For root hints
 #include "pdnsexception.hh"  // For PDNSException
+#include "rec-taskqueue.hh"  // For runPrefetchTasks
+#include "aggressive_nsec.hh"  // For g_aggressiveNSECCache
+#include "validate-recursor.hh"  // For g_dnssecmode
+#include "rec-lua-conf.hh"  // For g_luaconfs
+#include "rec-metrics.hh"  // For rec::startMetricsServer
+#include "rec-cachesnapshot.hh"  // For rec::saveCacheSnapshot, rec::loadCacheSnapshot
 #include <event2/util.h>  // For evutil_make_socket_nonblocking
 #include <iomanip>
 #include <thread>
+#include <chrono>
 #include "dnsrecords.hh"  // For reportAllTypes
 #include "rec-main.hh"    // For DNSComboWriter (minimal setup), deferredAdd_t, makeUDPServerSockets
 #include "logging.hh"     // For Logging::Logger::create
@@ -640,11 +647,38 @@ static void resolveTaskFunc(void* pv) {
       // Task function return will automatically destroy resolver and return control to MTasker scheduler
       // No need to call yield() - that would re-queue the task, which we don't want
 
+// Upstream: rec-main.cc:1999 - errors are logged, a failed snapshot does not stop the recursor
+static void saveCacheSnapshot(const std::string& path)
+{
+    try {
+        const auto start = std::chrono::steady_clock::now();
+        const auto stats = rec::saveCacheSnapshot(path);
+        const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Saved cache snapshot to " << path << ": " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries in " << msec << "ms" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "[ERROR] Unable to save cache snapshot to " << path << ": " << e.what() << std::endl;
+    }
+}
+
 // Simple DNS resolver test
-int main() {
+int main(int argc, char** argv) {
     // Initialize argument map with default values needed by pdns_recursor.cc functions
     // These are normally set by upstream's argument parsing, but we need them for minimal setup
     ::arg().set("spoof-nearmiss-max", "If non-zero, assume spoofing after this many near misses") = "1";
+    // Settings that can be overridden on the command line (--name=value), with the upstream defaults
+    ::arg().set("aggressive-nsec-cache-size", "The number of records to cache in the aggressive cache. If set to a value greater than 0, and DNSSEC processing or validation is enabled, the recursor will cache NSEC and NSEC3 records to generate negative answers, as defined in rfc8198") = "100000";
+    ::arg().set("event-trace-enabled", "If set, event traces are collected and sent out via protobuf logging (1), logfile (2), OpenTelemetry trace data (4) and/or summed into the phase-* histograms (8)") = "0";
+    ::arg().set("metrics-address", "If set, serve OpenMetrics on http://<address>/metrics, port 8083 unless given") = "";
+    ::arg().set("metrics-allow-from", "Only allow these subnets to fetch the metrics") = "127.0.0.1,::1";
+    ::arg().set("cache-snapshot-file", "If set, save the caches to this file every cache-snapshot-interval seconds and at shutdown") = "";
+    ::arg().set("cache-snapshot-interval", "Seconds between cache snapshots, 0 to only save at shutdown") = "3600";
+    ::arg().set("cache-snapshot-load", "Load cache-snapshot-file at startup") = "yes";
+    ::arg().set("cache-transfer-socket", "If set, serve the hot part of the caches to a replacing instance on this UNIX socket") = "";
+    ::arg().set("cache-transfer-socket-mode", "Permissions of cache-transfer-socket") = "0600";
+    ::arg().set("cache-transfer-max-bytes-per-second", "Rate limit of a cache transfer, 0 for unlimited") = "0";
+    ::arg().set("cache-transfer-pull", "If set, load the caches from the instance serving cache-transfer-socket at this path at startup") = "";
+    ::arg().set("cache-lock-profiling", "Profile the shard locks of the record and negative caches, reported in dump-cache and the metrics") = "no";
+    ::arg().laxParse(argc, argv);
     
     try {
         std::cout << "PowerDNS Recursor Windows POC - Starting DNS Server..." << std::endl;
@@ -686,6 +720,10 @@ int main() {
                 std::cerr << "[WARNING] Failed to initialize structured logging - makeUDPServerSockets may fail" << std::endl;
             }
         }
+        // Upstream: rec-main.cc:3478 - also used by the record cache when loading a snapshot
+        if (g_slog && !g_slogout) {
+            g_slogout = g_slog->withName("out");
+        }
         
         // Set up configuration for makeUDPServerSockets()
         // Upstream: rec-main.cc uses ::arg()["local-address"] and ::arg()["local-port"]
@@ -735,6 +773,49 @@ int main() {
             std::cout << "Initialized negative cache" << std::endl;
         }
         
+        // Upstream: rec-main.cc:2506 - only validated NSEC and NSEC3 records may be used to synthesize answers
+        if (::arg().asNum("aggressive-nsec-cache-size") > 0) {
+            if (g_dnssecmode == DNSSECMode::ValidateAll || g_dnssecmode == DNSSECMode::ValidateForLog || g_dnssecmode == DNSSECMode::Process) {
+                g_aggressiveNSECCache = std::make_unique<AggressiveNSECCache>(::arg().asNum("aggressive-nsec-cache-size"));
+            }
+            else {
+                std::cerr << "[WARNING] Aggressive NSEC/NSEC3 caching is enabled but DNSSEC validation is not set to 'validate', 'log-fail' or 'process', ignoring" << std::endl;
+            }
+        }
+        
+        // Upstream: rec-main.cc:2016 - load before serving, so the first queries already see a warm cache.
+        // A missing or damaged snapshot means a cold start, not a failure
+        const std::string cacheSnapshotFile = ::arg()["cache-snapshot-file"];
+        const time_t cacheSnapshotInterval = ::arg().asNum("cache-snapshot-interval");
+        if (!cacheSnapshotFile.empty() && ::arg().mustDo("cache-snapshot-load")) {
+            try {
+                const auto start = std::chrono::steady_clock::now();
+                const auto stats = rec::loadCacheSnapshot(cacheSnapshotFile, std::max(1U, std::thread::hardware_concurrency()));
+                const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Loaded cache snapshot from " << cacheSnapshotFile << ": " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries, " << stats.d_failedChunks << " failed chunks in " << msec << "ms" << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "[WARNING] Not loading cache snapshot from " << cacheSnapshotFile << ": " << e.what() << std::endl;
+            }
+        }
+        
+        // Upstream: rec-main.cc:2040 - the working set of the instance we are replacing is fresher than any snapshot
+        if (const auto& transferPull = ::arg()["cache-transfer-pull"]; !transferPull.empty()) {
+            try {
+                const auto start = std::chrono::steady_clock::now();
+                const auto stats = rec::pullCacheTransfer(transferPull);
+                const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Pulled cache transfer from " << transferPull << ": " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries, " << stats.d_failedChunks << " failed chunks in " << msec << "ms" << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "[WARNING] Unable to pull cache transfer from " << transferPull << ": " << e.what() << std::endl;
+            }
+        }
+        
+        // Upstream: rec-main.cc:3834 - compile the RPZ lookup structures once the zones are activated.
+        // This tree has no RPZ loader, so the engine is empty; zones replaced later via setZone() are patched in
+        g_luaconfs.modify([](LuaConfigItems& lci) {
+            lci.dfe.compile();
+        });
+        
         // Prime root hints into cache for iterative resolution
         timeval now{};
         Utility::gettimeofday(&now, nullptr);
@@ -808,6 +889,10 @@ int main() {
             SyncRes::s_max_CNAMES_followed = 10;
             std::cout << "[DEBUG] Initialized SyncRes::s_max_CNAMES_followed=" << SyncRes::s_max_CNAMES_followed << std::endl;
         }
+        // Upstream: rec-main.cc:1893 - 8 on its own only records the timestamps the phase-* histograms need
+        SyncRes::s_event_trace_enabled = ::arg().asNum("event-trace-enabled");
+        // Upstream: rec-main.cc:1931
+        ShardLockProfile::s_enabled = ::arg().mustDo("cache-lock-profiling");
 
         std::cout << "Initialized MTasker infrastructure:" << std::endl;
         std::cout << "  - g_multiTasker: ready" << std::endl;
@@ -827,11 +912,29 @@ int main() {
         
         // No direct recv test to avoid consuming datagrams
         
+        // Upstream: rec-main.cc:2607 - the metrics listener runs in its own thread
+        if (const auto& metricsAddress = ::arg()["metrics-address"]; !metricsAddress.empty()) {
+            NetmaskGroup metricsACL;
+            metricsACL.toMasks(::arg()["metrics-allow-from"]);
+            rec::startMetricsServer(ComboAddress(metricsAddress, 8083), metricsACL, g_slog->withName("metrics"));
+        }
+        
+        // Upstream: rec-main.cc:2625
+        if (const auto& transferSocket = ::arg()["cache-transfer-socket"]; !transferSocket.empty()) {
+            try {
+                rec::startCacheTransferServer(transferSocket, ::arg().asMode("cache-transfer-socket-mode"), ::arg().asNum("cache-transfer-max-bytes-per-second"), g_slog->withName("cachetransfer"));
+            } catch (const std::exception& e) {
+                std::cerr << "[ERROR] Unable to start the cache transfer server on " << transferSocket << ": " << e.what() << std::endl;
+                return 1;
+            }
+        }
+        
         std::cout << "DNS server running on port 5533. Press Ctrl+C to stop." << std::endl;
         
         // Main event loop - replicates recLoop() pattern from upstream
         timeval g_now{};
         int loop_count = 0;
+        time_t nextCacheSnapshot = time(nullptr) + cacheSnapshotInterval;
         while (true) {
             try {
                 // Update current time at start of each iteration
@@ -854,6 +957,17 @@ int main() {
                 if (schedule_count > 0 && loop_count < 10) {
                     std::cout << "[DEBUG] Event loop: schedule() loop completed after " << schedule_count << " iterations" << std::endl;
                 }
+
+                // Start refreshes of almost expired records as mthreads (upstream: recLoop() on the worker threads)
+                runPrefetchTasks(g_now.tv_sec, false, [](void (*func)(void*), void* arg) {
+                    g_multiTasker->makeThread(func, arg);
+                });
+                
+                // Upstream: rec-main.cc:2840 - periodic snapshot, run from the housekeeping of the handler thread
+                if (!cacheSnapshotFile.empty() && cacheSnapshotInterval > 0 && g_now.tv_sec >= nextCacheSnapshot) {
+                    saveCacheSnapshot(cacheSnapshotFile);
+                    nextCacheSnapshot = g_now.tv_sec + cacheSnapshotInterval;
+                }
                 
                 // NOTE: WSAEventSelect is level-triggered and working correctly
                 // All I/O events (incoming queries and outgoing responses) are handled by t_fdm->run() via WSAEventSelect
@@ -899,6 +1013,12 @@ int main() {
             }
         }
         
+        // Upstream: rec-main.cc:2639 - stop serving transfers, then save once more on the way out
+        rec::stopCacheTransferServer();
+        if (!cacheSnapshotFile.empty()) {
+            saveCacheSnapshot(cacheSnapshotFile);
+        }
+        
         // Cleanup
         if (t_fdm && g_udp_socket >= 0) {
             t_fdm->removeReadFD(g_udp_socket);
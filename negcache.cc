@@ -20,6 +20,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include <cinttypes>
+#include <protozero/pbf_builder.hpp>
+#include <protozero/pbf_message.hpp>
 
 #include "negcache.hh"
 #include "misc.hh"
@@ -29,6 +31,7 @@
 
 // For a description on how ServeStale works, see recursor_cache.cc, the general structure is the same.
 uint16_t NegCache::s_maxServedStaleExtensions;
+CacheEvictionPolicy NegCache::s_evictionPolicy = CacheEvictionPolicy::LRU;
 
 NegCache::NegCache(size_t mapsCount) :
   d_maps(mapsCount == 0 ? 1 : mapsCount)
@@ -100,7 +103,7 @@ void NegCache::updateStaleEntry(time_t now, negcache_t::iterator& entry, QType q
 bool NegCache::get(const DNSName& qname, QType qtype, const struct timeval& now, NegCacheEntry& ne, bool typeMustMatch, bool serveStale, bool refresh)
 {
   auto& map = getMap(qname);
-  auto content = map.lock();
+  auto content = map.lock(qname);
 
   const auto& idx = content->d_map.get<NegCacheEntry>();
   auto range = idx.equal_range(qname);
@@ -125,7 +128,7 @@ bool NegCache::get(const DNSName& qname, QType qtype, const struct timeval& now,
       if (now.tv_sec < ni->d_ttd) {
         // Not expired
         ne = *ni;
-        moveCacheItemToBack<SequenceTag>(content->d_map, firstIndexIterator);
+        touchCacheItem<SequenceTag>(content->d_map, firstIndexIterator, s_evictionPolicy);
         // when refreshing, we consider served-stale entries outdated
         return !(refresh && ni->d_servedStale > 0);
       }
@@ -143,8 +146,8 @@ void NegCache::add(const NegCacheEntry& ne)
 {
   bool inserted = false;
   auto& map = getMap(ne.d_name);
-  auto content = map.lock();
-  inserted = lruReplacingInsert<SequenceTag>(content->d_map, ne);
+  auto content = map.lock(ne.d_name);
+  inserted = lruReplacingInsert<SequenceTag>(content->d_map, ne, s_evictionPolicy);
   if (inserted) {
     map.incEntriesCount();
   }
@@ -160,7 +163,7 @@ void NegCache::add(const NegCacheEntry& ne)
 void NegCache::updateValidationStatus(const DNSName& qname, const QType qtype, const vState newState, boost::optional<time_t> capTTD)
 {
   auto& mc = getMap(qname);
-  auto map = mc.lock();
+  auto map = mc.lock(qname);
   auto range = map->d_map.equal_range(std::tie(qname, qtype));
 
   if (range.first != range.second) {
@@ -179,7 +182,7 @@ void NegCache::updateValidationStatus(const DNSName& qname, const QType qtype, c
 size_t NegCache::count(const DNSName& qname)
 {
   auto& map = getMap(qname);
-  auto content = map.lock();
+  auto content = map.lock(qname);
   return content->d_map.count(std::tie(qname));
 }
 
@@ -192,7 +195,7 @@ size_t NegCache::count(const DNSName& qname)
 size_t NegCache::count(const DNSName& qname, const QType qtype)
 {
   auto& map = getMap(qname);
-  auto content = map.lock();
+  auto content = map.lock(qname);
   return content->d_map.count(std::tie(qname, qtype));
 }
 
@@ -272,7 +275,7 @@ void NegCache::clear()
 void NegCache::prune(time_t now, size_t maxEntries)
 {
   size_t cacheSize = size();
-  pruneMutexCollectionsVector<SequenceTag>(now, d_maps, maxEntries, cacheSize);
+  pruneMutexCollectionsVector<SequenceTag>(now, d_maps, maxEntries, cacheSize, s_evictionPolicy);
 }
 
 /*!
@@ -298,8 +301,13 @@ size_t NegCache::doDump(int fd, size_t maxCacheEntries, time_t now)
   size_t shard = 0;
   size_t min = std::numeric_limits<size_t>::max();
   size_t max = 0;
+  const bool profiling = ShardLockProfile::s_enabled;
+  std::vector<ShardLockProfile::Summary> profiles;
   for (auto& mc : d_maps) {
     auto m = mc.lock();
+    if (profiling) {
+      profiles.push_back({m->d_profile, shard, m->d_acquired_count, m->d_contended_count});
+    }
     const auto shardSize = m->d_map.size();
     fprintf(filePtr.get(), "; negcache shard %zu; size %zu\n", shard, shardSize);
     min = std::min(min, shardSize);
@@ -325,5 +333,210 @@ size_t NegCache::doDump(int fd, size_t maxCacheEntries, time_t now)
     }
   }
   fprintf(filePtr.get(), "; negcache size: %zu/%zu shards: %zu min/max shard size: %zu/%zu\n", size(), maxCacheEntries, d_maps.size(), min, max);
+  if (profiling) {
+    ShardLockProfile::dump(filePtr.get(), "negcache", profiles);
+  }
   return ret;
 }
+
+enum class PBNegCacheDump : protozero::pbf_tag_type
+{
+  required_uint64_protocolVersion = 1,
+  required_int64_time = 2,
+  required_string_type = 3,
+  repeated_message_negCacheEntry = 4,
+};
+
+enum class PBNegCacheEntry : protozero::pbf_tag_type
+{
+  required_bytes_name = 1,
+  required_uint32_qtype = 2,
+  required_bytes_auth = 3,
+  required_int64_ttd = 4,
+  required_uint32_orig_ttl = 5,
+  required_uint32_servedStale = 6,
+  required_uint32_state = 7,
+  repeated_message_soaRecord = 8,
+  repeated_message_soaSig = 9,
+  repeated_message_dnssecRecord = 10,
+  repeated_message_dnssecSig = 11,
+};
+
+// The type must come before the rdata, it is needed to deserialize it
+enum class PBNegCacheRecord : protozero::pbf_tag_type
+{
+  required_bytes_name = 1,
+  required_uint32_type = 2,
+  required_uint32_class = 3,
+  required_uint32_ttl = 4,
+  required_uint32_place = 5,
+  required_bytes_rdata = 6,
+};
+
+static void getNegCacheRecords(protozero::pbf_builder<PBNegCacheEntry>& message, PBNegCacheEntry tag, const vector<DNSRecord>& records)
+{
+  for (const auto& record : records) {
+    protozero::pbf_builder<PBNegCacheRecord> rec(message, tag);
+    rec.add_bytes(PBNegCacheRecord::required_bytes_name, record.d_name.toString());
+    rec.add_uint32(PBNegCacheRecord::required_uint32_type, record.d_type);
+    rec.add_uint32(PBNegCacheRecord::required_uint32_class, record.d_class);
+    rec.add_uint32(PBNegCacheRecord::required_uint32_ttl, record.d_ttl);
+    rec.add_uint32(PBNegCacheRecord::required_uint32_place, record.d_place);
+    rec.add_bytes(PBNegCacheRecord::required_bytes_rdata, record.getContent()->serialize(record.d_name, true));
+  }
+}
+
+static void putNegCacheRecord(protozero::pbf_message<PBNegCacheEntry>& message, vector<DNSRecord>& records)
+{
+  protozero::pbf_message<PBNegCacheRecord> rec = message.get_message();
+  DNSRecord record;
+  while (rec.next()) {
+    switch (rec.tag()) {
+    case PBNegCacheRecord::required_bytes_name:
+      record.d_name = DNSName(rec.get_bytes());
+      break;
+    case PBNegCacheRecord::required_uint32_type:
+      record.d_type = rec.get_uint32();
+      break;
+    case PBNegCacheRecord::required_uint32_class:
+      record.d_class = rec.get_uint32();
+      break;
+    case PBNegCacheRecord::required_uint32_ttl:
+      record.d_ttl = rec.get_uint32();
+      break;
+    case PBNegCacheRecord::required_uint32_place:
+      record.d_place = static_cast<DNSResourceRecord::Place>(rec.get_uint32());
+      break;
+    case PBNegCacheRecord::required_bytes_rdata:
+      record.setContent(DNSRecordContent::deserialize(record.d_name, record.d_type, rec.get_bytes()));
+      break;
+    default:
+      rec.skip();
+      break;
+    }
+  }
+  records.emplace_back(std::move(record));
+}
+
+/*!
+ * Serializes all entries of a single shard, least recently used first
+ *
+ * \param shardNumber The shard to serialize
+ * \param ret The string to append the protobuf encoded entries to
+ * \return The number of entries serialized
+ */
+size_t NegCache::getShardEntries(size_t shardNumber, std::string& ret)
+{
+  protozero::pbf_builder<PBNegCacheDump> full(ret);
+  full.add_uint64(PBNegCacheDump::required_uint64_protocolVersion, 1);
+  full.add_int64(PBNegCacheDump::required_int64_time, time(nullptr));
+  full.add_string(PBNegCacheDump::required_string_type, "PBNegCacheDump");
+
+  size_t count = 0;
+  auto content = d_maps.at(shardNumber).lock();
+  for (const auto& negEntry : content->d_map.get<SequenceTag>()) {
+    protozero::pbf_builder<PBNegCacheEntry> message(full, PBNegCacheDump::repeated_message_negCacheEntry);
+    message.add_bytes(PBNegCacheEntry::required_bytes_name, negEntry.d_name.toString());
+    message.add_uint32(PBNegCacheEntry::required_uint32_qtype, negEntry.d_qtype);
+    message.add_bytes(PBNegCacheEntry::required_bytes_auth, negEntry.d_auth.toString());
+    message.add_int64(PBNegCacheEntry::required_int64_ttd, negEntry.d_ttd);
+    message.add_uint32(PBNegCacheEntry::required_uint32_orig_ttl, negEntry.d_orig_ttl);
+    message.add_uint32(PBNegCacheEntry::required_uint32_servedStale, negEntry.d_servedStale);
+    message.add_uint32(PBNegCacheEntry::required_uint32_state, static_cast<uint32_t>(negEntry.d_validationState));
+    getNegCacheRecords(message, PBNegCacheEntry::repeated_message_soaRecord, negEntry.authoritySOA.records);
+    getNegCacheRecords(message, PBNegCacheEntry::repeated_message_soaSig, negEntry.authoritySOA.signatures);
+    getNegCacheRecords(message, PBNegCacheEntry::repeated_message_dnssecRecord, negEntry.DNSSECRecords.records);
+    getNegCacheRecords(message, PBNegCacheEntry::repeated_message_dnssecSig, negEntry.DNSSECRecords.signatures);
+    ++count;
+  }
+  return count;
+}
+
+/*!
+ * Adds the entries produced by getShardEntries(), skipping the ones that went stale since.
+ * Throws a std::runtime_error if the data is not a negative cache dump.
+ *
+ * \param pbuf The protobuf encoded entries
+ * \return The number of entries added
+ */
+size_t NegCache::putEntries(const std::string& pbuf)
+{
+  protozero::pbf_message<PBNegCacheDump> full(pbuf);
+  const time_t now = time(nullptr);
+  size_t inserted = 0;
+  bool protocolVersionSeen = false;
+  bool typeSeen = false;
+  while (full.next()) {
+    switch (full.tag()) {
+    case PBNegCacheDump::required_uint64_protocolVersion:
+      if (full.get_uint64() != 1) {
+        throw std::runtime_error("Protocol version mismatch");
+      }
+      protocolVersionSeen = true;
+      break;
+    case PBNegCacheDump::required_string_type:
+      if (full.get_string() != "PBNegCacheDump") {
+        throw std::runtime_error("Data type mismatch");
+      }
+      typeSeen = true;
+      break;
+    case PBNegCacheDump::repeated_message_negCacheEntry: {
+      if (!protocolVersionSeen || !typeSeen) {
+        throw std::runtime_error("Required field missing");
+      }
+      protozero::pbf_message<PBNegCacheEntry> message = full.get_message();
+      NegCacheEntry negEntry;
+      while (message.next()) {
+        switch (message.tag()) {
+        case PBNegCacheEntry::required_bytes_name:
+          negEntry.d_name = DNSName(message.get_bytes());
+          break;
+        case PBNegCacheEntry::required_uint32_qtype:
+          negEntry.d_qtype = message.get_uint32();
+          break;
+        case PBNegCacheEntry::required_bytes_auth:
+          negEntry.d_auth = DNSName(message.get_bytes());
+          break;
+        case PBNegCacheEntry::required_int64_ttd:
+          negEntry.d_ttd = message.get_int64();
+          break;
+        case PBNegCacheEntry::required_uint32_orig_ttl:
+          negEntry.d_orig_ttl = message.get_uint32();
+          break;
+        case PBNegCacheEntry::required_uint32_servedStale:
+          negEntry.d_servedStale = message.get_uint32();
+          break;
+        case PBNegCacheEntry::required_uint32_state:
+          negEntry.d_validationState = static_cast<vState>(message.get_uint32());
+          break;
+        case PBNegCacheEntry::repeated_message_soaRecord:
+          putNegCacheRecord(message, negEntry.authoritySOA.records);
+          break;
+        case PBNegCacheEntry::repeated_message_soaSig:
+          putNegCacheRecord(message, negEntry.authoritySOA.signatures);
+          break;
+        case PBNegCacheEntry::repeated_message_dnssecRecord:
+          putNegCacheRecord(message, negEntry.DNSSECRecords.records);
+          break;
+        case PBNegCacheEntry::repeated_message_dnssecSig:
+          putNegCacheRecord(message, negEntry.DNSSECRecords.signatures);
+          break;
+        default:
+          message.skip();
+          break;
+        }
+      }
+      // ttd is absolute, so the time spent on disk is accounted for
+      if (!negEntry.isStale(now)) {
+        add(negEntry);
+        ++inserted;
+      }
+      break;
+    }
+    default:
+      full.skip();
+      break;
+    }
+  }
+  return inserted;
+}
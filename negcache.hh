@@ -31,7 +31,9 @@
 #include "dnsparser.hh"
 #include "dnsname.hh"
 #include "dns.hh"
+#include "cachecleaner.hh"
 #include "lock.hh"
+#include "shardlockprofile.hh"
 #include "stat_t.hh"
 #include "validate.hh"
 
@@ -61,6 +63,8 @@ public:
   static uint16_t s_maxServedStaleExtensions;
   // The time a stale cache entry is extended
   static constexpr uint32_t s_serveStaleExtensionPeriod = 30;
+  // How hits are recorded and which entries are evicted first when the cache is full
+  static CacheEvictionPolicy s_evictionPolicy;
 
   struct NegCacheEntry
   {
@@ -72,6 +76,7 @@ public:
     uint32_t d_orig_ttl;
     mutable uint16_t d_servedStale{0};
     mutable vState d_validationState{vState::Indeterminate};
+    mutable bool d_referenced{false}; // Hit since the last clock sweep, see CacheEvictionPolicy
     QType d_qtype; // The denied type
 
     bool isStale(time_t now) const
@@ -101,6 +106,12 @@ public:
   void prune(time_t now, size_t maxEntries);
   void clear();
   size_t doDump(int fd, size_t maxCacheEntries, time_t now = time(nullptr));
+  size_t getShardEntries(size_t shardNumber, std::string& ret);
+  size_t putEntries(const std::string& pbuf);
+  [[nodiscard]] size_t getShardsCount() const
+  {
+    return d_maps.size();
+  }
   size_t wipe(const DNSName& name, bool subtree = false);
   size_t wipeTyped(const DNSName& name, QType qtype);
   size_t size() const;
@@ -139,19 +150,20 @@ private:
       negcache_t d_map;
       uint64_t d_contended_count{0};
       uint64_t d_acquired_count{0};
+      ShardLockProfile d_profile;
       void invalidate() {}
       void preRemoval(const NegCacheEntry& /* entry */) {}
     };
 
-    LockGuardedTryHolder<MapCombo::LockedContent> lock()
+    ShardLockHolder<LockedContent> lock()
     {
-      auto locked = d_content.try_lock();
-      if (!locked.owns_lock()) {
-        locked.lock();
-        ++locked->d_contended_count;
-      }
-      ++locked->d_acquired_count;
-      return locked;
+      return lockShard(d_content);
+    }
+
+    // Same, but lets the lock profile attribute the acquisition to name
+    ShardLockHolder<LockedContent> lock(const DNSName& name)
+    {
+      return lockShard(d_content, &name);
     }
 
     [[nodiscard]] auto getEntriesCount() const
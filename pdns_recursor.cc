@@ -77,6 +77,8 @@ extern unsigned int g_maxMThreads;
 extern unsigned int g_networkTimeoutMsec;
 extern uint16_t g_outgoingEDNSBufsize;
 unsigned int g_maxChainLength = 0; // Chain length limit for query chaining (defined here since rec-main.cc is not in build)
+bool g_coalesceClientQueries = true; // Park identical UDP client questions on the one being resolved (defined here since rec-main.cc is not in build)
+unsigned int g_maxClientChainLength = 0; // Limit for the number of questions parked on one being resolved (0 = unlimited)
 extern bool g_logCommonErrors; // Log common errors flag
 extern bool g_ECSHardening; // ECS hardening mode flag (defined in lwres.cc)
 extern Logr::log_t g_slogudpin; // UDP input logger
@@ -102,6 +104,8 @@ struct ProtobufServersInfo
 thread_local std::shared_ptr<RecursorLua4> t_pdl; // Lua scripting (nullptr = disabled)
 thread_local ProtobufServersInfo t_protobufServers; // Protobuf logging (default = disabled)
 thread_local ProtobufServersInfo t_outgoingProtobufServers; // Outgoing protobuf (default = disabled)
+ExportSampler::Config ExportSampler::s_config;
+static thread_local ExportSampler t_exportSampler; // Sampling and subnet caps for protobuf/dnstap export of client queries
 thread_local std::unique_ptr<addrringbuf_t> t_remotes, t_servfailremotes, t_largeanswerremotes, t_bogusremotes; // Statistics (nullptr = disabled)
 thread_local std::unique_ptr<boost::circular_buffer<pair<DNSName, uint16_t>>> t_queryring, t_servfailqueryring, t_bogusqueryring; // Query ring (nullptr = disabled)
 thread_local std::shared_ptr<NetmaskGroup> t_allowFrom; // ACL filtering (nullptr = allow all)
@@ -724,7 +728,7 @@ LWResult::Result asendto(const void* data, size_t len, int /* flags */,
 static bool checkIncomingECSSource(const PacketBuffer& packet, const Netmask& subnet);
 
 LWResult::Result arecvfrom(PacketBuffer& packet, int /* flags */, const ComboAddress& fromAddr, size_t& len,
-                           uint16_t qid, const DNSName& domain, uint16_t qtype, int fileDesc, const std::optional<EDNSSubnetOpts>& ecs, const struct timeval& now)
+                           uint16_t qid, const DNSName& domain, uint16_t qtype, int fileDesc, const std::optional<EDNSSubnetOpts>& ecs, const struct timeval& now, unsigned int timeoutMsec)
 {
 #ifdef _WIN32
   std::cout << "[DEBUG] arecvfrom: ENTRY qid=" << qid << " qname=" << domain << " qtype=" << qtype << " fileDesc=" << fileDesc << " remote=" << fromAddr.toStringWithPort() << std::endl;
@@ -814,7 +818,8 @@ LWResult::Result arecvfrom(PacketBuffer& packet, int /* flags */, const ComboAdd
   }
 #endif
 
-  int ret = g_multiTasker->waitEvent(pident, &packet, authWaitTimeMSec(g_multiTasker), &now);
+  // A server's own timeout (see SyncRes::getServerTimeoutMsec()) already follows its RTT, so it is not shortened when we are busy
+  int ret = g_multiTasker->waitEvent(pident, &packet, timeoutMsec > 0 ? timeoutMsec : authWaitTimeMSec(g_multiTasker), &now);
 
 #ifdef _WIN32
   // CRITICAL: Log waiter count AFTER waitEvent (waiter should be removed by now)
@@ -866,6 +871,122 @@ LWResult::Result arecvfrom(PacketBuffer& packet, int /* flags */, const ComboAdd
   return ret == 0 ? LWResult::Result::Timeout : LWResult::Result::PermanentError;
 }
 
+// Staggered UDP queries, used by SyncRes::doResolveAt() when staggered-auth-queries is on. While the resolving
+// mthread waits for the first server in arecvfrom(), a small timer mthread sends the same query to a second server
+// once delayMsec has passed. An answer from that second server is handed to the waiting mthread by
+// handleUDPServerResponse() as if the first server sent it, so whichever answers first wins. The loser's socket is
+// closed, so a late answer from it is dropped.
+struct StaggeredQuery
+{
+  std::vector<uint8_t> query;
+  std::optional<EDNSSubnetOpts> ecs;
+  std::shared_ptr<PacketID> firstWait; // what the resolving mthread waits on
+  std::shared_ptr<PacketID> secondWait; // set once the query went to the second server
+  ComboAddress second;
+  unsigned int delayMsec{0};
+  bool finished{false};
+  bool secondAnswered{false};
+};
+
+// Indexed by the answer expected from the second server
+static thread_local std::map<std::shared_ptr<PacketID>, std::shared_ptr<StaggeredQuery>, PacketIDCompare> t_staggeredQueries;
+
+static void doResends(MT_t::waiters_t::iterator& iter, const std::shared_ptr<PacketID>& resend, const PacketBuffer& content);
+
+static void sendStaggeredQuery(void* arg)
+{
+  std::unique_ptr<std::shared_ptr<StaggeredQuery>> holder(static_cast<std::shared_ptr<StaggeredQuery>*>(arg));
+  auto staggered = *holder;
+
+  mthreadSleep(staggered->delayMsec);
+  if (staggered->finished) {
+    return;
+  }
+  struct timeval now{};
+  Utility::gettimeofday(&now, nullptr);
+  const auto& first = *staggered->firstWait;
+  int fileDesc = -1;
+  if (asendto(staggered->query.data(), staggered->query.size(), 0, staggered->second, first.id, first.domain, first.type, staggered->ecs, &fileDesc, now) != LWResult::Result::Success) {
+    return;
+  }
+  t_Counters.at(rec::Counter::staggeredAuthQueries)++;
+  if (fileDesc < 0) {
+    // chained onto a query already on its way to the second server, that answer is not ours to take
+    return;
+  }
+  auto wait = std::make_shared<PacketID>();
+  wait->remote = staggered->second;
+  wait->domain = first.domain;
+  wait->type = first.type;
+  wait->fd = fileDesc;
+  wait->id = first.id;
+  staggered->secondWait = wait;
+  t_staggeredQueries.emplace(std::move(wait), staggered);
+}
+
+// Called by handleUDPServerResponse() for an answer nobody waits for
+static bool deliverStaggeredAnswer(const std::shared_ptr<PacketID>& pident, const PacketBuffer& packet)
+{
+  auto iter = t_staggeredQueries.find(pident);
+  if (iter == t_staggeredQueries.end()) {
+    return false;
+  }
+  auto staggered = iter->second;
+  t_staggeredQueries.erase(iter);
+  staggered->secondAnswered = true;
+  // Queries chained on the first server's query get this answer as well, as its socket is closed after this
+  auto waiter = g_multiTasker->getWaiters().find(staggered->firstWait);
+  if (waiter != g_multiTasker->getWaiters().end()) {
+    doResends(waiter, staggered->firstWait, packet);
+  }
+  g_multiTasker->sendEvent(staggered->firstWait, &packet);
+  return true;
+}
+
+static void forgetStaggeredQuery(const std::shared_ptr<PacketID>& pident)
+{
+  if (!t_staggeredQueries.empty()) {
+    t_staggeredQueries.erase(pident);
+  }
+}
+
+LWResult::Result arecvfromStaggered(PacketBuffer& packet, const ComboAddress& fromAddr, size_t& len, uint16_t qid, const DNSName& domain, uint16_t qtype, int fileDesc,
+                                    const std::optional<EDNSSubnetOpts>& ecs, const struct timeval& now, unsigned int timeoutMsec, const std::vector<uint8_t>& query, const ComboAddress& second, unsigned int delayMsec, bool& secondAnswered)
+{
+  secondAnswered = false;
+  if (fileDesc < 0 || delayMsec >= (timeoutMsec > 0 ? timeoutMsec : authWaitTimeMSec(g_multiTasker)) || g_multiTasker->numProcesses() >= g_maxMThreads) {
+    return arecvfrom(packet, 0, fromAddr, len, qid, domain, qtype, fileDesc, ecs, now, timeoutMsec);
+  }
+
+  auto staggered = std::make_shared<StaggeredQuery>();
+  staggered->query = query;
+  staggered->ecs = ecs;
+  staggered->second = second;
+  staggered->delayMsec = delayMsec;
+  staggered->firstWait = std::make_shared<PacketID>();
+  staggered->firstWait->remote = fromAddr;
+  staggered->firstWait->domain = domain;
+  staggered->firstWait->type = qtype;
+  staggered->firstWait->fd = fileDesc;
+  staggered->firstWait->id = qid;
+  g_multiTasker->makeThread(sendStaggeredQuery, new std::shared_ptr<StaggeredQuery>(staggered)); // NOLINT(cppcoreguidelines-owning-memory)
+
+  auto ret = arecvfrom(packet, 0, fromAddr, len, qid, domain, qtype, fileDesc, ecs, now, timeoutMsec);
+
+  staggered->finished = true;
+  if (staggered->secondWait && t_staggeredQueries.erase(staggered->secondWait) > 0) {
+    // the second server lost, or never answered
+    t_udpclientsocks->returnSocket(staggered->secondWait->fd);
+  }
+  if (staggered->secondAnswered) {
+    // arecvfrom() only closes the socket on a timeout, and handleUDPServerResponse() closed the second server's one
+    t_udpclientsocks->returnSocket(fileDesc);
+    secondAnswered = true;
+    t_Counters.at(rec::Counter::staggeredAuthAnswers)++;
+  }
+  return ret;
+}
+
 // ========================================================================
 // UDP FLOW: addRecordToPacket - helper function for startDoResolve
 // ========================================================================
@@ -1453,6 +1574,254 @@ static void addPolicyTagsToPBMessageIfNeeded(DNSComboWriter& comboWriter, pdns::
   }
 }
 
+// A full trace is only needed when it gets exported, the phase histograms make do with the timestamps
+static void startEventTrace(RecEventTrace& eventTrace)
+{
+  if (SyncRes::s_event_trace_enabled == SyncRes::event_trace_to_histograms) {
+    eventTrace.setPhasesOnly();
+  }
+  else {
+    eventTrace.setEnabled(SyncRes::s_event_trace_enabled != 0);
+  }
+}
+
+// Feed the per-phase durations of a finished query into the thread local histograms
+static void addEventTracePhases(const RecEventTrace& eventTrace)
+{
+  if (!eventTrace.recordsPhases() || !SyncRes::eventTraceEnabled(SyncRes::event_trace_to_histograms)) {
+    return;
+  }
+  const auto phases = eventTrace.getPhaseDurations();
+  if (phases.ingress) {
+    t_Counters.at(rec::Histogram::phaseIngress)(*phases.ingress);
+  }
+  if (phases.syncRes > 0) {
+    t_Counters.at(rec::Histogram::phaseSyncRes)(phases.syncRes);
+  }
+  if (phases.authRequests > 0) {
+    t_Counters.at(rec::Histogram::phaseAuthRequests)(phases.authRequests);
+  }
+  if (phases.lua > 0) {
+    t_Counters.at(rec::Histogram::phaseLua)(phases.lua);
+  }
+  if (phases.egress) {
+    t_Counters.at(rec::Histogram::phaseEgress)(*phases.egress);
+  }
+}
+
+// In-flight client query coalescing. Identical UDP questions that arrive while one is being resolved do not get
+// an mthread of their own: they are parked on the one being resolved (the leader) and get its answer, with their
+// own ID and qname case. Questions are identical when everything that shapes the answer is: the question, the
+// header flags, the EDNS part of the query byte for byte, the packet cache tag and the routing tag. Answers that
+// turn out to depend on the client (resolver.wasVariable()) are not shared, the parked questions are then resolved
+// on their own after all. With pdns-distributes-queries the same name always lands on the same thread, so a per
+// thread table catches herds without cross-thread locking.
+using ClientQueryKey = std::tuple<DNSName, uint16_t, uint16_t, unsigned int, std::string, std::string, bool>;
+using ClientQueryFollowers = std::vector<std::unique_ptr<DNSComboWriter>>;
+static thread_local std::map<ClientQueryKey, ClientQueryFollowers> t_inFlightClientQueries;
+
+void startDoResolve(void* arg);
+
+// Offset of the end of the question section, or 0 if the question name is not stored plainly at the start of it,
+// which would make the qname copy in sendCoalescedAnswer() unsafe
+static size_t plainQuestionEnd(const std::string& query, const DNSName& qname)
+{
+  const size_t nameEnd = 12 + qname.wirelength();
+  if (query.size() < nameEnd + 4 || query.at(nameEnd - 1) != 0) {
+    return 0;
+  }
+  return nameEnd + 4;
+}
+
+static boost::optional<ClientQueryKey> clientQueryKey(const DNSComboWriter& comboWriter)
+{
+  const auto& query = comboWriter.d_query;
+  if (comboWriter.d_tcp || comboWriter.d_variable || comboWriter.d_rcode || !comboWriter.d_records.empty() || !comboWriter.d_proxyProtocolValues.empty() || t_pdl) {
+    return boost::none;
+  }
+  if (query.size() < 12) {
+    return boost::none;
+  }
+  // Read from the wire, not from the dnsheader struct, see the Windows layout note in doProcessUDPQuestion()
+  const auto* raw = reinterpret_cast<const uint8_t*>(query.data()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  const unsigned int opcode = (raw[2] >> 3) & 0x0f;
+  const bool oneQuestionOnly = raw[4] == 0 && raw[5] == 1 && raw[6] == 0 && raw[7] == 0 && raw[8] == 0 && raw[9] == 0;
+  if (opcode != static_cast<unsigned int>(Opcode::Query) || !oneQuestionOnly) {
+    return boost::none;
+  }
+  const size_t questionEnd = plainQuestionEnd(query, comboWriter.d_mdp.d_qname);
+  if (questionEnd == 0) {
+    return boost::none;
+  }
+  // Flags and everything after the question (the OPT record with the buffer size, DO bit and options)
+  std::string shape = query.substr(2, 2);
+  shape.append(query, questionEnd, std::string::npos);
+  return ClientQueryKey{comboWriter.d_mdp.d_qname, comboWriter.d_mdp.d_qtype, comboWriter.d_mdp.d_qclass, comboWriter.d_tag, std::move(shape), comboWriter.d_routingTag, g_paddingFrom.match(comboWriter.d_remote)};
+}
+
+// Returns true if comboWriter was parked on an in-flight leader (and moved from), otherwise comboWriter should be
+// resolved by an mthread of its own, which becomes the leader for later identical questions if there was none yet
+static bool parkOnInFlightClientQuery(std::unique_ptr<DNSComboWriter>& comboWriter)
+{
+  if (!g_coalesceClientQueries) {
+    return false;
+  }
+  auto key = clientQueryKey(*comboWriter);
+  if (!key || g_luaconfs.getLocal()->dfe.hasClientPolicies()) {
+    return false;
+  }
+  auto [iter, inserted] = t_inFlightClientQueries.try_emplace(std::move(*key));
+  if (inserted) {
+    comboWriter->d_coalesceLeader = true;
+    return false;
+  }
+  auto& followers = iter->second;
+  if (g_maxClientChainLength > 0 && followers.size() >= g_maxClientChainLength) {
+    ++t_Counters.at(rec::Counter::clientChainLimits);
+    return false;
+  }
+  followers.push_back(std::move(comboWriter));
+  if (followers.size() > t_Counters.at(rec::Counter::maxClientChainLength)) {
+    t_Counters.at(rec::Counter::maxClientChainLength) = followers.size();
+  }
+  return true;
+}
+
+static void sendCoalescedAnswer(const DNSComboWriter& follower, std::vector<uint8_t> packet)
+{
+  // Same name, so the same wire length: only the ID and the case of the qname differ from the leader's answer
+  const size_t nameEnd = 12 + follower.d_mdp.d_qname.wirelength();
+  if (packet.size() < nameEnd) {
+    return;
+  }
+  std::copy(follower.d_query.begin(), follower.d_query.begin() + 2, packet.begin());
+  std::copy(follower.d_query.begin() + 12, follower.d_query.begin() + static_cast<ssize_t>(nameEnd), packet.begin() + 12);
+
+  struct msghdr msgh{};
+  struct iovec iov{};
+  cmsgbuf_aligned cbuf{};
+  fillMSGHdr(&msgh, &iov, &cbuf, 0, reinterpret_cast<char*>(packet.data()), packet.size(), const_cast<ComboAddress*>(&follower.d_remote)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-type-const-cast)
+  msgh.msg_control = nullptr;
+  if (g_fromtosockets.count(follower.d_socket) > 0) {
+    addCMsgSrcAddr(&msgh, &cbuf, &follower.d_local, 0);
+  }
+  int sendErr = sendOnNBSocket(follower.d_socket, &msgh);
+  if (sendErr != 0 && g_logCommonErrors) {
+    SLOG(g_log << Logger::Warning << "Sending UDP reply to client " << follower.getRemote() << " failed with: " << stringerror(sendErr) << endl,
+         g_slogudpin->error(Logr::Warning, sendErr, "Sending UDP reply to client failed"));
+  }
+
+  struct timeval now{};
+  Utility::gettimeofday(&now, nullptr);
+  const uint64_t spentUsec = uSec(now - follower.d_now);
+  t_Counters.at(rec::Histogram::answers)(spentUsec);
+  t_Counters.at(rec::Histogram::cumulativeAnswers)(spentUsec);
+  ++t_Counters.at(rec::Counter::clientQueriesCoalesced);
+}
+
+// Lives as long as the startDoResolve() of a potential leader. Hands the leader's answer to the questions parked on
+// it, or, if the leader ends without an answer that can be shared, has them resolved on their own.
+class ClientQueryLeaderGuard
+{
+public:
+  ClientQueryLeaderGuard(const DNSComboWriter& comboWriter)
+  {
+    if (!comboWriter.d_coalesceLeader) {
+      return;
+    }
+    auto key = clientQueryKey(comboWriter);
+    if (key && t_inFlightClientQueries.count(*key) != 0) {
+      d_key = std::move(key);
+    }
+  }
+
+  ClientQueryLeaderGuard(const ClientQueryLeaderGuard&) = delete;
+  ClientQueryLeaderGuard& operator=(const ClientQueryLeaderGuard&) = delete;
+
+  ~ClientQueryLeaderGuard()
+  {
+    try {
+      auto followers = takeFollowers();
+      for (auto& follower : followers) {
+        ++t_Counters.at(rec::Counter::clientChainFallbacks);
+        if (g_multiTasker->numProcesses() >= g_maxMThreads) {
+          t_Counters.at(rec::Counter::overCapacityDrops)++;
+          continue;
+        }
+        g_multiTasker->makeThread(startDoResolve, follower.release()); // deletes the DNSComboWriter
+      }
+    }
+    catch (...) {
+    }
+  }
+
+  void answerFollowers(const std::vector<uint8_t>& packet, bool variable)
+  {
+    if (variable) {
+      // The destructor has the followers resolved on their own
+      return;
+    }
+    for (const auto& follower : takeFollowers()) {
+      sendCoalescedAnswer(*follower, packet);
+    }
+  }
+
+private:
+  ClientQueryFollowers takeFollowers()
+  {
+    ClientQueryFollowers followers;
+    if (d_key) {
+      auto iter = t_inFlightClientQueries.find(*d_key);
+      if (iter != t_inFlightClientQueries.end()) {
+        followers = std::move(iter->second);
+        t_inFlightClientQueries.erase(iter);
+      }
+      d_key = boost::none;
+    }
+    return followers;
+  }
+
+  boost::optional<ClientQueryKey> d_key;
+};
+
+// The response of a query deferred by the export sampler is exported after all if the answer in packet is interesting.
+// In that case the response part of pbMessage, skipped while answering, is filled in here and true is returned.
+static bool exportIfKept(const DNSComboWriter& comboWriter, const SyncRes& resolver, const LocalStateHolder<LuaConfigItems>& luaconfsLocal, const vector<DNSRecord>& ret, const vector<uint8_t>& packet, pdns::ProtoZero::RecMessage& pbMessage)
+{
+  if (comboWriter.d_exportVerdict != ExportSampler::Verdict::Deferred || packet.size() < sizeof(dnsheader)) {
+    return false;
+  }
+  dnsheader header{};
+  memcpy(&header, packet.data(), sizeof(header));
+  const auto& appliedPolicy = resolver.d_appliedPolicy;
+  const bool policyHit = appliedPolicy.d_type != DNSFilterEngine::PolicyType::None;
+  if (!ExportSampler::keep(header.rcode, policyHit, uSec(resolver.getNow() - comboWriter.d_now))) {
+    return false;
+  }
+  t_Counters.at(rec::Counter::exportKept)++;
+
+  pbMessage.reserve(128, 128);
+  pbMessage.setResponse(comboWriter.d_mdp.d_qname, comboWriter.d_mdp.d_qtype, comboWriter.d_mdp.d_qclass);
+  pbMessage.setServerIdentity(SyncRes::s_serverID);
+  for (const auto& record : ret) {
+    if (pbMessage.size() >= std::numeric_limits<uint16_t>::max() / 2) {
+      break;
+    }
+    pbMessage.addRR(record, luaconfsLocal->protobufExportConfig.exportTypes, std::nullopt);
+  }
+  pbMessage.setResponseCode(header.rcode);
+  if (policyHit) {
+    pbMessage.setAppliedPolicy(appliedPolicy.getName());
+    pbMessage.setAppliedPolicyType(appliedPolicy.d_type);
+    pbMessage.setAppliedPolicyTrigger(appliedPolicy.getTrigger());
+    pbMessage.setAppliedPolicyHit(appliedPolicy.getHit());
+    pbMessage.setAppliedPolicyKind(appliedPolicy.d_kind);
+  }
+  pbMessage.setInBytes(packet.size());
+  pbMessage.setValidationState(resolver.getValidationState());
+  return true;
+}
+
 // ========================================================================
 // UDP FLOW: startDoResolve - main DNS resolution function (from upstream)
 // ========================================================================
@@ -1464,6 +1833,7 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
 {
   std::cout << "[DEBUG startDoResolve] ENTRY: Function called with arg=" << arg << std::endl;
   auto comboWriter = std::unique_ptr<DNSComboWriter>(static_cast<DNSComboWriter*>(arg));
+  ClientQueryLeaderGuard coalescingGuard(*comboWriter);
   std::cout << "[DEBUG startDoResolve] DNSComboWriter created: qname=" << comboWriter->d_mdp.d_qname << " qtype=" << comboWriter->d_mdp.d_qtype << std::endl;
   
   // CRITICAL FIX: Initialize t_sstorage.domainmap if null (required by updateCacheFromRecords)
@@ -1558,7 +1928,9 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
     bool wantsRPZ(false);  // RPZ disabled by default (can be enabled if policy is configured)
     RecursorPacketCache::OptPBData pbDataForCache;
     pdns::ProtoZero::RecMessage pbMessage;
-    if (checkProtobufExport(luaconfsLocal)) {
+    // Queries left out by the export sampler do no protobuf work until their answer is known, see exportIfKept()
+    const bool pbExport = checkProtobufExport(luaconfsLocal) && comboWriter->d_exportVerdict == ExportSampler::Verdict::Export;
+    if (pbExport) {
       pbMessage.reserve(128, 128); // It's a bit of a guess...
       pbMessage.setResponse(comboWriter->d_mdp.d_qname, comboWriter->d_mdp.d_qtype, comboWriter->d_mdp.d_qclass);
       pbMessage.setServerIdentity(SyncRes::s_serverID);
@@ -2313,7 +2685,7 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
         }
 #endif /* NOD ENABLED */
 
-        if (t_protobufServers.servers) {
+        if (t_protobufServers.servers && pbExport) {
           // Max size is 64k, but we're conservative here, as other fields are added after the answers have been added
           // If a single answer causes a too big protobuf message, it will be dropped by queueData()
           // But note addRR has code to prevent that
@@ -2556,7 +2928,7 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
 
 #if 0
     // DISABLED: Protobuf message construction (not needed for minimal UDP flow)
-    if (t_protobufServers.servers && !(luaconfsLocal->protobufExportConfig.taggedOnly && appliedPolicy.getName().empty() && comboWriter->d_policyTags.empty())) {
+    if (t_protobufServers.servers && pbExport && !(luaconfsLocal->protobufExportConfig.taggedOnly && appliedPolicy.getName().empty() && comboWriter->d_policyTags.empty())) {
       // Start constructing embedded DNSResponse object
       pbMessage.setResponseCode(packetWriter.getHeader()->rcode);
       if (!appliedPolicy.getName().empty()) {
@@ -2634,6 +3006,7 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
         std::cout << "[DEBUG startDoResolve] About to call sendOnNBSocket on socket " << comboWriter->d_socket << std::endl;
       int sendErr = sendOnNBSocket(comboWriter->d_socket, &msgh);
         std::cout << "[DEBUG startDoResolve] sendOnNBSocket returned: " << sendErr << std::endl;
+      coalescingGuard.answerFollowers(packet, variableAnswer || resolver.wasVariable());
         if (sendErr != 0) {
           std::cerr << "[ERROR startDoResolve] sendOnNBSocket failed with error: " << sendErr << std::endl;
           if (g_logCommonErrors) {
@@ -2663,15 +3036,17 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
     std::cout << "[DEBUG startDoResolve] After UDP/TCP send, about to add event trace" << std::endl;
     std::cout.flush();
     resolver.d_eventTrace.add(RecEventTrace::AnswerSent);
+    addEventTracePhases(resolver.d_eventTrace);
     std::cout << "[DEBUG startDoResolve] Event trace added" << std::endl;
     std::cout.flush();
 
     std::cout << "[DEBUG startDoResolve] About to check event trace logging" << std::endl;
     std::cout.flush();
+    [[maybe_unused]] const bool exportKept = t_protobufServers.servers && exportIfKept(*comboWriter, resolver, luaconfsLocal, ret, packet, pbMessage);
 #if 0
     // DISABLED: Protobuf message construction (not needed for minimal UDP flow)
     // Now do the per query changing part of the protobuf message
-    if (t_protobufServers.servers && !(luaconfsLocal->protobufExportConfig.taggedOnly && appliedPolicy.getName().empty() && comboWriter->d_policyTags.empty())) {
+    if (t_protobufServers.servers && (pbExport || exportKept) && !(luaconfsLocal->protobufExportConfig.taggedOnly && appliedPolicy.getName().empty() && comboWriter->d_policyTags.empty())) {
       // Below are the fields that are not stored in the packet cache and will be appended here and on a cache hit
       if (g_useKernelTimestamp && comboWriter->d_kernelTimestamp.tv_sec != 0) {
         pbMessage.setQueryTime(comboWriter->d_kernelTimestamp.tv_sec, comboWriter->d_kernelTimestamp.tv_usec);
@@ -2732,7 +3107,7 @@ void startDoResolve(void* arg) // NOLINT(readability-function-cognitive-complexi
         string otData = otTrace.encode();
         pbMessage.setOpenTelemetryData(otData);
       }
-      if (comboWriter->d_logResponse) {
+      if (comboWriter->d_logResponse || exportKept) {
         protobufLogResponse(pbMessage);
       }
     }
@@ -3431,6 +3806,24 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
   }
   logQuery = t_protobufServers.servers && luaconfsLocal->protobufExportConfig.logQueries;
   logResponse = t_protobufServers.servers && luaconfsLocal->protobufExportConfig.logResponses;
+  auto exportVerdict = ExportSampler::Verdict::Export;
+  if (logQuery || logResponse) {
+    // Sample before any protobuf work is done. The hash includes the id so repeated questions are sampled independently
+    bool hashOK = false;
+    auto hash = hashQuestion(reinterpret_cast<const uint8_t*>(question.data()), question.size(), dnsheader_ptr->id, hashOK); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    exportVerdict = t_exportSampler.decide(hash, source, g_now.tv_sec);
+    if (exportVerdict == ExportSampler::Verdict::Export) {
+      t_Counters.at(rec::Counter::exportSampled)++;
+    }
+    else {
+      t_Counters.at(rec::Counter::exportDropped)++;
+      logQuery = false;
+      if (exportVerdict == ExportSampler::Verdict::Deferred && !logResponse) {
+        exportVerdict = ExportSampler::Verdict::Drop;
+      }
+      logResponse = false;
+    }
+  }
 #ifdef HAVE_FSTRM
   checkFrameStreamExport(luaconfsLocal, luaconfsLocal->frameStreamExportConfig, t_frameStreamServersInfo);
 #endif
@@ -3549,9 +3942,11 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
         }
         int sendErr = sendOnNBSocket(fileDesc, &msgh);
         eventTrace.add(RecEventTrace::AnswerSent);
+        addEventTracePhases(eventTrace);
 
         // NOTE: protobufLogResponse is disabled in minimal setup
-        // if (t_protobufServers.servers && logResponse && (!luaconfsLocal->protobufExportConfig.taggedOnly || (pbData && pbData->d_tagged))) {
+        // A deferred query (see ExportSampler) answered from the cache can only be kept by its rcode or policy hit, it is never slow
+        // if (t_protobufServers.servers && (logResponse || (exportVerdict == ExportSampler::Verdict::Deferred && ExportSampler::keep(reinterpret_cast<const dnsheader*>(response.data())->rcode, pbData && pbData->d_tagged, 0))) && (!luaconfsLocal->protobufExportConfig.taggedOnly || (pbData && pbData->d_tagged))) {
         //   protobufLogResponse(qname, qtype, *dnsheader_ptr, luaconfsLocal, pbData, tval, false, source, destination, mappedSource, ednssubnet, uniqueId, requestorId, deviceId, deviceName, meta, eventTrace, otTrace, policyTags);
         // }
 
@@ -3650,6 +4045,7 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
   comboWriter->d_followCNAMERecords = followCNAMEs;
   comboWriter->d_rcode = rcode;
   comboWriter->d_logResponse = logResponse;
+  comboWriter->d_exportVerdict = exportVerdict;
   if (t_protobufServers.servers || t_outgoingProtobufServers.servers) {
     comboWriter->d_uuid = uniqueId;
   }
@@ -3667,6 +4063,10 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
   comboWriter->d_eventTrace = std::move(eventTrace);
   comboWriter->d_otTrace = std::move(otTrace);
 
+  if (parkOnInFlightClientQuery(comboWriter)) {
+    return nullptr;
+  }
+
   g_multiTasker->makeThread(startDoResolve, (void*)comboWriter.release()); // deletes dc
 
   return nullptr;
@@ -3705,7 +4105,7 @@ void handleNewUDPQuestion(int fileDesc, FDMultiplexer::funcparam_t& /* var */) /
     ssize_t len = recvfrom(fileDesc, data.data(), data.size(), 0, reinterpret_cast<sockaddr*>(&fromaddr), &addrlen); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
     if (len >= 0) {
       eventTrace.clear();
-      eventTrace.setEnabled(SyncRes::s_event_trace_enabled != 0);
+      startEventTrace(eventTrace);
       // eventTrace uses monotonic time, while OpenTelemetry uses absolute time. setEnabled()
       // established the reference point, get an absolute TS as close as possible to the
       // eventTrace start of trace time.
@@ -3721,7 +4121,7 @@ void handleNewUDPQuestion(int fileDesc, FDMultiplexer::funcparam_t& /* var */) /
 #else
     if (ssize_t len = recvmsg(fileDesc, &msgh, 0); len >= 0) {
       eventTrace.clear();
-      eventTrace.setEnabled(SyncRes::s_event_trace_enabled != 0);
+      startEventTrace(eventTrace);
       // eventTrace uses monotonic time, while OpenTelemetry uses absolute time. setEnabled()
       // established the reference point, get an absolute TS as close as possible to the
       // eventTrace start of trace time.
@@ -4427,6 +4827,7 @@ static void handleUDPServerResponse(int fileDesc, FDMultiplexer::funcparam_t& va
   if (len < 0) {
     // len < 0: error on socket
     t_udpclientsocks->returnSocket(fileDesc);
+    forgetStaggeredQuery(pid);
 
     PacketBuffer empty;
     auto iter = g_multiTasker->getWaiters().find(pid);
@@ -4562,6 +4963,10 @@ static void handleUDPServerResponse(int fileDesc, FDMultiplexer::funcparam_t& va
 
 retryWithName:
 
+  if (!pident->domain.empty() && deliverStaggeredAnswer(pident, packet)) {
+    t_udpclientsocks->returnSocket(fileDesc);
+    return;
+  }
   if (pident->domain.empty() || g_multiTasker->sendEvent(pident, &packet) == 0) {
     /* we did not find a match for this response, something is wrong */
 
@@ -0,0 +1,620 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "rec-cachesnapshot.hh"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+#include "iputils.hh"
+#include "misc.hh"
+#include "negcache.hh"
+#include "recursor_cache.hh"
+#include "syncres.hh"
+#include "threadname.hh"
+
+namespace
+{
+// Magic, then chunks of [kind:1][length:4, big endian][payload], closed by an empty End chunk
+constexpr std::array<char, 8> s_magic = {'P', 'D', 'N', 'S', 'R', 'C', 'S', '1'};
+constexpr size_t s_chunkHeaderSize = 5;
+
+enum class ChunkKind : uint8_t
+{
+  End = 0,
+  RecordCacheShard = 1,
+  NegCacheShard = 2,
+  NSSpeeds = 3,
+  EDNSStatuses = 4,
+};
+
+struct ChunkIndex
+{
+  ChunkKind d_kind;
+  int64_t d_offset; // of the payload
+  uint32_t d_length;
+};
+
+// ftell() and fseek() use a long, which is 32 bits on Windows, and a snapshot can be larger
+int64_t tell64(FILE* filePtr)
+{
+#ifdef _WIN32
+  return _ftelli64(filePtr);
+#else
+  return ftello(filePtr);
+#endif
+}
+
+int seek64(FILE* filePtr, int64_t offset, int whence)
+{
+#ifdef _WIN32
+  return _fseeki64(filePtr, offset, whence);
+#else
+  return fseeko(filePtr, static_cast<off_t>(offset), whence);
+#endif
+}
+
+void writeOrThrow(FILE* filePtr, const void* data, size_t length)
+{
+  if (length > 0 && fwrite(data, 1, length, filePtr) != length) {
+    throw std::runtime_error("Error writing cache snapshot: " + stringerror());
+  }
+}
+
+using ChunkHeader = std::array<uint8_t, s_chunkHeaderSize>;
+
+ChunkHeader makeChunkHeader(ChunkKind kind, const std::string& payload)
+{
+  if (payload.size() > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("Cache snapshot chunk too large");
+  }
+  const auto length = static_cast<uint32_t>(payload.size());
+  return {static_cast<uint8_t>(kind), static_cast<uint8_t>(length >> 24), static_cast<uint8_t>(length >> 16), static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length)};
+}
+
+uint32_t getChunkLength(const ChunkHeader& header)
+{
+  return static_cast<uint32_t>(header[1]) << 24 | static_cast<uint32_t>(header[2]) << 16 | static_cast<uint32_t>(header[3]) << 8 | header[4];
+}
+
+void writeChunk(FILE* filePtr, ChunkKind kind, const std::string& payload)
+{
+  const auto header = makeChunkHeader(kind, payload);
+  writeOrThrow(filePtr, header.data(), header.size());
+  writeOrThrow(filePtr, payload.data(), payload.size());
+}
+
+pdns::UniqueFilePtr openSnapshot(const std::string& path)
+{
+  auto filePtr = pdns::UniqueFilePtr(fopen(path.c_str(), "rb"));
+  if (!filePtr) {
+    throw std::runtime_error("Unable to open cache snapshot " + path + ": " + stringerror());
+  }
+  return filePtr;
+}
+
+// Walk the chunk headers without reading the payloads
+std::vector<ChunkIndex> indexSnapshot(const std::string& path)
+{
+  auto filePtr = openSnapshot(path);
+  std::array<char, s_magic.size()> magic{};
+  if (fread(magic.data(), 1, magic.size(), filePtr.get()) != magic.size() || magic != s_magic) {
+    throw std::runtime_error("Not a cache snapshot: " + path);
+  }
+  std::vector<ChunkIndex> chunks;
+  while (true) {
+    ChunkHeader header{};
+    if (fread(header.data(), 1, header.size(), filePtr.get()) != header.size()) {
+      throw std::runtime_error("Truncated cache snapshot: " + path);
+    }
+    ChunkIndex chunk{static_cast<ChunkKind>(header[0]), tell64(filePtr.get()), getChunkLength(header)};
+    if (chunk.d_kind == ChunkKind::End) {
+      return chunks;
+    }
+    if (chunk.d_offset < 0 || seek64(filePtr.get(), chunk.d_length, SEEK_CUR) != 0) {
+      throw std::runtime_error("Truncated cache snapshot: " + path);
+    }
+    chunks.push_back(chunk);
+  }
+}
+
+struct AtomicStats
+{
+  std::atomic<size_t> d_recordSets{0};
+  std::atomic<size_t> d_negEntries{0};
+  std::atomic<size_t> d_nsSpeeds{0};
+  std::atomic<size_t> d_ednsStatuses{0};
+  std::atomic<size_t> d_failedChunks{0};
+};
+
+// A transfer sends record sets hottest first, a snapshot least recently used first
+void loadChunk(const ChunkIndex& chunk, const std::string& payload, AtomicStats& stats, bool hottestFirst = false)
+{
+  switch (chunk.d_kind) {
+  case ChunkKind::RecordCacheShard:
+    stats.d_recordSets += g_recCache->putRecordSets(payload, hottestFirst);
+    break;
+  case ChunkKind::NegCacheShard:
+    stats.d_negEntries += g_negCache->putEntries(payload);
+    break;
+  case ChunkKind::NSSpeeds:
+    stats.d_nsSpeeds += SyncRes::putIntoNSSpeedTable(payload);
+    break;
+  case ChunkKind::EDNSStatuses:
+    stats.d_ednsStatuses += SyncRes::putIntoEDNSStatusTable(payload);
+    break;
+  default:
+    // Written by a later version, skip
+    break;
+  }
+}
+
+void loadChunks(const std::string& path, const std::vector<ChunkIndex>& chunks, size_t first, size_t stride, AtomicStats& stats)
+{
+  auto filePtr = openSnapshot(path);
+  std::string payload;
+  for (size_t index = first; index < chunks.size(); index += stride) {
+    const auto& chunk = chunks.at(index);
+    try {
+      payload.resize(chunk.d_length);
+      if (seek64(filePtr.get(), chunk.d_offset, SEEK_SET) != 0 || fread(payload.data(), 1, payload.size(), filePtr.get()) != payload.size()) {
+        throw std::runtime_error("Truncated cache snapshot chunk");
+      }
+      loadChunk(chunk, payload, stats);
+    }
+    catch (const std::exception&) {
+      ++stats.d_failedChunks;
+    }
+  }
+}
+}
+
+// The cache transfer stream uses the snapshot format: the magic, then chunks, then an End chunk.
+// It starts with the small server tables, then sends the record cache in rounds, taking the
+// next s_transferRoundSize most recently used record sets of every shard in each round, so the
+// hottest entries of the whole cache come first and a shard is never locked for long. Each round
+// continues from the first record set the previous one did not send. Entries used while the
+// transfer is running move within a shard, so a few may be sent twice or not at all, which does
+// not matter for warming up a cache. A shard stops once it sent as many record sets as it held
+// when the transfer started, or when the record set to continue from was removed.
+constexpr size_t s_transferRoundSize = 256;
+constexpr int s_transferIOTimeout = 10;
+
+// Set by stopCacheTransferServer(), checked by the server thread every second and between chunks.
+// The thread is detached, so an exit() without stopping it first does not terminate the process;
+// s_transferServerDone becomes ready when it has returned.
+std::atomic<bool> s_transferServerStop{false};
+std::future<void> s_transferServerDone;
+
+bool wouldBlock()
+{
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+void sendAll(int fileDesc, const void* data, size_t length)
+{
+  size_t pos = 0;
+  while (pos < length) {
+    auto res = send(fileDesc, static_cast<const char*>(data) + pos, length - pos, 0);
+    if (res > 0) {
+      pos += static_cast<size_t>(res);
+      continue;
+    }
+    if (res < 0 && wouldBlock() && waitForRWData(fileDesc, false, s_transferIOTimeout, 0) > 0) {
+      continue;
+    }
+    throw std::runtime_error("error or timeout while sending cache transfer");
+  }
+}
+
+void recvAll(int fileDesc, void* data, size_t length)
+{
+  size_t pos = 0;
+  while (pos < length) {
+    auto res = recv(fileDesc, static_cast<char*>(data) + pos, length - pos, 0);
+    if (res > 0) {
+      pos += static_cast<size_t>(res);
+      continue;
+    }
+    if (res < 0 && wouldBlock() && waitForData(fileDesc, s_transferIOTimeout, 0) > 0) {
+      continue;
+    }
+    throw std::runtime_error(res == 0 ? "cache transfer closed early" : "error or timeout while receiving cache transfer");
+  }
+}
+
+// Sends chunks, sleeping as needed to stay below maxBytesPerSecond (0 means unlimited)
+class TransferSender
+{
+public:
+  TransferSender(int fileDesc, size_t maxBytesPerSecond) :
+    d_start(std::chrono::steady_clock::now()), d_maxBytesPerSecond(maxBytesPerSecond), d_fileDesc(fileDesc)
+  {
+    sendAll(d_fileDesc, s_magic.data(), s_magic.size());
+  }
+
+  void send(ChunkKind kind, const std::string& payload)
+  {
+    if (s_transferServerStop) {
+      throw std::runtime_error("cache transfer server is stopping");
+    }
+    const auto header = makeChunkHeader(kind, payload);
+    sendAll(d_fileDesc, header.data(), header.size());
+    sendAll(d_fileDesc, payload.data(), payload.size());
+    d_bytes += header.size() + payload.size();
+    if (d_maxBytesPerSecond > 0) {
+      std::this_thread::sleep_until(d_start + std::chrono::microseconds(d_bytes * 1000000 / d_maxBytesPerSecond));
+    }
+  }
+
+  [[nodiscard]] uint64_t getBytes() const
+  {
+    return d_bytes;
+  }
+
+private:
+  std::chrono::steady_clock::time_point d_start;
+  uint64_t d_bytes{0};
+  size_t d_maxBytesPerSecond;
+  int d_fileDesc;
+};
+
+rec::CacheSnapshotStats sendCacheTransfer(int fileDesc, size_t maxBytesPerSecond)
+{
+  rec::CacheSnapshotStats stats;
+  TransferSender sender(fileDesc, maxBytesPerSecond);
+  std::string payload;
+  stats.d_nsSpeeds = SyncRes::getNSSpeedTable(0, payload);
+  sender.send(ChunkKind::NSSpeeds, payload);
+  payload.clear();
+  stats.d_ednsStatuses = SyncRes::getEDNSStatusTable(payload);
+  sender.send(ChunkKind::EDNSStatuses, payload);
+
+  struct ShardProgress
+  {
+    boost::optional<MemRecursorCache::RecordSetKey> d_resumeAt;
+    size_t d_budget;
+    bool d_done{false};
+  };
+  std::vector<ShardProgress> shards;
+  shards.reserve(g_recCache->getShardsCount());
+  for (size_t shard = 0; shard < g_recCache->getShardsCount(); ++shard) {
+    shards.push_back({boost::none, g_recCache->getShardSize(shard)});
+  }
+  for (size_t remaining = shards.size(); remaining > 0;) {
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+      auto& progress = shards.at(shard);
+      if (progress.d_done) {
+        continue;
+      }
+      payload.clear();
+      auto count = g_recCache->getShardRecordSets(shard, payload, true, &progress.d_resumeAt, std::min(s_transferRoundSize, progress.d_budget));
+      progress.d_budget -= count;
+      if (!progress.d_resumeAt || progress.d_budget == 0) {
+        progress.d_done = true;
+        --remaining;
+      }
+      if (count > 0) {
+        sender.send(ChunkKind::RecordCacheShard, payload);
+        stats.d_recordSets += count;
+      }
+    }
+  }
+  for (size_t shard = 0; shard < g_negCache->getShardsCount(); ++shard) {
+    payload.clear();
+    stats.d_negEntries += g_negCache->getShardEntries(shard, payload);
+    sender.send(ChunkKind::NegCacheShard, payload);
+  }
+  sender.send(ChunkKind::End, {});
+  return stats;
+}
+
+void cacheTransferServerThread(int listenFD, size_t maxBytesPerSecond, Logr::log_t log, std::promise<void> done)
+{
+  setThreadName("rec/cachexfer");
+  while (!s_transferServerStop) {
+    if (waitForData(listenFD, 1, 0) <= 0) {
+      continue;
+    }
+    int fileDesc = accept(listenFD, nullptr, nullptr);
+    if (fileDesc < 0) {
+      continue;
+    }
+    try {
+      setNonBlocking(fileDesc);
+      const auto start = std::chrono::steady_clock::now();
+      const auto stats = sendCacheTransfer(fileDesc, maxBytesPerSecond);
+      const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+      log->info(Logr::Notice, "Sent cache transfer", "recordSets", Logging::Loggable(stats.d_recordSets), "negEntries", Logging::Loggable(stats.d_negEntries), "msec", Logging::Loggable(msec));
+    }
+    catch (const std::exception& e) {
+      log->error(Logr::Warning, e.what(), "Error while sending cache transfer");
+    }
+    catch (const PDNSException& e) {
+      log->error(Logr::Warning, e.reason, "Error while sending cache transfer");
+    }
+    closesocket(fileDesc);
+  }
+  closesocket(listenFD);
+  done.set_value();
+}
+
+rec::CacheSnapshotStats rec::saveCacheSnapshot(const std::string& path)
+{
+  const std::string tmpPath = path + ".tmp";
+  CacheSnapshotStats stats;
+  {
+    auto filePtr = pdns::UniqueFilePtr(fopen(tmpPath.c_str(), "wb"));
+    if (!filePtr) {
+      throw std::runtime_error("Unable to create cache snapshot " + tmpPath + ": " + stringerror());
+    }
+    writeOrThrow(filePtr.get(), s_magic.data(), s_magic.size());
+
+    // A single buffer, reused for every chunk
+    std::string payload;
+    for (size_t shard = 0; shard < g_recCache->getShardsCount(); ++shard) {
+      payload.clear();
+      stats.d_recordSets += g_recCache->getShardRecordSets(shard, payload);
+      writeChunk(filePtr.get(), ChunkKind::RecordCacheShard, payload);
+    }
+    for (size_t shard = 0; shard < g_negCache->getShardsCount(); ++shard) {
+      payload.clear();
+      stats.d_negEntries += g_negCache->getShardEntries(shard, payload);
+      writeChunk(filePtr.get(), ChunkKind::NegCacheShard, payload);
+    }
+    payload.clear();
+    stats.d_nsSpeeds = SyncRes::getNSSpeedTable(0, payload);
+    writeChunk(filePtr.get(), ChunkKind::NSSpeeds, payload);
+    payload.clear();
+    stats.d_ednsStatuses = SyncRes::getEDNSStatusTable(payload);
+    writeChunk(filePtr.get(), ChunkKind::EDNSStatuses, payload);
+    writeChunk(filePtr.get(), ChunkKind::End, {});
+
+    if (fflush(filePtr.get()) != 0) {
+      throw std::runtime_error("Error writing cache snapshot: " + stringerror());
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, path, error);
+  if (error) {
+    throw std::runtime_error("Unable to rename cache snapshot " + tmpPath + " to " + path + ": " + error.message());
+  }
+  return stats;
+}
+
+rec::CacheSnapshotStats rec::loadCacheSnapshot(const std::string& path, size_t threads)
+{
+  const auto chunks = indexSnapshot(path);
+  threads = std::max(static_cast<size_t>(1), std::min(threads, chunks.size()));
+
+  AtomicStats stats;
+  auto loader = [&path, &chunks, threads, &stats](size_t first) {
+    try {
+      loadChunks(path, chunks, first, threads, stats);
+    }
+    catch (const std::exception&) {
+      // Could not even open the file, count it as a single failure
+      ++stats.d_failedChunks;
+    }
+  };
+  std::vector<std::thread> loaders;
+  loaders.reserve(threads - 1);
+  for (size_t first = 1; first < threads; ++first) {
+    loaders.emplace_back([&loader, first]() {
+      setThreadName("rec/snapload");
+      loader(first);
+    });
+  }
+  loader(0);
+  for (auto& thread : loaders) {
+    thread.join();
+  }
+  return {stats.d_recordSets, stats.d_negEntries, stats.d_nsSpeeds, stats.d_ednsStatuses, stats.d_failedChunks};
+}
+
+void rec::startCacheTransferServer(const std::string& path, mode_t mode, size_t maxBytesPerSecond, Logr::log_t log)
+{
+  if (s_transferServerDone.valid()) {
+    throw std::runtime_error("The cache transfer server is already running");
+  }
+  struct sockaddr_un local{};
+  if (makeUNsockaddr(path, &local) != 0) {
+    throw std::runtime_error("Unable to use '" + path + "', it is not a valid UNIX socket path");
+  }
+  // A previous instance may still be running, it keeps its socket but this path is ours now
+  unlink(path.c_str());
+  int listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFD < 0) {
+    throw std::runtime_error("Unable to create cache transfer socket: " + stringerror());
+  }
+  // The socket hands out the cache contents, never let it exist with the permissions of the umask
+  const auto oldMask = umask(0077);
+  const bool bound = bind(listenFD, reinterpret_cast<struct sockaddr*>(&local), sizeof(local)) == 0; // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): it's the API
+  auto err = errno;
+  umask(oldMask);
+  if (bound && chmod(path.c_str(), mode) != 0) {
+    err = errno;
+    closesocket(listenFD);
+    throw std::runtime_error("Unable to chmod cache transfer socket " + path + ": " + stringerror(err));
+  }
+  if (!bound || listen(listenFD, 2) < 0) {
+    err = bound ? errno : err;
+    closesocket(listenFD);
+    throw std::runtime_error("Unable to listen on cache transfer socket " + path + ": " + stringerror(err));
+  }
+  setNonBlocking(listenFD);
+  s_transferServerStop = false;
+  std::promise<void> done;
+  s_transferServerDone = done.get_future();
+  std::thread thread(cacheTransferServerThread, listenFD, maxBytesPerSecond, log, std::move(done));
+  thread.detach();
+  log->info(Logr::Info, "Serving cache transfers", "path", Logging::Loggable(path));
+}
+
+void rec::stopCacheTransferServer()
+{
+  if (!s_transferServerDone.valid()) {
+    return;
+  }
+  s_transferServerStop = true;
+  s_transferServerDone.get();
+}
+
+rec::CacheSnapshotStats rec::pullCacheTransfer(const std::string& path)
+{
+  struct sockaddr_un remote{};
+  if (makeUNsockaddr(path, &remote) != 0) {
+    throw std::runtime_error("Unable to use '" + path + "', it is not a valid UNIX socket path");
+  }
+  int fileDesc = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fileDesc < 0) {
+    throw std::runtime_error("Unable to create cache transfer socket: " + stringerror());
+  }
+  AtomicStats stats;
+  try {
+    if (connect(fileDesc, reinterpret_cast<struct sockaddr*>(&remote), sizeof(remote)) < 0) { // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast): it's the API
+      throw std::runtime_error("Unable to connect to cache transfer socket " + path + ": " + stringerror());
+    }
+    setNonBlocking(fileDesc);
+    std::array<char, s_magic.size()> magic{};
+    recvAll(fileDesc, magic.data(), magic.size());
+    if (magic != s_magic) {
+      throw std::runtime_error("Not a cache transfer: " + path);
+    }
+    std::string payload;
+    while (true) {
+      ChunkHeader header{};
+      recvAll(fileDesc, header.data(), header.size());
+      ChunkIndex chunk{static_cast<ChunkKind>(header[0]), 0, getChunkLength(header)};
+      if (chunk.d_kind == ChunkKind::End) {
+        break;
+      }
+      payload.resize(chunk.d_length);
+      recvAll(fileDesc, payload.data(), payload.size());
+      try {
+        loadChunk(chunk, payload, stats, true);
+      }
+      catch (const std::exception&) {
+        ++stats.d_failedChunks;
+      }
+    }
+  }
+  catch (...) {
+    closesocket(fileDesc);
+    throw;
+  }
+  closesocket(fileDesc);
+  return {stats.d_recordSets, stats.d_negEntries, stats.d_nsSpeeds, stats.d_ednsStatuses, stats.d_failedChunks};
+}
+
+// Two-process cache transfer benchmark, built as timing_cache_transfer with -DBUILD_TIMING_TESTS=ON.
+// Run: timing_cache_transfer serve socketpath recordsets bytespersecond
+// and, once it is serving, in another shell: timing_cache_transfer pull socketpath
+// The serving side keeps doing cache lookups and reports their rate and worst latency every
+// second, so the effect of a transfer on it can be compared with the idle seconds.
+
+#if TEST_CACHE_TRANSFER_TIMING
+
+#include <iostream>
+
+#include "dnsrecords.hh"
+
+static void fillCache(size_t recordSets)
+{
+  const time_t now = time(nullptr);
+  for (size_t i = 0; i < recordSets; i++) {
+    DNSName name("host" + std::to_string(i) + ".example.");
+    DNSRecord record;
+    record.d_name = name;
+    record.d_type = QType::A;
+    record.d_ttl = now + 3600;
+    record.d_place = DNSResourceRecord::ANSWER;
+    record.setContent(DNSRecordContent::make(QType::A, QClass::IN, "192.0.2." + std::to_string(i % 250)));
+    g_recCache->replace(now, name, QType(QType::A), {record}, {}, {}, true, DNSName("example."), boost::none, boost::none, vState::Indeterminate, ComboAddress("192.0.2.53:53"));
+  }
+}
+
+static void serve(const std::string& path, size_t recordSets, size_t maxBytesPerSecond)
+{
+  fillCache(recordSets);
+  rec::startCacheTransferServer(path, 0600, maxBytesPerSecond, g_slog->withName("cachexfer"));
+  std::cerr << "serving " << g_recCache->size() << " record sets on " << path << std::endl;
+  const ComboAddress who("127.0.0.1");
+  for (size_t i = 0;; i = (i + 7919) % recordSets) {
+    const auto second = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    uint64_t lookups = 0;
+    std::chrono::nanoseconds worst{0};
+    while (std::chrono::steady_clock::now() < second) {
+      const auto start = std::chrono::steady_clock::now();
+      vector<DNSRecord> result;
+      g_recCache->get(time(nullptr), DNSName("host" + std::to_string((i + lookups) % recordSets) + ".example."), QType(QType::A), MemRecursorCache::None, &result, who);
+      worst = std::max(worst, std::chrono::steady_clock::now() - start);
+      ++lookups;
+    }
+    std::cerr << "lookups/s " << lookups << " worst-us " << std::chrono::duration_cast<std::chrono::microseconds>(worst).count() << std::endl;
+  }
+}
+
+static void pull(const std::string& path)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const auto stats = rec::pullCacheTransfer(path);
+  const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << "pulled " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries, " << stats.d_failedChunks << " failed chunks in "
+            << elapsed << "s, " << stats.d_recordSets / elapsed << " record sets/s" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  reportAllTypes();
+  g_slog = Logging::Logger::create([](const Logging::Entry& entry) {
+    if (entry.error) {
+      std::cerr << entry.message << ": " << entry.error.get() << std::endl;
+    }
+  });
+  g_slogout = g_slog->withName("out");
+  g_recCache = std::make_unique<MemRecursorCache>(1024);
+  g_negCache = std::make_unique<NegCache>(128);
+  if (argc == 5 && std::string(argv[1]) == "serve") {
+    serve(argv[2], std::stoul(argv[3]), std::stoul(argv[4]));
+  }
+  else if (argc == 3 && std::string(argv[1]) == "pull") {
+    pull(argv[2]);
+  }
+  else {
+    std::cerr << "usage: " << argv[0] << " serve socketpath recordsets bytespersecond | pull socketpath" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+#endif
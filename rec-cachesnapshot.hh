@@ -0,0 +1,68 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+
+#include "logging.hh"
+
+namespace rec
+{
+struct CacheSnapshotStats
+{
+  size_t d_recordSets{0};
+  size_t d_negEntries{0};
+  size_t d_nsSpeeds{0};
+  size_t d_ednsStatuses{0};
+  size_t d_failedChunks{0};
+};
+
+// Write the record cache, negative cache, NS speeds and EDNS status tables to path. The file
+// is a sequence of length-prefixed protobuf chunks, one per cache shard, so only one shard is
+// locked and held in memory at a time. It is written next to path and renamed over it when
+// complete, a reader never sees a partial snapshot. Throws a std::runtime_error on I/O errors.
+CacheSnapshotStats saveCacheSnapshot(const std::string& path);
+
+// Load a snapshot written by saveCacheSnapshot(), spreading the chunks over the given number
+// of threads. The shard count may differ from the one at save time. Expiry times are absolute,
+// so the time the recursor was down is accounted for and entries that went stale are skipped.
+// Throws a std::runtime_error if the file is not a complete snapshot; a chunk that fails to
+// decode is counted in d_failedChunks and skipped.
+CacheSnapshotStats loadCacheSnapshot(const std::string& path, size_t threads);
+
+// Serve the hot working set to a new instance over a UNIX socket, for rolling restarts. One
+// connection at a time, hottest record sets first, sent at most maxBytesPerSecond (0 means
+// unlimited) so the serving threads of this instance do not notice the transfer. The socket is
+// created with the given mode. Throws a std::runtime_error if the socket cannot be set up.
+void startCacheTransferServer(const std::string& path, mode_t mode, size_t maxBytesPerSecond, Logr::log_t log);
+
+// Stop the server thread, within a second, aborting a running transfer. The socket file is left
+// in place: during a rolling restart it may already belong to the new instance.
+void stopCacheTransferServer();
+
+// Pull and load a transfer from an instance running startCacheTransferServer(). The record sets
+// are put at the least recently used end of the cache, in an order that evicts the coldest first.
+// Throws a std::runtime_error if the other instance cannot be reached or the stream breaks off;
+// whatever was received up to that point stays in the caches.
+CacheSnapshotStats pullCacheTransfer(const std::string& path);
+}
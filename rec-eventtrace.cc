@@ -129,3 +129,155 @@ std::vector<pdns::trace::Span> RecEventTrace::convertToOT(const InitialSpanInfo&
   }
   return ret;
 }
+
+void RecEventTrace::PhaseTimes::add(EventType eventType, bool start, int64_t stamp, int64_t startStamp)
+{
+  if (start) {
+    switch (eventType) {
+    case ReqRecv:
+      if (!d_reqRecv) {
+        d_reqRecv = stamp;
+      }
+      break;
+    case AnswerSent:
+      d_answerSent = stamp;
+      break;
+    case SyncRes:
+      if (!d_firstSyncRes) {
+        d_firstSyncRes = stamp;
+      }
+      break;
+    default:
+      break;
+    }
+    return;
+  }
+
+  const auto duration = std::max(stamp - startStamp, static_cast<int64_t>(0));
+  switch (eventType) {
+  case PCacheCheck:
+    d_pcacheDone = stamp;
+    break;
+  case SyncRes:
+    d_syncRes += duration;
+    d_lastSyncRes = stamp;
+    break;
+  case AuthRequest:
+    d_authRequests += duration;
+    break;
+  case LuaGetTag:
+  case LuaGetTagFFI:
+  case LuaIPFilter:
+  case LuaPreRPZ:
+  case LuaPreResolve:
+  case LuaPreOutQuery:
+  case LuaPostResolve:
+  case LuaNoData:
+  case LuaNXDomain:
+  case LuaPostResolveFFI:
+    d_lua += duration;
+    break;
+  default:
+    break;
+  }
+}
+
+RecEventTrace::PhaseDurations RecEventTrace::PhaseTimes::getDurations() const
+{
+  PhaseDurations ret;
+  ret.syncRes = d_syncRes / 1000;
+  ret.authRequests = d_authRequests / 1000;
+  ret.lua = d_lua / 1000;
+
+  const auto ingressDone = d_pcacheDone ? d_pcacheDone : d_firstSyncRes;
+  if (d_reqRecv && ingressDone && *ingressDone >= *d_reqRecv) {
+    ret.ingress = (*ingressDone - *d_reqRecv) / 1000;
+  }
+  const auto workDone = d_lastSyncRes ? d_lastSyncRes : d_pcacheDone;
+  if (d_answerSent && workDone && *d_answerSent >= *workDone) {
+    ret.egress = (*d_answerSent - *workDone) / 1000;
+  }
+  return ret;
+}
+
+RecEventTrace::PhaseDurations RecEventTrace::getPhaseDurations() const
+{
+  if (d_status == PhasesOnly) {
+    return d_phaseTimes.getDurations();
+  }
+
+  PhaseTimes times;
+  for (const auto& event : d_events) {
+    if (event.d_start) {
+      times.add(event.d_event, true, event.d_ts, event.d_ts);
+    }
+    else if (event.d_matching < d_events.size()) {
+      times.add(event.d_event, false, event.d_ts, d_events.at(event.d_matching).d_ts);
+    }
+  }
+  return times.getDurations();
+}
+
+#if TEST_EVENT_TRACE_TIMING
+
+#include <iostream>
+
+static double elapsedSince(const timeval& start)
+{
+  timeval stop{};
+  gettimeofday(&stop, nullptr);
+  timeval diff{};
+  timersub(&stop, &start, &diff);
+  return static_cast<double>(diff.tv_sec) + static_cast<double>(diff.tv_usec) / 1e6;
+}
+
+// The events of a query missing the packet cache and sending three requests to auths
+static uint64_t traceQuery(RecEventTrace& eventTrace, bool phasesOnly)
+{
+  eventTrace.clear();
+  if (phasesOnly) {
+    eventTrace.setPhasesOnly();
+  }
+  else {
+    eventTrace.setEnabled(true);
+  }
+  eventTrace.add(RecEventTrace::ReqRecv);
+  auto match = eventTrace.add(RecEventTrace::PCacheCheck);
+  eventTrace.add(RecEventTrace::PCacheCheck, false, false, match);
+  {
+    auto newParent = eventTrace.add(RecEventTrace::SyncRes);
+    auto oldParent = eventTrace.setParent(newParent);
+    RecEventTrace::EventScope traceScope(oldParent, eventTrace);
+    for (int auth = 0; auth < 3; auth++) {
+      match = eventTrace.add(RecEventTrace::AuthRequest, std::string("www.example.com/A"), true, 0);
+      eventTrace.add(RecEventTrace::AuthRequest, static_cast<int64_t>(0), false, match);
+    }
+    traceScope.close(0);
+  }
+  eventTrace.add(RecEventTrace::AnswerSent);
+  const auto phases = eventTrace.getPhaseDurations();
+  return phases.syncRes + phases.authRequests + phases.ingress.value_or(0) + phases.egress.value_or(0);
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " queries" << std::endl;
+    return 1;
+  }
+  const size_t queries = std::atoi(argv[1]);
+
+  for (bool phasesOnly : {false, true}) {
+    RecEventTrace eventTrace;
+    uint64_t sum = 0;
+    timeval start{};
+    gettimeofday(&start, nullptr);
+    for (size_t idx = 0; idx < queries; idx++) {
+      sum += traceQuery(eventTrace, phasesOnly);
+    }
+    auto elapsed = elapsedSince(start);
+    std::cout << (phasesOnly ? "Phases only" : "Full trace") << ": " << elapsed * 1e9 / static_cast<double>(queries) << "ns per query, " << sum << "us of phases in total" << std::endl;
+  }
+}
+
+#endif
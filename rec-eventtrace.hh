@@ -25,6 +25,7 @@
 #include "noinitvector.hh"
 
 #include <optional>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 #include "protozero-trace.hh"
@@ -67,7 +68,10 @@ public:
 
   RecEventTrace(const RecEventTrace& old) :
     d_events(old.d_events),
+    d_phaseStarts(old.d_phaseStarts),
+    d_phaseTimes(old.d_phaseTimes),
     d_base(old.d_base),
+    d_lastPhaseEvent(old.d_lastPhaseEvent),
     d_status(old.d_status)
   {
     // An RecEventTrace object can be copied, but the original will be marked invalid.
@@ -78,7 +82,10 @@ public:
 
   RecEventTrace(RecEventTrace&& old) noexcept :
     d_events(std::move(old.d_events)),
+    d_phaseStarts(std::move(old.d_phaseStarts)),
+    d_phaseTimes(old.d_phaseTimes),
     d_base(old.d_base),
+    d_lastPhaseEvent(old.d_lastPhaseEvent),
     d_status(old.d_status)
   {
     // An RecEventTrace object can be moved, but the original will be marked invalid.
@@ -91,7 +98,10 @@ public:
   RecEventTrace& operator=(RecEventTrace&& old) noexcept
   {
     d_events = std::move(old.d_events);
+    d_phaseStarts = std::move(old.d_phaseStarts);
+    d_phaseTimes = old.d_phaseTimes;
     d_base = old.d_base;
+    d_lastPhaseEvent = old.d_lastPhaseEvent;
     d_status = old.d_status;
     old.d_status = Invalid;
     return *this;
@@ -172,6 +182,19 @@ public:
     return d_status == Enabled;
   }
 
+  // Only keep what getPhaseDurations() needs: no event list, no values. Used when the
+  // trace only feeds the phase histograms, so they do not cost a full trace per query.
+  void setPhasesOnly()
+  {
+    assert(d_status != Invalid);
+    d_status = PhasesOnly;
+  }
+
+  bool recordsPhases() const
+  {
+    return d_status == Enabled || d_status == PhasesOnly;
+  }
+
   template <class E>
   size_t add(E event, Value_t&& value, bool start, size_t match, int64_t stamp = 0)
   {
@@ -185,6 +208,13 @@ public:
       clock_gettime(CLOCK_MONOTONIC, &theTime);
       stamp = theTime.tv_nsec + theTime.tv_sec * 1000000000;
     }
+    if (d_status == PhasesOnly) {
+      // only differences between stamps matter here, no need to rebase them
+      if constexpr (std::is_same_v<E, EventType>) {
+        return addPhase(event, start, match, stamp);
+      }
+      return 0;
+    }
     if (stamp < d_base) {
       // If we get a ts before d_base, we adjust d_base and the existing events
       // This is possble if we add a kernel provided packet timestamp in the future
@@ -229,6 +259,8 @@ public:
   void clear()
   {
     d_events.clear();
+    d_phaseStarts.clear();
+    d_phaseTimes = PhaseTimes();
     reset();
   }
 
@@ -268,6 +300,21 @@ public:
 
   std::vector<pdns::trace::Span> convertToOT(const pdns::trace::InitialSpanInfo& span) const;
 
+  // Time spent in the main phases of handling a query, in microseconds. Ingress is the time from
+  // receiving the request to the end of the packet cache check (or the start of SyncRes if there is no
+  // packet cache check), egress the time from the end of the last lookup to sending the answer.
+  // Both are unset if the trace lacks the events to compute them.
+  struct PhaseDurations
+  {
+    std::optional<uint64_t> ingress;
+    uint64_t syncRes{0};
+    uint64_t authRequests{0};
+    uint64_t lua{0};
+    std::optional<uint64_t> egress;
+  };
+
+  [[nodiscard]] PhaseDurations getPhaseDurations() const;
+
   size_t setParent(size_t parent)
   {
     size_t old = d_parent;
@@ -289,12 +336,16 @@ public:
         d_event = d_eventTrace.d_events.back().d_event;
         d_match = d_eventTrace.d_events.size() - 1;
       }
+      else if (d_eventTrace.d_status == PhasesOnly && !d_eventTrace.d_phaseStarts.empty()) {
+        d_event = d_eventTrace.d_lastPhaseEvent;
+        d_match = d_eventTrace.d_phaseStarts.size() - 1;
+      }
     }
 
     // Only int64_t for now needed, might become a template in the future.
     void close(int64_t val)
     {
-      if (!d_eventTrace.enabled() || d_closed) {
+      if (!d_eventTrace.recordsPhases() || d_closed) {
         return;
       }
       d_eventTrace.setParent(d_oldParent);
@@ -322,14 +373,52 @@ public:
   };
 
 private:
+  // The timestamps getPhaseDurations() works from, fed from d_events or, when only the phases
+  // are recorded, as the events are added
+  class PhaseTimes
+  {
+  public:
+    void add(EventType eventType, bool start, int64_t stamp, int64_t startStamp);
+    [[nodiscard]] PhaseDurations getDurations() const;
+
+  private:
+    std::optional<int64_t> d_reqRecv;
+    std::optional<int64_t> d_pcacheDone;
+    std::optional<int64_t> d_firstSyncRes;
+    std::optional<int64_t> d_lastSyncRes;
+    std::optional<int64_t> d_answerSent;
+    int64_t d_syncRes{0};
+    int64_t d_authRequests{0};
+    int64_t d_lua{0};
+  };
+
+  size_t addPhase(EventType eventType, bool start, size_t match, int64_t stamp)
+  {
+    if (start) {
+      d_phaseTimes.add(eventType, true, stamp, stamp);
+      d_phaseStarts.push_back(stamp);
+      d_lastPhaseEvent = eventType;
+      return d_phaseStarts.size() - 1;
+    }
+    if (match < d_phaseStarts.size()) {
+      d_phaseTimes.add(eventType, false, stamp, d_phaseStarts[match]);
+    }
+    return 0;
+  }
+
   std::vector<Entry> d_events;
+  // start stamps of the events when only the phases are recorded, indexed like d_events would be
+  std::vector<int64_t> d_phaseStarts;
+  PhaseTimes d_phaseTimes;
   int64_t d_base{0};
   size_t d_parent{0};
+  EventType d_lastPhaseEvent{CustomEvent};
   enum Status : uint8_t
   {
     Disabled,
     Invalid,
-    Enabled
+    Enabled,
+    PhasesOnly
   };
   mutable Status d_status{Disabled};
 };
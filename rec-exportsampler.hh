@@ -0,0 +1,119 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <unordered_map>
+
+#include "dns.hh"
+#include "iputils.hh"
+
+//! Decides whether a client query and its response are exported over protobuf (and dnstap).
+/** The decision is taken once per query, before anything is serialized, in three steps:
+    - 1 in sampleRate queries is picked, based on a hash of the question and the query id, so the choice for a
+      given transaction is the same wherever it is taken;
+    - a picked query is still skipped if its client subnet already exported maxPerSubnetPerSecond queries in the
+      current second;
+    - a query that is not exported is Deferred instead of Dropped if a keep rule is configured: once the answer is
+      known, keep() says whether it is interesting enough (SERVFAIL, policy hit, slow) to export the response anyway.
+    The subnet counters live in a per thread instance, so the cap applies per worker thread. */
+class ExportSampler
+{
+public:
+  enum class Verdict : uint8_t
+  {
+    Export,
+    Deferred,
+    Drop
+  };
+
+  struct Config
+  {
+    uint32_t sampleRate{1}; // 1 exports everything
+    uint32_t maxPerSubnetPerSecond{0}; // 0 is unlimited
+    uint8_t v4Bits{24};
+    uint8_t v6Bits{56};
+    uint64_t slowAnswerUsec{0}; // 0 disables the slow answer rule
+    bool keepServFail{false};
+    bool keepPolicyHits{false};
+
+    [[nodiscard]] bool hasKeepRules() const
+    {
+      return keepServFail || keepPolicyHits || slowAnswerUsec > 0;
+    }
+    [[nodiscard]] bool exportsAll() const
+    {
+      return sampleRate <= 1 && maxPerSubnetPerSecond == 0;
+    }
+  };
+
+  static Config s_config;
+
+  Verdict decide(uint32_t qhash, const ComboAddress& client, time_t now)
+  {
+    if (s_config.exportsAll()) {
+      return Verdict::Export;
+    }
+    if ((s_config.sampleRate <= 1 || qhash % s_config.sampleRate == 0) && withinSubnetCap(client, now)) {
+      return Verdict::Export;
+    }
+    return s_config.hasKeepRules() ? Verdict::Deferred : Verdict::Drop;
+  }
+
+  //! Whether the response of a Deferred query should be exported after all
+  static bool keep(int rcode, bool policyHit, uint64_t spentUsec)
+  {
+    return (s_config.keepServFail && rcode == RCode::ServFail) || (s_config.keepPolicyHits && policyHit) || (s_config.slowAnswerUsec > 0 && spentUsec >= s_config.slowAnswerUsec);
+  }
+
+private:
+  bool withinSubnetCap(const ComboAddress& client, time_t now)
+  {
+    if (s_config.maxPerSubnetPerSecond == 0) {
+      return true;
+    }
+    if (now != d_second) {
+      d_counts.clear();
+      d_second = now;
+    }
+    ComboAddress subnet(client);
+    subnet.truncate(client.isIPv4() ? s_config.v4Bits : s_config.v6Bits);
+    auto iter = d_counts.find(subnet);
+    if (iter == d_counts.end()) {
+      // Bound the memory used by a flood of distinct subnets within a single second
+      if (d_counts.size() >= s_maxSubnets) {
+        return false;
+      }
+      d_counts.emplace(subnet, 1);
+      return true;
+    }
+    if (iter->second >= s_config.maxPerSubnetPerSecond) {
+      return false;
+    }
+    ++iter->second;
+    return true;
+  }
+
+  static constexpr size_t s_maxSubnets = 65536;
+
+  std::unordered_map<ComboAddress, uint32_t, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> d_counts;
+  time_t d_second{0};
+};
@@ -36,6 +36,9 @@
 #include "opensslsigners.hh"
 #include "ws-recursor.hh"
 #include "rec-taskqueue.hh"
+#include "rec-metrics.hh"
+#include "rec-cachesnapshot.hh"
+#include "rec-exportsampler.hh"
 #include "secpoll-recursor.hh"
 #include "logging.hh"
 #include "dnsseckeeper.hh"
@@ -117,6 +120,8 @@ LockGuarded<std::shared_ptr<NetmaskGroup>> g_initialAllowNotifyFrom; // new thre
 LockGuarded<std::shared_ptr<notifyset_t>> g_initialAllowNotifyFor; // new threads need this to be setup
 bool g_logRPZChanges{false};
 static time_t s_statisticsInterval;
+static std::string s_cacheSnapshotFile;
+static time_t s_cacheSnapshotInterval;
 static std::atomic<uint32_t> s_counter;
 int g_argc;
 char** g_argv;
@@ -1250,6 +1255,8 @@ static void doStats()
   auto tcpoutqueries = g_Counters.sum(rec::Counter::tcpoutqueries);
   auto dotoutqueries = g_Counters.sum(rec::Counter::dotoutqueries);
   auto outgoingtimeouts = g_Counters.sum(rec::Counter::outgoingtimeouts);
+  auto rpzPrefilterSkips = g_Counters.sum(rec::Counter::rpzPrefilterSkips);
+  auto rpzPrefilterFalsePositives = g_Counters.sum(rec::Counter::rpzPrefilterFalsePositives);
 
   auto log = g_slog->withName("stats");
 
@@ -1288,7 +1295,48 @@ static void doStats()
     log->info(Logr::Info, report,
               "taskqueue-pushed", Logging::Loggable(taskPushes),
               "taskqueue-expired", Logging::Loggable(taskExpired),
-              "taskqueue-size", Logging::Loggable(taskSize));
+              "taskqueue-size", Logging::Loggable(taskSize),
+              "refresh-queue-size", Logging::Loggable(getAlmostExpiredTasksSize()),
+              "refresh-expired", Logging::Loggable(getAlmostExpiredTasksExpired()),
+              "refresh-in-flight", Logging::Loggable(getPrefetchesInFlight()));
+    log->info(Logr::Info, report,
+              "rpz-prefilter-skips", Logging::Loggable(rpzPrefilterSkips),
+              "rpz-prefilter-false-positives", Logging::Loggable(rpzPrefilterFalsePositives),
+              "rpz-prefilter-false-positive-perc", Logging::Loggable(ratePercentage(rpzPrefilterFalsePositives, rpzPrefilterSkips + rpzPrefilterFalsePositives)));
+
+    const auto auth4Answers = g_Counters.sum(rec::LogLinearHistogram::auth4Answers);
+    log->info(Logr::Info, report,
+              "auth4-answers", Logging::Loggable(auth4Answers.getCount()),
+              "auth4-answers-p50-usec", Logging::Loggable(auth4Answers.getPercentile(50)),
+              "auth4-answers-p99-usec", Logging::Loggable(auth4Answers.getPercentile(99)),
+              "auth4-answers-p999-usec", Logging::Loggable(auth4Answers.getPercentile(99.9)));
+
+    if (SyncRes::eventTraceEnabled(SyncRes::event_trace_to_histograms)) {
+      // Average per-phase times in microseconds, the full distributions are in the phase-* histograms
+      auto phaseAverage = [](rec::Histogram index) {
+        const auto histogram = g_Counters.sum(index);
+        const auto counts = histogram.getCumulativeCounts();
+        return counts.empty() || counts.back() == 0 ? 0 : histogram.getSum() / counts.back();
+      };
+      log->info(Logr::Info, report,
+                "phase-ingress-avg-usec", Logging::Loggable(phaseAverage(rec::Histogram::phaseIngress)),
+                "phase-syncres-avg-usec", Logging::Loggable(phaseAverage(rec::Histogram::phaseSyncRes)),
+                "phase-authrequests-avg-usec", Logging::Loggable(phaseAverage(rec::Histogram::phaseAuthRequests)),
+                "phase-lua-avg-usec", Logging::Loggable(phaseAverage(rec::Histogram::phaseLua)),
+                "phase-egress-avg-usec", Logging::Loggable(phaseAverage(rec::Histogram::phaseEgress)));
+    }
+
+    const auto ecsDistribution = g_recCache->ecsIndexDistribution();
+    std::string ecsScopes;
+    for (size_t bucket = 0; bucket < ecsDistribution.size(); ++bucket) {
+      if (!ecsScopes.empty()) {
+        ecsScopes += ' ';
+      }
+      ecsScopes += (bucket == ecsDistribution.size() - 1 ? ">" + std::to_string(1U << (bucket - 1)) : "<=" + std::to_string(1U << bucket)) + ":" + std::to_string(ecsDistribution.at(bucket));
+    }
+    log->info(Logr::Info, report,
+              "record-cache-ecs-index-entries", Logging::Loggable(g_recCache->ecsIndexSize()),
+              "record-cache-ecs-scopes-per-name", Logging::Loggable(ecsScopes));
 
     size_t idx = 0;
     for (const auto& threadInfo : RecThreadInfo::infos()) {
@@ -1373,6 +1421,7 @@ static std::shared_ptr<NetmaskGroup> parseACL(const std::string& aclFile, const
     }
   }
 
+  result->compile();
   return result;
 }
 
@@ -1788,6 +1837,7 @@ static void initDontQuery(Logr::log_t log)
     for (const auto& anIP : ips) {
       SyncRes::addDontQuery(anIP);
     }
+    SyncRes::compileDontQuery();
     if (!g_slogStructured) {
       g_log << Logger::Warning << "Will not send queries to: ";
       for (auto i = ips.begin(); i != ips.end(); ++i) {
@@ -1835,6 +1885,7 @@ static int initSyncRes(Logr::log_t log)
   SyncRes::s_refresh_ttlperc = ::arg().asNum("refresh-on-ttl-perc");
   SyncRes::s_locked_ttlperc = ::arg().asNum("record-cache-locked-ttl-perc");
   RecursorPacketCache::s_refresh_ttlperc = SyncRes::s_refresh_ttlperc;
+  setMaxPrefetchesInFlight(::arg().asNum("max-concurrent-refreshes"));
   SyncRes::s_tcp_fast_open = ::arg().asNum("tcp-fast-open");
   SyncRes::s_tcp_fast_open_connect = ::arg().mustDo("tcp-fast-open-connect");
 
@@ -1842,6 +1893,11 @@ static int initSyncRes(Logr::log_t log)
   SyncRes::s_event_trace_enabled = ::arg().asNum("event-trace-enabled");
   SyncRes::s_save_parent_ns_set = ::arg().mustDo("save-parent-ns-set");
   SyncRes::s_max_busy_dot_probes = ::arg().asNum("max-busy-dot-probes");
+  SyncRes::s_staggered_auth_queries = ::arg().mustDo("staggered-auth-queries");
+  SyncRes::s_staggered_auth_min_delay_msec = ::arg().asNum("staggered-auth-min-delay-msec");
+  SyncRes::s_staggered_auth_zone_budget = ::arg().asNum("staggered-auth-zone-budget");
+  SyncRes::s_adaptive_auth_timeouts = ::arg().mustDo("adaptive-auth-timeouts");
+  SyncRes::s_auth_timeout_min_msec = ::arg().asNum("auth-timeout-min-msec");
   SyncRes::s_max_CNAMES_followed = ::arg().asNum("max-cnames-followed");
   {
     uint64_t sse = ::arg().asNum("serve-stale-extensions");
@@ -1853,8 +1909,26 @@ static int initSyncRes(Logr::log_t log)
     MemRecursorCache::s_maxServedStaleExtensions = sse;
     NegCache::s_maxServedStaleExtensions = sse;
   }
+  SyncRes::s_serve_stale_while_revalidate = ::arg().mustDo("serve-stale-while-revalidate");
   MemRecursorCache::s_maxRRSetSize = ::arg().asNum("max-rrset-size");
   MemRecursorCache::s_limitQTypeAny = ::arg().mustDo("limit-qtype-any");
+  {
+    const auto& policy = ::arg()["cache-eviction-policy"];
+    if (policy == "lru") {
+      MemRecursorCache::s_evictionPolicy = CacheEvictionPolicy::LRU;
+    }
+    else if (policy == "clock") {
+      MemRecursorCache::s_evictionPolicy = CacheEvictionPolicy::Clock;
+    }
+    else {
+      SLOG(g_log << Logger::Error << "Unknown cache-eviction-policy value: " << policy << "; expected lru or clock" << endl,
+           log->info(Logr::Error, "Unknown cache-eviction-policy value, expected lru or clock", "value", Logging::Loggable(policy)));
+      return 1;
+    }
+    NegCache::s_evictionPolicy = MemRecursorCache::s_evictionPolicy;
+  }
+  MemRecursorCache::s_maxECSScopesPerName = ::arg().asNum("ecs-cache-limit-scopes-per-name");
+  ShardLockProfile::s_enabled = ::arg().mustDo("cache-lock-profiling");
 
   if (SyncRes::s_tcp_fast_open_connect) {
     checkFastOpenSysctl(true, log);
@@ -1872,6 +1946,8 @@ static int initSyncRes(Logr::log_t log)
   SyncRes::s_qnameminimization = ::arg().mustDo("qname-minimization");
   SyncRes::s_minimize_one_label = ::arg().asNum("qname-minimize-one-label");
   SyncRes::s_max_minimize_count = ::arg().asNum("qname-max-minimize-count");
+  SyncRes::s_zonecutcachettl = ::arg().asNum("qname-minimize-zone-cut-cache-ttl");
+  SyncRes::setZoneCutCacheSize(::arg().asNum("qname-minimize-zone-cut-cache-size"));
 
   SyncRes::s_hardenNXD = SyncRes::HardenNXD::DNSSEC;
   string value = ::arg()["nothing-below-nxdomain"];
@@ -1920,6 +1996,66 @@ static int initSyncRes(Logr::log_t log)
   return 0;
 }
 
+static void saveCacheSnapshot(Logr::log_t log)
+{
+  try {
+    const auto start = std::chrono::steady_clock::now();
+    const auto stats = rec::saveCacheSnapshot(s_cacheSnapshotFile);
+    const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SLOG(g_log << Logger::Info << "Saved cache snapshot to " << s_cacheSnapshotFile << ": " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries in " << msec << "ms" << endl,
+         log->info(Logr::Info, "Saved cache snapshot", "file", Logging::Loggable(s_cacheSnapshotFile), "recordSets", Logging::Loggable(stats.d_recordSets), "negEntries", Logging::Loggable(stats.d_negEntries),
+                   "nsSpeeds", Logging::Loggable(stats.d_nsSpeeds), "ednsStatuses", Logging::Loggable(stats.d_ednsStatuses), "msec", Logging::Loggable(msec)));
+  }
+  catch (const std::exception& e) {
+    SLOG(g_log << Logger::Error << "Unable to save cache snapshot to " << s_cacheSnapshotFile << ": " << e.what() << endl,
+         log->error(Logr::Error, e.what(), "Unable to save cache snapshot", "file", Logging::Loggable(s_cacheSnapshotFile)));
+  }
+}
+
+// Runs before the listening sockets are created, so the first queries already see a warm cache
+static void loadCacheSnapshot(Logr::log_t log)
+{
+  s_cacheSnapshotFile = ::arg()["cache-snapshot-file"];
+  s_cacheSnapshotInterval = ::arg().asNum("cache-snapshot-interval");
+  if (s_cacheSnapshotFile.empty() || !::arg().mustDo("cache-snapshot-load")) {
+    return;
+  }
+  try {
+    const auto start = std::chrono::steady_clock::now();
+    const auto stats = rec::loadCacheSnapshot(s_cacheSnapshotFile, std::max(1U, std::thread::hardware_concurrency()));
+    const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SLOG(g_log << Logger::Notice << "Loaded cache snapshot from " << s_cacheSnapshotFile << ": " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries, " << stats.d_failedChunks << " failed chunks in " << msec << "ms" << endl,
+         log->info(Logr::Notice, "Loaded cache snapshot", "file", Logging::Loggable(s_cacheSnapshotFile), "recordSets", Logging::Loggable(stats.d_recordSets), "negEntries", Logging::Loggable(stats.d_negEntries),
+                   "nsSpeeds", Logging::Loggable(stats.d_nsSpeeds), "ednsStatuses", Logging::Loggable(stats.d_ednsStatuses), "failedChunks", Logging::Loggable(stats.d_failedChunks), "msec", Logging::Loggable(msec)));
+  }
+  catch (const std::exception& e) {
+    // A missing or damaged snapshot means a cold start, not a failure
+    SLOG(g_log << Logger::Warning << "Not loading cache snapshot from " << s_cacheSnapshotFile << ": " << e.what() << endl,
+         log->error(Logr::Warning, e.what(), "Not loading cache snapshot", "file", Logging::Loggable(s_cacheSnapshotFile)));
+  }
+}
+
+// Pull the working set of the instance we are replacing, which is fresher than any snapshot
+static void pullCacheTransfer(Logr::log_t log)
+{
+  const auto& path = ::arg()["cache-transfer-pull"];
+  if (path.empty()) {
+    return;
+  }
+  try {
+    const auto start = std::chrono::steady_clock::now();
+    const auto stats = rec::pullCacheTransfer(path);
+    const auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SLOG(g_log << Logger::Notice << "Pulled cache transfer from " << path << ": " << stats.d_recordSets << " record sets, " << stats.d_negEntries << " negative entries, " << stats.d_failedChunks << " failed chunks in " << msec << "ms" << endl,
+         log->info(Logr::Notice, "Pulled cache transfer", "path", Logging::Loggable(path), "recordSets", Logging::Loggable(stats.d_recordSets), "negEntries", Logging::Loggable(stats.d_negEntries),
+                   "nsSpeeds", Logging::Loggable(stats.d_nsSpeeds), "ednsStatuses", Logging::Loggable(stats.d_ednsStatuses), "failedChunks", Logging::Loggable(stats.d_failedChunks), "msec", Logging::Loggable(msec)));
+  }
+  catch (const std::exception& e) {
+    SLOG(g_log << Logger::Warning << "Unable to pull cache transfer from " << path << ": " << e.what() << endl,
+         log->error(Logr::Warning, e.what(), "Unable to pull cache transfer", "path", Logging::Loggable(path)));
+  }
+}
+
 static unsigned int initDistribution(Logr::log_t log)
 {
   unsigned int count = 0;
@@ -2297,6 +2433,7 @@ static int serviceMain(Logr::log_t log)
   g_lowercaseOutgoing = ::arg().mustDo("lowercase-outgoing");
 
   g_paddingFrom.toMasks(::arg()["edns-padding-from"]);
+  g_paddingFrom.compile();
   if (::arg()["edns-padding-mode"] == "always") {
     g_paddingMode = PaddingMode::Always;
   }
@@ -2312,6 +2449,23 @@ static int serviceMain(Logr::log_t log)
   g_paddingOutgoing = ::arg().mustDo("edns-padding-out");
   g_ECSHardening = ::arg().mustDo("edns-subnet-harden");
 
+  ExportSampler::s_config.sampleRate = std::max(1, ::arg().asNum("export-sample-rate"));
+  ExportSampler::s_config.maxPerSubnetPerSecond = std::max(0, ::arg().asNum("export-max-per-subnet-per-second"));
+  {
+    auto v4Bits = ::arg().asNum("export-subnet-mask-v4");
+    auto v6Bits = ::arg().asNum("export-subnet-mask-v6");
+    if (v4Bits < 0 || v4Bits > 32 || v6Bits < 0 || v6Bits > 128) {
+      SLOG(g_log << Logger::Error << "Illegal export-subnet-mask-v4 or export-subnet-mask-v6 value" << endl,
+           log->info(Logr::Error, "Illegal export-subnet-mask-v4 or export-subnet-mask-v6 value", "v4", Logging::Loggable(v4Bits), "v6", Logging::Loggable(v6Bits)));
+      return 1;
+    }
+    ExportSampler::s_config.v4Bits = v4Bits;
+    ExportSampler::s_config.v6Bits = v6Bits;
+  }
+  ExportSampler::s_config.keepServFail = ::arg().mustDo("export-keep-servfail");
+  ExportSampler::s_config.keepPolicyHits = ::arg().mustDo("export-keep-policy-hits");
+  ExportSampler::s_config.slowAnswerUsec = static_cast<uint64_t>(std::max(0, ::arg().asNum("export-keep-slow-answers-msec"))) * 1000;
+
   RecThreadInfo::setNumDistributorThreads(::arg().asNum("distributor-threads"));
   RecThreadInfo::setNumUDPWorkerThreads(::arg().asNum("threads"));
   if (RecThreadInfo::numUDPWorkers() < 1) {
@@ -2367,6 +2521,8 @@ static int serviceMain(Logr::log_t log)
 
   initSuffixMatchNodes(log);
   initCarbon();
+  loadCacheSnapshot(log);
+  pullCacheTransfer(log);
   auto listeningSockets = initDistribution(log);
 
 #ifdef NOD_ENABLED
@@ -2384,6 +2540,8 @@ static int serviceMain(Logr::log_t log)
 
   g_useKernelTimestamp = ::arg().mustDo("protobuf-use-kernel-timestamp");
   g_maxChainLength = ::arg().asNum("max-chain-length");
+  g_coalesceClientQueries = ::arg().mustDo("coalesce-client-queries");
+  g_maxClientChainLength = ::arg().asNum("max-client-chain-length");
 
   checkOrFixFDS(listeningSockets, log);
   checkOrFixLinuxMapCountLimits(log);
@@ -2446,9 +2604,42 @@ static int serviceMain(Logr::log_t log)
   setupNODThread(log);
 #endif /* NOD_ENABLED */
 
+  if (const auto& metricsAddress = ::arg()["metrics-address"]; !metricsAddress.empty()) {
+    try {
+      NetmaskGroup metricsACL;
+      metricsACL.toMasks(::arg()["metrics-allow-from"]);
+      rec::startMetricsServer(ComboAddress(metricsAddress, 8083), metricsACL, g_slog->withName("metrics"));
+    }
+    catch (const PDNSException& e) {
+      SLOG(g_log << Logger::Error << "Unable to start the metrics server on " << metricsAddress << ": " << e.reason << endl,
+           log->error(Logr::Error, e.reason, "Unable to start the metrics server", "address", Logging::Loggable(metricsAddress)));
+      return 1;
+    }
+    catch (const std::exception& e) {
+      SLOG(g_log << Logger::Error << "Unable to start the metrics server on " << metricsAddress << ": " << e.what() << endl,
+           log->error(Logr::Error, e.what(), "Unable to start the metrics server", "address", Logging::Loggable(metricsAddress)));
+      return 1;
+    }
+  }
+
+  if (const auto& transferSocket = ::arg()["cache-transfer-socket"]; !transferSocket.empty()) {
+    try {
+      rec::startCacheTransferServer(transferSocket, ::arg().asMode("cache-transfer-socket-mode"), ::arg().asNum("cache-transfer-max-bytes-per-second"), g_slog->withName("cachetransfer"));
+    }
+    catch (const std::exception& e) {
+      SLOG(g_log << Logger::Error << "Unable to start the cache transfer server on " << transferSocket << ": " << e.what() << endl,
+           log->error(Logr::Error, e.what(), "Unable to start the cache transfer server", "path", Logging::Loggable(transferSocket)));
+      return 1;
+    }
+  }
+
   runStartStopLua(true, log);
   ret = RecThreadInfo::runThreads(log);
   runStartStopLua(false, log);
+  rec::stopCacheTransferServer();
+  if (!s_cacheSnapshotFile.empty()) {
+    saveCacheSnapshot(log);
+  }
   return ret;
 }
 
@@ -2638,6 +2829,8 @@ static void houseKeepingWork(Logr::log_t log)
     static PeriodicTask pruneNSpeedTask{"pruneNSSpeedTask", 30};
     pruneNSpeedTask.runIfDue(now, [now]() {
       SyncRes::pruneNSSpeeds(now.tv_sec - 300);
+      SyncRes::pruneServerRTOs(now.tv_sec - 300);
+      SyncRes::pruneZoneCutCache(now.tv_sec);
     });
 
     static PeriodicTask pruneEDNSTask{"pruneEDNSTask", 60};
@@ -2645,6 +2838,13 @@ static void houseKeepingWork(Logr::log_t log)
       SyncRes::pruneEDNSStatuses(now.tv_sec);
     });
 
+    if (!s_cacheSnapshotFile.empty() && s_cacheSnapshotInterval > 0) {
+      static PeriodicTask cacheSnapshotTask{"cacheSnapshotTask", s_cacheSnapshotInterval};
+      cacheSnapshotTask.runIfDue(now, [&log]() {
+        saveCacheSnapshot(log);
+      });
+    }
+
     if (SyncRes::s_max_busy_dot_probes > 0) {
       static PeriodicTask pruneDoTProbeMap{"pruneDoTProbeMapTask", 60};
       pruneDoTProbeMap.runIfDue(now, [now]() {
@@ -2842,6 +3042,13 @@ static void recLoop()
 
       s_counter++;
 
+      // Refreshes use the same mthread budget as client queries, and never the last of it
+      if (threadInfo.isWorker() && g_multiTasker->numProcesses() < g_maxMThreads) {
+        runPrefetchTasks(g_now.tv_sec, g_logCommonErrors, [](void (*func)(void*), void* arg) {
+          g_multiTasker->makeThread(func, arg);
+        });
+      }
+
       if (threadInfo.isHandler()) {
         if (statsWanted || (s_statisticsInterval > 0 && (g_now.tv_sec - last_stat) >= s_statisticsInterval)) {
           doStats();
@@ -3546,8 +3753,8 @@ static bool activateRPZFile(const RPZTrackerParams& params, LuaConfigItems& lci,
     SLOG(g_log << Logger::Warning << "Loading RPZ from file '" << params.name << "'" << endl,
          log->info(Logr::Info, "Loading RPZ from file"));
     loadRPZFromFile(params.zoneXFRParams.name, zone, params.defpol, params.defpolOverrideLocal, params.maxTTL);
-    SLOG(g_log << Logger::Warning << "Done loading RPZ from file '" << params.name << "'" << endl,
-         log->info(Logr::Info, "Done loading RPZ from file"));
+    SLOG(g_log << Logger::Warning << "Done loading RPZ from file '" << params.name << "', " << zone->size() << " entries using " << zone->getMemoryUsage() << " bytes for " << zone->getActionsCount() << " distinct actions" << endl,
+         log->info(Logr::Info, "Done loading RPZ from file", "entries", Logging::Loggable(zone->size()), "bytes", Logging::Loggable(zone->getMemoryUsage()), "actions", Logging::Loggable(zone->getActionsCount())));
   }
   catch (const std::exception& e) {
     SLOG(g_log << Logger::Error << "Unable to load RPZ zone from '" << params.name << "': " << e.what() << endl,
@@ -3627,6 +3834,7 @@ static void activateRPZs(LuaConfigItems& lci)
     }
     broadcastFunction([name = zone->getName()] { return pleaseInitPolCounts(name); });
   }
+  lci.dfe.compile();
 }
 
 static void activateForwardingCatalogZones(LuaConfigItems& lci)
@@ -118,6 +118,7 @@ public:
 #include "ednssubnet.hh"        // For EDNSSubnetOpts
 #include "dnsparser.hh"        // For MOADNSParser
 #include "validate-recursor.hh"  // For ValidationState
+#include "rec-exportsampler.hh"  // For ExportSampler::Verdict
 
 #ifdef NOD_ENABLED
 #include "nod.hh"
@@ -217,6 +218,7 @@ struct DNSComboWriter
   boost::optional<uint16_t> d_extendedErrorCode{boost::none};
   string d_extendedErrorExtra;
   boost::optional<int> d_rcode{boost::none};
+  ExportSampler::Verdict d_exportVerdict{ExportSampler::Verdict::Export};
   int d_socket{-1};
   unsigned int d_tag{0};
   uint32_t d_qhash{0};
@@ -228,6 +230,7 @@ struct DNSComboWriter
   bool d_logResponse{false};
   bool d_tcp{false};
   bool d_responsePaddingDisabled{false};
+  bool d_coalesceLeader{false}; // identical questions may be parked on this one, see parkOnInFlightClientQuery()
   std::map<std::string, RecursorLua4::MetaValue> d_meta;
 };
 
@@ -314,6 +317,8 @@ extern size_t g_maxUDPQueriesPerRound;
 extern bool g_useKernelTimestamp;
 extern bool g_allowNoRD;
 extern unsigned int g_maxChainLength;
+extern bool g_coalesceClientQueries;
+extern unsigned int g_maxClientChainLength;
 extern thread_local std::shared_ptr<NetmaskGroup> t_allowFrom;
 extern thread_local std::shared_ptr<NetmaskGroup> t_allowNotifyFrom;
 extern thread_local std::shared_ptr<notifyset_t> t_allowNotifyFor;
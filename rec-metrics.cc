@@ -0,0 +1,461 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "rec-metrics.hh"
+
+#include <array>
+#include <thread>
+
+#include "misc.hh"
+#include "syncres.hh"
+#include "threadname.hh"
+#include "validate.hh"
+
+
+namespace
+{
+const std::string s_prefix = "pdns_recursor_";
+
+struct CounterDescription
+{
+  rec::Counter d_index;
+  const char* d_name;
+  // Gauges are maxima, aggregated with GlobalCounters::max() instead of summed
+  bool d_gauge{false};
+};
+
+const std::array<CounterDescription, static_cast<size_t>(rec::Counter::numberOfCounters)> s_counters = {{
+  {rec::Counter::outgoingtimeouts, "outgoing_timeouts"},
+  {rec::Counter::outgoing4timeouts, "outgoing4_timeouts"},
+  {rec::Counter::outgoing6timeouts, "outgoing6_timeouts"},
+  {rec::Counter::throttledqueries, "throttled_outqueries"},
+  {rec::Counter::dontqueries, "dont_outqueries"},
+  {rec::Counter::qnameminfallbacksuccess, "qname_min_fallback_success"},
+  {rec::Counter::authzonequeries, "auth_zone_queries"},
+  {rec::Counter::outqueries, "all_outqueries"},
+  {rec::Counter::tcpoutqueries, "tcp_outqueries"},
+  {rec::Counter::dotoutqueries, "dot_outqueries"},
+  {rec::Counter::unreachables, "unreachables"},
+  {rec::Counter::servFails, "servfail_answers"},
+  {rec::Counter::nxDomains, "nxdomain_answers"},
+  {rec::Counter::noErrors, "noerror_answers"},
+  {rec::Counter::qcounter, "questions"},
+  {rec::Counter::ipv6qcounter, "ipv6_questions"},
+  {rec::Counter::tcpqcounter, "tcp_questions"},
+  {rec::Counter::unauthorizedUDP, "unauthorized_udp"},
+  {rec::Counter::unauthorizedTCP, "unauthorized_tcp"},
+  {rec::Counter::sourceDisallowedNotify, "source_disallowed_notify"},
+  {rec::Counter::zoneDisallowedNotify, "zone_disallowed_notify"},
+  {rec::Counter::policyDrops, "policy_drops"},
+  {rec::Counter::tcpOverflow, "tcp_overflow"},
+  {rec::Counter::tcpClientOverflow, "tcp_client_overflow"},
+  {rec::Counter::clientParseError, "client_parse_errors"},
+  {rec::Counter::serverParseError, "server_parse_errors"},
+  {rec::Counter::tooOldDrops, "too_old_drops"},
+  {rec::Counter::truncatedDrops, "truncated_drops"},
+  {rec::Counter::queryPipeFullDrops, "query_pipe_full_drops"},
+  {rec::Counter::unexpectedCount, "unexpected_packets"},
+  {rec::Counter::caseMismatchCount, "case_mismatches"},
+  {rec::Counter::spoofCount, "spoof_prevents"},
+  {rec::Counter::resourceLimits, "resource_limits"},
+  {rec::Counter::overCapacityDrops, "over_capacity_drops"},
+  {rec::Counter::ipv6queries, "ipv6_outqueries"},
+  {rec::Counter::chainResends, "chain_resends"},
+  {rec::Counter::nsSetInvalidations, "nsset_invalidations"},
+  {rec::Counter::ednsPingMatches, "edns_ping_matches"},
+  {rec::Counter::ednsPingMismatches, "edns_ping_mismatches"},
+  {rec::Counter::noPingOutQueries, "noping_outqueries"},
+  {rec::Counter::noEdnsOutQueries, "noedns_outqueries"},
+  {rec::Counter::noPacketError, "no_packet_error"},
+  {rec::Counter::ignoredCount, "ignored_packets"},
+  {rec::Counter::emptyQueriesCount, "empty_queries"},
+  {rec::Counter::dnssecQueries, "dnssec_queries"},
+  {rec::Counter::dnssecAuthenticDataQueries, "dnssec_authentic_data_queries"},
+  {rec::Counter::dnssecCheckDisabledQueries, "dnssec_check_disabled_queries"},
+  {rec::Counter::variableResponses, "variable_responses"},
+  {rec::Counter::maxMThreadStackUsage, "max_mthread_stack", true},
+  {rec::Counter::dnssecValidations, "dnssec_validations"},
+  {rec::Counter::rebalancedQueries, "rebalanced_queries"},
+  {rec::Counter::proxyProtocolInvalidCount, "proxy_protocol_invalid"},
+  {rec::Counter::nodLookupsDroppedOversize, "nod_lookups_dropped_oversize"},
+  {rec::Counter::dns64prefixanswers, "dns64_prefix_answers"},
+  {rec::Counter::maintenanceUsec, "maintenance_usec"},
+  {rec::Counter::maintenanceCalls, "maintenance_calls"},
+  {rec::Counter::nodCount, "nod_events"},
+  {rec::Counter::udrCount, "udr_events"},
+  {rec::Counter::maxChainLength, "max_chain_length", true},
+  {rec::Counter::maxChainWeight, "max_chain_weight", true},
+  {rec::Counter::chainLimits, "chain_limits"},
+  {rec::Counter::ecsMissingCount, "ecs_missing"},
+  {rec::Counter::rpzPrefilterSkips, "rpz_prefilter_skips"},
+  {rec::Counter::rpzPrefilterFalsePositives, "rpz_prefilter_false_positives"},
+  {rec::Counter::clientQueriesCoalesced, "client_queries_coalesced"},
+  {rec::Counter::clientChainFallbacks, "client_chain_fallbacks"},
+  {rec::Counter::clientChainLimits, "client_chain_limits"},
+  {rec::Counter::maxClientChainLength, "max_client_chain_length", true},
+  {rec::Counter::staggeredAuthQueries, "staggered_auth_queries"},
+  {rec::Counter::staggeredAuthAnswers, "staggered_auth_answers"},
+  {rec::Counter::qnameminProbeQueries, "qname_min_probe_queries"},
+  {rec::Counter::qnameminProbesSaved, "qname_min_probes_saved"},
+  {rec::Counter::exportSampled, "export_sampled"},
+  {rec::Counter::exportDropped, "export_dropped"},
+  {rec::Counter::exportKept, "export_kept"},
+}};
+
+// Indexed by rec::Histogram, all of them are in microseconds
+const std::array<const char*, static_cast<size_t>(rec::Histogram::numberOfCounters)> s_histograms = {
+  "answers",
+  "auth6_answers",
+  "ourtime",
+  "cumulative_answers",
+  "cumulative_auth6_answers",
+  "phase_ingress",
+  "phase_syncres",
+  "phase_authrequests",
+  "phase_lua",
+  "phase_egress",
+};
+
+// Indexed by rec::LogLinearHistogram, all of them are in microseconds
+const std::array<const char*, static_cast<size_t>(rec::LogLinearHistogram::numberOfCounters)> s_logLinearHistograms = {
+  "auth4_answers",
+};
+
+const std::array<std::pair<const char*, double>, 5> s_quantiles = {{{"0.5", 50}, {"0.9", 90}, {"0.99", 99}, {"0.999", 99.9}, {"1.0", 100}}};
+
+class OpenMetricsWriter
+{
+public:
+  OpenMetricsWriter(const std::function<void(const std::string&)>& emit) :
+    d_emit(emit)
+  {
+  }
+
+  void family(const std::string& name, const char* type, const char* help)
+  {
+    flushIfNeeded();
+    d_buffer += "# TYPE " + s_prefix + name + ' ' + type + '\n';
+    d_buffer += "# HELP " + s_prefix + name + ' ' + help + '\n';
+  }
+
+  void sample(const std::string& name, const std::string& labels, uint64_t value)
+  {
+    sample(name, labels, std::to_string(value));
+  }
+
+  void sample(const std::string& name, const std::string& labels, const std::string& value)
+  {
+    d_buffer += s_prefix + name;
+    if (!labels.empty()) {
+      d_buffer += '{' + labels + '}';
+    }
+    d_buffer += ' ' + value + '\n';
+  }
+
+  void counter(const std::string& name, const char* help, uint64_t value)
+  {
+    family(name, "counter", help);
+    sample(name + "_total", "", value);
+  }
+
+  void gauge(const std::string& name, const char* help, uint64_t value)
+  {
+    family(name, "gauge", help);
+    sample(name, "", value);
+  }
+
+  void finish()
+  {
+    d_buffer += "# EOF\n";
+    d_emit(d_buffer);
+    d_buffer.clear();
+  }
+
+  static std::string label(const char* name, const std::string& value)
+  {
+    std::string ret = std::string(name) + "=\"";
+    for (const auto chr : value) {
+      if (chr == '\\' || chr == '"') {
+        ret += '\\';
+        ret += chr;
+      }
+      else if (chr == '\n') {
+        ret += "\\n";
+      }
+      else {
+        ret += chr;
+      }
+    }
+    ret += '"';
+    return ret;
+  }
+
+private:
+  void flushIfNeeded()
+  {
+    if (d_buffer.size() >= s_flushSize) {
+      d_emit(d_buffer);
+      d_buffer.clear();
+    }
+  }
+
+  static constexpr size_t s_flushSize = 16384;
+  const std::function<void(const std::string&)>& d_emit;
+  std::string d_buffer;
+};
+
+void renderCounters(OpenMetricsWriter& writer, rec::Counters& data)
+{
+  for (const auto& counter : s_counters) {
+    if (counter.d_gauge) {
+      writer.gauge(counter.d_name, "Maximum over all threads", g_Counters.max(counter.d_index));
+    }
+    else {
+      writer.counter(counter.d_name, "Counter", data.at(counter.d_index));
+    }
+  }
+
+  writer.family("latency_average_usec", "gauge", "Rolling average of the answer latency in microseconds");
+  writer.sample("latency_average_usec", "", std::to_string(data.at(rec::DoubleWAvgCounter::avgLatencyUsec).avg));
+  writer.family("latency_ours_average_usec", "gauge", "Rolling average of the time spent by the recursor itself in microseconds");
+  writer.sample("latency_ours_average_usec", "", std::to_string(data.at(rec::DoubleWAvgCounter::avgLatencyOursUsec).avg));
+
+  writer.family("auth_rcode_answers", "counter", "Answers from authoritative servers by rcode");
+  const auto& rcodes = data.at(rec::RCode::auth).rcodeCounters;
+  for (size_t rcode = 0; rcode < rcodes.size(); ++rcode) {
+    writer.sample("auth_rcode_answers_total", OpenMetricsWriter::label("rcode", std::to_string(rcode)), rcodes.at(rcode));
+  }
+
+  writer.family("policy_results", "counter", "RPZ policy hits by kind");
+  auto& policies = data.at(rec::PolicyHistogram::policy);
+  for (size_t kind = 0; kind < policies.counts.size(); ++kind) {
+    const auto policyKind = static_cast<DNSFilterEngine::PolicyKind>(kind);
+    writer.sample("policy_results_total", OpenMetricsWriter::label("kind", DNSFilterEngine::getKindToString(policyKind)), policies.at(policyKind));
+  }
+
+  writer.family("policy_name_hits", "counter", "RPZ policy hits by policy name");
+  for (const auto& [name, count] : data.at(rec::PolicyNameHits::policyName).counts) {
+    writer.sample("policy_name_hits_total", OpenMetricsWriter::label("name", name), count);
+  }
+
+  const std::array<std::pair<rec::DNSSECHistogram, const char*>, 2> dnssec = {{{rec::DNSSECHistogram::dnssec, "dnssec_results"}, {rec::DNSSECHistogram::xdnssec, "x_dnssec_results"}}};
+  for (const auto& [index, name] : dnssec) {
+    writer.family(name, "counter", "DNSSEC validation results by state");
+    auto& states = data.at(index);
+    for (size_t state = 0; state < states.counts.size(); ++state) {
+      const auto vstate = static_cast<vState>(state);
+      writer.sample(std::string(name) + "_total", OpenMetricsWriter::label("state", vStateToString(vstate)), states.at(vstate));
+    }
+  }
+}
+
+void renderHistograms(OpenMetricsWriter& writer, rec::Counters& data)
+{
+  for (size_t index = 0; index < s_histograms.size(); ++index) {
+    const std::string name = std::string(s_histograms.at(index)) + "_usec";
+    const auto& histogram = data.at(static_cast<rec::Histogram>(index));
+    writer.family(name, "histogram", "Latency distribution in microseconds");
+    uint64_t count = 0;
+    for (const auto& bucket : histogram.getCumulativeBuckets()) {
+      const bool last = bucket.d_boundary == std::numeric_limits<uint64_t>::max();
+      writer.sample(name + "_bucket", OpenMetricsWriter::label("le", last ? "+Inf" : std::to_string(bucket.d_boundary)), bucket.d_count);
+      count = bucket.d_count;
+    }
+    writer.sample(name + "_count", "", count);
+    writer.sample(name + "_sum", "", histogram.getSum());
+  }
+
+  for (size_t index = 0; index < s_logLinearHistograms.size(); ++index) {
+    const std::string name = std::string(s_logLinearHistograms.at(index)) + "_usec";
+    const auto& histogram = data.at(static_cast<rec::LogLinearHistogram>(index));
+    writer.family(name, "summary", "Latency quantiles in microseconds");
+    for (const auto& [quantile, percentile] : s_quantiles) {
+      writer.sample(name, OpenMetricsWriter::label("quantile", quantile), histogram.getPercentile(percentile));
+    }
+    writer.sample(name + "_count", "", histogram.getCount());
+    writer.sample(name + "_sum", "", histogram.getSum());
+  }
+}
+
+void renderCaches(OpenMetricsWriter& writer)
+{
+  if (g_recCache) {
+    writer.gauge("cache_entries", "Number of entries in the record cache", g_recCache->size());
+    writer.counter("cache_hits", "Record cache hits", g_recCache->getCacheHits());
+    writer.counter("cache_misses", "Record cache misses", g_recCache->getCacheMisses());
+    writer.counter("cache_stale_hits", "Record cache hits on records being served stale", g_recCache->getStaleHits());
+    writer.counter("cache_stale_refreshes", "Records served stale that were replaced by fresh data", g_recCache->getStaleRefreshes());
+    // These walk the shards, locking one at a time
+    const auto [contended, acquired] = g_recCache->stats();
+    writer.counter("record_cache_lock_contended", "Record cache shard lock acquisitions that had to wait", contended);
+    writer.counter("record_cache_lock_acquired", "Record cache shard lock acquisitions", acquired);
+    if (ShardLockProfile::s_enabled) {
+      const auto [waitNsec, holdNsec] = g_recCache->lockProfileTotals();
+      writer.counter("record_cache_lock_wait_nsec", "Time spent waiting for record cache shard locks, with cache-lock-profiling", waitNsec);
+      writer.counter("record_cache_lock_hold_nsec", "Time record cache shard locks were held, with cache-lock-profiling", holdNsec);
+    }
+    writer.gauge("cache_bytes", "Estimated size of the record cache in bytes", g_recCache->bytes());
+    writer.gauge("ecs_index_entries", "Number of names with ECS specific entries in the record cache", g_recCache->ecsIndexSize());
+    writer.gauge("zone_cut_index_entries", "Number of names in the record cache delegation index", g_recCache->zoneCutIndexSize());
+  }
+  if (g_negCache) {
+    writer.gauge("negcache_entries", "Number of entries in the negative cache", g_negCache->size());
+  }
+  // No packet cache series: this tree has no recpacketcache.cc, the packet cache
+  // is stubbed out in pdns_recursor.cc and g_packetCache is never created
+}
+
+void renderServerTables(OpenMetricsWriter& writer)
+{
+  writer.gauge("throttle_entries", "Number of throttled server/name/type combinations", SyncRes::getThrottledServersSize());
+  writer.gauge("nsspeed_entries", "Number of entries in the nameserver speeds table", SyncRes::getNSSpeedsSize());
+  writer.gauge("server_rto_entries", "Number of entries in the per server timeouts table", SyncRes::getServerRTOsSize());
+  writer.gauge("zone_cut_cache_entries", "Number of entries in the qname minimization zone cut cache", SyncRes::getZoneCutCacheSize());
+  writer.gauge("failed_host_entries", "Number of servers that failed to resolve", SyncRes::getFailedServersSize());
+  writer.gauge("edns_entries", "Number of entries in the EDNS status table", SyncRes::getEDNSStatusesSize());
+  writer.gauge("non_resolving_nameserver_entries", "Number of nameserver names that failed to resolve", SyncRes::getNonResolvingNSSize());
+  writer.gauge("saved_parent_ns_sets_entries", "Number of saved parent NS sets", SyncRes::getSaveParentsNSSetsSize());
+}
+
+bool wouldBlock()
+{
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// Send all of data on a non-blocking socket, waiting at most timeout seconds each time the socket is full
+void sendAll(int fileDesc, const std::string& data, int timeout)
+{
+  size_t pos = 0;
+  while (pos < data.size()) {
+    auto res = send(fileDesc, data.data() + pos, data.size() - pos, 0);
+    if (res > 0) {
+      pos += static_cast<size_t>(res);
+      continue;
+    }
+    if (res < 0 && wouldBlock() && waitForRWData(fileDesc, false, timeout, 0) > 0) {
+      continue;
+    }
+    throw std::runtime_error("error or timeout while sending metrics");
+  }
+}
+
+// Read the request head, up to the empty line, and return its first line
+std::string readRequestLine(int fileDesc, int timeout)
+{
+  std::string request;
+  std::array<char, 1024> buffer{};
+  while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+    if (request.size() > 8192 || waitForData(fileDesc, timeout, 0) <= 0) {
+      throw std::runtime_error("invalid request or timeout while reading it");
+    }
+    auto res = recv(fileDesc, buffer.data(), buffer.size(), 0);
+    if (res <= 0) {
+      if (res < 0 && wouldBlock()) {
+        continue;
+      }
+      throw std::runtime_error("connection closed while reading request");
+    }
+    request.append(buffer.data(), static_cast<size_t>(res));
+  }
+  return request.substr(0, request.find_first_of("\r\n"));
+}
+
+void handleConnection(int fileDesc)
+{
+  const int timeout = 2;
+  const auto requestLine = readRequestLine(fileDesc, timeout);
+  std::vector<std::string> parts;
+  stringtok(parts, requestLine, " ");
+  if (parts.size() != 3 || parts.at(0) != "GET" || (parts.at(1) != "/metrics" && parts.at(1).rfind("/metrics?", 0) != 0)) {
+    sendAll(fileDesc, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length: 10\r\n\r\nNot Found\n", timeout);
+    return;
+  }
+  // No Content-Length: the body is streamed as it is rendered and ends when we close the connection
+  sendAll(fileDesc, "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nConnection: close\r\n\r\n", timeout);
+  rec::renderOpenMetrics([fileDesc, timeout](const std::string& text) { sendAll(fileDesc, text, timeout); });
+}
+
+void metricsServerThread(int listenFD, const ComboAddress& local, const NetmaskGroup& acl, Logr::log_t log)
+{
+  setThreadName("rec/metrics");
+  for (;;) {
+    if (waitForData(listenFD, 1, 0) <= 0) {
+      continue;
+    }
+    // Same family as the listening address, so accept() gets the full remote address
+    ComboAddress remote = local;
+    int fileDesc = -1;
+    try {
+      fileDesc = SAccept(listenFD, remote);
+      if (acl.match(remote)) {
+        setNonBlocking(fileDesc);
+        handleConnection(fileDesc);
+      }
+      else {
+        log->info(Logr::Notice, "Refused metrics request from an address not in metrics-allow-from", "remote", Logging::Loggable(remote));
+      }
+    }
+    catch (const std::exception& e) {
+      log->error(Logr::Debug, e.what(), "Error while serving metrics", "remote", Logging::Loggable(remote));
+    }
+    catch (const PDNSException& e) {
+      log->error(Logr::Debug, e.reason, "Error while serving metrics", "remote", Logging::Loggable(remote));
+    }
+    if (fileDesc >= 0) {
+      closesocket(fileDesc);
+    }
+  }
+}
+}
+
+void rec::renderOpenMetrics(const std::function<void(const std::string&)>& emit)
+{
+  OpenMetricsWriter writer(emit);
+  // One consistent snapshot of all the thread local counters
+  auto data = g_Counters.aggregatedSnap();
+  renderCounters(writer, data);
+  renderHistograms(writer, data);
+  renderCaches(writer);
+  renderServerTables(writer);
+  writer.finish();
+}
+
+void rec::startMetricsServer(const ComboAddress& local, const NetmaskGroup& acl, Logr::log_t log)
+{
+  int listenFD = SSocket(local.sin4.sin_family, SOCK_STREAM, 0);
+  try {
+    setReuseAddr(listenFD);
+    SBind(listenFD, local);
+    SListen(listenFD, 16);
+    setNonBlocking(listenFD);
+  }
+  catch (...) {
+    closesocket(listenFD);
+    throw;
+  }
+  std::thread thread(metricsServerThread, listenFD, local, acl, log);
+  thread.detach();
+  log->info(Logr::Info, "Serving metrics", "address", Logging::Loggable(local), "allowed", Logging::Loggable(acl.toString()));
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "iputils.hh"
+#include "logging.hh"
+
+namespace rec
+{
+// Render all counters, histograms and cache, throttle and mthread statistics in OpenMetrics
+// text format. The output is produced one metric family at a time: emit is called with the text
+// rendered so far whenever it grows beyond a few kilobytes, and a final time at the end.
+// The record cache is only ever locked one shard at a time.
+void renderOpenMetrics(const std::function<void(const std::string&)>& emit);
+
+// Start a thread serving GET /metrics over plain HTTP on the given address, to the clients in acl.
+// Connections are handled one at a time, each with a short timeout, so a slow scraper cannot stall
+// it for long. This thread never touches the resolver threads directly, it only reads the published
+// snapshots.
+void startMetricsServer(const ComboAddress& local, const NetmaskGroup& acl, Logr::log_t log);
+}
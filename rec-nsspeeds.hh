@@ -26,6 +26,7 @@
 #include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/key_extractors.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
+#include <cmath>
 
 #include "iputils.hh"
 
@@ -170,3 +171,71 @@ private:
   template <typename T>
   bool putPBEntry(time_t cutoff, T& message);
 };
+
+//! Retransmission timeout of a server address, after RFC 6298.
+/** SRTT and RTTVAR follow the answered queries, the timeout is SRTT + 4 * RTTVAR and doubles for every consecutive
+    timeout. Fields other than the indexed ones are mutable, like DecayingEwmaCollection::d_collection. */
+struct ServerRTO
+{
+  ServerRTO(const ComboAddress& address, time_t now) :
+    d_address(address), d_lastUpdate(now)
+  {
+  }
+
+  void submitRTT(float usec) const
+  {
+    if (d_srtt == 0) {
+      d_srtt = usec;
+      d_rttvar = usec / 2;
+    }
+    else {
+      d_rttvar = 0.75F * d_rttvar + 0.25F * std::fabs(d_srtt - usec);
+      d_srtt = 0.875F * d_srtt + 0.125F * usec;
+    }
+    d_timeouts = 0;
+  }
+
+  // Returns the number of consecutive timeouts, including this one
+  unsigned int submitTimeout() const
+  {
+    if (d_timeouts < std::numeric_limits<decltype(d_timeouts)>::max()) {
+      ++d_timeouts;
+    }
+    return d_timeouts;
+  }
+
+  [[nodiscard]] unsigned int getTimeoutMsec(unsigned int minMsec, unsigned int maxMsec) const
+  {
+    auto rto = std::max(static_cast<uint64_t>((d_srtt + 4 * d_rttvar) / 1000), static_cast<uint64_t>(minMsec));
+    rto <<= std::min(d_timeouts, static_cast<uint8_t>(16));
+    return static_cast<unsigned int>(std::min(rto, static_cast<uint64_t>(maxMsec)));
+  }
+
+  ComboAddress d_address;
+  time_t d_lastUpdate;
+  mutable float d_srtt{0};
+  mutable float d_rttvar{0};
+  mutable uint8_t d_timeouts{0};
+};
+
+class serverrtos_t : public multi_index_container<ServerRTO,
+                                                  indexed_by<
+                                                    hashed_unique<tag<ComboAddress>, member<ServerRTO, ComboAddress, &ServerRTO::d_address>, ComboAddress::addressPortOnlyHash>,
+                                                    ordered_non_unique<tag<time_t>, member<ServerRTO, time_t, &ServerRTO::d_lastUpdate>>>>
+{
+public:
+  const ServerRTO& find_or_enter(const ComboAddress& address, time_t now)
+  {
+    auto iter = insert(ServerRTO{address, now}).first;
+    if (iter->d_lastUpdate != now) {
+      get<ComboAddress>().modify(iter, [now](ServerRTO& entry) { entry.d_lastUpdate = now; });
+    }
+    return *iter;
+  }
+
+  void prune(time_t limit)
+  {
+    auto& ind = get<time_t>();
+    ind.erase(ind.begin(), ind.upper_bound(limit));
+  }
+};
@@ -103,6 +103,9 @@ struct Queue
   TimedSet rateLimitSet{60};
 };
 static LockGuarded<Queue> s_taskQueue;
+static LockGuarded<pdns::PrefetchQueue> s_prefetchQueue;
+static std::atomic<uint64_t> s_prefetchesInFlight{0};
+static std::atomic<uint64_t> s_maxPrefetchesInFlight{100};
 
 struct taskstats
 {
@@ -221,6 +224,49 @@ static void tryDoT(const struct timeval& now, bool logErrors, const pdns::Resolv
   }
 }
 
+struct PrefetchJob
+{
+  pdns::ResolveTask d_task;
+  bool d_logErrors;
+};
+
+static void runPrefetchJob(void* arg)
+{
+  std::unique_ptr<PrefetchJob> job(static_cast<PrefetchJob*>(arg));
+  struct timeval now{};
+  Utility::gettimeofday(&now);
+  // The deadline was checked when popping, but an mthread can wait a while before it gets to run
+  if (job->d_task.d_deadline >= now.tv_sec) {
+    resolveInternal(now, job->d_logErrors, job->d_task, false);
+  }
+  else {
+    s_prefetchQueue.lock()->incExpired();
+  }
+  --s_prefetchesInFlight;
+}
+
+void runPrefetchTasks(time_t now, bool logErrors, const PrefetchThreadMaker& makeThread)
+{
+  while (true) {
+    if (s_prefetchesInFlight.fetch_add(1) >= s_maxPrefetchesInFlight) {
+      --s_prefetchesInFlight;
+      return;
+    }
+    auto job = std::make_unique<PrefetchJob>();
+    job->d_logErrors = logErrors;
+    if (!s_prefetchQueue.lock()->pop(now, job->d_task)) {
+      --s_prefetchesInFlight;
+      return;
+    }
+    makeThread(runPrefetchJob, job.release());
+  }
+}
+
+void setMaxPrefetchesInFlight(uint64_t max)
+{
+  s_maxPrefetchesInFlight = max;
+}
+
 void runTasks(size_t max, bool logErrors)
 {
   for (size_t count = 0; count < max; count++) {
@@ -248,15 +294,15 @@ bool runTaskOnce(bool logErrors)
   return true;
 }
 
-void pushAlmostExpiredTask(const DNSName& qname, uint16_t qtype, time_t deadline, const Netmask& netmask)
+void pushAlmostExpiredTask(const DNSName& qname, uint16_t qtype, time_t deadline, const Netmask& netmask, uint32_t hits)
 {
   if (SyncRes::isUnsupported(qtype)) {
     auto log = g_slog->withName("taskq")->withValues("name", Logging::Loggable(qname), "qtype", Logging::Loggable(QType(qtype).toString()), "netmask", Logging::Loggable(netmask.empty() ? "" : netmask.toString()));
     log->error(Logr::Error, "Cannot push task", "qtype unsupported");
     return;
   }
-  pdns::ResolveTask task{qname, qtype, deadline, true, resolve, {}, {}, netmask};
-  if (s_taskQueue.lock()->queue.push(std::move(task))) {
+  pdns::ResolveTask task{qname, qtype, deadline, true, resolve, {}, {}, netmask, hits};
+  if (s_prefetchQueue.lock()->push(std::move(task))) {
     ++s_almost_expired_tasks.pushed;
   }
 }
@@ -312,9 +358,12 @@ uint64_t getTaskSize()
 
 void taskQueueClear()
 {
-  auto lock = s_taskQueue.lock();
-  lock->queue.clear();
-  lock->rateLimitSet.clear();
+  {
+    auto lock = s_taskQueue.lock();
+    lock->queue.clear();
+    lock->rateLimitSet.clear();
+  }
+  s_prefetchQueue.lock()->clear();
 }
 
 pdns::ResolveTask taskQueuePop()
@@ -337,6 +386,21 @@ uint64_t getAlmostExpiredTaskExceptions()
   return s_almost_expired_tasks.exceptions;
 }
 
+uint64_t getAlmostExpiredTasksExpired()
+{
+  return s_prefetchQueue.lock()->getExpired();
+}
+
+uint64_t getAlmostExpiredTasksSize()
+{
+  return s_prefetchQueue.lock()->size();
+}
+
+uint64_t getPrefetchesInFlight()
+{
+  return s_prefetchesInFlight;
+}
+
 uint64_t getResolveTasksPushed()
 {
   return s_almost_expired_tasks.pushed;
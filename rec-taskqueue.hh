@@ -23,6 +23,7 @@
 
 #include <cstdint>
 #include <ctime>
+#include <functional>
 #include <qtype.hh>
 
 class DNSName;
@@ -35,10 +36,17 @@ struct ResolveTask;
 }
 void runTasks(size_t max, bool logErrors);
 bool runTaskOnce(bool logErrors);
-void pushAlmostExpiredTask(const DNSName& qname, uint16_t qtype, time_t deadline, const Netmask& netmask);
+void pushAlmostExpiredTask(const DNSName& qname, uint16_t qtype, time_t deadline, const Netmask& netmask, uint32_t hits = 0);
 void pushResolveTask(const DNSName& qname, uint16_t qtype, time_t now, time_t deadline, bool forceQMOff);
 bool pushTryDoTTask(const DNSName& qname, uint16_t qtype, const ComboAddress& ipAddress, time_t deadline, const DNSName& nsname);
 void taskQueueClear();
+
+// Almost expired tasks are not run by runTasks(), but concurrently as mthreads by the threads calling
+// runPrefetchTasks(), most hit first, with at most setMaxPrefetchesInFlight() of them running over all threads.
+// makeThread is expected to start func(arg) as an mthread of the calling thread.
+using PrefetchThreadMaker = std::function<void(void (*func)(void*), void* arg)>;
+void runPrefetchTasks(time_t now, bool logErrors, const PrefetchThreadMaker& makeThread);
+void setMaxPrefetchesInFlight(uint64_t max);
 pdns::ResolveTask taskQueuePop();
 
 // General task stats
@@ -55,5 +63,8 @@ uint64_t getResolveTaskExceptions();
 uint64_t getAlmostExpiredTasksPushed();
 uint64_t getAlmostExpiredTasksRun();
 uint64_t getAlmostExpiredTaskExceptions();
+uint64_t getAlmostExpiredTasksExpired();
+uint64_t getAlmostExpiredTasksSize();
+uint64_t getPrefetchesInFlight();
 
 bool taskQTypeIsSupported(QType qtype);
@@ -53,6 +53,9 @@ Counters& Counters::merge(const Counters& data)
   for (size_t i = 0; i < histograms.size(); i++) {
     histograms.at(i) += data.histograms.at(i);
   }
+  for (size_t i = 0; i < logLinearHistograms.size(); i++) {
+    logLinearHistograms.at(i) += data.logLinearHistograms.at(i);
+  }
 
   // ResponseStats knows how to add
   responseStats += data.responseStats;
@@ -96,6 +99,9 @@ std::string Counters::toString() const
   for (const auto& element : histograms) {
     stream << element.getName() << ": NYI ";
   }
+  for (const auto& element : logLinearHistograms) {
+    stream << element.getName() << ": count=" << element.getCount() << " p50=" << element.getPercentile(50) << " p99=" << element.getPercentile(99) << ' ';
+  }
   stream << "DNSSEC Histograms: ";
   stream << "NYI ";
   stream << "Policy Counters: ";
@@ -111,6 +117,7 @@ std::string Counters::toString() const
 
 // Compile with:
 // c++ -DTEST_TCOUNTER_TIMING -Wall -std=c++17 -O2 rec-tcounters.cc -pthread
+// and run with: ./a.out threads iterations
 
 #if TEST_TCOUNTER_TIMING
 
@@ -124,9 +131,20 @@ rec::GlobalCounters g_counters;
 thread_local rec::TCounters t_counters(g_counters);
 
 std::atomic<uint64_t> atomicCounter;
+std::atomic<bool> stopSnapping;
+std::atomic<size_t> runningThreads;
 
 size_t iterations;
 
+static double elapsedSince(const timeval& start)
+{
+  timeval stop;
+  gettimeofday(&stop, nullptr);
+  timeval diff;
+  timersub(&stop, &start, &diff);
+  return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
 void atomicThread()
 {
   for (size_t i = 0; i < iterations; i++) {
@@ -144,6 +162,21 @@ void tcounterThread()
   }
 }
 
+// Keep updating counters and snapshots (at the default interval) until told to stop, like a resolver thread would
+void snappingThread()
+{
+  ++t_counters.at(rec::Counter::qcounter);
+  t_counters.updateSnap(true);
+  ++runningThreads;
+  while (!stopSnapping) {
+    for (size_t i = 0; i < 1000; i++) {
+      ++t_counters.at(rec::Counter::qcounter);
+      t_counters.at(rec::LogLinearHistogram::auth4Answers)(i);
+    }
+    t_counters.updateSnap();
+  }
+}
+
 int main(int argc, char* argv[])
 {
   size_t threads = std::atoi(argv[1]);
@@ -161,11 +194,7 @@ int main(int argc, char* argv[])
   for (size_t i = 0; i < threads; i++) {
     thr[i].join();
   }
-  timeval stop;
-  gettimeofday(&stop, nullptr);
-  timeval diff;
-  timersub(&stop, &start, &diff);
-  auto elapsed = (diff.tv_sec + diff.tv_usec / 1e6);
+  auto elapsed = elapsedSince(start);
   std::cout << "Sum is " << atomicCounter << " elapsed is " << elapsed << std::endl;
 
   std::cout << "Now doing the same with tcounters" << std::endl;
@@ -176,10 +205,51 @@ int main(int argc, char* argv[])
   for (size_t i = 0; i < threads; i++) {
     thr[i].join();
   }
-  gettimeofday(&stop, nullptr);
-  timersub(&stop, &start, &diff);
-  elapsed = (diff.tv_sec + diff.tv_usec / 1e6);
+  elapsed = elapsedSince(start);
   std::cout << "Sum is " << g_counters.sum(rec::Counter::qcounter) << " elapsed is " << elapsed << std::endl;
+
+  std::cout << "Cost of a single increment without snapshots" << std::endl;
+  gettimeofday(&start, nullptr);
+  for (size_t i = 0; i < iterations; i++) {
+    ++t_counters.at(rec::Counter::qcounter);
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per increment " << elapsed * 1e9 / static_cast<double>(iterations) << "ns" << std::endl;
+
+  std::cout << "Cost of a forced snapshot update" << std::endl;
+  const size_t snaps = 1000;
+  gettimeofday(&start, nullptr);
+  for (size_t i = 0; i < snaps; i++) {
+    t_counters.updateSnap(true);
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per snapshot update " << elapsed * 1e6 / snaps << "us" << std::endl;
+
+  std::cout << "Aggregating while " << threads << " threads keep updating" << std::endl;
+  for (size_t i = 0; i < threads; i++) {
+    thr[i] = std::thread(snappingThread);
+  }
+  while (runningThreads < threads) {
+    std::this_thread::yield();
+  }
+  const size_t aggregations = 100;
+  uint64_t total = 0;
+  gettimeofday(&start, nullptr);
+  for (size_t i = 0; i < aggregations; i++) {
+    total += g_counters.aggregatedSnap().at(rec::Counter::qcounter);
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per aggregatedSnap " << elapsed * 1e6 / aggregations << "us" << std::endl;
+  gettimeofday(&start, nullptr);
+  for (size_t i = 0; i < aggregations; i++) {
+    total += g_counters.sum(rec::Counter::qcounter);
+  }
+  elapsed = elapsedSince(start);
+  std::cout << "Per sum " << elapsed * 1e6 / aggregations << "us (" << total << ")" << std::endl;
+  stopSnapping = true;
+  for (size_t i = 0; i < threads; i++) {
+    thr[i].join();
+  }
 }
 
 #endif
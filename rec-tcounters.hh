@@ -99,6 +99,19 @@ enum class Counter : uint8_t
   maxChainWeight,
   chainLimits,
   ecsMissingCount,
+  rpzPrefilterSkips, // RPZ lookups answered by the prefilters alone
+  rpzPrefilterFalsePositives, // RPZ lookups let through by the prefilters that found nothing
+  clientQueriesCoalesced, // UDP questions answered with the result of an identical question already being resolved
+  clientChainFallbacks, // coalesced questions that had to be resolved on their own after all
+  clientChainLimits, // questions not coalesced because the chain was full
+  maxClientChainLength,
+  staggeredAuthQueries, // queries also sent to a second server because the first was slow to answer
+  staggeredAuthAnswers, // of those, the ones where the second server answered first
+  qnameminProbeQueries, // outgoing queries done for qname minimization probes
+  qnameminProbesSaved, // probes skipped thanks to the zone cut cache
+  exportSampled, // client queries picked for protobuf/dnstap export
+  exportDropped, // client queries not exported because of sampling or subnet caps
+  exportKept, // of those not picked, the ones whose response was exported anyway by a keep rule
 
   numberOfCounters
 };
@@ -129,12 +142,24 @@ enum class ResponseStats : uint8_t
 enum class Histogram : uint8_t
 {
   answers,
-  auth4Answers,
   auth6Answers,
   ourtime,
   cumulativeAnswers,
-  cumulativeAuth4Answers,
   cumulativeAuth6Answers,
+  // Per-phase query handling times, fed from the event trace (see RecEventTrace::getPhaseDurations())
+  phaseIngress,
+  phaseSyncRes,
+  phaseAuthRequests,
+  phaseLua,
+  phaseEgress,
+
+  numberOfCounters
+};
+
+// Log-linear histograms, for latencies that need fine grained percentiles
+enum class LogLinearHistogram : uint8_t
+{
+  auth4Answers,
 
   numberOfCounters
 };
@@ -204,12 +229,18 @@ struct Counters
 
   std::array<pdns::Histogram, static_cast<size_t>(Histogram::numberOfCounters)> histograms = {
     pdns::Histogram{"answers", {1000, 10000, 100000, 1000000}},
-    pdns::Histogram{"auth4answers", {1000, 10000, 100000, 1000000}},
     pdns::Histogram{"auth6answers", {1000, 10000, 100000, 1000000}},
     pdns::Histogram{"ourtime", {1000, 2000, 4000, 8000, 16000, 32000}},
     pdns::Histogram{"cumul-clientanswers-", 10, 19},
     pdns::Histogram{"cumul-authanswers-", 1000, 13},
-    pdns::Histogram{"cumul-authanswers-", 1000, 13}};
+    pdns::Histogram{"phase-ingress-", 10, 19},
+    pdns::Histogram{"phase-syncres-", 10, 19},
+    pdns::Histogram{"phase-authrequests-", 10, 19},
+    pdns::Histogram{"phase-lua-", 10, 19},
+    pdns::Histogram{"phase-egress-", 10, 19}};
+
+  std::array<pdns::LogLinearHistogram, static_cast<size_t>(LogLinearHistogram::numberOfCounters)> logLinearHistograms = {
+    pdns::LogLinearHistogram{"auth4answers"}};
 
   // Response stats
   RecResponseStats responseStats{};
@@ -273,7 +304,7 @@ struct Counters
     for (auto& elem : auth.rcodeCounters) {
       elem = 0;
     }
-    // Histogram has a constructor that initializes
+    // Histogram and LogLinearHistogram have a constructor that initializes
     // RecResponseStats has a default constructor that initializes
     for (auto& histogram : dnssecCounters) {
       for (auto& elem : histogram.counts) {
@@ -318,6 +349,11 @@ struct Counters
     return histograms.at(static_cast<size_t>(index));
   }
 
+  pdns::LogLinearHistogram& at(LogLinearHistogram index)
+  {
+    return logLinearHistograms.at(static_cast<size_t>(index));
+  }
+
   DNSSECCounters& at(DNSSECHistogram index)
   {
     return dnssecCounters.at(static_cast<size_t>(index));
@@ -0,0 +1,132 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/key_extractors.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/optional.hpp>
+
+#include "dnsname.hh"
+
+//! Zone cuts learned while doing qname minimization.
+/** An entry for name N with cut C says that N is not a zone cut itself but lives in the zone starting at C, because
+    asking the servers of C about N did not get a delegation. Minimization can then go straight from C to N without
+    asking for the names in between again. Entries do not outlive the NS set of C they were learned from. An entry
+    that has gone out of date costs privacy, not correctness: the servers of C still hand out a delegation for a
+    newer cut below them. */
+class ZoneCutCache
+{
+public:
+  ZoneCutCache(size_t maxEntries = 0) :
+    d_maxEntries(maxEntries)
+  {
+  }
+
+  void insert(const DNSName& name, const DNSName& cut, time_t ttd)
+  {
+    if (d_maxEntries == 0) {
+      return;
+    }
+    auto& ind = d_entries.get<NameTag>();
+    auto iter = ind.find(name);
+    if (iter != ind.end()) {
+      ind.modify(iter, [&](Entry& entry) {
+        entry.d_cut = cut;
+        entry.d_ttd = ttd;
+      });
+      d_entries.get<LRUTag>().relocate(d_entries.get<LRUTag>().end(), d_entries.project<LRUTag>(iter));
+      return;
+    }
+    d_entries.get<LRUTag>().push_back(Entry{name, cut, ttd});
+    while (d_entries.size() > d_maxEntries) {
+      d_entries.get<LRUTag>().pop_front();
+    }
+  }
+
+  //! The deepest name at or above qname and below cut that is known to live in the zone starting at cut
+  boost::optional<DNSName> getClosest(const DNSName& qname, const DNSName& cut, time_t now) const
+  {
+    if (d_entries.empty() || !qname.isPartOf(cut)) {
+      return boost::none;
+    }
+    const auto& ind = d_entries.get<NameTag>();
+    DNSName name(qname);
+    while (name.countLabels() > cut.countLabels()) {
+      auto iter = ind.find(name);
+      if (iter != ind.end() && iter->d_ttd > now && iter->d_cut == cut) {
+        return name;
+      }
+      name.chopOff();
+    }
+    return boost::none;
+  }
+
+  void prune(time_t now)
+  {
+    auto& ind = d_entries.get<LRUTag>();
+    for (auto iter = ind.begin(); iter != ind.end();) {
+      iter = iter->d_ttd <= now ? ind.erase(iter) : std::next(iter);
+    }
+  }
+
+  void setMaxEntries(size_t maxEntries)
+  {
+    d_maxEntries = maxEntries;
+    while (d_entries.size() > d_maxEntries) {
+      d_entries.get<LRUTag>().pop_front();
+    }
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return d_entries.size();
+  }
+
+  void clear()
+  {
+    d_entries.clear();
+  }
+
+private:
+  struct Entry
+  {
+    DNSName d_name;
+    DNSName d_cut;
+    time_t d_ttd;
+  };
+  struct NameTag
+  {
+  };
+  struct LRUTag
+  {
+  };
+
+  boost::multi_index::multi_index_container<
+    Entry,
+    boost::multi_index::indexed_by<
+      boost::multi_index::hashed_unique<boost::multi_index::tag<NameTag>, boost::multi_index::member<Entry, DNSName, &Entry::d_name>>,
+      boost::multi_index::sequenced<boost::multi_index::tag<LRUTag>>>>
+    d_entries;
+  size_t d_maxEntries;
+};
@@ -35,6 +35,7 @@
  #include "packetcache.hh"
  #include "validate.hh"
  #include "lock.hh"
+ #include "shardlockprofile.hh"
  #include "stat_t.hh"
  
  #ifdef HAVE_CONFIG_H
@@ -182,19 +183,20 @@
        uint64_t d_misses{0};
        uint64_t d_contended_count{0};
        uint64_t d_acquired_count{0};
+       ShardLockProfile d_profile;
        void invalidate() {}
        void preRemoval(const Entry& /* entry */) {}
      };
  
-     LockGuardedTryHolder<MapCombo::LockedContent> lock()
+     ShardLockHolder<LockedContent> lock()
      {
-       auto locked = d_content.try_lock();
-       if (!locked.owns_lock()) {
-         locked.lock();
-         ++locked->d_contended_count;
-       }
-       ++locked->d_acquired_count;
-       return locked;
+       return lockShard(d_content);
+     }
+
+     // Same, but lets the lock profile attribute the acquisition to name
+     ShardLockHolder<LockedContent> lock(const DNSName& name)
+     {
+       return lockShard(d_content, &name);
      }
  
      [[nodiscard]] auto getEntriesCount() const
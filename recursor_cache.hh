@@ -34,7 +34,9 @@
 #include <boost/multi_index/sequenced_index.hpp>
 #include <boost/version.hpp>
 #include "iputils.hh"
+#include "cachecleaner.hh"
 #include "lock.hh"
+#include "shardlockprofile.hh"
 #include "stat_t.hh"
 #include "validate.hh"
 #undef max
@@ -57,15 +59,40 @@ public:
   static uint16_t s_maxRRSetSize;
   static bool s_limitQTypeAny;
 
+  // How hits are recorded and which entries are evicted first when the cache is full
+  static CacheEvictionPolicy s_evictionPolicy;
+
+  // Maximum number of ECS-scoped entries kept for a single (qname, qtype), 0 means unlimited.
+  // When exceeded, the least recently used scope is evicted.
+  static uint32_t s_maxECSScopesPerName;
+
   [[nodiscard]] size_t size() const;
   [[nodiscard]] size_t bytes();
   [[nodiscard]] pair<uint64_t, uint64_t> stats();
+  // Summed lock wait and hold times of all shards in ns, only counted while ShardLockProfile::s_enabled
+  [[nodiscard]] pair<uint64_t, uint64_t> lockProfileTotals();
   [[nodiscard]] size_t ecsIndexSize();
-
-  size_t getRecordSets(size_t perShard, size_t maxSize, std::string& ret);
-  size_t putRecordSets(const std::string& pbuf);
+  // Number of names in the ECS index having at most 1, 2, 4, ... 2^n scopes, the last bucket collecting the rest
+  [[nodiscard]] std::vector<uint64_t> ecsIndexDistribution(size_t buckets = 8);
 
   using OptTag = boost::optional<std::string>;
+  // Identifies a record set in its shard, to resume a getShardRecordSets() walk
+  using RecordSetKey = std::tuple<DNSName, QType, OptTag, Netmask>;
+
+  size_t getRecordSets(size_t perShard, size_t maxSize, std::string& ret);
+  // With hottestFirst, the record sets are taken to come most recently used first, and are put at
+  // the least recently used end so the coldest of them is evicted first
+  size_t putRecordSets(const std::string& pbuf, bool hottestFirst = false);
+  // Record sets of a single shard, in the format read by putRecordSets(). Least recently used first,
+  // unless hottestFirst is set, stopping after maxCount. If resumeAt holds a key, the walk starts at
+  // that record set, and none is sent if it left the shard. On return, resumeAt holds the key of the
+  // first record set not sent, or none once the end of the shard was reached.
+  size_t getShardRecordSets(size_t shardNumber, std::string& ret, bool hottestFirst = false, boost::optional<RecordSetKey>* resumeAt = nullptr, size_t maxCount = std::numeric_limits<size_t>::max());
+  [[nodiscard]] size_t getShardsCount() const
+  {
+    return d_maps.size();
+  }
+  [[nodiscard]] size_t getShardSize(size_t shardNumber) const;
 
   using Flags = uint8_t;
   static constexpr Flags None = 0;
@@ -101,6 +128,9 @@ public:
   void replace(time_t, const DNSName& qname, QType qtype, const vector<DNSRecord>& content, const SigRecsVec& signatures, const AuthRecsVec& authorityRecs, bool auth, const DNSName& authZone, boost::optional<Netmask> ednsmask = boost::none, const OptTag& routingTag = boost::none, vState state = vState::Indeterminate, boost::optional<ComboAddress> from = boost::none, bool refresh = false, time_t ttl_time = time(nullptr));
 
   void doPrune(time_t now, size_t keep);
+  // Sets name to its deepest ancestor-or-self that might have an NS set in the cache, or to the root
+  void getClosestZoneCut(time_t now, DNSName& name);
+  size_t zoneCutIndexSize();
   uint64_t doDump(int fileDesc, size_t maxCacheEntries);
 
   size_t doWipeCache(const DNSName& name, bool sub, QType qtype = 0xffff);
@@ -117,6 +147,14 @@ public:
   {
     return cacheMisses.load();
   }
+  [[nodiscard]] auto getStaleHits() const
+  {
+    return staleHits.load();
+  }
+  [[nodiscard]] auto getStaleRefreshes() const
+  {
+    return staleRefreshes.load();
+  }
 
   void incCacheHits()
   {
@@ -129,6 +167,8 @@ public:
 
 private:
   pdns::stat_t cacheHits{0}, cacheMisses{0};
+  // Hits on records being served stale, and replacements of such records by fresh data
+  pdns::stat_t staleHits{0}, staleRefreshes{0};
 
   struct CacheEntry
   {
@@ -171,17 +211,19 @@ private:
     mutable vState d_state{vState::Indeterminate};
     mutable time_t d_ttd{0};
     uint32_t d_orig_ttl{0};
+    mutable uint32_t d_hits{0}; // ranks almost expired refresh tasks, halved on every refresh so it follows current popularity
     mutable uint16_t d_servedStale{0};
     QType d_qtype;
     bool d_auth;
     mutable bool d_submitted{false}; // whether this entry has been queued for refetch
+    mutable bool d_referenced{false}; // hit since the last clock sweep, see CacheEvictionPolicy
     bool d_tooBig{false};
   };
 
-  bool replace(CacheEntry&& entry);
+  bool replace(CacheEntry&& entry, bool leastRecentlyUsed = false);
   // Using templates to avoid exposing protozero types in this header file
   template <typename T>
-  bool putRecordSet(T&);
+  bool putRecordSet(T&, time_t now, bool leastRecentlyUsed);
   template <typename T, typename U>
   void getRecordSet(T&, U);
 
@@ -203,10 +245,12 @@ private:
     {
     }
 
+    /* returns the most specific scope covering addr, marking it as recently used */
     [[nodiscard]] Netmask lookupBestMatch(const ComboAddress& addr) const
     {
-      const auto* best = d_nmt.lookup(addr);
+      auto* best = d_nmt.lookup(addr);
       if (best != nullptr) {
+        best->second = ++d_clock;
         return best->first;
       }
 
@@ -215,7 +259,7 @@ private:
 
     void addMask(const Netmask& netmask) const
     {
-      d_nmt.insert(netmask).second = true;
+      d_nmt.insert(netmask).second = ++d_clock;
     }
 
     void removeNetmask(const Netmask& netmask) const
@@ -228,7 +272,28 @@ private:
       return d_nmt.empty();
     }
 
-    mutable NetmaskTree<bool> d_nmt;
+    [[nodiscard]] size_t size() const
+    {
+      return d_nmt.size();
+    }
+
+    /* the least recently used scope, other than the one just added */
+    [[nodiscard]] Netmask getLeastRecentlyUsed(const Netmask& except) const
+    {
+      Netmask victim;
+      uint64_t oldest = std::numeric_limits<uint64_t>::max();
+      for (const auto& node : d_nmt) {
+        if (node.second < oldest && node.first != except) {
+          oldest = node.second;
+          victim = node.first;
+        }
+      }
+      return victim;
+    }
+
+    // the value is the last time (in d_clock ticks) a scope was added or matched
+    mutable NetmaskTree<uint64_t> d_nmt;
+    mutable uint64_t d_clock{0};
     DNSName d_qname;
     QType d_qtype;
   };
@@ -302,6 +367,7 @@ private:
       Entries d_cachecache;
       uint64_t d_contended_count{0};
       uint64_t d_acquired_count{0};
+      ShardLockProfile d_profile;
       bool d_cachecachevalid{false};
 
       void invalidate()
@@ -326,15 +392,15 @@ private:
       }
     };
 
-    LockGuardedTryHolder<LockedContent> lock()
+    ShardLockHolder<LockedContent> lock()
     {
-      auto locked = d_content.try_lock();
-      if (!locked.owns_lock()) {
-        locked.lock();
-        ++locked->d_contended_count;
-      }
-      ++locked->d_acquired_count;
-      return locked;
+      return lockShard(d_content);
+    }
+
+    // Same, but lets the lock profile attribute the acquisition to name
+    ShardLockHolder<LockedContent> lock(const DNSName& name)
+    {
+      return lockShard(d_content, &name);
     }
 
     [[nodiscard]] auto getEntriesCount() const
@@ -363,6 +429,10 @@ private:
   };
 
   vector<MapCombo> d_maps;
+  // Every name with an NS set in d_maps, mapped to the highest TTD stored for it. Entries only go
+  // away once expired, so this may claim cuts the cache no longer has, but never misses one.
+  SharedLockGuarded<std::unordered_map<DNSName, time_t>> d_zoneCuts;
+  void addZoneCut(const DNSName& name, time_t ttd);
   MapCombo& getMap(const DNSName& qname)
   {
     return d_maps.at(qname.hash() % d_maps.size());
@@ -372,11 +442,18 @@ private:
 
   static bool entryMatches(OrderedTagIterator_t& entry, QType qtype, bool requireAuth, const ComboAddress& who);
   static Entries getEntries(MapCombo::LockedContent& map, const DNSName& qname, QType qtype, const OptTag& rtag);
+  static void evictLeastRecentlyUsedScope(MapCombo::LockedContent& content, MapCombo& shard, const ECSIndexEntry& ecsIndex, const Netmask& keep);
   static cache_t::const_iterator getEntryUsingECSIndex(MapCombo::LockedContent& map, time_t now, const DNSName& qname, QType qtype, bool requireAuth, const ComboAddress& who, bool serveStale);
 
   static time_t handleHit(time_t now, MapCombo::LockedContent& content, OrderedTagIterator_t& entry, const DNSName& qname, uint32_t& origTTL, vector<DNSRecord>* res, SigRecs* signatures, AuthRecs* authorityRecs, bool* variable, boost::optional<vState>& state, bool* wasAuth, DNSName* authZone, ComboAddress* fromAuthIP);
   static void updateStaleEntry(time_t now, OrderedTagIterator_t& entry);
   static void handleServeStaleBookkeeping(time_t, bool, OrderedTagIterator_t&);
+  void countStaleHit(const OrderedTagIterator_t& entry)
+  {
+    if (entry->d_servedStale > 0) {
+      ++staleHits;
+    }
+  }
 };
 
 namespace boost
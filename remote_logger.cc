@@ -1,4 +1,6 @@
 #include <unistd.h>
+#include <climits>
+#include <unordered_map>
 #include "threadname.hh"
 #include "remote_logger.hh"
 #ifndef _WIN32
@@ -14,67 +16,214 @@
 #endif
 #include "logging.hh"
 
-bool CircularWriteBuffer::hasRoomFor(const std::string& str) const
+bool SPSCWriteRing::write(const std::string& str)
 {
-  if (d_buffer.size() + 2 + str.size() > d_buffer.capacity()) {
+  if (d_lengthBytes == 2 && str.size() > std::numeric_limits<uint16_t>::max()) {
     return false;
   }
 
+  const auto tail = d_tail.load(std::memory_order_relaxed);
+  const auto head = d_head.load(std::memory_order_acquire);
+  if (tail - head + d_lengthBytes + str.size() > d_buffer.size()) {
+    return false;
+  }
+
+  const uint16_t len16 = htons(str.size());
+  const uint32_t len32 = htonl(str.size());
+  auto pos = tail % d_buffer.size();
+  auto copy = [this, &pos](const char* ptr, size_t size) {
+    const size_t first = std::min(size, d_buffer.size() - pos);
+    memcpy(&d_buffer.at(pos), ptr, first);
+    if (first < size) {
+      memcpy(d_buffer.data(), ptr + first, size - first);
+    }
+    pos = (pos + size) % d_buffer.size();
+  };
+  if (d_lengthBytes == 2) {
+    copy(reinterpret_cast<const char*>(&len16), sizeof(len16)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  }
+  else {
+    copy(reinterpret_cast<const char*>(&len32), sizeof(len32)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+  }
+  if (!str.empty()) {
+    copy(str.data(), str.size());
+  }
+
+  d_tail.store(tail + d_lengthBytes + str.size(), std::memory_order_release);
   return true;
 }
 
-bool CircularWriteBuffer::write(const std::string& str)
+size_t SPSCWriteRing::getReadable(std::array<std::pair<const char*, size_t>, 2>& spans) const
 {
-  if (str.size() > std::numeric_limits<uint16_t>::max() || !hasRoomFor(str)) {
-    return false;
+  const auto head = d_head.load(std::memory_order_relaxed);
+  const auto tail = d_tail.load(std::memory_order_acquire);
+  const size_t available = tail - head;
+  const size_t pos = head % d_buffer.size();
+  const size_t first = std::min(available, d_buffer.size() - pos);
+  spans[0] = {d_buffer.data() + pos, first};
+  spans[1] = {d_buffer.data(), available - first};
+  return available;
+}
+
+void SPSCWriteRing::consume(size_t bytes)
+{
+  d_head.store(d_head.load(std::memory_order_relaxed) + bytes, std::memory_order_release);
+}
+
+void SPSCWriteRing::discard()
+{
+  // The tail always sits on a message boundary, so this drops whole messages, plus the remainder
+  // of one already partially sent
+  d_head.store(d_tail.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+const std::string& RemoteLoggerInterface::toErrorString(Result r)
+{
+  static const std::array<std::string,5> str = {
+    "Queued",
+    "Queue full, dropping",
+    "Not sending too large protobuf message",
+    "Submiting to queue failed",
+    "?"
+  };
+  auto i = static_cast<unsigned int>(r);
+  return str[std::min(i, 4U)];
+}
+
+static std::atomic<uint64_t> s_threadRingsID{0};
+
+ThreadRings::ThreadRings(size_t ringSize, size_t lengthBytes) :
+  d_ringSize(ringSize), d_lengthBytes(lengthBytes), d_id(++s_threadRingsID)
+{
+}
+
+ThreadRings::ProducerRing& ThreadRings::getProducerRing()
+{
+  // Keyed by ID rather than address, a new instance might be allocated where an old one was
+  static thread_local std::unordered_map<uint64_t, ProducerRing*> t_rings;
+  auto& ring = t_rings[d_id];
+  if (ring == nullptr) {
+    auto rings = d_rings.lock();
+    rings->push_back(std::make_unique<ProducerRing>(d_ringSize, d_lengthBytes));
+    ring = rings->back().get();
+  }
+  return *ring;
+}
+
+RemoteLoggerInterface::Result ThreadRings::queue(const std::string& data)
+{
+  auto& producer = getProducerRing();
+
+  if ((d_lengthBytes == 2 && data.size() > std::numeric_limits<uint16_t>::max()) || data.size() + d_lengthBytes > d_ringSize) {
+    producer.d_tooLarge.fetch_add(1, std::memory_order_relaxed);
+    return RemoteLoggerInterface::Result::TooLarge;
   }
 
-  uint16_t len = htons(str.size());
-  const char* ptr = reinterpret_cast<const char*>(&len);
-  d_buffer.insert(d_buffer.end(), ptr, ptr + 2);
-  d_buffer.insert(d_buffer.end(), str.begin(), str.end());
+  if (!producer.d_ring.write(data)) {
+    /* the consumer has not caught up, or is not connected: drop */
+    producer.d_pipeFull.fetch_add(1, std::memory_order_relaxed);
+    return RemoteLoggerInterface::Result::PipeFull;
+  }
 
-  return true;
+  producer.d_queued.fetch_add(1, std::memory_order_relaxed);
+  return RemoteLoggerInterface::Result::Queued;
+}
+
+RemoteLoggerInterface::Stats ThreadRings::getStats()
+{
+  RemoteLoggerInterface::Stats stats;
+  for (const auto& producer : *d_rings.lock()) {
+    stats.d_queued += producer->d_queued.load(std::memory_order_relaxed);
+    stats.d_pipeFull += producer->d_pipeFull.load(std::memory_order_relaxed);
+    stats.d_tooLarge += producer->d_tooLarge.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+std::vector<ThreadRings::ProducerRing*> ThreadRings::getProducers()
+{
+  std::vector<ProducerRing*> producers;
+  auto rings = d_rings.lock();
+  producers.reserve(rings->size());
+  if (d_partial != nullptr) {
+    producers.push_back(d_partial);
+  }
+  for (const auto& ring : *rings) {
+    if (ring.get() != d_partial) {
+      producers.push_back(ring.get());
+    }
+  }
+  return producers;
 }
 
-bool CircularWriteBuffer::flush(int fd)
+size_t ThreadRings::pending()
 {
-  if (d_buffer.empty()) {
-    // not optional, we report EOF otherwise
+  size_t total = 0;
+  for (const auto* producer : getProducers()) {
+    std::array<std::pair<const char*, size_t>, 2> spans;
+    total += producer->d_ring.getReadable(spans);
+  }
+  return total;
+}
+
+void ThreadRings::discard()
+{
+  for (auto* producer : getProducers()) {
+    producer->d_ring.discard();
+  }
+  d_partial = nullptr;
+}
+
+/* Sends what all rings hold in a single write. Returns true if anything was sent. Throws on
+   a socket error or EOF, after dropping what was queued as we can't be sure we haven't sent a
+   partial message, and we don't want to send the remaining part after reconnecting */
+bool ThreadRings::flush(int fileDesc)
+{
+  auto producers = getProducers();
+
+  std::vector<std::pair<const char*, size_t>> spans;
+  std::vector<size_t> available;
+  spans.reserve(producers.size() * 2);
+  available.reserve(producers.size());
+  size_t total = 0;
+  for (const auto* producer : producers) {
+    std::array<std::pair<const char*, size_t>, 2> ringSpans;
+    available.push_back(producer->d_ring.getReadable(ringSpans));
+    total += available.back();
+    for (const auto& span : ringSpans) {
+      if (span.second > 0) {
+        spans.push_back(span);
+      }
+    }
+  }
+  if (total == 0) {
     return false;
   }
 
-  auto arr1 = d_buffer.array_one();
-  auto arr2 = d_buffer.array_two();
-
-  #ifndef _WIN32
-  struct iovec iov[2];
-  int pos = 0;
-  for(const auto& arr : {arr1, arr2}) {
-    if(arr.second) {
-      iov[pos].iov_base = arr.first;
-      iov[pos].iov_len = arr.second;
-      ++pos;
+#ifndef _WIN32
+  std::vector<struct iovec> iov;
+  iov.reserve(std::min(spans.size(), static_cast<size_t>(IOV_MAX)));
+  for (const auto& span : spans) {
+    if (iov.size() == IOV_MAX) {
+      break;
     }
+    iov.push_back({const_cast<char*>(span.first), span.second}); // NOLINT(cppcoreguidelines-pro-type-const-cast)
   }
 
   ssize_t res = 0;
   do {
-    res = writev(fd, iov, pos);
-  #else
+    res = writev(fileDesc, iov.data(), static_cast<int>(iov.size()));
+#else
   // Windows fallback: coalesce into one buffer and write once
   std::vector<char> coalesced;
-  coalesced.reserve(arr1.second + arr2.second);
-  if (arr1.second) {
-    coalesced.insert(coalesced.end(), arr1.first, arr1.first + arr1.second);
-  }
-  if (arr2.second) {
-    coalesced.insert(coalesced.end(), arr2.first, arr2.first + arr2.second);
+  coalesced.reserve(total);
+  for (const auto& span : spans) {
+    coalesced.insert(coalesced.end(), span.first, span.first + span.second);
   }
   ssize_t res = 0;
   do {
-    res = ::write(fd, coalesced.data(), static_cast<unsigned int>(coalesced.size()));
-  #endif
+    res = ::write(fileDesc, coalesced.data(), static_cast<unsigned int>(coalesced.size()));
+#endif
 
     if (res < 0) {
       if (errno == EINTR) {
@@ -85,46 +234,32 @@ bool CircularWriteBuffer::flush(int fd)
         return false;
       }
 
-      /* we can't be sure we haven't sent a partial message,
-         and we don't want to send the remaining part after reconnecting */
-      d_buffer.clear();
+      discard();
       throw std::runtime_error("Couldn't flush a thing: " + stringerror());
     }
     else if (!res) {
-      /* we can't be sure we haven't sent a partial message,
-         and we don't want to send the remaining part after reconnecting */
-      d_buffer.clear();
+      discard();
       throw std::runtime_error("EOF");
     }
   }
   while (res < 0);
 
-  if (static_cast<size_t>(res) == d_buffer.size()) {
-    d_buffer.clear();
-  }
-  else {
-    while (res--) {
-      d_buffer.pop_front();
+  // Hand the written bytes back to the rings in the order they were sent
+  auto written = static_cast<size_t>(res);
+  d_partial = nullptr;
+  for (size_t idx = 0; idx < producers.size() && written > 0; ++idx) {
+    const size_t done = std::min(written, available.at(idx));
+    producers.at(idx)->d_ring.consume(done);
+    written -= done;
+    if (done < available.at(idx)) {
+      d_partial = producers.at(idx);
     }
   }
 
   return true;
 }
 
-const std::string& RemoteLoggerInterface::toErrorString(Result r)
-{
-  static const std::array<std::string,5> str = {
-    "Queued",
-    "Queue full, dropping",
-    "Not sending too large protobuf message",
-    "Submiting to queue failed",
-    "?"
-  };
-  auto i = static_cast<unsigned int>(r);
-  return str[std::min(i, 4U)];
-}
-
-RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedBytes, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect), d_runtime({CircularWriteBuffer(maxQueuedBytes), nullptr})
+RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedBytes, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect), d_rings(std::max(maxQueuedBytes, static_cast<uint64_t>(2 + std::numeric_limits<uint16_t>::max())), 2)
 {
   if (!d_asyncConnect) {
     reconnect();
@@ -139,13 +274,7 @@ bool RemoteLogger::reconnect()
     auto newSock = make_unique<Socket>(d_remote.sin4.sin_family, SOCK_STREAM, 0);
     newSock->setNonBlocking();
     newSock->connect(d_remote, d_timeout);
-
-    {
-      /* we are now successfully connected, time to take the lock and update the
-         socket */
-      auto runtime = d_runtime.lock();
-      runtime->d_socket = std::move(newSock);
-    }
+    d_socket = std::move(newSock);
   }
   catch (const std::exception& e) {
 #ifdef RECURSOR
@@ -162,45 +291,7 @@ bool RemoteLogger::reconnect()
 
 RemoteLoggerInterface::Result RemoteLogger::queueData(const std::string& data)
 {
-  auto runtime = d_runtime.lock();
-
-  if (data.size() > std::numeric_limits<uint16_t>::max()) {
-    ++runtime->d_stats.d_tooLarge;
-    return Result::TooLarge;
-  }
-
-  if (!runtime->d_writer.hasRoomFor(data)) {
-    /* not connected, queue is full, just drop */
-    if (!runtime->d_socket) {
-      ++runtime->d_stats.d_pipeFull;
-      return Result::PipeFull;
-    }
-    try {
-      /* we try to flush some data */
-      if (!runtime->d_writer.flush(runtime->d_socket->getHandle())) {
-        /* but failed, let's just drop */
-        ++runtime->d_stats.d_pipeFull;
-        return Result::PipeFull;
-      }
-
-      /* see if we freed enough data */
-      if (!runtime->d_writer.hasRoomFor(data)) {
-        /* we didn't */
-        ++runtime->d_stats.d_pipeFull;
-        return Result::PipeFull;
-      }
-    }
-    catch(const std::exception& e) {
-      //      cout << "Got exception writing: "<<e.what()<<endl;
-      runtime->d_socket.reset();
-      ++runtime->d_stats.d_otherError;
-      return Result::OtherError;
-    }
-  }
-
-  runtime->d_writer.write(data);
-  ++runtime->d_stats.d_queued;
-  return Result::Queued;
+  return d_rings.queue(data);
 }
 
 void RemoteLogger::maintenanceThread() 
@@ -213,44 +304,43 @@ void RemoteLogger::maintenanceThread()
 #endif
     setThreadName(threadName);
 
+    time_t lastConnectAttempt = 0;
     for (;;) {
       if (d_exiting) {
         break;
       }
 
-      bool connected = true;
-      if (d_runtime.lock()->d_socket == nullptr) {
-        // if it was unset, it will remain so, we are the only ones setting it!
-        connected = reconnect();
-      }
-
-      /* we will just go to sleep if the reconnection just failed */
-      if (connected) {
-        try {
-          /* we don't want to take the lock while trying to reconnect */
-          auto runtime = d_runtime.lock();
-          if (runtime->d_socket) { // check if it is set
-            /* if flush() returns false, it means that we couldn't flush anything yet
-               either because there is nothing to flush, or because the outgoing TCP
-               buffer is full. That's fine by us */
-            runtime->d_writer.flush(runtime->d_socket->getHandle());
-          }
-          else {
-            connected = false;
-          }
+      if (d_socket == nullptr) {
+        time_t now = time(nullptr);
+        if (now - lastConnectAttempt < d_reconnectWaitTime) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          continue;
         }
-        catch (const std::exception& e) {
-          d_runtime.lock()->d_socket.reset();
-          connected = false;
+        lastConnectAttempt = now;
+        if (!reconnect()) {
+          continue;
         }
+      }
 
-        if (!connected) {
-          /* let's try to reconnect right away, we are about to sleep anyway */
-          reconnect();
-        }
+      bool sent = false;
+      try {
+        /* if flush() returns false, it means that we couldn't flush anything yet
+           either because there is nothing to flush, or because the outgoing TCP
+           buffer is full. That's fine by us */
+        sent = d_rings.flush(d_socket->getHandle());
+      }
+      catch (const std::exception& e) {
+        d_socket.reset();
+        d_otherError.fetch_add(1, std::memory_order_relaxed);
+        /* let's try to reconnect right away */
+        lastConnectAttempt = 0;
+        continue;
       }
 
-      sleep(d_reconnectWaitTime);
+      /* keep going while there is data, otherwise give the workers some time to queue more */
+      if (!sent) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
     }
   }
   catch (const std::exception& e)
@@ -24,37 +24,44 @@
 #include "config.h"
 #endif
 
+#include <array>
 #include <atomic>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "iputils.hh"
-#include "circular_buffer.hh"
 #include "lock.hh"
 #include "sstuff.hh"
 
-/* Writes can be submitted and they are atomically accepted. Either the whole write
-   ends up in the buffer or nothing ends up in the buffer.
-   In case nothing ends up in the buffer, an exception is thrown.
-   Similarly, EOF leads to this treatment
+/* Single producer, single consumer ring of length-prefixed messages, the length being sent in
+   network order over two (protobuf) or four (Frame Streams) bytes. Writes are atomically
+   accepted: either the whole message with its length ends up in the ring, or nothing does. The producer only moves the tail and the consumer only moves the head, so neither side
+   takes a lock.
 
-   The filedescriptor can be in non-blocking mode.
-
-   This class is not threadsafe.
+   write() may only be called by the producer thread, getReadable(), consume() and discard() only
+   by the consumer thread.
 */
-
-class CircularWriteBuffer
+class SPSCWriteRing
 {
 public:
-  explicit CircularWriteBuffer(size_t size) : d_buffer(size)
+  explicit SPSCWriteRing(size_t size, size_t lengthBytes = 2) :
+    d_buffer(size), d_lengthBytes(lengthBytes)
   {
   }
 
-  bool hasRoomFor(const std::string& str) const;
   bool write(const std::string& str);
-  bool flush(int fd);
+  // Fills up to two spans with the bytes ready to be sent, returns their total size
+  size_t getReadable(std::array<std::pair<const char*, size_t>, 2>& spans) const;
+  void consume(size_t bytes);
+  void discard();
+
 private:
-  boost::circular_buffer<char> d_buffer;
+  std::vector<char> d_buffer;
+  size_t d_lengthBytes;
+  // Monotonic byte counts, positions in d_buffer are taken modulo its size
+  std::atomic<uint64_t> d_head{0};
+  std::atomic<uint64_t> d_tail{0};
 };
 
 class RemoteLoggerInterface
@@ -104,10 +111,52 @@ private:
   bool d_logUDRs{false};
 };
 
+/* The rings of all threads queueing data for one destination. A producer only takes a lock the
+   first time it queues, to register its ring. A single consumer thread drains all rings with
+   flush(), batching them into one writev() call.
+*/
+class ThreadRings
+{
+public:
+  ThreadRings(size_t ringSize, size_t lengthBytes);
+
+  RemoteLoggerInterface::Result queue(const std::string& data);
+  [[nodiscard]] RemoteLoggerInterface::Stats getStats();
+
+  // Consumer side
+  size_t pending();
+  bool flush(int fileDesc);
+  void discard();
+
+private:
+  // Written to by exactly one thread
+  struct ProducerRing
+  {
+    ProducerRing(size_t size, size_t lengthBytes) :
+      d_ring(size, lengthBytes)
+    {
+    }
+    SPSCWriteRing d_ring;
+    std::atomic<uint64_t> d_queued{0};
+    std::atomic<uint64_t> d_pipeFull{0};
+    std::atomic<uint64_t> d_tooLarge{0};
+  };
+  ProducerRing& getProducerRing();
+  std::vector<ProducerRing*> getProducers();
+
+  size_t d_ringSize;
+  size_t d_lengthBytes;
+  uint64_t d_id;
+  LockGuarded<std::vector<std::unique_ptr<ProducerRing>>> d_rings;
+  // A ring left with a partially written message, it must go first on the next flush
+  ProducerRing* d_partial{nullptr};
+};
+
 /* Thread safe. Will connect asynchronously on request.
-   Runs a reconnection thread that also periodicall flushes.
-   Note that the buffer only runs as long as there is a connection.
-   If there is no connection we don't buffer a thing
+   Each thread queueing data gets its own ring (see ThreadRings), so queueing never takes a
+   lock. A single maintenance thread reconnects when needed and drains the rings to the socket.
+   Note that the rings only drain as long as there is a connection. If there is no connection,
+   data is kept until a thread's ring is full and dropped after that.
 */
 class RemoteLogger : public RemoteLoggerInterface
 {
@@ -130,13 +179,15 @@ public:
   }
   [[nodiscard]] std::string toString() override
   {
-    auto runtime = d_runtime.lock();
-    return d_remote.toStringWithPort() + " (" + std::to_string(runtime->d_stats.d_queued) + " processed, " + std::to_string(runtime->d_stats.d_pipeFull + runtime->d_stats.d_tooLarge + runtime->d_stats.d_otherError) + " dropped)";
+    auto stats = getStats();
+    return d_remote.toStringWithPort() + " (" + std::to_string(stats.d_queued) + " processed, " + std::to_string(stats.d_pipeFull + stats.d_tooLarge + stats.d_otherError) + " dropped)";
   }
 
   [[nodiscard]] RemoteLoggerInterface::Stats getStats() override
   {
-    return d_runtime.lock()->d_stats;
+    auto stats = d_rings.getStats();
+    stats.d_otherError = d_otherError.load(std::memory_order_relaxed);
+    return stats;
   }
 
   void stop()
@@ -148,20 +199,15 @@ private:
   bool reconnect();
   void maintenanceThread();
 
-  struct RuntimeData
-  {
-    CircularWriteBuffer d_writer;
-    std::unique_ptr<Socket> d_socket{nullptr};
-    RemoteLoggerInterface::Stats d_stats{};
-  };
-
   ComboAddress d_remote;
   uint16_t d_timeout;
   uint8_t d_reconnectWaitTime;
   std::atomic<bool> d_exiting{false};
   bool d_asyncConnect{false};
 
-  LockGuarded<RuntimeData> d_runtime;
+  ThreadRings d_rings;
+  // Only used by the maintenance thread (and the constructor, before it is started)
+  std::unique_ptr<Socket> d_socket{nullptr};
+  std::atomic<uint64_t> d_otherError{0};
   std::thread d_thread;
 };
-
@@ -29,6 +29,7 @@
 #include <functional>
 
 #include "dnsname.hh"
+#include "iputils.hh"
 
 struct ResolveContext
 {
@@ -44,6 +45,11 @@ struct ResolveContext
 
   boost::optional<const boost::uuids::uuid&> d_initialRequestId;
   DNSName d_nsName;
+  // If set, a UDP query also goes to this server when the first one has not answered after d_staggeredDelayMsec
+  boost::optional<ComboAddress> d_staggeredAddress;
+  unsigned int d_staggeredDelayMsec{0};
+  // How long to wait for a UDP answer, 0 means the global auth timeout
+  unsigned int d_timeoutMsec{0};
 #ifdef HAVE_FSTRM
   boost::optional<const DNSName&> d_auth;
 #endif
@@ -0,0 +1,236 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <vector>
+
+#include "dnsname.hh"
+#include "lock.hh"
+
+// Opt-in profiling of the shard locks of the sharded caches (record cache, negative cache and
+// packet cache). When enabled, every acquisition records how long it waited for the lock and how
+// long the lock was held, in power-of-two nanosecond buckets, and lookups that know their name
+// feed a small per-shard top-k of the names causing the most acquisitions. All of it lives in the
+// shard's locked content, so it is only updated and read with the shard lock held.
+// When disabled, the cost is one relaxed atomic load per acquisition.
+class ShardLockProfile
+{
+public:
+  static inline std::atomic<bool> s_enabled{false};
+
+  static constexpr size_t s_buckets = 32; // up to ~2s
+  static constexpr size_t s_topNames = 8;
+
+  struct TopName
+  {
+    DNSName d_name;
+    uint64_t d_count{0};
+  };
+
+  void recordWait(uint64_t nsec)
+  {
+    ++d_wait.at(bucketFor(nsec));
+    d_waitTotalNsec += nsec;
+  }
+
+  void recordHold(uint64_t nsec)
+  {
+    ++d_hold.at(bucketFor(nsec));
+    d_holdTotalNsec += nsec;
+  }
+
+  // Space-saving top-k: an untracked name replaces the least counted one and inherits its count
+  void recordName(const DNSName& name)
+  {
+    auto found = std::find_if(d_names.begin(), d_names.end(), [&name](const TopName& entry) { return entry.d_count > 0 && entry.d_name == name; });
+    if (found == d_names.end()) {
+      found = std::min_element(d_names.begin(), d_names.end(), [](const TopName& lhs, const TopName& rhs) { return lhs.d_count < rhs.d_count; });
+      found->d_name = name;
+    }
+    ++found->d_count;
+  }
+
+  [[nodiscard]] uint64_t getTotalNsec() const
+  {
+    return d_waitTotalNsec + d_holdTotalNsec;
+  }
+
+  [[nodiscard]] uint64_t getWaitNsec() const
+  {
+    return d_waitTotalNsec;
+  }
+
+  [[nodiscard]] uint64_t getHoldNsec() const
+  {
+    return d_holdTotalNsec;
+  }
+
+  // A copy of the profile of one shard, with its lock counters, taken while dumping
+  struct Summary;
+
+  // Write the per-shard histograms and the hottest shards with their top names
+  static void dump(FILE* filePtr, const char* cacheName, std::vector<Summary>& summaries, size_t hottest = 10);
+
+private:
+  static size_t bucketFor(uint64_t nsec)
+  {
+    size_t bucket = 0;
+    while (nsec > 1 && bucket < s_buckets - 1) {
+      nsec >>= 1;
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  static std::string histogramToString(const std::array<uint64_t, s_buckets>& histogram)
+  {
+    // Only the non-empty buckets, as <upper bound>:<count>
+    std::string ret;
+    for (size_t bucket = 0; bucket < histogram.size(); ++bucket) {
+      if (histogram.at(bucket) == 0) {
+        continue;
+      }
+      if (!ret.empty()) {
+        ret += ',';
+      }
+      ret += std::to_string(static_cast<uint64_t>(1) << (bucket + 1)) + ':' + std::to_string(histogram.at(bucket));
+    }
+    return ret.empty() ? "-" : ret;
+  }
+
+  std::array<uint64_t, s_buckets> d_wait{};
+  std::array<uint64_t, s_buckets> d_hold{};
+  std::array<TopName, s_topNames> d_names{};
+  uint64_t d_waitTotalNsec{0};
+  uint64_t d_holdTotalNsec{0};
+};
+
+struct ShardLockProfile::Summary
+{
+  ShardLockProfile d_profile;
+  size_t d_shard{0};
+  uint64_t d_acquired{0};
+  uint64_t d_contended{0};
+};
+
+inline void ShardLockProfile::dump(FILE* filePtr, const char* cacheName, std::vector<Summary>& summaries, size_t hottest)
+{
+  fprintf(filePtr, "; %s lock profile follows (histogram buckets are powers of two in ns)\n", cacheName);
+  for (const auto& summary : summaries) {
+    const auto& profile = summary.d_profile;
+    fprintf(filePtr, "; %s shard %zu lock acquired %" PRIu64 " contended %" PRIu64 " wait-us %" PRIu64 " hold-us %" PRIu64 " wait %s hold %s\n",
+            cacheName, summary.d_shard, summary.d_acquired, summary.d_contended, profile.d_waitTotalNsec / 1000, profile.d_holdTotalNsec / 1000,
+            histogramToString(profile.d_wait).c_str(), histogramToString(profile.d_hold).c_str());
+  }
+  std::sort(summaries.begin(), summaries.end(), [](const Summary& lhs, const Summary& rhs) { return lhs.d_profile.getTotalNsec() > rhs.d_profile.getTotalNsec(); });
+  summaries.resize(std::min(summaries.size(), hottest));
+  for (const auto& summary : summaries) {
+    fprintf(filePtr, "; %s hot shard %zu wait+hold-us %" PRIu64 " top names:", cacheName, summary.d_shard, summary.d_profile.getTotalNsec() / 1000);
+    auto names = summary.d_profile.d_names;
+    std::sort(names.begin(), names.end(), [](const TopName& lhs, const TopName& rhs) { return lhs.d_count > rhs.d_count; });
+    for (const auto& name : names) {
+      if (name.d_count > 0) {
+        fprintf(filePtr, " %s=%" PRIu64, name.d_name.toLogString().c_str(), name.d_count);
+      }
+    }
+    fprintf(filePtr, "\n");
+  }
+}
+
+// The lock holder returned by the MapCombo::lock() methods of the sharded caches. It behaves like
+// the LockGuardedTryHolder it wraps, and records the hold time in the shard's d_profile on release
+// when profiling was enabled at acquisition time.
+template <typename T>
+class ShardLockHolder
+{
+public:
+  ShardLockHolder(LockGuardedTryHolder<T>&& holder, bool profiling) :
+    d_holder(std::move(holder)), d_profiling(profiling)
+  {
+    if (d_profiling) {
+      d_acquired = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ShardLockHolder()
+  {
+    if (d_profiling && d_holder.owns_lock()) {
+      d_holder->d_profile.recordHold(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - d_acquired).count());
+    }
+  }
+
+  ShardLockHolder(const ShardLockHolder&) = delete;
+  ShardLockHolder(ShardLockHolder&&) = delete;
+  ShardLockHolder& operator=(const ShardLockHolder&) = delete;
+  ShardLockHolder& operator=(ShardLockHolder&&) = delete;
+
+  T& operator*() const
+  {
+    return *d_holder;
+  }
+
+  T* operator->() const
+  {
+    return d_holder.operator->();
+  }
+
+  [[nodiscard]] bool owns_lock() const noexcept
+  {
+    return d_holder.owns_lock();
+  }
+
+private:
+  LockGuardedTryHolder<T> d_holder;
+  std::chrono::steady_clock::time_point d_acquired;
+  bool d_profiling;
+};
+
+// Acquire the lock of a shard, counting contended acquisitions and, when profiling, the wait time
+// and the name (if known) the shard is locked for
+template <typename T>
+ShardLockHolder<T> lockShard(LockGuarded<T>& content, const DNSName* name = nullptr)
+{
+  const bool profiling = ShardLockProfile::s_enabled.load(std::memory_order_relaxed);
+  auto locked = content.try_lock();
+  if (!locked.owns_lock()) {
+    if (profiling) {
+      const auto start = std::chrono::steady_clock::now();
+      locked.lock();
+      locked->d_profile.recordWait(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+    else {
+      locked.lock();
+    }
+    ++locked->d_contended_count;
+  }
+  ++locked->d_acquired_count;
+  if (profiling && name != nullptr) {
+    locked->d_profile.recordName(*name);
+  }
+  return ShardLockHolder<T>(std::move(locked), profiling);
+}
@@ -26,9 +26,7 @@
 #endif
 
 #include "arguments.hh"
-#if defined(HAVE_DNSSEC) && HAVE_DNSSEC
 #include "aggressive_nsec.hh"
-#endif
 #include "cachecleaner.hh"
 #include "dns_random.hh"
 #include "dnsparser.hh"
@@ -49,6 +47,8 @@
 #include "rec-taskqueue.hh"
 #include "shuffle.hh"
 #include "rec-nsspeeds.hh"
+#include "rec-zonecuts.hh"
+#include "protozero-helpers.hh"
 
 rec::GlobalCounters g_Counters;
 thread_local rec::TCounters t_Counters(g_Counters);
@@ -126,6 +126,8 @@ private:
 };
 
 static LockGuarded<nsspeeds_t> s_nsSpeeds;
+static LockGuarded<serverrtos_t> s_serverRTOs;
+static LockGuarded<ZoneCutCache> s_zoneCuts;
 
 size_t SyncRes::getNSSpeedTable(size_t maxSize, std::string& ret)
 {
@@ -400,7 +402,13 @@ bool SyncRes::s_tcp_fast_open_connect;
 bool SyncRes::s_dot_to_port_853;
 int SyncRes::s_event_trace_enabled;
 bool SyncRes::s_save_parent_ns_set;
+bool SyncRes::s_serve_stale_while_revalidate;
 unsigned int SyncRes::s_max_busy_dot_probes;
+bool SyncRes::s_staggered_auth_queries;
+unsigned int SyncRes::s_staggered_auth_min_delay_msec;
+unsigned int SyncRes::s_staggered_auth_zone_budget;
+bool SyncRes::s_adaptive_auth_timeouts;
+unsigned int SyncRes::s_auth_timeout_min_msec;
 unsigned int SyncRes::s_max_CNAMES_followed;
 bool SyncRes::s_addExtendedResolutionDNSErrors;
 
@@ -462,8 +470,7 @@ static inline std::string fmtfloat(double value)
 static inline void accountAuthLatency(uint64_t usec, int family)
 {
   if (family == AF_INET) {
-    t_Counters.at(rec::Histogram::auth4Answers)(usec);
-    t_Counters.at(rec::Histogram::cumulativeAuth4Answers)(usec);
+    t_Counters.at(rec::LogLinearHistogram::auth4Answers)(usec);
   }
   else {
     t_Counters.at(rec::Histogram::auth6Answers)(usec);
@@ -1194,6 +1201,92 @@ void SyncRes::pruneEDNSStatuses(time_t cutoff)
   s_ednsstatus.lock()->prune(cutoff);
 }
 
+enum class PBEDNSStatusDump : protozero::pbf_tag_type
+{
+  required_uint64_protocolVersion = 1,
+  required_string_type = 2,
+  repeated_message_status = 3,
+};
+
+enum class PBEDNSStatus : protozero::pbf_tag_type
+{
+  required_message_address = 1,
+  required_int64_ttd = 2,
+  required_uint32_mode = 3,
+};
+
+size_t SyncRes::getEDNSStatusTable(std::string& ret)
+{
+  const auto copy = s_ednsstatus.lock()->getMap();
+  protozero::pbf_builder<PBEDNSStatusDump> full(ret);
+  full.add_uint64(PBEDNSStatusDump::required_uint64_protocolVersion, 1);
+  full.add_string(PBEDNSStatusDump::required_string_type, "PBEDNSStatusDump");
+  for (const auto& status : copy) {
+    protozero::pbf_builder<PBEDNSStatus> message(full, PBEDNSStatusDump::repeated_message_status);
+    encodeComboAddress(message, PBEDNSStatus::required_message_address, status.address);
+    message.add_int64(PBEDNSStatus::required_int64_ttd, status.ttd);
+    message.add_uint32(PBEDNSStatus::required_uint32_mode, status.mode);
+  }
+  return copy.size();
+}
+
+size_t SyncRes::putIntoEDNSStatusTable(const std::string& pbuf)
+{
+  protozero::pbf_message<PBEDNSStatusDump> full(pbuf);
+  const time_t now = time(nullptr);
+  size_t inserted = 0;
+  bool protocolVersionSeen = false;
+  bool typeSeen = false;
+  while (full.next()) {
+    switch (full.tag()) {
+    case PBEDNSStatusDump::required_uint64_protocolVersion:
+      if (full.get_uint64() != 1) {
+        throw std::runtime_error("Protocol version mismatch");
+      }
+      protocolVersionSeen = true;
+      break;
+    case PBEDNSStatusDump::required_string_type:
+      if (full.get_string() != "PBEDNSStatusDump") {
+        throw std::runtime_error("Data type mismatch");
+      }
+      typeSeen = true;
+      break;
+    case PBEDNSStatusDump::repeated_message_status: {
+      if (!protocolVersionSeen || !typeSeen) {
+        throw std::runtime_error("Required field missing");
+      }
+      protozero::pbf_message<PBEDNSStatus> message = full.get_message();
+      EDNSStatus status{ComboAddress()};
+      while (message.next()) {
+        switch (message.tag()) {
+        case PBEDNSStatus::required_message_address:
+          decodeComboAddress(message, status.address);
+          break;
+        case PBEDNSStatus::required_int64_ttd:
+          status.ttd = message.get_int64();
+          break;
+        case PBEDNSStatus::required_uint32_mode:
+          status.mode = static_cast<EDNSStatus::EDNSMode>(message.get_uint32());
+          break;
+        default:
+          message.skip();
+          break;
+        }
+      }
+      // Expired statuses would be removed on first use anyway; existing ones are more recent
+      if (status.ttd >= now && s_ednsstatus.lock()->insert(status).second) {
+        ++inserted;
+      }
+      break;
+    }
+    default:
+      full.skip();
+      break;
+    }
+  }
+  return inserted;
+}
+
 uint64_t SyncRes::doEDNSDump(int fileDesc)
 {
   int newfd = dup(fileDesc);
@@ -1246,6 +1339,73 @@ float SyncRes::getNSSpeed(const DNSName& server, const ComboAddress& address)
   return lock->find_or_enter(server).d_collection[address].peek();
 }
 
+// 0 if there is nothing known about the server (or adaptive-auth-timeouts is off), the global timeout applies then
+unsigned int SyncRes::getServerTimeoutMsec(const ComboAddress& server, time_t now)
+{
+  if (!s_adaptive_auth_timeouts) {
+    return 0;
+  }
+  auto lock = s_serverRTOs.lock();
+  auto iter = lock->find(server);
+  if (iter == lock->end() || iter->d_srtt == 0) {
+    return 0;
+  }
+  if (iter->d_lastUpdate < now - 300) {
+    return 0; // too old to go by
+  }
+  return iter->getTimeoutMsec(s_auth_timeout_min_msec, g_networkTimeoutMsec);
+}
+
+void SyncRes::submitServerRTT(const ComboAddress& server, uint32_t usec, time_t now)
+{
+  if (s_adaptive_auth_timeouts) {
+    s_serverRTOs.lock()->find_or_enter(server, now).submitRTT(static_cast<float>(usec));
+  }
+}
+
+unsigned int SyncRes::submitServerTimeout(const ComboAddress& server, time_t now)
+{
+  if (!s_adaptive_auth_timeouts) {
+    return 0;
+  }
+  return s_serverRTOs.lock()->find_or_enter(server, now).submitTimeout();
+}
+
+void SyncRes::pruneServerRTOs(time_t limit)
+{
+  s_serverRTOs.lock()->prune(limit);
+}
+
+uint64_t SyncRes::getServerRTOsSize()
+{
+  return s_serverRTOs.lock()->size();
+}
+
+void SyncRes::clearServerRTOs()
+{
+  s_serverRTOs.lock()->clear();
+}
+
+void SyncRes::setZoneCutCacheSize(size_t size)
+{
+  s_zoneCuts.lock()->setMaxEntries(size);
+}
+
+uint64_t SyncRes::getZoneCutCacheSize()
+{
+  return s_zoneCuts.lock()->size();
+}
+
+void SyncRes::pruneZoneCutCache(time_t now)
+{
+  s_zoneCuts.lock()->prune(now);
+}
+
+void SyncRes::clearZoneCutCache()
+{
+  s_zoneCuts.lock()->clear();
+}
+
 uint64_t SyncRes::doDumpNSSpeeds(int fileDesc)
 {
   int newfd = dup(fileDesc);
@@ -1592,6 +1752,13 @@ LWResult::Result SyncRes::asyncresolveWrapper(const ComboAddress& address, bool
 #ifdef HAVE_FSTRM
   ctx.d_auth = auth;
 #endif
+  if (!doTCP) {
+    ctx.d_timeoutMsec = getServerTimeoutMsec(address, d_now.tv_sec);
+    if (d_staggered) {
+      ctx.d_staggeredAddress = d_staggered->address;
+      ctx.d_staggeredDelayMsec = d_staggered->delayMsec;
+    }
+  }
 
   LWResult::Result ret{};
 
@@ -1634,6 +1801,10 @@ LWResult::Result SyncRes::asyncresolveWrapper(const ComboAddress& address, bool
       break;
     }
 
+    if (res->d_staggeredAnswer) { // another server answered, nothing to learn about the EDNS status of this one
+      break;
+    }
+
     if (EDNSLevel == 1) {
       // We sent out with EDNS
       // ret is LWResult::Result::Success
@@ -1670,6 +1841,8 @@ LWResult::Result SyncRes::asyncresolveWrapper(const ComboAddress& address, bool
 unsigned int SyncRes::s_max_minimize_count; // default is 10
 /* number of iterations that should only have one label appended */
 unsigned int SyncRes::s_minimize_one_label; // default is 4
+/* cap on the lifetime of a zone cut cache entry, see ZoneCutCache */
+unsigned int SyncRes::s_zonecutcachettl;
 
 static unsigned int qmStepLen(unsigned int labels, unsigned int qnamelen, unsigned int qmIteration)
 {
@@ -1789,6 +1962,8 @@ int SyncRes::doResolve(const DNSName& qname, const QType qtype, vector<DNSRecord
 
     // Step 1
     vector<DNSRecord> bestns;
+    DNSName cut; // only set if not forwarded
+    time_t cutTTD{0};
     DNSName nsdomain(qname);
     if (qtype == QType::DS) {
       nsdomain.chopOff();
@@ -1822,6 +1997,15 @@ int SyncRes::doResolve(const DNSName& qname, const QType qtype, vector<DNSRecord
       }
       else {
         child = bestns[0].d_name;
+        cut = child;
+        cutTTD = bestns[0].d_ttl;
+        if (auto known = s_zoneCuts.lock()->getClosest(qname, cut, d_now.tv_sec); known && known->countLabels() > child.countLabels()) {
+          const auto skipped = known->countLabels() - child.countLabels();
+          LOG(prefix << qname << ": Step1 " << *known << " is known to be in zone " << cut << ", skipping " << skipped << " label(s)" << endl);
+          child = *known;
+          d_qmProbesSaved += skipped;
+          t_Counters.at(rec::Counter::qnameminProbesSaved) += skipped;
+        }
       }
     }
     for (; i <= qnamelen; i++) {
@@ -1875,13 +2059,19 @@ int SyncRes::doResolve(const DNSName& qname, const QType qtype, vector<DNSRecord
       d_followCNAME = false;
       retq.clear();
       StopAtDelegation stopAtDelegation = Stop;
+      const auto outqueries = d_outqueries;
       res = doResolveNoQNameMinimization(child, QType::A, retq, depth, beenthere, context, nullptr, &stopAtDelegation);
       d_followCNAME = oldFollowCNAME;
+      d_qmProbeQueries += d_outqueries - outqueries;
+      t_Counters.at(rec::Counter::qnameminProbeQueries) += d_outqueries - outqueries;
       LOG(prefix << qname << ": Step4 Resolve " << child << "|A result is " << RCode::to_s(res) << "/" << retq.size() << "/" << stopAtDelegation << endl);
       if (stopAtDelegation == Stopped) {
         LOG(prefix << qname << ": Delegation seen, continue at step 1" << endl);
         break;
       }
+      if (res == RCode::NoError && !cut.empty() && s_zonecutcachettl > 0) {
+        s_zoneCuts.lock()->insert(child, cut, std::min(cutTTD, d_now.tv_sec + static_cast<time_t>(s_zonecutcachettl)));
+      }
 
       if (res != RCode::NoError) {
         // Case 5: unexpected answer
@@ -1983,10 +2173,14 @@ int SyncRes::doResolveNoQNameMinimization(const DNSName& qname, const QType qtyp
   int res = 0;
 
   const int iterations = !d_refresh && MemRecursorCache::s_maxServedStaleExtensions > 0 ? 2 : 1;
+  // With stale-while-revalidate the cache-only serve-stale pass comes first, and only a miss there
+  // goes out to the network. A stale hit pushes a refresh task, see updateStaleEntry().
+  const bool staleFirst = iterations == 2 && s_serve_stale_while_revalidate;
+  const int staleLoop = staleFirst ? 0 : 1;
   for (int loop = 0; loop < iterations; loop++) {
 
-    d_serveStale = loop == 1;
-    if (d_serveStale) {
+    d_serveStale = loop == staleLoop;
+    if (d_serveStale && !staleFirst) {
       LOG(prefix << qname << ": Restart, with serve-stale enabled" << endl);
     }
     // This is a difficult way of expressing "this is a normal query", i.e. not getRootNS.
@@ -2137,7 +2331,11 @@ int SyncRes::doResolveNoQNameMinimization(const DNSName& qname, const QType qtyp
 
     // When trying to serve-stale, we also only look at the cache. Don't look at d_serveStale, it
     // might be changed by recursive calls (this should be fixed in a better way!).
-    if (loop == 1) {
+    if (loop == staleLoop) {
+      if (staleFirst) {
+        LOG(prefix << qname << ": No stale cache hit, resolving" << endl);
+        continue;
+      }
       return res;
     }
 
@@ -2400,6 +2598,8 @@ void SyncRes::getBestNSFromCache(const DNSName& qname, const QType qtype, vector
     flags |= MemRecursorCache::ServeStale;
   }
   do {
+    // Skip the labels the cache has no NS set for at all, without a full lookup for each of them
+    g_recCache->getClosestZoneCut(d_now.tv_sec, subdomain);
     if (cutOffDomain && (subdomain == *cutOffDomain || !subdomain.isPartOf(*cutOffDomain))) {
       break;
     }
@@ -3253,7 +3453,6 @@ bool SyncRes::doCacheCheck(const DNSName& qname, const DNSName& authname, bool w
   }
 
   /* let's check if we have a NSEC covering that record */
-#if defined(HAVE_DNSSEC) && HAVE_DNSSEC
   if (g_aggressiveNSECCache && !wasForwardedOrAuthZone) {
     if (g_aggressiveNSECCache->getDenial(d_now.tv_sec, qname, qtype, ret, res, d_cacheRemote, d_routingTag, d_doDNSSEC, d_validationContext, LogObject(prefix))) {
       context.state = vState::Secure;
@@ -3263,7 +3462,6 @@ bool SyncRes::doCacheCheck(const DNSName& qname, const DNSName& authname, bool w
       return true;
     }
   }
-#endif
 
   return false;
 }
@@ -5192,7 +5390,6 @@ RCode::rcodes_ SyncRes::updateCacheFromRecords(unsigned int depth, const string&
           g_negCache->wipeTyped(tCacheEntry->first.name, tCacheEntry->first.type);
         }
 
-#if defined(HAVE_DNSSEC) && HAVE_DNSSEC
         if (g_aggressiveNSECCache && thisRRNeedsWildcardProof && recordState == vState::Secure && tCacheEntry->first.place == DNSResourceRecord::ANSWER && !tCacheEntry->second.signatures.empty() && !d_routingTag && !ednsmask) {
           /* we have an answer synthesized from a wildcard and aggressive NSEC is enabled, we need to store the
              wildcard in its non-expanded form in the cache to be able to synthesize wildcard answers later */
@@ -5213,7 +5410,6 @@ RCode::rcodes_ SyncRes::updateCacheFromRecords(unsigned int depth, const string&
             g_recCache->replace(d_now.tv_sec, realOwner, QType(tCacheEntry->first.type), content, tCacheEntry->second.signatures, /* no additional records in that case */ {}, tCacheEntry->first.type == QType::DS ? true : isAA, auth, boost::none, boost::none, recordState, remoteIP, d_refresh, tCacheEntry->second.d_ttl_time);
           }
         }
-#endif
       }
     }
 
@@ -5221,12 +5417,10 @@ RCode::rcodes_ SyncRes::updateCacheFromRecords(unsigned int depth, const string&
       seenAuth = getSigner(tCacheEntry->second.signatures);
     }
 
-#if defined(HAVE_DNSSEC) && HAVE_DNSSEC
     if (g_aggressiveNSECCache && (tCacheEntry->first.type == QType::NSEC || tCacheEntry->first.type == QType::NSEC3) && recordState == vState::Secure && !seenAuth.empty()) {
       // Good candidate for NSEC{,3} caching
       g_aggressiveNSECCache->insertNSEC(seenAuth, tCacheEntry->first.name, tCacheEntry->second.records.at(0), tCacheEntry->second.signatures, tCacheEntry->first.type == QType::NSEC3, qname, qtype);
     }
-#endif
 
     if (tCacheEntry->first.place == DNSResourceRecord::ANSWER && ednsmask) {
       d_wasVariable = true;
@@ -5874,6 +6068,81 @@ void SyncRes::checkTotalTime(const DNSName& qname, QType qtype, boost::optional<
   }
 }
 
+// Staggered queries in flight per zone cut on this thread, bounded by staggered-auth-zone-budget
+static thread_local std::map<DNSName, unsigned int> t_staggeredQueriesInFlight;
+
+// Holds a zone's budget for as long as SyncRes::d_staggered is set
+class StaggeredQueryGuard
+{
+public:
+  StaggeredQueryGuard(boost::optional<SyncRes::StaggeredTarget>& staggered, const DNSName& auth) :
+    d_staggered(staggered), d_auth(auth)
+  {
+    if (d_staggered) {
+      ++t_staggeredQueriesInFlight[d_auth];
+    }
+  }
+  StaggeredQueryGuard(const StaggeredQueryGuard&) = delete;
+  StaggeredQueryGuard& operator=(const StaggeredQueryGuard&) = delete;
+  ~StaggeredQueryGuard()
+  {
+    if (d_staggered) {
+      auto iter = t_staggeredQueriesInFlight.find(d_auth);
+      if (iter != t_staggeredQueriesInFlight.end() && --iter->second == 0) {
+        t_staggeredQueriesInFlight.erase(iter);
+      }
+      d_staggered = boost::none;
+    }
+  }
+
+private:
+  boost::optional<SyncRes::StaggeredTarget>& d_staggered; // NOLINT(cppcoreguidelines-avoid-const-or-ref-data-members)
+  const DNSName& d_auth; // NOLINT(cppcoreguidelines-avoid-const-or-ref-data-members)
+};
+
+/* Picks the server that also gets a UDP query to remoteIP if remoteIP is slow to answer: the next usable address of
+   the same nameserver or, failing that, a cached address of the next nameserver in speed order. The delay is twice
+   the smoothed RTT of remoteIP, so a server that answers as fast as it usually does never causes a second query. */
+boost::optional<SyncRes::StaggeredTarget> SyncRes::pickStaggeredTarget(const std::string& prefix, const DNSName& qname, const QType qtype, const DNSName& auth, const DNSName& nsName, const ComboAddress& remoteIP,
+                                                                       vector<ComboAddress>::const_iterator nextIP, vector<ComboAddress>::const_iterator endIP,
+                                                                       vector<std::pair<DNSName, float>>::const_iterator nextNS, vector<std::pair<DNSName, float>>::const_iterator endNS, unsigned int depth)
+{
+  if (auto budget = t_staggeredQueriesInFlight.find(auth); budget != t_staggeredQueriesInFlight.end() && budget->second >= s_staggered_auth_zone_budget) {
+    return boost::none;
+  }
+
+  auto usable = [&](const ComboAddress& address) {
+    return address != remoteIP && address.getPort() != 853 && !isThrottled(d_now.tv_sec, address) && !isThrottled(d_now.tv_sec, address, qname, qtype) && !(s_dontQuery && s_dontQuery->match(&address));
+  };
+
+  boost::optional<ComboAddress> second;
+  DNSName secondNS = nsName;
+  for (; nextIP != endIP && !second; ++nextIP) {
+    if (usable(*nextIP)) {
+      second = *nextIP;
+    }
+  }
+  if (!second && nextNS != endNS && !nextNS->first.empty() && nextNS->first != qname && !doDoTtoAuth(nextNS->first)) {
+    set<GetBestNSAnswer> beenthere;
+    unsigned int addressQueries = 0;
+    for (const auto& address : getAddrs(nextNS->first, depth + 1, prefix, beenthere, true, addressQueries)) {
+      if (usable(address)) {
+        second = address;
+        secondNS = nextNS->first;
+        break;
+      }
+    }
+  }
+  if (!second) {
+    return boost::none;
+  }
+
+  const auto rttUsec = getNSSpeed(nsName.empty() ? DNSName(remoteIP.toStringWithPort()) : nsName, remoteIP);
+  const auto delayMsec = std::min(std::max(s_staggered_auth_min_delay_msec, static_cast<unsigned int>(2 * rttUsec / 1000)), g_networkTimeoutMsec / 4);
+  LOG(prefix << qname << ": Also asking " << second->toStringWithPort() << " if " << remoteIP.toStringWithPort() << " has not answered within " << delayMsec << "ms" << endl);
+  return StaggeredTarget{*second, secondNS.empty() ? DNSName(second->toStringWithPort()) : secondNS, delayMsec};
+}
+
 bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname, const QType qtype, LWResult& lwr, boost::optional<Netmask>& ednsmask, const DNSName& auth, bool const sendRDQuery, const bool wasForwarded, const DNSName& nsName, const ComboAddress& remoteIP, bool doTCP, bool doDoT, bool& truncated, bool& spoofed, boost::optional<EDNSExtendedError>& extendedError, bool dontThrottle)
 {
   std::cout << "[DEBUG] doResolveAtThisIP: target=" << remoteIP.toStringWithPort() << " nsName=" << nsName << " qname=" << qname << " qtype=" << qtype.getCode() << " doTCP=" << doTCP << " doDoT=" << doDoT << std::endl;
@@ -5942,6 +6211,22 @@ bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname,
     return false;
   }
 
+  // Per server timeouts are for UDP, and a chained query was not timed from its own send
+  unsigned int consecutiveTimeouts = 0;
+  if (!doTCP && !chained) {
+    if (resolveret == LWResult::Result::Timeout) {
+      consecutiveTimeouts = submitServerTimeout(remoteIP, d_now.tv_sec);
+    }
+    else if (resolveret == LWResult::Result::Success && lwr.d_validpacket) {
+      if (!lwr.d_staggeredAnswer) {
+        submitServerRTT(remoteIP, lwr.d_usec, d_now.tv_sec);
+      }
+      else if (d_staggered && lwr.d_usec > d_staggered->delayMsec * 1000) {
+        submitServerRTT(d_staggered->address, lwr.d_usec - d_staggered->delayMsec * 1000, d_now.tv_sec);
+      }
+    }
+  }
+
   accountAuthLatency(lwr.d_usec, remoteIP.sin4.sin_family);
   if (lwr.d_rcode >= 0 && lwr.d_rcode < static_cast<decltype(lwr.d_rcode)>(t_Counters.at(rec::RCode::auth).rcodeCounters.size())) {
     ++t_Counters.at(rec::RCode::auth).rcodeCounters.at(static_cast<uint8_t>(lwr.d_rcode));
@@ -5999,8 +6284,9 @@ bool SyncRes::doResolveAtThisIP(const std::string& prefix, const DNSName& qname,
       else {
         // If the actual response time was more than 80% of the default timeout, we throttle. On a
         // busy rec we reduce the time we are willing to wait for an auth, it is unfair to throttle on
-        // such a shortened timeout.
-        if (responseUsec > g_networkTimeoutMsec * 800) {
+        // such a shortened timeout. A server with a timeout of its own is throttled once that has been
+        // doubled a few times in a row.
+        if (responseUsec > g_networkTimeoutMsec * 800 || consecutiveTimeouts >= 3) {
           // timeout, 10 seconds or 5 queries
           doThrottle(d_now.tv_sec, remoteIP, qname, qtype, 10, 5, Throttle::Reason::Timeout);
         }
@@ -6527,7 +6813,13 @@ int SyncRes::doResolveAt(NsSet& nameservers, DNSName auth, bool flawedNSSet, con
           if (!doDoT && s_max_busy_dot_probes > 0) {
             submitTryDotTask(*remoteIP, auth, tns->first, d_now.tv_sec);
           }
+          boost::optional<StaggeredTarget> staggered;
           if (!forceTCP) {
+            if (s_staggered_auth_queries) {
+              d_staggered = pickStaggeredTarget(prefix, qname, qtype, auth, tns->first, *remoteIP, std::next(remoteIP), remoteIPs.end(), std::next(tns), rnameservers.cend(), depth);
+            }
+            StaggeredQueryGuard staggeredGuard(d_staggered, auth);
+            staggered = d_staggered;
             gotAnswer = doResolveAtThisIP(prefix, qname, qtype, lwr, ednsmask, auth, sendRDQuery, wasForwarded,
                                           tns->first, *remoteIP, false, false, truncated, spoofed, context.extendedError);
           }
@@ -6557,13 +6849,21 @@ int SyncRes::doResolveAt(NsSet& nameservers, DNSName auth, bool flawedNSSet, con
           //        cout<<"ms: "<<lwr.d_usec/1000.0<<", "<<g_avgLatency/1000.0<<'\n';
 
           s_nsSpeeds.lock()->find_or_enter(tns->first.empty() ? DNSName(remoteIP->toStringWithPort()) : tns->first, d_now).submit(*remoteIP, static_cast<int>(lwr.d_usec), d_now);
+          ComboAddress answeredBy = *remoteIP;
+          if (lwr.d_staggeredAnswer && staggered) {
+            // The first server took at least lwr.d_usec (submitted above), the second one that less the delay
+            answeredBy = staggered->address;
+            LOG(prefix << qname << ": Answer came from the staggered query to " << answeredBy.toStringWithPort() << endl);
+            const auto usec = lwr.d_usec > staggered->delayMsec * 1000 ? lwr.d_usec - staggered->delayMsec * 1000 : 0;
+            s_nsSpeeds.lock()->find_or_enter(staggered->nsName, d_now).submit(answeredBy, static_cast<int>(usec), d_now);
+          }
 
           /* we have received an answer, are we done ? */
           #if defined(HAVE_LUA) && HAVE_LUA
-          bool done = processAnswer(depth, prefix, lwr, qname, qtype, auth, wasForwarded, ednsmask, sendRDQuery, nameservers, ret, luaconfsLocal->dfe, &gotNewServers, &rcode, context.state, *remoteIP);
+          bool done = processAnswer(depth, prefix, lwr, qname, qtype, auth, wasForwarded, ednsmask, sendRDQuery, nameservers, ret, luaconfsLocal->dfe, &gotNewServers, &rcode, context.state, answeredBy);
           #else
           DNSFilterEngine emptyDfe2;
-          bool done = processAnswer(depth, prefix, lwr, qname, qtype, auth, wasForwarded, ednsmask, sendRDQuery, nameservers, ret, emptyDfe2, &gotNewServers, &rcode, context.state, *remoteIP);
+          bool done = processAnswer(depth, prefix, lwr, qname, qtype, auth, wasForwarded, ednsmask, sendRDQuery, nameservers, ret, emptyDfe2, &gotNewServers, &rcode, context.state, answeredBy);
           #endif
           if (done) {
             return rcode;
@@ -6577,7 +6877,7 @@ int SyncRes::doResolveAt(NsSet& nameservers, DNSName auth, bool flawedNSSet, con
           }
           /* was lame */
           if (!shouldNotThrottle(&tns->first, &*remoteIP)) {
-            doThrottle(d_now.tv_sec, *remoteIP, qname, qtype, 60, 100, Throttle::Reason::Lame);
+            doThrottle(d_now.tv_sec, answeredBy, qname, qtype, 60, 100, Throttle::Reason::Lame);
           }
         }
 
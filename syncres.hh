@@ -204,6 +204,12 @@ public:
   {
     s_dontQuery = nullptr;
   }
+  static void compileDontQuery()
+  {
+    if (s_dontQuery) {
+      s_dontQuery->compile();
+    }
+  }
   static void parseEDNSSubnetAllowlist(const std::string& alist);
   static void parseEDNSSubnetAddFor(const std::string& subnetlist);
   static void addEDNSLocalSubnet(const std::string& subnet)
@@ -237,6 +243,18 @@ public:
   static void clearNSSpeeds();
   static float getNSSpeed(const DNSName& server, const ComboAddress& address);
 
+  static unsigned int getServerTimeoutMsec(const ComboAddress& server, time_t now);
+  static void submitServerRTT(const ComboAddress& server, uint32_t usec, time_t now);
+  static unsigned int submitServerTimeout(const ComboAddress& server, time_t now);
+  static void pruneServerRTOs(time_t limit);
+  static uint64_t getServerRTOsSize();
+  static void clearServerRTOs();
+
+  static void setZoneCutCacheSize(size_t size);
+  static uint64_t getZoneCutCacheSize();
+  static void pruneZoneCutCache(time_t now);
+  static void clearZoneCutCache();
+
   struct EDNSStatus
   {
     EDNSStatus(const ComboAddress& arg) :
@@ -265,6 +283,8 @@ public:
   static uint64_t getEDNSStatusesSize();
   static void clearEDNSStatuses();
   static void pruneEDNSStatuses(time_t cutoff);
+  static size_t getEDNSStatusTable(std::string& ret);
+  static size_t putIntoEDNSStatusTable(const std::string& pbuf);
 
   static uint64_t getThrottledServersSize();
   static void pruneThrottledServers(time_t now);
@@ -580,15 +600,31 @@ public:
   static bool s_tcp_fast_open_connect;
   static bool s_dot_to_port_853;
   static unsigned int s_max_busy_dot_probes;
+  static bool s_staggered_auth_queries;
+  static unsigned int s_staggered_auth_min_delay_msec;
+  static unsigned int s_staggered_auth_zone_budget;
+  static bool s_adaptive_auth_timeouts;
+  static unsigned int s_auth_timeout_min_msec;
+
+  // Second server for a UDP query, asked when the first has not answered after delayMsec, see pickStaggeredTarget()
+  struct StaggeredTarget
+  {
+    ComboAddress address;
+    DNSName nsName; // key in the NS speeds table
+    unsigned int delayMsec;
+  };
   static unsigned int s_max_CNAMES_followed;
   static unsigned int s_max_minimize_count;
   static unsigned int s_minimize_one_label;
+  static unsigned int s_zonecutcachettl;
 
   static const int event_trace_to_pb = 1;
   static const int event_trace_to_log = 2;
   static const int event_trace_to_ot = 4;
+  static const int event_trace_to_histograms = 8;
   static int s_event_trace_enabled;
   static bool s_save_parent_ns_set;
+  static bool s_serve_stale_while_revalidate;
   static bool s_addExtendedResolutionDNSErrors;
 
   static bool eventTraceEnabled(int flag)
@@ -614,6 +650,8 @@ public:
   unsigned int d_unreachables;
   unsigned int d_totUsec;
   unsigned int d_maxdepth{0};
+  unsigned int d_qmProbeQueries{0}; // outgoing queries done for qname minimization probes
+  unsigned int d_qmProbesSaved{0}; // probes skipped because the zone cut cache knew the answer
   // Initialized ony once, as opposed to d_now which gets updated after outgoing requests
   struct timeval d_fixednow;
 
@@ -659,6 +697,9 @@ private:
   void ednsStats(boost::optional<Netmask>& ednsmask, const DNSName& qname, const string& prefix);
   void incTimeoutStats(const ComboAddress& remoteIP);
   void checkTotalTime(const DNSName& qname, QType qtype, boost::optional<EDNSExtendedError>& extendedError) const;
+  boost::optional<StaggeredTarget> pickStaggeredTarget(const std::string& prefix, const DNSName& qname, QType qtype, const DNSName& auth, const DNSName& nsName, const ComboAddress& remoteIP,
+                                                       vector<ComboAddress>::const_iterator nextIP, vector<ComboAddress>::const_iterator endIP,
+                                                       vector<std::pair<DNSName, float>>::const_iterator nextNS, vector<std::pair<DNSName, float>>::const_iterator endNS, unsigned int depth);
   bool doResolveAtThisIP(const std::string& prefix, const DNSName& qname, QType qtype, LWResult& lwr, boost::optional<Netmask>& ednsmask, const DNSName& auth, bool sendRDQuery, bool wasForwarded, const DNSName& nsName, const ComboAddress& remoteIP, bool doTCP, bool doDoT, bool& truncated, bool& spoofed, boost::optional<EDNSExtendedError>& extendedError, bool dontThrottle = false);
   bool processAnswer(unsigned int depth, const string& prefix, LWResult& lwr, const DNSName& qname, QType qtype, DNSName& auth, bool wasForwarded, const boost::optional<Netmask>& ednsmask, bool sendRDQuery, NsSet& nameservers, std::vector<DNSRecord>& ret, const DNSFilterEngine& dfe, bool* gotNewServers, int* rcode, vState& state, const ComboAddress& remoteIP);
 
@@ -748,6 +789,7 @@ private:
   boost::optional<const boost::uuids::uuid&> d_initialRequestId;
   pdns::validation::ValidationContext d_validationContext;
   asyncresolve_t d_asyncResolve{nullptr};
+  boost::optional<StaggeredTarget> d_staggered; // for the UDP query doResolveAt() is sending
   // d_now is initialized in the constructor and updates after outgoing requests in lwres.cc:asyncresolve
   struct timeval d_now;
   /* if the client is asking for a DS that does not exist, we need to provide the SOA along with the NSEC(3) proof
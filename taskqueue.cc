@@ -45,6 +45,40 @@ ResolveTask TaskQueue::pop()
   return ret;
 }
 
+bool PrefetchQueue::push(ResolveTask&& task)
+{
+  auto& index = d_queue.get<HashTag>();
+  auto existing = index.find(std::tie(task.d_qname, task.d_qtype, task.d_netmask));
+  if (existing != index.end()) {
+    // Already scheduled, but keep the most recent view of its popularity and the latest deadline
+    index.modify(existing, [&task](ResolveTask& queued) {
+      queued.d_hits = std::max(queued.d_hits, task.d_hits);
+      queued.d_deadline = std::max(queued.d_deadline, task.d_deadline);
+    });
+    return false;
+  }
+  d_queue.insert(std::move(task));
+  d_pushes++;
+  return true;
+}
+
+bool PrefetchQueue::pop(time_t now, ResolveTask& task)
+{
+  // Drop what can no longer be refreshed in time first, so it does not linger below the popular tasks
+  auto& byDeadline = d_queue.get<DeadlineTag>();
+  while (!byDeadline.empty() && byDeadline.begin()->d_deadline < now) {
+    byDeadline.erase(byDeadline.begin());
+    d_expired++;
+  }
+  auto& byHits = d_queue.get<HitsTag>();
+  if (byHits.empty()) {
+    return false;
+  }
+  task = *byHits.begin();
+  byHits.erase(byHits.begin());
+  return true;
+}
+
 bool ResolveTask::run(bool logErrors) const
 {
   if (d_func == nullptr) {
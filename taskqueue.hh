@@ -62,6 +62,8 @@ struct ResolveTask
   // NS name used by DoT probe task, not part of index and not used by operator<()
   DNSName d_nsname;
   Netmask d_netmask;
+  // Cache hits on the record being refreshed, orders the PrefetchQueue, not part of index and not used by operator<()
+  uint32_t d_hits{0};
 
   bool operator<(const ResolveTask& task) const
   {
@@ -133,4 +135,72 @@ private:
   uint64_t d_expired{0};
 };
 
+// Almost expired tasks: popped most hit first, tasks whose deadline has passed are dropped instead of popped
+class PrefetchQueue
+{
+public:
+  [[nodiscard]] bool empty() const
+  {
+    return d_queue.empty();
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return d_queue.size();
+  }
+
+  bool push(ResolveTask&& task);
+  bool pop(time_t now, ResolveTask& task);
+
+  [[nodiscard]] uint64_t getPushes() const
+  {
+    return d_pushes;
+  }
+
+  [[nodiscard]] uint64_t getExpired() const
+  {
+    return d_expired;
+  }
+
+  void incExpired()
+  {
+    d_expired++;
+  }
+
+  void clear()
+  {
+    d_queue.clear();
+  }
+
+private:
+  struct HashTag
+  {
+  };
+
+  struct HitsTag
+  {
+  };
+
+  struct DeadlineTag
+  {
+  };
+
+  using queue_t = multi_index_container<
+    ResolveTask,
+    indexed_by<ordered_unique<tag<HashTag>,
+                              composite_key<ResolveTask,
+                                            member<ResolveTask, DNSName, &ResolveTask::d_qname>,
+                                            member<ResolveTask, uint16_t, &ResolveTask::d_qtype>,
+                                            member<ResolveTask, Netmask, &ResolveTask::d_netmask>>>,
+               ordered_non_unique<tag<HitsTag>,
+                                  member<ResolveTask, uint32_t, &ResolveTask::d_hits>,
+                                  std::greater<>>,
+               ordered_non_unique<tag<DeadlineTag>,
+                                  member<ResolveTask, time_t, &ResolveTask::d_deadline>>>>;
+
+  queue_t d_queue;
+  uint64_t d_pushes{0};
+  uint64_t d_expired{0};
+};
+
 }
@@ -48,6 +48,7 @@ using suseconds_t = long;
 #include <unistd.h>
 #endif
 #include <array>
+#include <atomic>
 #include <set>
 
 #include "lock.hh"
@@ -69,8 +70,15 @@ namespace pdns
 // current counters are copied to the snapshot thread local copies in
 // a thread safe way.
 
+// The snapshot is double buffered: the owning thread copies into the
+// buffer that is not published and then publishes it, so it never waits
+// for a reader that is still folding the published one. If a (very slow)
+// reader still holds the unpublished buffer, the update is skipped and
+// retried on the next call.
+
 // The snapshot counters are aggregated by the GlobalCounters
-// class, as these can be accessed safely from multiple threads.
+// class, as these can be accessed safely from multiple threads. Readers
+// fold the published buffer in place instead of copying it first.
 
 // Make sure to call the thread local tlocal.updatesAtomics() once
 // in a while. This will fill the snapshot values for that thread if some
@@ -177,12 +185,20 @@ public:
   // coverity[auto_causes_copy]
   auto snapAt(Enum index)
   {
-    return d_snapshot.lock()->at(index);
+    return published().lock()->at(index);
   }
 
   [[nodiscard]] Counters getSnap()
   {
-    return *(d_snapshot.lock());
+    return *(published().lock());
+  }
+
+  // Call func with the published snapshot, while holding its lock
+  template <typename Func>
+  void visitSnap(Func&& func)
+  {
+    auto lock = published().lock();
+    func(*lock);
   }
 
   bool updateSnap(const timeval& tv_now, bool force = false)
@@ -193,8 +209,19 @@ public:
       timersub(&tv_now, &d_last, &tv_diff);
     }
     if (force || timercmp(&tv_diff, &d_interval, >=)) {
+      // Only this thread writes d_published, so a relaxed load is enough here
+      const auto next = 1 - d_published.load(std::memory_order_relaxed);
+      auto& buffer = d_snapshots.at(next);
+      auto lock = buffer.try_lock();
+      if (!lock.owns_lock()) {
+        if (!force) {
+          return false;
+        }
+        lock.lock();
+      }
       // It's a copy
-      *(d_snapshot.lock()) = d_current;
+      *lock = d_current;
+      d_published.store(next, std::memory_order_release);
       d_last = tv_now;
       return true;
     }
@@ -219,9 +246,15 @@ public:
   }
 
 private:
+  LockGuarded<Counters>& published()
+  {
+    return d_snapshots.at(d_published.load(std::memory_order_acquire));
+  }
+
   GlobalCounters<Counters>& d_collector;
   Counters d_current;
-  LockGuarded<Counters> d_snapshot;
+  std::array<LockGuarded<Counters>, 2> d_snapshots;
+  std::atomic<unsigned int> d_published{0};
   timeval d_last{0, 0};
   const timeval d_interval;
 };
@@ -236,7 +269,7 @@ auto GlobalCounters<Counters>::sum(Enum index)
   auto lock = d_guarded.lock();
   auto sum = lock->d_history.at(index);
   for (const auto& instance : lock->d_instances) {
-    sum += instance->snapAt(index);
+    instance->visitSnap([&sum, index](Counters& snap) { sum += snap.at(index); });
   }
   return sum;
 }
@@ -253,9 +286,11 @@ auto GlobalCounters<Counters>::avg(Enum index)
   auto sum = wavg.avg * wavg.weight;
   auto count = wavg.weight;
   for (const auto& instance : lock->d_instances) {
-    auto val = instance->snapAt(index);
-    count += val.weight;
-    sum += val.avg * val.weight;
+    instance->visitSnap([&sum, &count, index](Counters& snap) {
+      const auto& val = snap.at(index);
+      count += val.weight;
+      sum += val.avg * val.weight;
+    });
   }
   return count > 0 ? sum / count : 0;
 }
@@ -270,7 +305,7 @@ auto GlobalCounters<Counters>::max(Enum index)
   auto lock = d_guarded.lock();
   uint64_t max = 0; // ignore history
   for (const auto& instance : lock->d_instances) {
-    max = std::max(instance->snapAt(index), max);
+    instance->visitSnap([&max, index](Counters& snap) { max = std::max(snap.at(index), max); });
   }
   return max;
 }
@@ -282,8 +317,7 @@ Counters GlobalCounters<Counters>::aggregatedSnap()
   auto lock = d_guarded.lock();
   Counters ret = lock->d_history;
   for (const auto& instance : lock->d_instances) {
-    auto snap = instance->getSnap();
-    ret.merge(snap);
+    instance->visitSnap([&ret](const Counters& snap) { ret.merge(snap); });
   }
   return ret;
 }